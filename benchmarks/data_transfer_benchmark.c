@@ -0,0 +1,219 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures clipboard throughput for large payloads. Each mode is named after
+// the path it measures:
+//
+//   pipe          A plain pipe without a relay. This is all the noop data
+//                 driver costs, as it hands the host fd to the client.
+//   relay-splice  sl_data_transfer_create() between two pipes, which moves
+//                 the data with splice().
+//   relay-copy    sl_data_transfer_create() from a pipe to a socket in
+//                 append mode. splice() refuses such destinations, so the
+//                 relay falls back to its ring buffer like it does for fds
+//                 that can't be spliced, such as virtwl pipes.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+struct benchmark_writer {
+  int fd;
+  size_t size;
+};
+
+struct benchmark_reader {
+  int fd;
+  size_t size;
+  int done_fd;
+};
+
+enum {
+  BENCHMARK_PIPE,
+  BENCHMARK_RELAY_SPLICE,
+  BENCHMARK_RELAY_COPY,
+};
+
+static const char* const benchmark_modes[] = {"pipe", "relay-splice",
+                                              "relay-copy"};
+
+static const size_t benchmark_chunk_size = 64 * 1024;
+
+static double benchmark_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* benchmark_write(void* data) {
+  struct benchmark_writer* writer = (struct benchmark_writer*)data;
+  uint8_t* buffer = malloc(benchmark_chunk_size);
+  size_t left = writer->size;
+
+  assert(buffer);
+  memset(buffer, 'x', benchmark_chunk_size);
+  while (left) {
+    ssize_t bytes = write(writer->fd, buffer, MIN(left, benchmark_chunk_size));
+    assert(bytes > 0);
+    left -= bytes;
+  }
+  close(writer->fd);
+  free(buffer);
+  return NULL;
+}
+
+static void* benchmark_read(void* data) {
+  struct benchmark_reader* reader = (struct benchmark_reader*)data;
+  uint8_t* buffer = malloc(benchmark_chunk_size);
+  ssize_t bytes;
+
+  assert(buffer);
+  reader->size = 0;
+  while ((bytes = read(reader->fd, buffer, benchmark_chunk_size)) > 0)
+    reader->size += bytes;
+  close(reader->fd);
+  free(buffer);
+
+  if (reader->done_fd != -1) {
+    bytes = write(reader->done_fd, "", 1);
+    UNUSED(bytes);
+  }
+  return NULL;
+}
+
+static int benchmark_handle_done(int fd, uint32_t mask, void* data) {
+  int* done = (int*)data;
+
+  *done = 1;
+  return 0;
+}
+
+// Returns the time it took to move |size| bytes from a writer to a reader
+// along the path of |mode|.
+static double benchmark_run(size_t size, int mode) {
+  struct benchmark_writer writer;
+  struct benchmark_reader reader;
+  pthread_t writer_thread, reader_thread;
+  int source[2], destination[2], done[2];
+  double start, end;
+  int rv;
+
+  rv = pipe2(source, O_CLOEXEC);
+  assert(!rv);
+  writer.fd = source[1];
+  writer.size = size;
+  reader.done_fd = -1;
+
+  if (mode != BENCHMARK_PIPE) {
+    struct wl_event_loop* event_loop = wl_event_loop_create();
+    struct wl_event_source* done_event_source;
+    int finished = 0;
+
+    if (mode == BENCHMARK_RELAY_COPY) {
+      rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, destination);
+      assert(!rv);
+      rv = fcntl(destination[1], F_SETFL, O_APPEND);
+      assert(!rv);
+    } else {
+      rv = pipe2(destination, O_CLOEXEC);
+      assert(!rv);
+    }
+    rv = pipe2(done, O_CLOEXEC);
+    assert(!rv);
+    reader.fd = destination[0];
+    reader.done_fd = done[1];
+    done_event_source = wl_event_loop_add_fd(
+        event_loop, done[0], WL_EVENT_READABLE, benchmark_handle_done,
+        &finished);
+
+    start = benchmark_now();
+    sl_data_transfer_create(event_loop, source[0], destination[1]);
+    pthread_create(&reader_thread, NULL, benchmark_read, &reader);
+    pthread_create(&writer_thread, NULL, benchmark_write, &writer);
+    while (!finished)
+      wl_event_loop_dispatch(event_loop, -1);
+    end = benchmark_now();
+
+    wl_event_source_remove(done_event_source);
+    wl_event_loop_destroy(event_loop);
+    close(done[0]);
+    close(done[1]);
+  } else {
+    reader.fd = source[0];
+
+    start = benchmark_now();
+    pthread_create(&reader_thread, NULL, benchmark_read, &reader);
+    pthread_create(&writer_thread, NULL, benchmark_write, &writer);
+    pthread_join(reader_thread, NULL);
+    end = benchmark_now();
+  }
+
+  if (mode != BENCHMARK_PIPE)
+    pthread_join(reader_thread, NULL);
+  pthread_join(writer_thread, NULL);
+  if (reader.size != size) {
+    fprintf(stderr, "error: received %zu of %zu bytes\n", reader.size, size);
+    exit(EXIT_FAILURE);
+  }
+
+  return end - start;
+}
+
+static void benchmark_usage(const char* name) {
+  printf(
+      "usage: %s [options]\n\n"
+      "options:\n"
+      "  -h, --help\t\tPrint this help\n"
+      "  --size=MB\t\tPayload size in megabytes (default 256)\n"
+      "  --iterations=N\tNumber of runs per mode (default 3)\n",
+      name);
+}
+
+int main(int argc, char** argv) {
+  size_t size = 256;
+  int iterations = 3;
+  int i, j;
+
+  for (i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value = strchr(arg, '=');
+
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      benchmark_usage(argv[0]);
+      return EXIT_SUCCESS;
+    } else if (strstr(arg, "--size") == arg && value) {
+      size = strtoul(value + 1, NULL, 10);
+    } else if (strstr(arg, "--iterations") == arg && value) {
+      iterations = atoi(value + 1);
+    } else {
+      fprintf(stderr, "Option `%s' is unknown.\n", arg);
+      return EXIT_FAILURE;
+    }
+  }
+  size *= 1024 * 1024;
+
+  for (i = 0; i < ARRAY_SIZE(benchmark_modes); ++i) {
+    double best = 0;
+
+    for (j = 0; j < iterations; ++j) {
+      double seconds = benchmark_run(size, i);
+
+      if (!j || seconds < best)
+        best = seconds;
+    }
+    printf("%-12s %8.1f MB/s\n", benchmark_modes[i],
+           size / best / (1024 * 1024));
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,314 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// A stand-in for the VirtWL device so the virtwl drivers can be exercised
+// outside a VM. It is preloaded into sommelier and takes over when
+// sommelier opens the device "fake-virtwl":
+//
+//   LD_PRELOAD=libfake_virtwl.so FAKE_VIRTWL_DISPLAY=wayland-1 sommelier
+//       --virtwl-device=fake-virtwl --shm-driver=virtwl ...
+//
+// Contexts are unix socket connections to FAKE_VIRTWL_DISPLAY, and SEND and
+// RECV move the transaction data and fds over them. Allocations and dmabufs
+// are plain memfds that the host can map like any shm pool, with dmabuf
+// strides padded the way a GPU allocator would. Dmabuf sync is a no-op.
+// Pipes aren't supported, run sommelier with --data-driver=noop.
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <drm_fourcc.h>
+#include <linux/virtwl.h>
+
+#define ALIGN(x, a) (((x) + (a)-1) & ~((a)-1))
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+// Row alignment of dmabufs.
+static const uint32_t fake_virtwl_stride_alignment = 64;
+
+static const char fake_virtwl_device[] = "fake-virtwl";
+
+static pthread_mutex_t fake_virtwl_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fake_virtwl_fd = -1;
+static int fake_virtwl_ctx_fds[16];
+static int fake_virtwl_num_ctx_fds;
+
+static int fake_virtwl_is_ctx(int fd) {
+  int found = 0;
+  int i;
+
+  pthread_mutex_lock(&fake_virtwl_lock);
+  for (i = 0; i < fake_virtwl_num_ctx_fds; ++i) {
+    if (fake_virtwl_ctx_fds[i] == fd) {
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fake_virtwl_lock);
+  return found;
+}
+
+static int fake_virtwl_new_ctx(void) {
+  const char* display = getenv("FAKE_VIRTWL_DISPLAY");
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  struct sockaddr_un addr;
+  int fd;
+
+  if (!display)
+    display = "wayland-0";
+
+  addr.sun_family = AF_UNIX;
+  if (display[0] == '/') {
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", display);
+  } else {
+    if (!runtime_dir) {
+      errno = ENOENT;
+      return -1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", runtime_dir,
+             display);
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+
+  pthread_mutex_lock(&fake_virtwl_lock);
+  if (fake_virtwl_num_ctx_fds == ARRAY_SIZE(fake_virtwl_ctx_fds)) {
+    pthread_mutex_unlock(&fake_virtwl_lock);
+    close(fd);
+    errno = ENOSPC;
+    return -1;
+  }
+  fake_virtwl_ctx_fds[fake_virtwl_num_ctx_fds++] = fd;
+  pthread_mutex_unlock(&fake_virtwl_lock);
+
+  return fd;
+}
+
+static int fake_virtwl_new_memfd(size_t size) {
+  int fd = memfd_create("fake-virtwl", MFD_CLOEXEC);
+
+  if (fd < 0)
+    return -1;
+  if (ftruncate(fd, size)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int fake_virtwl_new_dmabuf(struct virtwl_ioctl_new* new_alloc) {
+  uint32_t width = new_alloc->dmabuf.width;
+  uint32_t height = new_alloc->dmabuf.height;
+  uint32_t stride0, stride1 = 0, offset1 = 0;
+  size_t size;
+
+  switch (new_alloc->dmabuf.format) {
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_XBGR8888:
+      stride0 = ALIGN(width * 4, fake_virtwl_stride_alignment);
+      size = stride0 * height;
+      break;
+    case DRM_FORMAT_RGB565:
+      stride0 = ALIGN(width * 2, fake_virtwl_stride_alignment);
+      size = stride0 * height;
+      break;
+    case DRM_FORMAT_NV12:
+      stride0 = ALIGN(width, fake_virtwl_stride_alignment);
+      stride1 = stride0;
+      offset1 = stride0 * height;
+      size = offset1 + stride1 * ((height + 1) / 2);
+      break;
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+
+  if (!width || !height) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  new_alloc->fd = fake_virtwl_new_memfd(size);
+  if (new_alloc->fd < 0)
+    return -1;
+  new_alloc->dmabuf.stride0 = stride0;
+  new_alloc->dmabuf.stride1 = stride1;
+  new_alloc->dmabuf.stride2 = 0;
+  new_alloc->dmabuf.offset0 = 0;
+  new_alloc->dmabuf.offset1 = offset1;
+  new_alloc->dmabuf.offset2 = 0;
+  return 0;
+}
+
+static int fake_virtwl_new(struct virtwl_ioctl_new* new_alloc) {
+  switch (new_alloc->type) {
+    case VIRTWL_IOCTL_NEW_CTX:
+      new_alloc->fd = fake_virtwl_new_ctx();
+      return new_alloc->fd < 0 ? -1 : 0;
+    case VIRTWL_IOCTL_NEW_ALLOC:
+      new_alloc->fd = fake_virtwl_new_memfd(new_alloc->size);
+      return new_alloc->fd < 0 ? -1 : 0;
+    case VIRTWL_IOCTL_NEW_DMABUF:
+      return fake_virtwl_new_dmabuf(new_alloc);
+    default:
+      errno = EOPNOTSUPP;
+      return -1;
+  }
+}
+
+static int fake_virtwl_send(int fd, struct virtwl_ioctl_txn* txn) {
+  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+  struct iovec iov = {txn->data, txn->len};
+  struct msghdr msg = {0};
+  size_t sent = 0;
+  int num_fds = 0;
+  ssize_t bytes;
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  while (num_fds < VIRTWL_SEND_MAX_ALLOCS && txn->fds[num_fds] >= 0)
+    ++num_fds;
+
+  if (num_fds) {
+    struct cmsghdr* cmsg;
+
+    msg.msg_control = fd_buffer;
+    msg.msg_controllen = CMSG_LEN(sizeof(int) * num_fds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = msg.msg_controllen;
+    memcpy(CMSG_DATA(cmsg), txn->fds, sizeof(int) * num_fds);
+  }
+
+  // Like the device, a transaction goes through whole or not at all. The
+  // context is non-blocking, so wait for the rest once part of it is out.
+  bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  if (bytes < 0)
+    return -1;
+  sent = bytes;
+  while (sent < txn->len) {
+    struct pollfd pfd = {fd, POLLOUT, 0};
+
+    poll(&pfd, 1, -1);
+    bytes = send(fd, txn->data + sent, txn->len - sent, MSG_NOSIGNAL);
+    if (bytes < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+      return -1;
+    }
+    sent += bytes;
+  }
+
+  return 0;
+}
+
+static int fake_virtwl_recv(int fd, struct virtwl_ioctl_txn* txn) {
+  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+  struct iovec iov = {txn->data, txn->len};
+  struct msghdr msg = {0};
+  struct cmsghdr* cmsg;
+  int num_fds = 0;
+  ssize_t bytes;
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = fd_buffer;
+  msg.msg_controllen = sizeof(fd_buffer);
+  bytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  if (bytes < 0)
+    return -1;
+  if (!bytes) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    size_t count;
+
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(&txn->fds[num_fds], CMSG_DATA(cmsg), count * sizeof(int));
+    num_fds += count;
+  }
+  while (num_fds < VIRTWL_SEND_MAX_ALLOCS)
+    txn->fds[num_fds++] = -1;
+  txn->len = bytes;
+
+  return 0;
+}
+
+int open(const char* path, int flags, ...) {
+  static int (*real_open)(const char*, int, ...);
+  mode_t mode = 0;
+
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    va_list args;
+
+    va_start(args, flags);
+    mode = va_arg(args, mode_t);
+    va_end(args);
+  }
+
+  if (!real_open)
+    real_open = dlsym(RTLD_NEXT, "open");
+
+  if (strcmp(path, fake_virtwl_device) == 0) {
+    int fd = real_open("/dev/null", flags);
+
+    if (fd >= 0)
+      fake_virtwl_fd = fd;
+    return fd;
+  }
+
+  return real_open(path, flags, mode);
+}
+
+int open64(const char* path, int flags, ...) __attribute__((alias("open")));
+
+int ioctl(int fd, unsigned long request, ...) {
+  static int (*real_ioctl)(int, unsigned long, ...);
+  va_list args;
+  void* arg;
+
+  va_start(args, request);
+  arg = va_arg(args, void*);
+  va_end(args);
+
+  if (fd == fake_virtwl_fd && fd >= 0 && request == VIRTWL_IOCTL_NEW)
+    return fake_virtwl_new(arg);
+  if (request == VIRTWL_IOCTL_SEND && fake_virtwl_is_ctx(fd))
+    return fake_virtwl_send(fd, arg);
+  if (request == VIRTWL_IOCTL_RECV && fake_virtwl_is_ctx(fd))
+    return fake_virtwl_recv(fd, arg);
+  if (request == VIRTWL_IOCTL_DMABUF_SYNC)
+    return 0;
+
+  if (!real_ioctl)
+    real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+  return real_ioctl(fd, request, arg);
+}
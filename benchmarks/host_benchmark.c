@@ -0,0 +1,715 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures the frame path of sommelier for each shm driver without a real
+// host. Every run starts a stub_host, and a sommelier connected to it that
+// runs this program again as its client. The client animates a toplevel for
+// a while and reports the commit rate it achieved along with what the run
+// cost sommelier: bytes of shm contents copied per second, CPU time per
+// frame and resident memory. The virtwl drivers run with the fake VirtWL
+// device preloaded, the dmabuf driver only when --drm-device is given.
+//
+// Scenarios:
+//   full     Every frame redraws and damages the whole surface.
+//   partial  Every frame redraws and damages a 64x64 square.
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#include "xdg-shell-unstable-v6-client-protocol.h"
+
+#ifndef SOMMELIER_PATH
+#error SOMMELIER_PATH must be defined
+#endif
+
+#ifndef STUB_HOST_PATH
+#error STUB_HOST_PATH must be defined
+#endif
+
+#ifndef FAKE_VIRTWL_PATH
+#error FAKE_VIRTWL_PATH must be defined
+#endif
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+// Frames drawn before measuring starts.
+static const int benchmark_warmup_frames = 10;
+
+static const int32_t benchmark_partial_size = 64;
+
+#define BENCHMARK_NUM_BUFFERS 3
+
+struct benchmark_options {
+  const char* sommelier;
+  const char* stub_host;
+  const char* fake_virtwl;
+  const char* drm_device;
+  const char* drivers;
+  const char* scenarios;
+  int seconds;
+  int32_t width;
+  int32_t height;
+  int refresh;
+  int release_delay;
+};
+
+struct benchmark_buffer {
+  struct wl_buffer* buffer;
+  uint32_t* data;
+  int busy;
+};
+
+struct benchmark_client {
+  struct wl_display* display;
+  struct wl_compositor* compositor;
+  struct wl_shm* shm;
+  struct zxdg_shell_v6* xdg_shell;
+  struct wl_surface* surface;
+  struct zxdg_surface_v6* xdg_surface;
+  struct zxdg_toplevel_v6* toplevel;
+  struct benchmark_buffer buffers[BENCHMARK_NUM_BUFFERS];
+  int32_t width;
+  int32_t height;
+  int configured;
+  int frame_pending;
+};
+
+// What a run cost sommelier up to some point.
+struct benchmark_sample {
+  double time;
+  double cpu_time;
+  unsigned long long copy_bytes;
+};
+
+static double benchmark_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double benchmark_cpu_time(pid_t pid) {
+  char path[64];
+  char stat[1024];
+  unsigned long utime, stime;
+  const char* fields;
+  FILE* file;
+  size_t size;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  file = fopen(path, "r");
+  if (!file)
+    return 0;
+  size = fread(stat, 1, sizeof(stat) - 1, file);
+  fclose(file);
+  stat[size] = '\0';
+
+  // The command name can contain anything, so start after its last ')'.
+  fields = strrchr(stat, ')');
+  if (!fields || sscanf(fields + 2,
+                        "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                        &utime, &stime) != 2) {
+    return 0;
+  }
+  return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static unsigned long benchmark_rss_kb(pid_t pid) {
+  char path[64];
+  char line[256];
+  unsigned long rss_kb = 0;
+  FILE* file;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  file = fopen(path, "r");
+  if (!file)
+    return 0;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "VmRSS: %lu kB", &rss_kb) == 1)
+      break;
+  }
+  fclose(file);
+  return rss_kb;
+}
+
+// Reads the shm copy counter from the stats socket of sommelier.
+static unsigned long long benchmark_copy_bytes(const char* stats_socket) {
+  static const char metric[] = "sommelier_shm_copy_bytes_total ";
+  struct sockaddr_un addr;
+  unsigned long long bytes = 0;
+  char line[512];
+  FILE* file;
+  int fd;
+
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", stats_socket);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  assert(fd >= 0);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+      write(fd, "prometheus\n", 11) != 11) {
+    close(fd);
+    return 0;
+  }
+
+  file = fdopen(fd, "r");
+  assert(file);
+  while (fgets(line, sizeof(line), file)) {
+    if (strncmp(line, metric, sizeof(metric) - 1) == 0)
+      bytes = strtoull(line + sizeof(metric) - 1, NULL, 10);
+  }
+  fclose(file);
+  return bytes;
+}
+
+static void benchmark_sample(struct benchmark_sample* sample,
+                             pid_t sommelier,
+                             const char* stats_socket) {
+  sample->time = benchmark_now();
+  sample->cpu_time = benchmark_cpu_time(sommelier);
+  sample->copy_bytes = benchmark_copy_bytes(stats_socket);
+}
+
+static void benchmark_buffer_release(void* data, struct wl_buffer* buffer) {
+  struct benchmark_buffer* benchmark_buffer = data;
+
+  benchmark_buffer->busy = 0;
+}
+
+static const struct wl_buffer_listener benchmark_buffer_listener = {
+    benchmark_buffer_release};
+
+static void benchmark_frame_done(void* data,
+                                 struct wl_callback* callback,
+                                 uint32_t time) {
+  struct benchmark_client* client = data;
+
+  client->frame_pending = 0;
+  wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener benchmark_frame_listener = {
+    benchmark_frame_done};
+
+static void benchmark_xdg_surface_configure(
+    void* data, struct zxdg_surface_v6* xdg_surface, uint32_t serial) {
+  struct benchmark_client* client = data;
+
+  zxdg_surface_v6_ack_configure(xdg_surface, serial);
+  client->configured = 1;
+}
+
+static const struct zxdg_surface_v6_listener benchmark_xdg_surface_listener = {
+    benchmark_xdg_surface_configure};
+
+static void benchmark_toplevel_configure(void* data,
+                                         struct zxdg_toplevel_v6* toplevel,
+                                         int32_t width,
+                                         int32_t height,
+                                         struct wl_array* states) {}
+
+static void benchmark_toplevel_close(void* data,
+                                     struct zxdg_toplevel_v6* toplevel) {}
+
+static const struct zxdg_toplevel_v6_listener benchmark_toplevel_listener = {
+    benchmark_toplevel_configure, benchmark_toplevel_close};
+
+static void benchmark_xdg_shell_ping(void* data,
+                                     struct zxdg_shell_v6* xdg_shell,
+                                     uint32_t serial) {
+  zxdg_shell_v6_pong(xdg_shell, serial);
+}
+
+static const struct zxdg_shell_v6_listener benchmark_xdg_shell_listener = {
+    benchmark_xdg_shell_ping};
+
+static void benchmark_registry_global(void* data,
+                                      struct wl_registry* registry,
+                                      uint32_t name,
+                                      const char* interface,
+                                      uint32_t version) {
+  struct benchmark_client* client = data;
+
+  if (strcmp(interface, "wl_compositor") == 0) {
+    client->compositor =
+        wl_registry_bind(registry, name, &wl_compositor_interface, 1);
+  } else if (strcmp(interface, "wl_shm") == 0) {
+    client->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+  } else if (strcmp(interface, "zxdg_shell_v6") == 0) {
+    client->xdg_shell =
+        wl_registry_bind(registry, name, &zxdg_shell_v6_interface, 1);
+    zxdg_shell_v6_add_listener(client->xdg_shell,
+                               &benchmark_xdg_shell_listener, client);
+  }
+}
+
+static void benchmark_registry_global_remove(void* data,
+                                             struct wl_registry* registry,
+                                             uint32_t name) {}
+
+static const struct wl_registry_listener benchmark_registry_listener = {
+    benchmark_registry_global, benchmark_registry_global_remove};
+
+static void benchmark_create_buffers(struct benchmark_client* client) {
+  int32_t stride = client->width * 4;
+  size_t size = (size_t)stride * client->height;
+  struct wl_shm_pool* pool;
+  uint8_t* data;
+  int fd;
+  int i;
+
+  fd = memfd_create("host-benchmark", MFD_CLOEXEC);
+  assert(fd >= 0);
+  if (ftruncate(fd, size * BENCHMARK_NUM_BUFFERS)) {
+    fprintf(stderr, "error: failed to allocate buffers: %m\n");
+    exit(EXIT_FAILURE);
+  }
+  data = mmap(NULL, size * BENCHMARK_NUM_BUFFERS, PROT_READ | PROT_WRITE,
+              MAP_SHARED, fd, 0);
+  assert(data != MAP_FAILED);
+
+  pool = wl_shm_create_pool(client->shm, fd, size * BENCHMARK_NUM_BUFFERS);
+  for (i = 0; i < BENCHMARK_NUM_BUFFERS; ++i) {
+    struct benchmark_buffer* buffer = &client->buffers[i];
+
+    buffer->data = (uint32_t*)(data + size * i);
+    buffer->busy = 0;
+    buffer->buffer =
+        wl_shm_pool_create_buffer(pool, size * i, client->width,
+                                  client->height, stride,
+                                  WL_SHM_FORMAT_XRGB8888);
+    wl_buffer_add_listener(buffer->buffer, &benchmark_buffer_listener, buffer);
+  }
+  wl_shm_pool_destroy(pool);
+  close(fd);
+}
+
+static struct benchmark_buffer* benchmark_next_buffer(
+    struct benchmark_client* client) {
+  int i;
+
+  for (;;) {
+    for (i = 0; i < BENCHMARK_NUM_BUFFERS; ++i) {
+      if (!client->buffers[i].busy)
+        return &client->buffers[i];
+    }
+    if (wl_display_dispatch(client->display) < 0)
+      return NULL;
+  }
+}
+
+static void benchmark_fill(struct benchmark_client* client,
+                           struct benchmark_buffer* buffer,
+                           int32_t x,
+                           int32_t y,
+                           int32_t width,
+                           int32_t height,
+                           uint32_t color) {
+  int32_t i, j;
+
+  for (j = y; j < y + height; ++j) {
+    uint32_t* row = buffer->data + (size_t)j * client->width;
+
+    for (i = x; i < x + width; ++i)
+      row[i] = color;
+  }
+}
+
+// Draws, commits and waits for one frame.
+static int benchmark_frame(struct benchmark_client* client,
+                           int full,
+                           uint32_t frame) {
+  struct benchmark_buffer* buffer = benchmark_next_buffer(client);
+  uint32_t color = 0xff000000 | (frame * 0x010203);
+  int32_t x = 0, y = 0;
+  int32_t width = client->width, height = client->height;
+  struct wl_callback* callback;
+
+  if (!buffer)
+    return -1;
+
+  if (!full) {
+    width = height = benchmark_partial_size;
+    x = (frame * 8) % (client->width - width);
+    y = (frame * 4) % (client->height - height);
+  }
+  benchmark_fill(client, buffer, x, y, width, height, color);
+
+  wl_surface_attach(client->surface, buffer->buffer, 0, 0);
+  wl_surface_damage(client->surface, x, y, width, height);
+  callback = wl_surface_frame(client->surface);
+  wl_callback_add_listener(callback, &benchmark_frame_listener, client);
+  wl_surface_commit(client->surface);
+  buffer->busy = 1;
+  client->frame_pending = 1;
+
+  while (client->frame_pending) {
+    if (wl_display_dispatch(client->display) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Runs as the client of the sommelier under test, which is our parent.
+static int benchmark_client_main(const char* driver,
+                                 const char* scenario,
+                                 const char* stats_socket,
+                                 const struct benchmark_options* options) {
+  struct benchmark_client client;
+  struct benchmark_sample start, end;
+  pid_t sommelier = getppid();
+  int full = strcmp(scenario, "full") == 0;
+  uint32_t frame = 0;
+  uint32_t frames;
+  double elapsed;
+
+  if (!full && strcmp(scenario, "partial")) {
+    fprintf(stderr, "error: unknown scenario %s\n", scenario);
+    return EXIT_FAILURE;
+  }
+
+  memset(&client, 0, sizeof(client));
+  client.width = options->width;
+  client.height = options->height;
+  client.display = wl_display_connect(NULL);
+  if (!client.display) {
+    fprintf(stderr, "error: failed to connect to sommelier\n");
+    return EXIT_FAILURE;
+  }
+  wl_registry_add_listener(wl_display_get_registry(client.display),
+                           &benchmark_registry_listener, &client);
+  wl_display_roundtrip(client.display);
+  if (!client.compositor || !client.shm || !client.xdg_shell) {
+    fprintf(stderr, "error: missing globals\n");
+    return EXIT_FAILURE;
+  }
+
+  client.surface = wl_compositor_create_surface(client.compositor);
+  client.xdg_surface =
+      zxdg_shell_v6_get_xdg_surface(client.xdg_shell, client.surface);
+  zxdg_surface_v6_add_listener(client.xdg_surface,
+                               &benchmark_xdg_surface_listener, &client);
+  client.toplevel = zxdg_surface_v6_get_toplevel(client.xdg_surface);
+  zxdg_toplevel_v6_add_listener(client.toplevel, &benchmark_toplevel_listener,
+                                &client);
+  zxdg_toplevel_v6_set_title(client.toplevel, "host_benchmark");
+  wl_surface_commit(client.surface);
+  while (!client.configured) {
+    if (wl_display_dispatch(client.display) < 0)
+      return EXIT_FAILURE;
+  }
+  benchmark_create_buffers(&client);
+
+  for (; frame < benchmark_warmup_frames; ++frame) {
+    if (benchmark_frame(&client, full, frame))
+      return EXIT_FAILURE;
+  }
+
+  benchmark_sample(&start, sommelier, stats_socket);
+  do {
+    if (benchmark_frame(&client, full, frame++))
+      return EXIT_FAILURE;
+  } while (benchmark_now() - start.time < options->seconds);
+  benchmark_sample(&end, sommelier, stats_socket);
+
+  frames = frame - benchmark_warmup_frames;
+  elapsed = end.time - start.time;
+  printf("%-14s %-8s %10.1f %12.1f %14.3f %10.1f\n", driver, scenario,
+         frames / elapsed,
+         (end.copy_bytes - start.copy_bytes) / elapsed / (1024 * 1024),
+         (end.cpu_time - start.cpu_time) * 1000 / frames,
+         benchmark_rss_kb(sommelier) / 1024.0);
+  fflush(stdout);
+
+  wl_display_disconnect(client.display);
+  return EXIT_SUCCESS;
+}
+
+static pid_t benchmark_spawn(char** argv, const char* preload) {
+  pid_t pid = fork();
+
+  assert(pid >= 0);
+  if (!pid) {
+    if (preload)
+      setenv("LD_PRELOAD", preload, 1);
+    execv(argv[0], argv);
+    fprintf(stderr, "error: failed to run %s: %m\n", argv[0]);
+    _exit(EXIT_FAILURE);
+  }
+  return pid;
+}
+
+static int benchmark_wait_for_socket(const char* path, pid_t pid) {
+  struct timespec delay = {0, 10000000};
+  struct stat st;
+  int i;
+
+  for (i = 0; i < 500; ++i) {
+    if (!stat(path, &st))
+      return 0;
+    if (waitpid(pid, NULL, WNOHANG) == pid)
+      return -1;
+    nanosleep(&delay, NULL);
+  }
+  return -1;
+}
+
+static int benchmark_run(const struct benchmark_options* options,
+                         const char* self,
+                         const char* runtime_dir,
+                         const char* driver,
+                         const char* scenario) {
+  char socket_name[64], socket_path[PATH_MAX], stats_socket[PATH_MAX];
+  char refresh[32], release_delay[32];
+  char display[80], shm_driver[64], stats[PATH_MAX + 16];
+  char drm_device[PATH_MAX + 16];
+  char client_driver[64], client_scenario[64], client_stats[PATH_MAX + 16];
+  char seconds[32], size[64];
+  char* stub_argv[] = {(char*)options->stub_host, socket_name, refresh,
+                       release_delay, NULL};
+  char* sommelier_argv[16];
+  int virtwl = strncmp(driver, "virtwl", 6) == 0;
+  pid_t stub_host, sommelier;
+  int status;
+  int n = 0;
+
+  snprintf(socket_name, sizeof(socket_name), "--socket=host-benchmark-%d",
+           getpid());
+  snprintf(socket_path, sizeof(socket_path), "%s/host-benchmark-%d",
+           runtime_dir, getpid());
+  snprintf(stats_socket, sizeof(stats_socket), "%s/host-benchmark-%d.stats",
+           runtime_dir, getpid());
+  snprintf(refresh, sizeof(refresh), "--refresh=%d", options->refresh);
+  snprintf(release_delay, sizeof(release_delay), "--release-delay=%d",
+           options->release_delay);
+
+  stub_host = benchmark_spawn(stub_argv, NULL);
+  if (benchmark_wait_for_socket(socket_path, stub_host)) {
+    fprintf(stderr, "error: stub host did not start\n");
+    kill(stub_host, SIGTERM);
+    waitpid(stub_host, NULL, 0);
+    return -1;
+  }
+
+  snprintf(display, sizeof(display), "--display=host-benchmark-%d",
+           getpid());
+  snprintf(shm_driver, sizeof(shm_driver), "--shm-driver=%s", driver);
+  snprintf(stats, sizeof(stats), "--stats-socket=%s", stats_socket);
+  snprintf(client_driver, sizeof(client_driver), "--driver=%s", driver);
+  snprintf(client_scenario, sizeof(client_scenario), "--client=%s", scenario);
+  snprintf(client_stats, sizeof(client_stats), "--stats-socket=%s",
+           stats_socket);
+  snprintf(seconds, sizeof(seconds), "--seconds=%d", options->seconds);
+  snprintf(size, sizeof(size), "--size=%dx%d", options->width,
+           options->height);
+
+  sommelier_argv[n++] = (char*)options->sommelier;
+  sommelier_argv[n++] = shm_driver;
+  sommelier_argv[n++] = "--data-driver=noop";
+  sommelier_argv[n++] = stats;
+  if (virtwl) {
+    // The host connection goes through a virtwl context as it does in a VM.
+    sommelier_argv[n++] = "--virtwl-device=fake-virtwl";
+    setenv("FAKE_VIRTWL_DISPLAY", socket_path, 1);
+  } else {
+    sommelier_argv[n++] = display;
+  }
+  if (options->drm_device) {
+    snprintf(drm_device, sizeof(drm_device), "--drm-device=%s",
+             options->drm_device);
+    sommelier_argv[n++] = drm_device;
+  }
+  sommelier_argv[n++] = "--";
+  sommelier_argv[n++] = (char*)self;
+  sommelier_argv[n++] = client_scenario;
+  sommelier_argv[n++] = client_driver;
+  sommelier_argv[n++] = client_stats;
+  sommelier_argv[n++] = seconds;
+  sommelier_argv[n++] = size;
+  sommelier_argv[n] = NULL;
+  assert(n < ARRAY_SIZE(sommelier_argv));
+
+  unlink(stats_socket);
+  sommelier =
+      benchmark_spawn(sommelier_argv, virtwl ? options->fake_virtwl : NULL);
+  waitpid(sommelier, &status, 0);
+  unlink(stats_socket);
+
+  kill(stub_host, SIGTERM);
+  waitpid(stub_host, NULL, 0);
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    printf("%-14s %-8s failed\n", driver, scenario);
+    fflush(stdout);
+    return -1;
+  }
+  return 0;
+}
+
+static void benchmark_usage(const char* name) {
+  printf(
+      "usage: %s [options]\n\n"
+      "options:\n"
+      "  -h, --help\t\t\tPrint this help\n"
+      "  --drivers=LIST\t\tShm drivers to run (default "
+      "noop,virtwl,virtwl-dmabuf\n"
+      "\t\t\t\tand dmabuf with --drm-device)\n"
+      "  --scenarios=LIST\t\tScenarios to run (default full,partial)\n"
+      "  --seconds=SECONDS\t\tDuration of each run (default 5)\n"
+      "  --size=WIDTHxHEIGHT\t\tSize of the surface (default 1280x720)\n"
+      "  --refresh=HZ\t\t\tFrame rate of the stub host, 0 for unthrottled\n"
+      "\t\t\t\t(default 0)\n"
+      "  --release-delay=MS\t\tBuffer release delay of the stub host "
+      "(default 0)\n"
+      "  --drm-device=DEVICE\t\tDRM device for the dmabuf driver\n"
+      "  --sommelier=PATH\t\tSommelier to benchmark\n"
+      "  --stub-host=PATH\t\tStub host compositor to use\n"
+      "  --fake-virtwl=PATH\t\tFake VirtWL library to preload\n",
+      name);
+}
+
+int main(int argc, char** argv) {
+  struct benchmark_options options = {
+      .sommelier = SOMMELIER_PATH,
+      .stub_host = STUB_HOST_PATH,
+      .fake_virtwl = FAKE_VIRTWL_PATH,
+      .drm_device = NULL,
+      .drivers = NULL,
+      .scenarios = "full,partial",
+      .seconds = 5,
+      .width = 1280,
+      .height = 720,
+      .refresh = 0,
+      .release_delay = 0,
+  };
+  const char* client_scenario = NULL;
+  const char* client_driver = "";
+  const char* client_stats = NULL;
+  char runtime_dir_template[] = "/tmp/host-benchmark-XXXXXX";
+  const char* runtime_dir;
+  char self[PATH_MAX];
+  char *drivers, *driver, *driver_state;
+  ssize_t length;
+  int failures = 0;
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value = strchr(arg, '=');
+
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      benchmark_usage(argv[0]);
+      return EXIT_SUCCESS;
+    } else if (strstr(arg, "--drivers") == arg && value) {
+      options.drivers = value + 1;
+    } else if (strstr(arg, "--scenarios") == arg && value) {
+      options.scenarios = value + 1;
+    } else if (strstr(arg, "--seconds") == arg && value) {
+      options.seconds = atoi(value + 1);
+    } else if (strstr(arg, "--size") == arg && value) {
+      if (sscanf(value + 1, "%dx%d", &options.width, &options.height) != 2) {
+        benchmark_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (strstr(arg, "--refresh") == arg && value) {
+      options.refresh = atoi(value + 1);
+    } else if (strstr(arg, "--release-delay") == arg && value) {
+      options.release_delay = atoi(value + 1);
+    } else if (strstr(arg, "--drm-device") == arg && value) {
+      options.drm_device = value + 1;
+    } else if (strstr(arg, "--sommelier") == arg && value) {
+      options.sommelier = value + 1;
+    } else if (strstr(arg, "--stub-host") == arg && value) {
+      options.stub_host = value + 1;
+    } else if (strstr(arg, "--fake-virtwl") == arg && value) {
+      options.fake_virtwl = value + 1;
+    } else if (strstr(arg, "--client") == arg && value) {
+      client_scenario = value + 1;
+    } else if (strstr(arg, "--driver") == arg && value) {
+      client_driver = value + 1;
+    } else if (strstr(arg, "--stats-socket") == arg && value) {
+      client_stats = value + 1;
+    } else {
+      fprintf(stderr, "Option `%s' is unknown.\n", arg);
+      return EXIT_FAILURE;
+    }
+  }
+  if (options.seconds <= 0 || options.width < 2 * benchmark_partial_size ||
+      options.height < 2 * benchmark_partial_size) {
+    benchmark_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (client_scenario) {
+    if (!client_stats) {
+      benchmark_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    return benchmark_client_main(client_driver, client_scenario, client_stats,
+                                 &options);
+  }
+
+  if (!options.drivers) {
+    options.drivers = options.drm_device
+                          ? "noop,virtwl,virtwl-dmabuf,dmabuf"
+                          : "noop,virtwl,virtwl-dmabuf";
+  }
+
+  // Sommelier runs us again as its client.
+  length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (length < 0) {
+    fprintf(stderr, "error: failed to find own executable: %m\n");
+    return EXIT_FAILURE;
+  }
+  self[length] = '\0';
+
+  // Wayland sockets live in XDG_RUNTIME_DIR, which CI machines often lack.
+  runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (!runtime_dir) {
+    runtime_dir = mkdtemp(runtime_dir_template);
+    if (!runtime_dir) {
+      fprintf(stderr, "error: failed to create runtime directory: %m\n");
+      return EXIT_FAILURE;
+    }
+    setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
+  }
+
+  printf("%-14s %-8s %10s %12s %14s %10s\n", "driver", "scenario",
+         "commits/s", "copy MB/s", "CPU ms/frame", "RSS MB");
+  fflush(stdout);
+
+  drivers = strdup(options.drivers);
+  assert(drivers);
+  for (driver = strtok_r(drivers, ",", &driver_state); driver;
+       driver = strtok_r(NULL, ",", &driver_state)) {
+    char* scenarios = strdup(options.scenarios);
+    char *scenario, *scenario_state;
+
+    assert(scenarios);
+    for (scenario = strtok_r(scenarios, ",", &scenario_state); scenario;
+         scenario = strtok_r(NULL, ",", &scenario_state)) {
+      if (benchmark_run(&options, self, runtime_dir, driver, scenario))
+        failures++;
+    }
+    free(scenarios);
+  }
+  free(drivers);
+
+  if (runtime_dir == runtime_dir_template)
+    rmdir(runtime_dir);
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
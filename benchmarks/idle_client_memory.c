@@ -0,0 +1,199 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Measures the memory a master sommelier needs to serve idle clients. The
+// clients connect to the master's socket, bind the globals a typical
+// toolkit binds at startup and then sit idle while the RSS and PSS of the
+// master and all its descendants are added up. Run it against a master
+// started with and without --single-process to compare the two models.
+
+#include <assert.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+struct benchmark_memory {
+  int processes;
+  unsigned long rss_kb;
+  unsigned long pss_kb;
+};
+
+static void benchmark_registry_global(void* data,
+                                      struct wl_registry* registry,
+                                      uint32_t name,
+                                      const char* interface,
+                                      uint32_t version) {
+  if (strcmp(interface, "wl_compositor") == 0) {
+    wl_registry_bind(registry, name, &wl_compositor_interface, 1);
+  } else if (strcmp(interface, "wl_shm") == 0) {
+    wl_registry_bind(registry, name, &wl_shm_interface, 1);
+  } else if (strcmp(interface, "wl_seat") == 0) {
+    wl_registry_bind(registry, name, &wl_seat_interface, 1);
+  } else if (strcmp(interface, "wl_output") == 0) {
+    wl_registry_bind(registry, name, &wl_output_interface, 1);
+  } else if (strcmp(interface, "wl_data_device_manager") == 0) {
+    wl_registry_bind(registry, name, &wl_data_device_manager_interface, 1);
+  }
+}
+
+static void benchmark_registry_global_remove(void* data,
+                                             struct wl_registry* registry,
+                                             uint32_t name) {}
+
+static const struct wl_registry_listener benchmark_registry_listener = {
+    benchmark_registry_global, benchmark_registry_global_remove};
+
+static pid_t benchmark_parent_pid(pid_t pid) {
+  char path[64];
+  char line[256];
+  pid_t ppid = -1;
+  FILE* file;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  file = fopen(path, "r");
+  if (!file)
+    return -1;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "PPid: %d", &ppid) == 1)
+      break;
+  }
+  fclose(file);
+  return ppid;
+}
+
+static int benchmark_is_descendant(pid_t pid, pid_t ancestor) {
+  while (pid > 1) {
+    if (pid == ancestor)
+      return 1;
+    pid = benchmark_parent_pid(pid);
+  }
+  return 0;
+}
+
+static void benchmark_add_process(struct benchmark_memory* memory, pid_t pid) {
+  char path[64];
+  char line[256];
+  unsigned long value;
+  FILE* file;
+
+  snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+  file = fopen(path, "r");
+  if (!file)
+    return;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "Rss: %lu kB", &value) == 1)
+      memory->rss_kb += value;
+    else if (sscanf(line, "Pss: %lu kB", &value) == 1)
+      memory->pss_kb += value;
+  }
+  fclose(file);
+  memory->processes++;
+}
+
+static void benchmark_measure(struct benchmark_memory* memory, pid_t master) {
+  struct dirent* entry;
+  DIR* dir;
+
+  memset(memory, 0, sizeof(*memory));
+  dir = opendir("/proc");
+  assert(dir);
+  while ((entry = readdir(dir))) {
+    pid_t pid = atoi(entry->d_name);
+
+    if (pid > 0 && benchmark_is_descendant(pid, master))
+      benchmark_add_process(memory, pid);
+  }
+  closedir(dir);
+}
+
+static void benchmark_print(const char* label,
+                            const struct benchmark_memory* memory) {
+  printf("%-8s %4d processes %10lu kB RSS %10lu kB PSS\n", label,
+         memory->processes, memory->rss_kb, memory->pss_kb);
+}
+
+static void benchmark_usage(const char* name) {
+  printf(
+      "usage: %s [options] --pid=PID\n\n"
+      "options:\n"
+      "  -h, --help\t\tPrint this help\n"
+      "  --pid=PID\t\tProcess id of the master sommelier\n"
+      "  --display=DISPLAY\tSocket of the master (default $WAYLAND_DISPLAY)\n"
+      "  --clients=N\t\tNumber of idle clients (default 50)\n"
+      "  --settle=SECONDS\tTime to wait before measuring (default 2)\n",
+      name);
+}
+
+int main(int argc, char** argv) {
+  const char* display = NULL;
+  struct wl_display** clients;
+  struct benchmark_memory before, after;
+  pid_t master = -1;
+  int count = 50;
+  int settle = 2;
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value = strchr(arg, '=');
+
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      benchmark_usage(argv[0]);
+      return EXIT_SUCCESS;
+    } else if (strstr(arg, "--pid") == arg && value) {
+      master = atoi(value + 1);
+    } else if (strstr(arg, "--display") == arg && value) {
+      display = value + 1;
+    } else if (strstr(arg, "--clients") == arg && value) {
+      count = atoi(value + 1);
+    } else if (strstr(arg, "--settle") == arg && value) {
+      settle = atoi(value + 1);
+    } else {
+      fprintf(stderr, "Option `%s' is unknown.\n", arg);
+      return EXIT_FAILURE;
+    }
+  }
+  if (master <= 0 || count <= 0) {
+    benchmark_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  benchmark_measure(&before, master);
+
+  clients = calloc(count, sizeof(*clients));
+  assert(clients);
+  for (i = 0; i < count; ++i) {
+    struct wl_registry* registry;
+
+    clients[i] = wl_display_connect(display);
+    if (!clients[i]) {
+      fprintf(stderr, "error: failed to connect client %d: %m\n", i);
+      return EXIT_FAILURE;
+    }
+    registry = wl_display_get_registry(clients[i]);
+    wl_registry_add_listener(registry, &benchmark_registry_listener, NULL);
+    // One roundtrip for the globals and one for the state of the bound ones.
+    wl_display_roundtrip(clients[i]);
+    wl_display_roundtrip(clients[i]);
+  }
+
+  sleep(settle);
+  benchmark_measure(&after, master);
+
+  benchmark_print("idle", &before);
+  benchmark_print("clients", &after);
+  printf("%lu kB PSS per client\n",
+         after.pss_kb > before.pss_kb ? (after.pss_kb - before.pss_kb) / count
+                                      : 0);
+
+  for (i = 0; i < count; ++i)
+    wl_display_disconnect(clients[i]);
+  free(clients);
+
+  return EXIT_SUCCESS;
+}
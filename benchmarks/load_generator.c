@@ -0,0 +1,957 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// A synthetic Wayland client for load testing sommelier. It creates a number
+// of toplevels, each with its own subsurfaces and popups, and animates all of
+// them with one damage pattern until the time is up. It then reports, for
+// each kind of surface, the frame rate achieved and the latency from commit
+// to frame callback:
+//
+//   sommelier --shm-driver=virtwl -- load_generator --toplevels=4
+//       --subsurfaces=2 --damage=scatter --fps=60
+//
+// Damage patterns:
+//   full     Every frame redraws and damages the whole surface.
+//   scroll   Every frame copies the previous frame up by a few rows, draws a
+//            new line at the bottom and damages the whole surface.
+//   scatter  Every frame draws and damages small rects at random positions.
+//   cursor   Every frame toggles a text cursor and damages only that.
+//
+// Only the damaged areas of a buffer are redrawn, so buffers are not kept
+// consistent with each other. The contents only exist to be copied.
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#include "xdg-shell-unstable-v6-client-protocol.h"
+
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+#define LOAD_MAX_BUFFERS 4
+
+// Frames each surface draws before it is measured.
+static const uint32_t load_warmup_frames = 5;
+
+static const int32_t load_rect_size = 16;
+static const int32_t load_scroll_step = 16;
+static const int32_t load_cursor_width = 2;
+static const int32_t load_cursor_height = 16;
+
+enum load_role {
+  LOAD_ROLE_TOPLEVEL,
+  LOAD_ROLE_SUBSURFACE,
+  LOAD_ROLE_POPUP,
+  LOAD_NUM_ROLES
+};
+
+static const char* const load_role_names[] = {"toplevel", "subsurface",
+                                              "popup"};
+
+enum load_damage {
+  LOAD_DAMAGE_FULL,
+  LOAD_DAMAGE_SCROLL,
+  LOAD_DAMAGE_SCATTER,
+  LOAD_DAMAGE_CURSOR
+};
+
+static const char* const load_damage_names[] = {"full", "scroll", "scatter",
+                                                "cursor"};
+
+// How buffers are spread over shm pools.
+enum load_pool_layout {
+  LOAD_POOL_SHARED,
+  LOAD_POOL_SURFACE,
+  LOAD_POOL_BUFFER
+};
+
+static const char* const load_pool_names[] = {"shared", "surface", "buffer"};
+
+struct load_format {
+  const char* name;
+  uint32_t format;
+  // Bytes per pixel of the first plane.
+  int32_t bpp;
+  // Set for formats with a half resolution interleaved UV plane.
+  int subsampled;
+};
+
+static const struct load_format load_formats[] = {
+    {"argb8888", WL_SHM_FORMAT_ARGB8888, 4, 0},
+    {"xrgb8888", WL_SHM_FORMAT_XRGB8888, 4, 0},
+    {"rgb565", WL_SHM_FORMAT_RGB565, 2, 0},
+    {"nv12", WL_SHM_FORMAT_NV12, 1, 1},
+};
+
+struct load_pool {
+  struct wl_shm_pool* pool;
+  uint8_t* data;
+  size_t size;
+  size_t used;
+};
+
+struct load_buffer {
+  struct wl_buffer* buffer;
+  uint8_t* data;
+  int busy;
+};
+
+struct load_surface {
+  struct load_context* ctx;
+  struct wl_list link;
+  enum load_role role;
+  struct load_surface* parent;
+  struct wl_surface* surface;
+  struct wl_subsurface* subsurface;
+  struct zxdg_surface_v6* xdg_surface;
+  struct zxdg_toplevel_v6* toplevel;
+  struct zxdg_popup_v6* popup;
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+  int32_t stride;
+  struct load_buffer buffers[LOAD_MAX_BUFFERS];
+  struct load_buffer* last_buffer;
+  unsigned seed;
+  int configured;
+  // Set when a frame should be drawn as soon as a buffer is free.
+  int due;
+  struct wl_callback* frame_callback;
+  double commit_time;
+  uint32_t frame;
+  // Measured part of the run.
+  double first_commit_time;
+  double last_done_time;
+  uint64_t frames;
+  uint64_t skipped;
+  // Commit to frame callback latencies in microseconds.
+  struct wl_array latencies;
+};
+
+struct load_options {
+  int toplevels;
+  int subsurfaces;
+  int popups;
+  enum load_damage damage;
+  const struct load_format* format;
+  enum load_pool_layout pool_layout;
+  int buffers;
+  int fps;
+  int seconds;
+  int rects;
+  int32_t width;
+  int32_t height;
+  int32_t child_width;
+  int32_t child_height;
+};
+
+struct load_context {
+  struct load_options options;
+  struct wl_display* display;
+  struct wl_compositor* compositor;
+  struct wl_subcompositor* subcompositor;
+  struct wl_shm* shm;
+  struct zxdg_shell_v6* xdg_shell;
+  int format_supported;
+  struct wl_list surfaces;
+  struct load_pool* shared_pool;
+};
+
+static double load_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t load_buffer_size(struct load_surface* surface) {
+  size_t size = (size_t)surface->stride * surface->height;
+
+  if (surface->ctx->options.format->subsampled)
+    size += (size_t)surface->stride * (surface->height / 2);
+  return size;
+}
+
+static struct load_pool* load_pool_create(struct load_context* ctx,
+                                          size_t size) {
+  struct load_pool* pool;
+  int fd;
+
+  pool = malloc(sizeof(*pool));
+  assert(pool);
+  fd = memfd_create("load-generator", MFD_CLOEXEC);
+  assert(fd >= 0);
+  if (ftruncate(fd, size)) {
+    fprintf(stderr, "error: failed to allocate pool: %m\n");
+    exit(EXIT_FAILURE);
+  }
+  pool->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  assert(pool->data != MAP_FAILED);
+  pool->pool = wl_shm_create_pool(ctx->shm, fd, size);
+  pool->size = size;
+  pool->used = 0;
+  close(fd);
+  return pool;
+}
+
+static void load_buffer_release(void* data, struct wl_buffer* buffer);
+
+static const struct wl_buffer_listener load_buffer_listener = {
+    load_buffer_release};
+
+// Carves the buffers of |surface| out of pools laid out as requested. Pools
+// other than the shared one are only needed until the buffers exist.
+static void load_surface_create_buffers(struct load_surface* surface) {
+  struct load_context* ctx = surface->ctx;
+  size_t size = load_buffer_size(surface);
+  struct load_pool* pool = ctx->shared_pool;
+  int i;
+
+  if (ctx->options.pool_layout == LOAD_POOL_SURFACE)
+    pool = load_pool_create(ctx, size * ctx->options.buffers);
+
+  for (i = 0; i < ctx->options.buffers; ++i) {
+    struct load_buffer* buffer = &surface->buffers[i];
+
+    if (ctx->options.pool_layout == LOAD_POOL_BUFFER)
+      pool = load_pool_create(ctx, size);
+
+    assert(pool->used + size <= pool->size);
+    buffer->data = pool->data + pool->used;
+    buffer->busy = 0;
+    buffer->buffer = wl_shm_pool_create_buffer(
+        pool->pool, pool->used, surface->width, surface->height,
+        surface->stride, ctx->options.format->format);
+    wl_buffer_add_listener(buffer->buffer, &load_buffer_listener, surface);
+    pool->used += size;
+
+    if (ctx->options.pool_layout == LOAD_POOL_BUFFER) {
+      wl_shm_pool_destroy(pool->pool);
+      free(pool);
+    }
+  }
+
+  if (ctx->options.pool_layout == LOAD_POOL_SURFACE) {
+    wl_shm_pool_destroy(pool->pool);
+    free(pool);
+  }
+}
+
+static uint32_t load_color(uint32_t frame) {
+  return 0xff000000 | ((frame * 0x0a1b2c) & 0xffffff);
+}
+
+static void load_fill(struct load_surface* surface,
+                      struct load_buffer* buffer,
+                      int32_t x,
+                      int32_t y,
+                      int32_t width,
+                      int32_t height,
+                      uint32_t color) {
+  const struct load_format* format = surface->ctx->options.format;
+  int32_t i, j;
+
+  for (j = y; j < y + height; ++j) {
+    uint8_t* row = buffer->data + (size_t)j * surface->stride;
+
+    switch (format->bpp) {
+      case 4:
+        for (i = x; i < x + width; ++i)
+          ((uint32_t*)row)[i] = color;
+        break;
+      case 2:
+        for (i = x; i < x + width; ++i) {
+          ((uint16_t*)row)[i] = ((color >> 8) & 0xf800) |
+                                ((color >> 5) & 0x07e0) |
+                                ((color >> 3) & 0x001f);
+        }
+        break;
+      default:
+        memset(row + x, color & 0xff, width);
+        break;
+    }
+  }
+
+  if (format->subsampled) {
+    uint8_t* uv = buffer->data + (size_t)surface->stride * surface->height;
+    int32_t uv_x = x & ~1;
+    int32_t uv_width = ((x + width + 1) & ~1) - uv_x;
+
+    for (j = y / 2; j < (y + height + 1) / 2; ++j) {
+      memset(uv + (size_t)j * surface->stride + uv_x, (color >> 8) & 0xff,
+             uv_width);
+    }
+  }
+}
+
+// Copies the contents of |src| into |dst| moved up by |rows|.
+static void load_scroll(struct load_surface* surface,
+                        struct load_buffer* dst,
+                        struct load_buffer* src,
+                        int32_t rows) {
+  size_t plane_size = (size_t)surface->stride * surface->height;
+  size_t offset = (size_t)surface->stride * rows;
+
+  memmove(dst->data, src->data + offset, plane_size - offset);
+  if (surface->ctx->options.format->subsampled) {
+    size_t uv_offset = (size_t)surface->stride * (rows / 2);
+
+    memmove(dst->data + plane_size, src->data + plane_size + uv_offset,
+            (size_t)surface->stride * (surface->height / 2) - uv_offset);
+  }
+}
+
+static void load_surface_draw(struct load_surface* surface,
+                              struct load_buffer* buffer) {
+  const struct load_options* options = &surface->ctx->options;
+  uint32_t color = load_color(surface->frame);
+  int32_t width = surface->width, height = surface->height;
+  int i;
+
+  // The first frame of a surface fills all of it whatever the pattern.
+  if (!surface->frame) {
+    load_fill(surface, buffer, 0, 0, width, height, color);
+    wl_surface_damage(surface->surface, 0, 0, width, height);
+    return;
+  }
+
+  switch (options->damage) {
+    case LOAD_DAMAGE_FULL:
+      load_fill(surface, buffer, 0, 0, width, height, color);
+      wl_surface_damage(surface->surface, 0, 0, width, height);
+      break;
+    case LOAD_DAMAGE_SCROLL:
+      load_scroll(surface, buffer, surface->last_buffer, load_scroll_step);
+      load_fill(surface, buffer, 0, height - load_scroll_step, width,
+                load_scroll_step, color);
+      wl_surface_damage(surface->surface, 0, 0, width, height);
+      break;
+    case LOAD_DAMAGE_SCATTER:
+      for (i = 0; i < options->rects; ++i) {
+        int32_t x = rand_r(&surface->seed) % (width - load_rect_size);
+        int32_t y = rand_r(&surface->seed) % (height - load_rect_size);
+
+        load_fill(surface, buffer, x, y, load_rect_size, load_rect_size,
+                  color);
+        wl_surface_damage(surface->surface, x, y, load_rect_size,
+                          load_rect_size);
+      }
+      break;
+    case LOAD_DAMAGE_CURSOR:
+      load_fill(surface, buffer, load_cursor_width * 4, load_cursor_height,
+                load_cursor_width, load_cursor_height,
+                surface->frame % 2 ? 0xff000000 : 0xffffffff);
+      wl_surface_damage(surface->surface, load_cursor_width * 4,
+                        load_cursor_height, load_cursor_width,
+                        load_cursor_height);
+      break;
+  }
+}
+
+static void load_frame_done(void* data,
+                            struct wl_callback* callback,
+                            uint32_t time);
+
+static const struct wl_callback_listener load_frame_listener = {
+    load_frame_done};
+
+// Draws and commits a frame if one is due and the previous one is done.
+static void load_surface_update(struct load_surface* surface) {
+  struct load_buffer* buffer = NULL;
+  int i;
+
+  if (!surface->configured || !surface->due || surface->frame_callback)
+    return;
+
+  for (i = 0; i < surface->ctx->options.buffers; ++i) {
+    if (!surface->buffers[i].busy) {
+      buffer = &surface->buffers[i];
+      break;
+    }
+  }
+  // Tried again when a buffer is released.
+  if (!buffer)
+    return;
+
+  load_surface_draw(surface, buffer);
+  wl_surface_attach(surface->surface, buffer->buffer, 0, 0);
+  surface->frame_callback = wl_surface_frame(surface->surface);
+  wl_callback_add_listener(surface->frame_callback, &load_frame_listener,
+                           surface);
+  wl_surface_commit(surface->surface);
+
+  buffer->busy = 1;
+  surface->last_buffer = buffer;
+  surface->commit_time = load_now();
+  if (surface->frame == load_warmup_frames)
+    surface->first_commit_time = surface->commit_time;
+  surface->frame++;
+  surface->due = 0;
+}
+
+static void load_frame_done(void* data,
+                            struct wl_callback* callback,
+                            uint32_t time) {
+  struct load_surface* surface = data;
+  double now = load_now();
+
+  wl_callback_destroy(callback);
+  surface->frame_callback = NULL;
+
+  if (surface->frame > load_warmup_frames) {
+    uint32_t* latency = wl_array_add(&surface->latencies, sizeof(*latency));
+
+    assert(latency);
+    *latency = (now - surface->commit_time) * 1e6;
+    surface->frames++;
+    surface->last_done_time = now;
+  }
+
+  // Without a frame rate, surfaces draw as fast as callbacks allow.
+  if (!surface->ctx->options.fps)
+    surface->due = 1;
+  load_surface_update(surface);
+}
+
+static void load_buffer_release(void* data, struct wl_buffer* buffer) {
+  struct load_surface* surface = data;
+  int i;
+
+  for (i = 0; i < surface->ctx->options.buffers; ++i) {
+    if (surface->buffers[i].buffer == buffer)
+      surface->buffers[i].busy = 0;
+  }
+  load_surface_update(surface);
+}
+
+static void load_xdg_surface_configure(void* data,
+                                       struct zxdg_surface_v6* xdg_surface,
+                                       uint32_t serial) {
+  struct load_surface* surface = data;
+  struct load_surface* child;
+
+  zxdg_surface_v6_ack_configure(xdg_surface, serial);
+  if (surface->configured)
+    return;
+
+  surface->configured = 1;
+  load_surface_update(surface);
+
+  // Subsurfaces are only shown once their parent is.
+  wl_list_for_each(child, &surface->ctx->surfaces, link) {
+    if (child->parent == surface && child->role == LOAD_ROLE_SUBSURFACE) {
+      child->configured = 1;
+      load_surface_update(child);
+    }
+  }
+}
+
+static const struct zxdg_surface_v6_listener load_xdg_surface_listener = {
+    load_xdg_surface_configure};
+
+static void load_toplevel_configure(void* data,
+                                    struct zxdg_toplevel_v6* toplevel,
+                                    int32_t width,
+                                    int32_t height,
+                                    struct wl_array* states) {}
+
+static void load_toplevel_close(void* data,
+                                struct zxdg_toplevel_v6* toplevel) {}
+
+static const struct zxdg_toplevel_v6_listener load_toplevel_listener = {
+    load_toplevel_configure, load_toplevel_close};
+
+static void load_popup_configure(void* data,
+                                 struct zxdg_popup_v6* popup,
+                                 int32_t x,
+                                 int32_t y,
+                                 int32_t width,
+                                 int32_t height) {}
+
+static void load_popup_done(void* data, struct zxdg_popup_v6* popup) {}
+
+static const struct zxdg_popup_v6_listener load_popup_listener = {
+    load_popup_configure, load_popup_done};
+
+static void load_xdg_shell_ping(void* data,
+                                struct zxdg_shell_v6* xdg_shell,
+                                uint32_t serial) {
+  zxdg_shell_v6_pong(xdg_shell, serial);
+}
+
+static const struct zxdg_shell_v6_listener load_xdg_shell_listener = {
+    load_xdg_shell_ping};
+
+static void load_shm_format(void* data, struct wl_shm* shm, uint32_t format) {
+  struct load_context* ctx = data;
+
+  if (format == ctx->options.format->format)
+    ctx->format_supported = 1;
+}
+
+static const struct wl_shm_listener load_shm_listener = {load_shm_format};
+
+static void load_registry_global(void* data,
+                                 struct wl_registry* registry,
+                                 uint32_t name,
+                                 const char* interface,
+                                 uint32_t version) {
+  struct load_context* ctx = data;
+
+  if (strcmp(interface, "wl_compositor") == 0) {
+    ctx->compositor =
+        wl_registry_bind(registry, name, &wl_compositor_interface, 1);
+  } else if (strcmp(interface, "wl_subcompositor") == 0) {
+    ctx->subcompositor =
+        wl_registry_bind(registry, name, &wl_subcompositor_interface, 1);
+  } else if (strcmp(interface, "wl_shm") == 0) {
+    ctx->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+    wl_shm_add_listener(ctx->shm, &load_shm_listener, ctx);
+  } else if (strcmp(interface, "zxdg_shell_v6") == 0) {
+    ctx->xdg_shell =
+        wl_registry_bind(registry, name, &zxdg_shell_v6_interface, 1);
+    zxdg_shell_v6_add_listener(ctx->xdg_shell, &load_xdg_shell_listener, ctx);
+  }
+}
+
+static void load_registry_global_remove(void* data,
+                                        struct wl_registry* registry,
+                                        uint32_t name) {}
+
+static const struct wl_registry_listener load_registry_listener = {
+    load_registry_global, load_registry_global_remove};
+
+static struct load_surface* load_surface_create(struct load_context* ctx,
+                                                enum load_role role,
+                                                struct load_surface* parent,
+                                                int index) {
+  struct load_surface* surface;
+
+  surface = malloc(sizeof(*surface));
+  assert(surface);
+  memset(surface, 0, sizeof(*surface));
+  surface->ctx = ctx;
+  surface->role = role;
+  surface->parent = parent;
+  surface->seed = index;
+  surface->due = 1;
+  wl_array_init(&surface->latencies);
+  if (role == LOAD_ROLE_TOPLEVEL) {
+    surface->width = ctx->options.width;
+    surface->height = ctx->options.height;
+  } else {
+    surface->width = ctx->options.child_width;
+    surface->height = ctx->options.child_height;
+    // Children are spread along the diagonal of their parent.
+    surface->x = (index * 40) % MAX(parent->width - surface->width, 1);
+    surface->y = (index * 40) % MAX(parent->height - surface->height, 1);
+  }
+  surface->stride = surface->width * ctx->options.format->bpp;
+  wl_list_insert(ctx->surfaces.prev, &surface->link);
+  return surface;
+}
+
+static void load_surface_create_role(struct load_surface* surface) {
+  struct load_context* ctx = surface->ctx;
+  struct zxdg_positioner_v6* positioner;
+
+  surface->surface = wl_compositor_create_surface(ctx->compositor);
+
+  switch (surface->role) {
+    case LOAD_ROLE_TOPLEVEL:
+      surface->xdg_surface =
+          zxdg_shell_v6_get_xdg_surface(ctx->xdg_shell, surface->surface);
+      zxdg_surface_v6_add_listener(surface->xdg_surface,
+                                   &load_xdg_surface_listener, surface);
+      surface->toplevel = zxdg_surface_v6_get_toplevel(surface->xdg_surface);
+      zxdg_toplevel_v6_add_listener(surface->toplevel, &load_toplevel_listener,
+                                    surface);
+      zxdg_toplevel_v6_set_title(surface->toplevel, "load_generator");
+      wl_surface_commit(surface->surface);
+      break;
+    case LOAD_ROLE_SUBSURFACE:
+      surface->subsurface = wl_subcompositor_get_subsurface(
+          ctx->subcompositor, surface->surface, surface->parent->surface);
+      wl_subsurface_set_position(surface->subsurface, surface->x, surface->y);
+      // Lets the subsurface animate without commits of its parent.
+      wl_subsurface_set_desync(surface->subsurface);
+      break;
+    case LOAD_ROLE_POPUP:
+      positioner = zxdg_shell_v6_create_positioner(ctx->xdg_shell);
+      zxdg_positioner_v6_set_size(positioner, surface->width,
+                                  surface->height);
+      zxdg_positioner_v6_set_anchor_rect(positioner, surface->x, surface->y, 1,
+                                         1);
+      zxdg_positioner_v6_set_anchor(
+          positioner,
+          ZXDG_POSITIONER_V6_ANCHOR_TOP | ZXDG_POSITIONER_V6_ANCHOR_LEFT);
+      zxdg_positioner_v6_set_gravity(
+          positioner,
+          ZXDG_POSITIONER_V6_GRAVITY_BOTTOM | ZXDG_POSITIONER_V6_GRAVITY_RIGHT);
+      surface->xdg_surface =
+          zxdg_shell_v6_get_xdg_surface(ctx->xdg_shell, surface->surface);
+      zxdg_surface_v6_add_listener(surface->xdg_surface,
+                                   &load_xdg_surface_listener, surface);
+      surface->popup = zxdg_surface_v6_get_popup(
+          surface->xdg_surface, surface->parent->xdg_surface, positioner);
+      zxdg_popup_v6_add_listener(surface->popup, &load_popup_listener,
+                                 surface);
+      zxdg_positioner_v6_destroy(positioner);
+      wl_surface_commit(surface->surface);
+      break;
+    case LOAD_NUM_ROLES:
+      break;
+  }
+}
+
+static int load_compare(const void* a, const void* b) {
+  uint32_t value_a = *(const uint32_t*)a;
+  uint32_t value_b = *(const uint32_t*)b;
+
+  return value_a < value_b ? -1 : value_a > value_b;
+}
+
+static void load_report(struct load_context* ctx) {
+  enum load_role role;
+
+  printf("%-10s %8s %8s %8s %8s %8s %8s %8s %8s\n", "role", "surfaces",
+         "frames", "fps", "skipped", "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+  for (role = 0; role < LOAD_NUM_ROLES; ++role) {
+    struct load_surface* surface;
+    struct wl_array latencies;
+    uint64_t frames = 0, skipped = 0;
+    double fps = 0;
+    uint32_t* values;
+    size_t count;
+    int surfaces = 0;
+
+    wl_array_init(&latencies);
+    wl_list_for_each(surface, &ctx->surfaces, link) {
+      double elapsed = surface->last_done_time - surface->first_commit_time;
+
+      if (surface->role != role)
+        continue;
+
+      surfaces++;
+      frames += surface->frames;
+      skipped += surface->skipped;
+      if (surface->frames && elapsed > 0)
+        fps += surface->frames / elapsed;
+      if (surface->latencies.size) {
+        void* p = wl_array_add(&latencies, surface->latencies.size);
+
+        assert(p);
+        memcpy(p, surface->latencies.data, surface->latencies.size);
+      }
+    }
+    if (!surfaces)
+      continue;
+
+    values = latencies.data;
+    count = latencies.size / sizeof(*values);
+    printf("%-10s %8d %8llu %8.1f %8llu", load_role_names[role], surfaces,
+           (unsigned long long)frames, fps / surfaces,
+           (unsigned long long)skipped);
+    if (count) {
+      qsort(values, count, sizeof(*values), load_compare);
+      printf(" %8.2f %8.2f %8.2f %8.2f\n", values[count * 50 / 100] / 1e3,
+             values[count * 90 / 100] / 1e3, values[count * 99 / 100] / 1e3,
+             values[count - 1] / 1e3);
+    } else {
+      printf(" %8s %8s %8s %8s\n", "-", "-", "-", "-");
+    }
+    wl_array_release(&latencies);
+  }
+}
+
+// Marks a frame due on every surface. Surfaces that haven't drawn the last
+// one yet skip it.
+static void load_tick(struct load_context* ctx) {
+  struct load_surface* surface;
+
+  wl_list_for_each(surface, &ctx->surfaces, link) {
+    if (surface->due && surface->frame > load_warmup_frames)
+      surface->skipped++;
+    surface->due = 1;
+    load_surface_update(surface);
+  }
+}
+
+static int load_run(struct load_context* ctx) {
+  double end_time;
+  struct pollfd pfds[2];
+  int num_pfds = 1;
+  int timer_fd = -1;
+
+  pfds[0].fd = wl_display_get_fd(ctx->display);
+  pfds[0].events = POLLIN;
+  if (ctx->options.fps) {
+    long interval = 1000000000L / ctx->options.fps;
+    struct itimerspec spec = {{interval / 1000000000L, interval % 1000000000L},
+                              {interval / 1000000000L, interval % 1000000000L}};
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    assert(timer_fd >= 0);
+    timerfd_settime(timer_fd, 0, &spec, NULL);
+    pfds[1].fd = timer_fd;
+    pfds[1].events = POLLIN;
+    num_pfds = 2;
+  }
+
+  end_time = load_now() + ctx->options.seconds;
+  for (;;) {
+    double remaining = end_time - load_now();
+    int rv;
+
+    if (remaining <= 0)
+      break;
+
+    while (wl_display_prepare_read(ctx->display) != 0)
+      wl_display_dispatch_pending(ctx->display);
+    if (wl_display_flush(ctx->display) < 0 && errno != EAGAIN) {
+      wl_display_cancel_read(ctx->display);
+      return -1;
+    }
+
+    rv = poll(pfds, num_pfds, remaining * 1000 + 1);
+    if (rv < 0 && errno != EINTR) {
+      wl_display_cancel_read(ctx->display);
+      return -1;
+    }
+    if (rv > 0 && (pfds[0].revents & POLLIN)) {
+      if (wl_display_read_events(ctx->display) < 0)
+        return -1;
+    } else {
+      wl_display_cancel_read(ctx->display);
+    }
+    if (rv > 0 && (pfds[0].revents & (POLLERR | POLLHUP)))
+      return -1;
+    if (wl_display_dispatch_pending(ctx->display) < 0)
+      return -1;
+
+    if (rv > 0 && num_pfds > 1 && (pfds[1].revents & POLLIN)) {
+      uint64_t expirations;
+
+      if (read(timer_fd, &expirations, sizeof(expirations)) ==
+          sizeof(expirations)) {
+        load_tick(ctx);
+      }
+    }
+  }
+
+  if (timer_fd >= 0)
+    close(timer_fd);
+  return 0;
+}
+
+static int load_parse_enum(const char* value,
+                           const char* const* names,
+                           size_t num_names) {
+  size_t i;
+
+  for (i = 0; i < num_names; ++i) {
+    if (strcmp(value, names[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static void load_usage(const char* name) {
+  printf(
+      "usage: %s [options]\n\n"
+      "options:\n"
+      "  -h, --help\t\t\tPrint this help\n"
+      "  --toplevels=N\t\t\tNumber of toplevels (default 1)\n"
+      "  --subsurfaces=N\t\tSubsurfaces per toplevel (default 0)\n"
+      "  --popups=N\t\t\tPopups per toplevel (default 0)\n"
+      "  --damage=PATTERN\t\tfull, scroll, scatter or cursor (default "
+      "full)\n"
+      "  --rects=N\t\t\tRects per frame for scatter (default 16)\n"
+      "  --format=FORMAT\t\targb8888, xrgb8888, rgb565 or nv12 (default\n"
+      "\t\t\t\targb8888)\n"
+      "  --pool=LAYOUT\t\t\tOne shm pool per buffer, surface or shared by\n"
+      "\t\t\t\tall (default surface)\n"
+      "  --buffers=N\t\t\tBuffers per surface, up to 4 (default 2)\n"
+      "  --fps=FPS\t\t\tFrame rate, 0 to draw on every frame callback\n"
+      "\t\t\t\t(default 0)\n"
+      "  --seconds=SECONDS\t\tDuration of the run (default 10)\n"
+      "  --size=WIDTHxHEIGHT\t\tSize of toplevels (default 512x512)\n"
+      "  --child-size=WIDTHxHEIGHT\tSize of subsurfaces and popups (default\n"
+      "\t\t\t\t128x128)\n",
+      name);
+}
+
+int main(int argc, char** argv) {
+  struct load_context ctx = {
+      .options =
+          {
+              .toplevels = 1,
+              .subsurfaces = 0,
+              .popups = 0,
+              .damage = LOAD_DAMAGE_FULL,
+              .format = &load_formats[0],
+              .pool_layout = LOAD_POOL_SURFACE,
+              .buffers = 2,
+              .fps = 0,
+              .seconds = 10,
+              .rects = 16,
+              .width = 512,
+              .height = 512,
+              .child_width = 128,
+              .child_height = 128,
+          },
+  };
+  struct load_options* options = &ctx.options;
+  struct load_surface* surface;
+  size_t shared_pool_size = 0;
+  int index = 0;
+  int i, j, rv;
+
+  for (i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value = strchr(arg, '=');
+
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      load_usage(argv[0]);
+      return EXIT_SUCCESS;
+    } else if (strstr(arg, "--toplevels") == arg && value) {
+      options->toplevels = atoi(value + 1);
+    } else if (strstr(arg, "--subsurfaces") == arg && value) {
+      options->subsurfaces = atoi(value + 1);
+    } else if (strstr(arg, "--popups") == arg && value) {
+      options->popups = atoi(value + 1);
+    } else if (strstr(arg, "--damage") == arg && value) {
+      rv = load_parse_enum(value + 1, load_damage_names,
+                           ARRAY_SIZE(load_damage_names));
+      if (rv < 0) {
+        load_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      options->damage = rv;
+    } else if (strstr(arg, "--rects") == arg && value) {
+      options->rects = atoi(value + 1);
+    } else if (strstr(arg, "--format") == arg && value) {
+      options->format = NULL;
+      for (j = 0; j < ARRAY_SIZE(load_formats); ++j) {
+        if (strcmp(value + 1, load_formats[j].name) == 0)
+          options->format = &load_formats[j];
+      }
+      if (!options->format) {
+        load_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (strstr(arg, "--pool") == arg && value) {
+      rv = load_parse_enum(value + 1, load_pool_names,
+                           ARRAY_SIZE(load_pool_names));
+      if (rv < 0) {
+        load_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      options->pool_layout = rv;
+    } else if (strstr(arg, "--buffers") == arg && value) {
+      options->buffers = atoi(value + 1);
+    } else if (strstr(arg, "--fps") == arg && value) {
+      options->fps = atoi(value + 1);
+    } else if (strstr(arg, "--seconds") == arg && value) {
+      options->seconds = atoi(value + 1);
+    } else if (strstr(arg, "--size") == arg && value) {
+      if (sscanf(value + 1, "%dx%d", &options->width, &options->height) !=
+          2) {
+        load_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (strstr(arg, "--child-size") == arg && value) {
+      if (sscanf(value + 1, "%dx%d", &options->child_width,
+                 &options->child_height) != 2) {
+        load_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else {
+      fprintf(stderr, "Option `%s' is unknown.\n", arg);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Sizes are kept even for the subsampled formats and large enough for
+  // every damage pattern.
+  if (options->toplevels < 1 || options->subsurfaces < 0 ||
+      options->popups < 0 || options->rects < 1 || options->buffers < 1 ||
+      options->buffers > LOAD_MAX_BUFFERS || options->fps < 0 ||
+      options->seconds < 1 || options->width < 2 * load_scroll_step ||
+      options->height < 2 * load_scroll_step ||
+      options->child_width < 2 * load_scroll_step ||
+      options->child_height < 2 * load_scroll_step ||
+      options->width % 2 || options->height % 2 ||
+      options->child_width % 2 || options->child_height % 2) {
+    load_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  wl_list_init(&ctx.surfaces);
+  ctx.display = wl_display_connect(NULL);
+  if (!ctx.display) {
+    fprintf(stderr, "error: failed to connect to display\n");
+    return EXIT_FAILURE;
+  }
+  wl_registry_add_listener(wl_display_get_registry(ctx.display),
+                           &load_registry_listener, &ctx);
+  wl_display_roundtrip(ctx.display);
+  if (!ctx.compositor || !ctx.shm || !ctx.xdg_shell ||
+      (options->subsurfaces && !ctx.subcompositor)) {
+    fprintf(stderr, "error: missing globals\n");
+    return EXIT_FAILURE;
+  }
+  // Formats arrive after the shm global is bound.
+  wl_display_roundtrip(ctx.display);
+  if (!ctx.format_supported) {
+    fprintf(stderr, "error: format %s is not supported\n",
+            options->format->name);
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < options->toplevels; ++i) {
+    struct load_surface* toplevel =
+        load_surface_create(&ctx, LOAD_ROLE_TOPLEVEL, NULL, index++);
+
+    for (j = 0; j < options->subsurfaces; ++j)
+      load_surface_create(&ctx, LOAD_ROLE_SUBSURFACE, toplevel, index++);
+    for (j = 0; j < options->popups; ++j)
+      load_surface_create(&ctx, LOAD_ROLE_POPUP, toplevel, index++);
+  }
+
+  if (options->pool_layout == LOAD_POOL_SHARED) {
+    wl_list_for_each(surface, &ctx.surfaces, link) {
+      shared_pool_size += load_buffer_size(surface) * options->buffers;
+    }
+    ctx.shared_pool = load_pool_create(&ctx, shared_pool_size);
+  }
+
+  // Buffers exist before roles are assigned, so the first configure event
+  // can draw right away.
+  wl_list_for_each(surface, &ctx.surfaces, link) {
+    load_surface_create_buffers(surface);
+    load_surface_create_role(surface);
+  }
+
+  if (load_run(&ctx)) {
+    fprintf(stderr, "error: lost connection to display\n");
+    return EXIT_FAILURE;
+  }
+
+  load_report(&ctx);
+  wl_display_disconnect(ctx.display);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,1092 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// A headless stand-in for the host compositor. It advertises the globals
+// sommelier binds, keeps track of surfaces and buffers without ever looking
+// at their contents, and answers frame callbacks, presentation feedback and
+// buffer releases from timers. That is enough to drive sommelier and its
+// clients on a machine without a display or GPU.
+//
+// Frame callbacks and presentation feedback fire on the next tick of a
+// virtual display running at --refresh, or right away with --refresh=0.
+// Buffers are released --release-delay milliseconds after the commit that
+// used them. Synchronized subsurfaces are treated as desynchronized.
+
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-server.h>
+
+#include "drm-server-protocol.h"
+#include "linux-dmabuf-unstable-v1-server-protocol.h"
+#include "presentation-time-server-protocol.h"
+#include "viewporter-server-protocol.h"
+#include "xdg-shell-unstable-v6-server-protocol.h"
+
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+struct stub_host {
+  struct wl_display* display;
+  int refresh;
+  int release_delay_ms;
+  int32_t width;
+  int32_t height;
+  int32_t scale;
+  struct wl_event_source* frame_timer;
+  struct wl_event_source* release_timer;
+  int frame_timer_armed;
+  // Callbacks and feedback waiting for the next frame.
+  struct wl_list frame_callbacks;
+  struct wl_list feedbacks;
+  // Buffers waiting to be released, oldest first.
+  struct wl_list busy_buffers;
+  uint64_t seq;
+  uint64_t commits;
+  uint64_t frames;
+  uint64_t releases;
+};
+
+struct stub_buffer {
+  struct stub_host* host;
+  struct wl_resource* resource;
+  struct wl_list link;
+  int busy;
+  uint64_t release_time;
+};
+
+struct stub_surface {
+  struct stub_host* host;
+  struct wl_resource* resource;
+  struct wl_resource* pending_buffer;
+  struct wl_listener pending_buffer_listener;
+  struct wl_list pending_frame_callbacks;
+  struct wl_list pending_feedbacks;
+};
+
+struct stub_xdg_surface {
+  struct stub_host* host;
+  struct wl_resource* resource;
+};
+
+struct stub_positioner {
+  int32_t width;
+  int32_t height;
+  int32_t x;
+  int32_t y;
+};
+
+static const uint32_t stub_shm_formats[] = {
+    WL_SHM_FORMAT_ARGB8888, WL_SHM_FORMAT_XRGB8888, WL_SHM_FORMAT_ABGR8888,
+    WL_SHM_FORMAT_XBGR8888, WL_SHM_FORMAT_RGB565,   WL_SHM_FORMAT_NV12,
+};
+
+static const uint32_t stub_dmabuf_formats[] = {
+    WL_DRM_FORMAT_ARGB8888, WL_DRM_FORMAT_XRGB8888, WL_DRM_FORMAT_ABGR8888,
+    WL_DRM_FORMAT_XBGR8888, WL_DRM_FORMAT_RGB565,   WL_DRM_FORMAT_NV12,
+};
+
+static uint64_t stub_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t stub_next_serial(struct stub_host* host) {
+  return wl_display_next_serial(host->display);
+}
+
+static void stub_destroy(struct wl_client* client,
+                         struct wl_resource* resource) {
+  wl_resource_destroy(resource);
+}
+
+static void stub_unlink_resource(struct wl_resource* resource) {
+  wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void stub_send_frame(struct stub_host* host) {
+  struct wl_resource* resource;
+  struct wl_resource* next;
+  uint64_t now = stub_now();
+  uint32_t refresh_ns = host->refresh ? 1000000000u / host->refresh : 0;
+
+  host->seq++;
+  wl_resource_for_each_safe(resource, next, &host->frame_callbacks) {
+    wl_callback_send_done(resource, now / 1000000);
+    wl_resource_destroy(resource);
+  }
+  wl_resource_for_each_safe(resource, next, &host->feedbacks) {
+    uint64_t sec = now / 1000000000ull;
+
+    wp_presentation_feedback_send_presented(
+        resource, sec >> 32, sec & 0xffffffff, now % 1000000000ull, refresh_ns,
+        host->seq >> 32, host->seq & 0xffffffff,
+        host->refresh ? WP_PRESENTATION_FEEDBACK_KIND_VSYNC : 0);
+    wl_resource_destroy(resource);
+  }
+  host->frames++;
+}
+
+static int stub_handle_frame_timer(void* data) {
+  struct stub_host* host = data;
+
+  host->frame_timer_armed = 0;
+  stub_send_frame(host);
+  return 0;
+}
+
+// Like a real display, the timer only runs while someone waits for a frame.
+static void stub_schedule_frame(struct stub_host* host) {
+  uint64_t period_ns;
+  uint64_t delay_ns;
+
+  if (wl_list_empty(&host->frame_callbacks) && wl_list_empty(&host->feedbacks))
+    return;
+
+  if (!host->refresh) {
+    stub_send_frame(host);
+    return;
+  }
+
+  if (host->frame_timer_armed)
+    return;
+
+  period_ns = 1000000000ull / host->refresh;
+  delay_ns = period_ns - stub_now() % period_ns;
+  wl_event_source_timer_update(host->frame_timer,
+                               MAX((delay_ns + 999999) / 1000000, 1));
+  host->frame_timer_armed = 1;
+}
+
+static void stub_release_buffer(struct stub_buffer* buffer) {
+  wl_list_remove(&buffer->link);
+  buffer->busy = 0;
+  wl_buffer_send_release(buffer->resource);
+  buffer->host->releases++;
+}
+
+static int stub_handle_release_timer(void* data) {
+  struct stub_host* host = data;
+  uint64_t now = stub_now();
+  struct stub_buffer* buffer;
+  struct stub_buffer* next;
+
+  wl_list_for_each_safe(buffer, next, &host->busy_buffers, link) {
+    if (buffer->release_time > now) {
+      wl_event_source_timer_update(
+          host->release_timer,
+          MAX((buffer->release_time - now + 999999) / 1000000, 1));
+      break;
+    }
+    stub_release_buffer(buffer);
+  }
+  return 0;
+}
+
+static void stub_buffer_committed(struct stub_buffer* buffer) {
+  struct stub_host* host = buffer->host;
+
+  if (buffer->busy)
+    wl_list_remove(&buffer->link);
+
+  if (!host->release_delay_ms) {
+    buffer->busy = 0;
+    wl_buffer_send_release(buffer->resource);
+    host->releases++;
+    return;
+  }
+
+  buffer->busy = 1;
+  buffer->release_time = stub_now() + host->release_delay_ms * 1000000ull;
+  if (wl_list_empty(&host->busy_buffers))
+    wl_event_source_timer_update(host->release_timer, host->release_delay_ms);
+  wl_list_insert(host->busy_buffers.prev, &buffer->link);
+}
+
+static const struct wl_buffer_interface stub_buffer_implementation = {
+    stub_destroy};
+
+static void stub_destroy_buffer(struct wl_resource* resource) {
+  struct stub_buffer* buffer = wl_resource_get_user_data(resource);
+
+  if (buffer->busy)
+    wl_list_remove(&buffer->link);
+  free(buffer);
+}
+
+static struct wl_resource* stub_buffer_create(struct stub_host* host,
+                                              struct wl_client* client,
+                                              uint32_t id) {
+  struct stub_buffer* buffer = malloc(sizeof(*buffer));
+
+  assert(buffer);
+  buffer->host = host;
+  buffer->busy = 0;
+  buffer->resource = wl_resource_create(client, &wl_buffer_interface, 1, id);
+  wl_resource_set_implementation(buffer->resource, &stub_buffer_implementation,
+                                 buffer, stub_destroy_buffer);
+  return buffer->resource;
+}
+
+static void stub_region_add(struct wl_client* client,
+                            struct wl_resource* resource,
+                            int32_t x,
+                            int32_t y,
+                            int32_t width,
+                            int32_t height) {}
+
+static const struct wl_region_interface stub_region_implementation = {
+    stub_destroy, stub_region_add, stub_region_add};
+
+static void stub_surface_set_pending_buffer(struct stub_surface* surface,
+                                            struct wl_resource* buffer) {
+  if (surface->pending_buffer)
+    wl_list_remove(&surface->pending_buffer_listener.link);
+  surface->pending_buffer = buffer;
+  if (buffer) {
+    wl_resource_add_destroy_listener(buffer,
+                                     &surface->pending_buffer_listener);
+  }
+}
+
+static void stub_surface_pending_buffer_destroyed(struct wl_listener* listener,
+                                                  void* data) {
+  struct stub_surface* surface =
+      wl_container_of(listener, surface, pending_buffer_listener);
+
+  wl_list_remove(&surface->pending_buffer_listener.link);
+  surface->pending_buffer = NULL;
+}
+
+static void stub_surface_attach(struct wl_client* client,
+                                struct wl_resource* resource,
+                                struct wl_resource* buffer,
+                                int32_t x,
+                                int32_t y) {
+  stub_surface_set_pending_buffer(wl_resource_get_user_data(resource), buffer);
+}
+
+static void stub_surface_damage(struct wl_client* client,
+                                struct wl_resource* resource,
+                                int32_t x,
+                                int32_t y,
+                                int32_t width,
+                                int32_t height) {}
+
+static void stub_surface_frame(struct wl_client* client,
+                               struct wl_resource* resource,
+                               uint32_t callback) {
+  struct stub_surface* surface = wl_resource_get_user_data(resource);
+  struct wl_resource* callback_resource =
+      wl_resource_create(client, &wl_callback_interface, 1, callback);
+
+  wl_resource_set_implementation(callback_resource, NULL, NULL,
+                                 stub_unlink_resource);
+  wl_list_insert(surface->pending_frame_callbacks.prev,
+                 wl_resource_get_link(callback_resource));
+}
+
+static void stub_surface_set_region(struct wl_client* client,
+                                    struct wl_resource* resource,
+                                    struct wl_resource* region) {}
+
+static void stub_surface_commit(struct wl_client* client,
+                                struct wl_resource* resource) {
+  struct stub_surface* surface = wl_resource_get_user_data(resource);
+  struct stub_host* host = surface->host;
+
+  if (surface->pending_buffer) {
+    stub_buffer_committed(wl_resource_get_user_data(surface->pending_buffer));
+    stub_surface_set_pending_buffer(surface, NULL);
+  }
+
+  wl_list_insert_list(host->frame_callbacks.prev,
+                      &surface->pending_frame_callbacks);
+  wl_list_init(&surface->pending_frame_callbacks);
+  wl_list_insert_list(host->feedbacks.prev, &surface->pending_feedbacks);
+  wl_list_init(&surface->pending_feedbacks);
+
+  host->commits++;
+  stub_schedule_frame(host);
+}
+
+static void stub_surface_set_int(struct wl_client* client,
+                                 struct wl_resource* resource,
+                                 int32_t value) {}
+
+static const struct wl_surface_interface stub_surface_implementation = {
+    stub_destroy,         stub_surface_attach,     stub_surface_damage,
+    stub_surface_frame,   stub_surface_set_region, stub_surface_set_region,
+    stub_surface_commit,  stub_surface_set_int,    stub_surface_set_int,
+    stub_surface_damage};
+
+static void stub_destroy_surface(struct wl_resource* resource) {
+  struct stub_surface* surface = wl_resource_get_user_data(resource);
+  struct wl_resource* child;
+  struct wl_resource* next;
+
+  stub_surface_set_pending_buffer(surface, NULL);
+  wl_resource_for_each_safe(child, next, &surface->pending_frame_callbacks) {
+    wl_resource_destroy(child);
+  }
+  wl_resource_for_each_safe(child, next, &surface->pending_feedbacks) {
+    wp_presentation_feedback_send_discarded(child);
+    wl_resource_destroy(child);
+  }
+  free(surface);
+}
+
+static void stub_compositor_create_surface(struct wl_client* client,
+                                           struct wl_resource* resource,
+                                           uint32_t id) {
+  struct stub_surface* surface = malloc(sizeof(*surface));
+
+  assert(surface);
+  surface->host = wl_resource_get_user_data(resource);
+  surface->pending_buffer = NULL;
+  surface->pending_buffer_listener.notify =
+      stub_surface_pending_buffer_destroyed;
+  wl_list_init(&surface->pending_frame_callbacks);
+  wl_list_init(&surface->pending_feedbacks);
+  surface->resource = wl_resource_create(
+      client, &wl_surface_interface, wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(surface->resource,
+                                 &stub_surface_implementation, surface,
+                                 stub_destroy_surface);
+}
+
+static void stub_compositor_create_region(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          uint32_t id) {
+  struct wl_resource* region =
+      wl_resource_create(client, &wl_region_interface, 1, id);
+
+  wl_resource_set_implementation(region, &stub_region_implementation, NULL,
+                                 NULL);
+}
+
+static const struct wl_compositor_interface stub_compositor_implementation = {
+    stub_compositor_create_surface, stub_compositor_create_region};
+
+static void stub_bind_compositor(struct wl_client* client,
+                                 void* data,
+                                 uint32_t version,
+                                 uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_compositor_interface, version, id);
+
+  wl_resource_set_implementation(resource, &stub_compositor_implementation,
+                                 data, NULL);
+}
+
+static void stub_subsurface_set_position(struct wl_client* client,
+                                         struct wl_resource* resource,
+                                         int32_t x,
+                                         int32_t y) {}
+
+static void stub_subsurface_place(struct wl_client* client,
+                                  struct wl_resource* resource,
+                                  struct wl_resource* sibling) {}
+
+static void stub_subsurface_set_mode(struct wl_client* client,
+                                     struct wl_resource* resource) {}
+
+static const struct wl_subsurface_interface stub_subsurface_implementation = {
+    stub_destroy,
+    stub_subsurface_set_position,
+    stub_subsurface_place,
+    stub_subsurface_place,
+    stub_subsurface_set_mode,
+    stub_subsurface_set_mode};
+
+static void stub_subcompositor_get_subsurface(struct wl_client* client,
+                                              struct wl_resource* resource,
+                                              uint32_t id,
+                                              struct wl_resource* surface,
+                                              struct wl_resource* parent) {
+  struct wl_resource* subsurface =
+      wl_resource_create(client, &wl_subsurface_interface, 1, id);
+
+  wl_resource_set_implementation(subsurface, &stub_subsurface_implementation,
+                                 NULL, NULL);
+}
+
+static const struct wl_subcompositor_interface
+    stub_subcompositor_implementation = {stub_destroy,
+                                         stub_subcompositor_get_subsurface};
+
+static void stub_bind_subcompositor(struct wl_client* client,
+                                    void* data,
+                                    uint32_t version,
+                                    uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_subcompositor_interface, version, id);
+
+  wl_resource_set_implementation(resource, &stub_subcompositor_implementation,
+                                 data, NULL);
+}
+
+static void stub_shm_pool_create_buffer(struct wl_client* client,
+                                        struct wl_resource* resource,
+                                        uint32_t id,
+                                        int32_t offset,
+                                        int32_t width,
+                                        int32_t height,
+                                        int32_t stride,
+                                        uint32_t format) {
+  stub_buffer_create(wl_resource_get_user_data(resource), client, id);
+}
+
+static void stub_shm_pool_resize(struct wl_client* client,
+                                 struct wl_resource* resource,
+                                 int32_t size) {}
+
+static const struct wl_shm_pool_interface stub_shm_pool_implementation = {
+    stub_shm_pool_create_buffer, stub_destroy, stub_shm_pool_resize};
+
+// Contents are never looked at, so the pool doesn't even need a mapping.
+static void stub_shm_create_pool(struct wl_client* client,
+                                 struct wl_resource* resource,
+                                 uint32_t id,
+                                 int32_t fd,
+                                 int32_t size) {
+  struct wl_resource* pool =
+      wl_resource_create(client, &wl_shm_pool_interface, 1, id);
+
+  close(fd);
+  wl_resource_set_implementation(pool, &stub_shm_pool_implementation,
+                                 wl_resource_get_user_data(resource), NULL);
+}
+
+static const struct wl_shm_interface stub_shm_implementation = {
+    stub_shm_create_pool};
+
+static void stub_bind_shm(struct wl_client* client,
+                          void* data,
+                          uint32_t version,
+                          uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_shm_interface, 1, id);
+  size_t i;
+
+  wl_resource_set_implementation(resource, &stub_shm_implementation, data,
+                                 NULL);
+  for (i = 0; i < ARRAY_SIZE(stub_shm_formats); ++i)
+    wl_shm_send_format(resource, stub_shm_formats[i]);
+}
+
+static void stub_buffer_params_add(struct wl_client* client,
+                                   struct wl_resource* resource,
+                                   int32_t fd,
+                                   uint32_t plane_idx,
+                                   uint32_t offset,
+                                   uint32_t stride,
+                                   uint32_t modifier_hi,
+                                   uint32_t modifier_lo) {
+  close(fd);
+}
+
+static void stub_buffer_params_create(struct wl_client* client,
+                                      struct wl_resource* resource,
+                                      int32_t width,
+                                      int32_t height,
+                                      uint32_t format,
+                                      uint32_t flags) {
+  struct wl_resource* buffer =
+      stub_buffer_create(wl_resource_get_user_data(resource), client, 0);
+
+  zwp_linux_buffer_params_v1_send_created(resource, buffer);
+}
+
+static void stub_buffer_params_create_immed(struct wl_client* client,
+                                            struct wl_resource* resource,
+                                            uint32_t buffer_id,
+                                            int32_t width,
+                                            int32_t height,
+                                            uint32_t format,
+                                            uint32_t flags) {
+  stub_buffer_create(wl_resource_get_user_data(resource), client, buffer_id);
+}
+
+static const struct zwp_linux_buffer_params_v1_interface
+    stub_buffer_params_implementation = {
+        stub_destroy, stub_buffer_params_add, stub_buffer_params_create,
+        stub_buffer_params_create_immed};
+
+static void stub_linux_dmabuf_create_params(struct wl_client* client,
+                                            struct wl_resource* resource,
+                                            uint32_t id) {
+  struct wl_resource* params = wl_resource_create(
+      client, &zwp_linux_buffer_params_v1_interface,
+      wl_resource_get_version(resource), id);
+
+  wl_resource_set_implementation(params, &stub_buffer_params_implementation,
+                                 wl_resource_get_user_data(resource), NULL);
+}
+
+static const struct zwp_linux_dmabuf_v1_interface
+    stub_linux_dmabuf_implementation = {stub_destroy,
+                                        stub_linux_dmabuf_create_params};
+
+static void stub_bind_linux_dmabuf(struct wl_client* client,
+                                   void* data,
+                                   uint32_t version,
+                                   uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &zwp_linux_dmabuf_v1_interface, version, id);
+  size_t i;
+
+  wl_resource_set_implementation(resource, &stub_linux_dmabuf_implementation,
+                                 data, NULL);
+  for (i = 0; i < ARRAY_SIZE(stub_dmabuf_formats); ++i)
+    zwp_linux_dmabuf_v1_send_format(resource, stub_dmabuf_formats[i]);
+}
+
+static void stub_viewport_set_source(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     wl_fixed_t x,
+                                     wl_fixed_t y,
+                                     wl_fixed_t width,
+                                     wl_fixed_t height) {}
+
+static void stub_viewport_set_destination(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          int32_t width,
+                                          int32_t height) {}
+
+static const struct wp_viewport_interface stub_viewport_implementation = {
+    stub_destroy, stub_viewport_set_source, stub_viewport_set_destination};
+
+static void stub_viewporter_get_viewport(struct wl_client* client,
+                                         struct wl_resource* resource,
+                                         uint32_t id,
+                                         struct wl_resource* surface) {
+  struct wl_resource* viewport =
+      wl_resource_create(client, &wp_viewport_interface, 1, id);
+
+  wl_resource_set_implementation(viewport, &stub_viewport_implementation,
+                                 NULL, NULL);
+}
+
+static const struct wp_viewporter_interface stub_viewporter_implementation = {
+    stub_destroy, stub_viewporter_get_viewport};
+
+static void stub_bind_viewporter(struct wl_client* client,
+                                 void* data,
+                                 uint32_t version,
+                                 uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wp_viewporter_interface, 1, id);
+
+  wl_resource_set_implementation(resource, &stub_viewporter_implementation,
+                                 data, NULL);
+}
+
+static void stub_presentation_feedback(struct wl_client* client,
+                                       struct wl_resource* resource,
+                                       struct wl_resource* surface_resource,
+                                       uint32_t id) {
+  struct stub_surface* surface = wl_resource_get_user_data(surface_resource);
+  struct wl_resource* feedback =
+      wl_resource_create(client, &wp_presentation_feedback_interface, 1, id);
+
+  wl_resource_set_implementation(feedback, NULL, NULL, stub_unlink_resource);
+  wl_list_insert(surface->pending_feedbacks.prev,
+                 wl_resource_get_link(feedback));
+}
+
+static const struct wp_presentation_interface
+    stub_presentation_implementation = {stub_destroy,
+                                        stub_presentation_feedback};
+
+static void stub_bind_presentation(struct wl_client* client,
+                                   void* data,
+                                   uint32_t version,
+                                   uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wp_presentation_interface, 1, id);
+
+  wl_resource_set_implementation(resource, &stub_presentation_implementation,
+                                 data, NULL);
+  wp_presentation_send_clock_id(resource, CLOCK_MONOTONIC);
+}
+
+static void stub_positioner_set_size(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     int32_t width,
+                                     int32_t height) {
+  struct stub_positioner* positioner = wl_resource_get_user_data(resource);
+
+  positioner->width = width;
+  positioner->height = height;
+}
+
+static void stub_positioner_set_anchor_rect(struct wl_client* client,
+                                            struct wl_resource* resource,
+                                            int32_t x,
+                                            int32_t y,
+                                            int32_t width,
+                                            int32_t height) {
+  struct stub_positioner* positioner = wl_resource_get_user_data(resource);
+
+  positioner->x = x;
+  positioner->y = y;
+}
+
+static void stub_positioner_set_uint(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     uint32_t value) {}
+
+static void stub_positioner_set_offset(struct wl_client* client,
+                                       struct wl_resource* resource,
+                                       int32_t x,
+                                       int32_t y) {}
+
+static const struct zxdg_positioner_v6_interface
+    stub_positioner_implementation = {
+        stub_destroy,
+        stub_positioner_set_size,
+        stub_positioner_set_anchor_rect,
+        stub_positioner_set_uint,
+        stub_positioner_set_uint,
+        stub_positioner_set_uint,
+        stub_positioner_set_offset};
+
+static void stub_destroy_positioner(struct wl_resource* resource) {
+  free(wl_resource_get_user_data(resource));
+}
+
+static void stub_toplevel_configure(struct wl_resource* resource,
+                                    int32_t width,
+                                    int32_t height,
+                                    uint32_t state) {
+  struct stub_xdg_surface* xdg_surface = wl_resource_get_user_data(resource);
+  struct wl_array states;
+  uint32_t* p;
+
+  wl_array_init(&states);
+  if (state) {
+    p = wl_array_add(&states, sizeof(*p));
+    assert(p);
+    *p = state;
+  }
+  zxdg_toplevel_v6_send_configure(resource, width, height, &states);
+  wl_array_release(&states);
+  zxdg_surface_v6_send_configure(xdg_surface->resource,
+                                 stub_next_serial(xdg_surface->host));
+}
+
+static void stub_toplevel_set_parent(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     struct wl_resource* parent) {}
+
+static void stub_toplevel_set_string(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     const char* value) {}
+
+static void stub_toplevel_show_window_menu(struct wl_client* client,
+                                           struct wl_resource* resource,
+                                           struct wl_resource* seat,
+                                           uint32_t serial,
+                                           int32_t x,
+                                           int32_t y) {}
+
+static void stub_toplevel_move(struct wl_client* client,
+                               struct wl_resource* resource,
+                               struct wl_resource* seat,
+                               uint32_t serial) {}
+
+static void stub_toplevel_resize(struct wl_client* client,
+                                 struct wl_resource* resource,
+                                 struct wl_resource* seat,
+                                 uint32_t serial,
+                                 uint32_t edges) {}
+
+static void stub_toplevel_set_size(struct wl_client* client,
+                                   struct wl_resource* resource,
+                                   int32_t width,
+                                   int32_t height) {}
+
+static void stub_toplevel_set_maximized(struct wl_client* client,
+                                        struct wl_resource* resource) {
+  struct stub_xdg_surface* xdg_surface = wl_resource_get_user_data(resource);
+
+  stub_toplevel_configure(resource, xdg_surface->host->width,
+                          xdg_surface->host->height,
+                          ZXDG_TOPLEVEL_V6_STATE_MAXIMIZED);
+}
+
+static void stub_toplevel_unset_state(struct wl_client* client,
+                                      struct wl_resource* resource) {
+  stub_toplevel_configure(resource, 0, 0, 0);
+}
+
+static void stub_toplevel_set_fullscreen(struct wl_client* client,
+                                         struct wl_resource* resource,
+                                         struct wl_resource* output) {
+  struct stub_xdg_surface* xdg_surface = wl_resource_get_user_data(resource);
+
+  stub_toplevel_configure(resource, xdg_surface->host->width,
+                          xdg_surface->host->height,
+                          ZXDG_TOPLEVEL_V6_STATE_FULLSCREEN);
+}
+
+static void stub_toplevel_set_minimized(struct wl_client* client,
+                                        struct wl_resource* resource) {}
+
+static const struct zxdg_toplevel_v6_interface stub_toplevel_implementation = {
+    stub_destroy,
+    stub_toplevel_set_parent,
+    stub_toplevel_set_string,
+    stub_toplevel_set_string,
+    stub_toplevel_show_window_menu,
+    stub_toplevel_move,
+    stub_toplevel_resize,
+    stub_toplevel_set_size,
+    stub_toplevel_set_size,
+    stub_toplevel_set_maximized,
+    stub_toplevel_unset_state,
+    stub_toplevel_set_fullscreen,
+    stub_toplevel_unset_state,
+    stub_toplevel_set_minimized};
+
+static void stub_popup_grab(struct wl_client* client,
+                            struct wl_resource* resource,
+                            struct wl_resource* seat,
+                            uint32_t serial) {}
+
+static const struct zxdg_popup_v6_interface stub_popup_implementation = {
+    stub_destroy, stub_popup_grab};
+
+static void stub_xdg_surface_get_toplevel(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          uint32_t id) {
+  struct wl_resource* toplevel =
+      wl_resource_create(client, &zxdg_toplevel_v6_interface, 1, id);
+
+  wl_resource_set_implementation(toplevel, &stub_toplevel_implementation,
+                                 wl_resource_get_user_data(resource), NULL);
+  stub_toplevel_configure(toplevel, 0, 0, ZXDG_TOPLEVEL_V6_STATE_ACTIVATED);
+}
+
+static void stub_xdg_surface_get_popup(
+    struct wl_client* client,
+    struct wl_resource* resource,
+    uint32_t id,
+    struct wl_resource* parent,
+    struct wl_resource* positioner_resource) {
+  struct stub_xdg_surface* xdg_surface = wl_resource_get_user_data(resource);
+  struct stub_positioner* positioner =
+      wl_resource_get_user_data(positioner_resource);
+  struct wl_resource* popup =
+      wl_resource_create(client, &zxdg_popup_v6_interface, 1, id);
+
+  wl_resource_set_implementation(popup, &stub_popup_implementation, NULL,
+                                 NULL);
+  zxdg_popup_v6_send_configure(popup, positioner->x, positioner->y,
+                               positioner->width, positioner->height);
+  zxdg_surface_v6_send_configure(xdg_surface->resource,
+                                 stub_next_serial(xdg_surface->host));
+}
+
+static void stub_xdg_surface_set_window_geometry(struct wl_client* client,
+                                                 struct wl_resource* resource,
+                                                 int32_t x,
+                                                 int32_t y,
+                                                 int32_t width,
+                                                 int32_t height) {}
+
+static void stub_xdg_surface_ack_configure(struct wl_client* client,
+                                           struct wl_resource* resource,
+                                           uint32_t serial) {}
+
+static const struct zxdg_surface_v6_interface stub_xdg_surface_implementation =
+    {stub_destroy, stub_xdg_surface_get_toplevel, stub_xdg_surface_get_popup,
+     stub_xdg_surface_set_window_geometry, stub_xdg_surface_ack_configure};
+
+static void stub_destroy_xdg_surface(struct wl_resource* resource) {
+  free(wl_resource_get_user_data(resource));
+}
+
+static void stub_xdg_shell_create_positioner(struct wl_client* client,
+                                             struct wl_resource* resource,
+                                             uint32_t id) {
+  struct stub_positioner* positioner = calloc(1, sizeof(*positioner));
+  struct wl_resource* positioner_resource;
+
+  assert(positioner);
+  positioner_resource =
+      wl_resource_create(client, &zxdg_positioner_v6_interface, 1, id);
+  wl_resource_set_implementation(positioner_resource,
+                                 &stub_positioner_implementation, positioner,
+                                 stub_destroy_positioner);
+}
+
+static void stub_xdg_shell_get_xdg_surface(struct wl_client* client,
+                                           struct wl_resource* resource,
+                                           uint32_t id,
+                                           struct wl_resource* surface) {
+  struct stub_xdg_surface* xdg_surface = malloc(sizeof(*xdg_surface));
+
+  assert(xdg_surface);
+  xdg_surface->host = wl_resource_get_user_data(resource);
+  xdg_surface->resource =
+      wl_resource_create(client, &zxdg_surface_v6_interface, 1, id);
+  wl_resource_set_implementation(xdg_surface->resource,
+                                 &stub_xdg_surface_implementation, xdg_surface,
+                                 stub_destroy_xdg_surface);
+}
+
+static void stub_xdg_shell_pong(struct wl_client* client,
+                                struct wl_resource* resource,
+                                uint32_t serial) {}
+
+static const struct zxdg_shell_v6_interface stub_xdg_shell_implementation = {
+    stub_destroy, stub_xdg_shell_create_positioner,
+    stub_xdg_shell_get_xdg_surface, stub_xdg_shell_pong};
+
+static void stub_bind_xdg_shell(struct wl_client* client,
+                                void* data,
+                                uint32_t version,
+                                uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &zxdg_shell_v6_interface, 1, id);
+
+  wl_resource_set_implementation(resource, &stub_xdg_shell_implementation,
+                                 data, NULL);
+}
+
+static void stub_pointer_set_cursor(struct wl_client* client,
+                                    struct wl_resource* resource,
+                                    uint32_t serial,
+                                    struct wl_resource* surface,
+                                    int32_t hotspot_x,
+                                    int32_t hotspot_y) {}
+
+static const struct wl_pointer_interface stub_pointer_implementation = {
+    stub_pointer_set_cursor, stub_destroy};
+
+static const struct wl_keyboard_interface stub_keyboard_implementation = {
+    stub_destroy};
+
+static void stub_seat_get_pointer(struct wl_client* client,
+                                  struct wl_resource* resource,
+                                  uint32_t id) {
+  struct wl_resource* pointer = wl_resource_create(
+      client, &wl_pointer_interface, wl_resource_get_version(resource), id);
+
+  wl_resource_set_implementation(pointer, &stub_pointer_implementation, NULL,
+                                 NULL);
+}
+
+// There is no input, so there is no need for a keymap either.
+static void stub_seat_get_keyboard(struct wl_client* client,
+                                   struct wl_resource* resource,
+                                   uint32_t id) {
+  struct wl_resource* keyboard = wl_resource_create(
+      client, &wl_keyboard_interface, wl_resource_get_version(resource), id);
+  int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  wl_resource_set_implementation(keyboard, &stub_keyboard_implementation,
+                                 NULL, NULL);
+  if (fd >= 0) {
+    wl_keyboard_send_keymap(keyboard, WL_KEYBOARD_KEYMAP_FORMAT_NO_KEYMAP, fd,
+                            0);
+    close(fd);
+  }
+}
+
+static void stub_seat_get_touch(struct wl_client* client,
+                                struct wl_resource* resource,
+                                uint32_t id) {
+  wl_resource_post_error(resource, WL_SEAT_ERROR_MISSING_CAPABILITY,
+                         "no touch");
+}
+
+static const struct wl_seat_interface stub_seat_implementation = {
+    stub_seat_get_pointer, stub_seat_get_keyboard, stub_seat_get_touch,
+    stub_destroy};
+
+static void stub_bind_seat(struct wl_client* client,
+                           void* data,
+                           uint32_t version,
+                           uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_seat_interface, version, id);
+
+  wl_resource_set_implementation(resource, &stub_seat_implementation, data,
+                                 NULL);
+  wl_seat_send_capabilities(
+      resource, WL_SEAT_CAPABILITY_POINTER | WL_SEAT_CAPABILITY_KEYBOARD);
+  if (version >= WL_SEAT_NAME_SINCE_VERSION)
+    wl_seat_send_name(resource, "seat0");
+}
+
+static const struct wl_output_interface stub_output_implementation = {
+    stub_destroy};
+
+static void stub_bind_output(struct wl_client* client,
+                             void* data,
+                             uint32_t version,
+                             uint32_t id) {
+  struct stub_host* host = data;
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_output_interface, version, id);
+
+  wl_resource_set_implementation(resource, &stub_output_implementation, data,
+                                 NULL);
+  // Physical size for 96 DPI.
+  wl_output_send_geometry(resource, 0, 0, host->width * 254 / 960,
+                          host->height * 254 / 960,
+                          WL_OUTPUT_SUBPIXEL_UNKNOWN, "stub", "headless",
+                          WL_OUTPUT_TRANSFORM_NORMAL);
+  wl_output_send_mode(resource,
+                      WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+                      host->width * host->scale, host->height * host->scale,
+                      (host->refresh ? host->refresh : 60) * 1000);
+  if (version >= WL_OUTPUT_SCALE_SINCE_VERSION)
+    wl_output_send_scale(resource, host->scale);
+  if (version >= WL_OUTPUT_DONE_SINCE_VERSION)
+    wl_output_send_done(resource);
+}
+
+static int stub_handle_signal(int signal_number, void* data) {
+  struct stub_host* host = data;
+
+  wl_display_terminate(host->display);
+  return 1;
+}
+
+static void stub_usage(const char* name) {
+  printf(
+      "usage: %s [options]\n\n"
+      "options:\n"
+      "  -h, --help\t\t\tPrint this help\n"
+      "  --socket=SOCKET\t\tName of socket to listen on (default automatic)\n"
+      "  --refresh=HZ\t\t\tFrame callback rate, 0 for immediate (default 60)\n"
+      "  --release-delay=MS\t\tTime until buffers are released (default 0)\n"
+      "  --size=WIDTHxHEIGHT\t\tLogical size of the output (default "
+      "1920x1080)\n"
+      "  --scale=SCALE\t\t\tScale of the output (default 1)\n",
+      name);
+}
+
+int main(int argc, char** argv) {
+  struct stub_host host = {
+      .display = NULL,
+      .refresh = 60,
+      .release_delay_ms = 0,
+      .width = 1920,
+      .height = 1080,
+      .scale = 1,
+      .frame_timer_armed = 0,
+      .seq = 0,
+      .commits = 0,
+      .frames = 0,
+      .releases = 0,
+  };
+  const char* socket_name = NULL;
+  struct wl_event_loop* event_loop;
+  struct wl_event_source* signals[2];
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value = strchr(arg, '=');
+
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      stub_usage(argv[0]);
+      return EXIT_SUCCESS;
+    } else if (strstr(arg, "--socket") == arg && value) {
+      socket_name = value + 1;
+    } else if (strstr(arg, "--refresh") == arg && value) {
+      host.refresh = MAX(atoi(value + 1), 0);
+    } else if (strstr(arg, "--release-delay") == arg && value) {
+      host.release_delay_ms = MAX(atoi(value + 1), 0);
+    } else if (strstr(arg, "--size") == arg && value) {
+      if (sscanf(value + 1, "%dx%d", &host.width, &host.height) != 2 ||
+          host.width <= 0 || host.height <= 0) {
+        stub_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (strstr(arg, "--scale") == arg && value) {
+      host.scale = MAX(atoi(value + 1), 1);
+    } else {
+      fprintf(stderr, "Option `%s' is unknown.\n", arg);
+      return EXIT_FAILURE;
+    }
+  }
+
+  host.display = wl_display_create();
+  assert(host.display);
+  event_loop = wl_display_get_event_loop(host.display);
+  wl_list_init(&host.frame_callbacks);
+  wl_list_init(&host.feedbacks);
+  wl_list_init(&host.busy_buffers);
+  host.frame_timer =
+      wl_event_loop_add_timer(event_loop, stub_handle_frame_timer, &host);
+  host.release_timer =
+      wl_event_loop_add_timer(event_loop, stub_handle_release_timer, &host);
+  signals[0] = wl_event_loop_add_signal(event_loop, SIGINT, stub_handle_signal,
+                                        &host);
+  signals[1] = wl_event_loop_add_signal(event_loop, SIGTERM,
+                                        stub_handle_signal, &host);
+
+  if (socket_name) {
+    if (wl_display_add_socket(host.display, socket_name)) {
+      fprintf(stderr, "error: failed to add socket %s: %m\n", socket_name);
+      return EXIT_FAILURE;
+    }
+  } else {
+    socket_name = wl_display_add_socket_auto(host.display);
+    if (!socket_name) {
+      fprintf(stderr, "error: failed to add socket: %m\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  wl_global_create(host.display, &wl_compositor_interface, 4, &host,
+                   stub_bind_compositor);
+  wl_global_create(host.display, &wl_subcompositor_interface, 1, &host,
+                   stub_bind_subcompositor);
+  wl_global_create(host.display, &wl_shm_interface, 1, &host, stub_bind_shm);
+  wl_global_create(host.display, &zwp_linux_dmabuf_v1_interface, 2, &host,
+                   stub_bind_linux_dmabuf);
+  wl_global_create(host.display, &wp_viewporter_interface, 1, &host,
+                   stub_bind_viewporter);
+  wl_global_create(host.display, &wp_presentation_interface, 1, &host,
+                   stub_bind_presentation);
+  wl_global_create(host.display, &zxdg_shell_v6_interface, 1, &host,
+                   stub_bind_xdg_shell);
+  wl_global_create(host.display, &wl_seat_interface, 5, &host, stub_bind_seat);
+  wl_global_create(host.display, &wl_output_interface, 3, &host,
+                   stub_bind_output);
+
+  printf("%s\n", socket_name);
+  fflush(stdout);
+
+  wl_display_run(host.display);
+
+  fprintf(stderr,
+          "stub host: %llu commits, %llu frames, %llu buffers released\n",
+          (unsigned long long)host.commits, (unsigned long long)host.frames,
+          (unsigned long long)host.releases);
+
+  for (i = 0; i < ARRAY_SIZE(signals); ++i)
+    wl_event_source_remove(signals[i]);
+  wl_display_destroy_clients(host.display);
+  wl_event_source_remove(host.frame_timer);
+  wl_event_source_remove(host.release_timer);
+  wl_display_destroy(host.display);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,519 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Stresses the window management of an X11 sommelier the way IDEs with
+// hundreds of windows and popups do. It keeps creating, mapping,
+// reconfiguring, retitling and destroying windows as fast as it can, or at
+// --rate operations per second. Some of the windows are transient for
+// another one, some are override-redirect. Run it as the program of an X11
+// sommelier, against the stub host if there is no real one:
+//
+//   sommelier -X --display=stub-host --stats-socket=/tmp/stats --
+//       x11_wm_stress --stats-socket=/tmp/stats
+//
+// What the client sees is reported at the end: the time from mapping a
+// window until it is reported mapped, which is when sommelier has handled
+// the map request for managed windows, and the time from a configure request
+// to the configure notify that answers it. With --stats-socket, the
+// histograms sommelier keeps of the time from a map request to the first
+// frame of a window, and of the time from applying a host configure to
+// acking it, are reported as well.
+
+#include <assert.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <xcb/xcb.h>
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+enum stress_kind {
+  STRESS_KIND_NORMAL,
+  STRESS_KIND_TRANSIENT,
+  STRESS_KIND_OVERRIDE_REDIRECT
+};
+
+enum stress_op {
+  STRESS_OP_MAP,
+  STRESS_OP_CONFIGURE,
+  STRESS_OP_RETITLE,
+  STRESS_OP_DESTROY,
+  STRESS_NUM_OPS
+};
+
+static const char* const stress_op_names[] = {"map", "configure", "retitle",
+                                              "destroy"};
+
+struct stress_window {
+  xcb_window_t id;
+  enum stress_kind kind;
+  int mapped;
+  // Times of the map and configure requests not answered yet, 0 if none.
+  double map_time;
+  double configure_time;
+  uint32_t title;
+};
+
+struct stress_samples {
+  double* values;
+  size_t count;
+  size_t size;
+};
+
+struct stress_context {
+  xcb_connection_t* connection;
+  xcb_screen_t* screen;
+  struct stress_window* windows;
+  int num_windows;
+  int max_windows;
+  int transient_percent;
+  int override_redirect_percent;
+  int32_t width;
+  int32_t height;
+  unsigned seed;
+  uint64_t ops[STRESS_NUM_OPS];
+  // Map to map notify and configure to configure notify, in milliseconds.
+  struct stress_samples map_latencies;
+  struct stress_samples configure_latencies;
+};
+
+static double stress_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stress_add_sample(struct stress_samples* samples, double value) {
+  if (samples->count == samples->size) {
+    samples->size = samples->size ? samples->size * 2 : 1024;
+    samples->values =
+        realloc(samples->values, samples->size * sizeof(*samples->values));
+    assert(samples->values);
+  }
+  samples->values[samples->count++] = value;
+}
+
+static int stress_compare(const void* a, const void* b) {
+  double value_a = *(const double*)a;
+  double value_b = *(const double*)b;
+
+  return value_a < value_b ? -1 : value_a > value_b;
+}
+
+static void stress_print_samples(const char* name,
+                                 struct stress_samples* samples) {
+  size_t count = samples->count;
+  double* values = samples->values;
+
+  if (!count) {
+    printf("%-28s %8s\n", name, "-");
+    return;
+  }
+
+  qsort(values, count, sizeof(*values), stress_compare);
+  printf("%-28s %8zu %9.2f %9.2f %9.2f %9.2f\n", name, count,
+         values[count * 50 / 100], values[count * 90 / 100],
+         values[count * 99 / 100], values[count - 1]);
+}
+
+static struct stress_window* stress_lookup_window(struct stress_context* ctx,
+                                                  xcb_window_t id) {
+  int i;
+
+  for (i = 0; i < ctx->num_windows; ++i) {
+    if (ctx->windows[i].id == id)
+      return &ctx->windows[i];
+  }
+  return NULL;
+}
+
+static void stress_set_title(struct stress_context* ctx,
+                             struct stress_window* window) {
+  char title[64];
+
+  snprintf(title, sizeof(title), "x11_wm_stress %x/%u", window->id,
+           window->title++);
+  xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE, window->id,
+                      XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8, strlen(title),
+                      title);
+}
+
+static void stress_create_window(struct stress_context* ctx) {
+  static const char wm_class[] = "x11_wm_stress\0X11WmStress";
+  struct stress_window* window = &ctx->windows[ctx->num_windows];
+  struct stress_window* parent = NULL;
+  int r = rand_r(&ctx->seed) % 100;
+  uint32_t values[3];
+  int i;
+
+  window->kind = STRESS_KIND_NORMAL;
+  if (r < ctx->override_redirect_percent) {
+    window->kind = STRESS_KIND_OVERRIDE_REDIRECT;
+  } else if (r < ctx->override_redirect_percent + ctx->transient_percent) {
+    // Transients need a mapped normal window to belong to.
+    for (i = 0; i < ctx->num_windows; ++i) {
+      if (ctx->windows[i].kind == STRESS_KIND_NORMAL &&
+          ctx->windows[i].mapped) {
+        parent = &ctx->windows[i];
+        window->kind = STRESS_KIND_TRANSIENT;
+        break;
+      }
+    }
+  }
+
+  window->id = xcb_generate_id(ctx->connection);
+  window->mapped = 0;
+  window->configure_time = 0;
+  window->title = 0;
+  values[0] = ctx->screen->white_pixel;
+  values[1] = window->kind == STRESS_KIND_OVERRIDE_REDIRECT;
+  values[2] = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+  xcb_create_window(
+      ctx->connection, XCB_COPY_FROM_PARENT, window->id, ctx->screen->root,
+      rand_r(&ctx->seed) % 256, rand_r(&ctx->seed) % 256,
+      window->kind == STRESS_KIND_NORMAL ? ctx->width : ctx->width / 2,
+      window->kind == STRESS_KIND_NORMAL ? ctx->height : ctx->height / 2, 0,
+      XCB_WINDOW_CLASS_INPUT_OUTPUT, ctx->screen->root_visual,
+      XCB_CW_BACK_PIXEL | XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK,
+      values);
+  xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE, window->id,
+                      XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 8, sizeof(wm_class),
+                      wm_class);
+  if (parent) {
+    xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE, window->id,
+                        XCB_ATOM_WM_TRANSIENT_FOR, XCB_ATOM_WINDOW, 32, 1,
+                        &parent->id);
+  }
+  stress_set_title(ctx, window);
+
+  window->map_time = stress_now();
+  xcb_map_window(ctx->connection, window->id);
+  ctx->num_windows++;
+}
+
+static void stress_destroy_window(struct stress_context* ctx,
+                                  struct stress_window* window) {
+  xcb_destroy_window(ctx->connection, window->id);
+  *window = ctx->windows[--ctx->num_windows];
+}
+
+static void stress_configure_window(struct stress_context* ctx,
+                                    struct stress_window* window) {
+  uint32_t values[4];
+
+  values[0] = rand_r(&ctx->seed) % 256;
+  values[1] = rand_r(&ctx->seed) % 256;
+  values[2] = ctx->width / 2 + rand_r(&ctx->seed) % (ctx->width / 2);
+  values[3] = ctx->height / 2 + rand_r(&ctx->seed) % (ctx->height / 2);
+  xcb_configure_window(ctx->connection, window->id,
+                       XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y |
+                           XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT,
+                       values);
+  // Measured from the oldest request a notify can answer.
+  if (!window->configure_time)
+    window->configure_time = stress_now();
+}
+
+// Performs one random operation. Windows are only reconfigured, retitled or
+// destroyed once mapped, so every map gets its notify.
+static void stress_step(struct stress_context* ctx) {
+  struct stress_window* window;
+  enum stress_op op;
+  int r = rand_r(&ctx->seed) % 100;
+
+  if (!ctx->num_windows || (r < 25 && ctx->num_windows < ctx->max_windows)) {
+    stress_create_window(ctx);
+    ctx->ops[STRESS_OP_MAP]++;
+    return;
+  }
+
+  window = &ctx->windows[rand_r(&ctx->seed) % ctx->num_windows];
+  if (!window->mapped)
+    return;
+
+  if (r < 55)
+    op = STRESS_OP_CONFIGURE;
+  else if (r < 80)
+    op = STRESS_OP_RETITLE;
+  else
+    op = STRESS_OP_DESTROY;
+
+  switch (op) {
+    case STRESS_OP_CONFIGURE:
+      stress_configure_window(ctx, window);
+      break;
+    case STRESS_OP_RETITLE:
+      stress_set_title(ctx, window);
+      break;
+    case STRESS_OP_DESTROY:
+      stress_destroy_window(ctx, window);
+      break;
+    case STRESS_OP_MAP:
+    case STRESS_NUM_OPS:
+      break;
+  }
+  ctx->ops[op]++;
+}
+
+static void stress_handle_event(struct stress_context* ctx,
+                                xcb_generic_event_t* event) {
+  struct stress_window* window;
+  double now = stress_now();
+
+  switch (event->response_type & ~0x80) {
+    case XCB_MAP_NOTIFY: {
+      xcb_map_notify_event_t* map = (xcb_map_notify_event_t*)event;
+
+      window = stress_lookup_window(ctx, map->window);
+      if (window && window->map_time) {
+        stress_add_sample(&ctx->map_latencies,
+                          (now - window->map_time) * 1000);
+        window->map_time = 0;
+      }
+      if (window)
+        window->mapped = 1;
+    } break;
+    case XCB_CONFIGURE_NOTIFY: {
+      xcb_configure_notify_event_t* configure =
+          (xcb_configure_notify_event_t*)event;
+
+      window = stress_lookup_window(ctx, configure->window);
+      if (window && window->configure_time) {
+        stress_add_sample(&ctx->configure_latencies,
+                          (now - window->configure_time) * 1000);
+        window->configure_time = 0;
+      }
+    } break;
+    case 0: {
+      xcb_generic_error_t* error = (xcb_generic_error_t*)event;
+
+      fprintf(stderr, "error: X11 error %d\n", error->error_code);
+    } break;
+  }
+}
+
+// Asks sommelier for its metrics and prints the percentiles of |histogram|.
+// Buckets have power of two bounds, so these are upper bounds.
+static void stress_print_histogram(const char* stats_socket,
+                                   const char* name,
+                                   const char* histogram) {
+  struct sockaddr_un addr;
+  unsigned long long bounds[32], counts[32];
+  char prefix[128];
+  char line[512];
+  size_t num_buckets = 0;
+  size_t prefix_length;
+  FILE* file;
+  int fd;
+  int i;
+
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", stats_socket);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  assert(fd >= 0);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+      write(fd, "prometheus\n", 11) != 11) {
+    fprintf(stderr, "error: failed to query %s: %m\n", stats_socket);
+    close(fd);
+    return;
+  }
+
+  prefix_length = snprintf(prefix, sizeof(prefix),
+                           "sommelier_%s_bucket{le=\"", histogram);
+  file = fdopen(fd, "r");
+  assert(file);
+  while (fgets(line, sizeof(line), file)) {
+    const char* value;
+
+    if (strncmp(line, prefix, prefix_length) ||
+        num_buckets == ARRAY_SIZE(counts)) {
+      continue;
+    }
+    value = strchr(line + prefix_length, ' ');
+    if (!value)
+      continue;
+    bounds[num_buckets] = line[prefix_length] == '+'
+                              ? 0
+                              : strtoull(line + prefix_length, NULL, 10);
+    counts[num_buckets++] = strtoull(value + 1, NULL, 10);
+  }
+  fclose(file);
+
+  if (!num_buckets || !counts[num_buckets - 1]) {
+    printf("%-28s %8s\n", name, "-");
+    return;
+  }
+
+  printf("%-28s %8llu", name, counts[num_buckets - 1]);
+  for (i = 0; i < 4; ++i) {
+    static const int percents[] = {50, 90, 99, 100};
+    unsigned long long rank =
+        (counts[num_buckets - 1] * percents[i] + 99) / 100;
+    size_t bucket = 0;
+
+    while (bucket < num_buckets - 1 && counts[bucket] < rank)
+      ++bucket;
+    if (bounds[bucket])
+      printf(" %9.2f", bounds[bucket] / 1e3);
+    else
+      printf(" %9s", "inf");
+  }
+  printf("\n");
+}
+
+static void stress_usage(const char* name) {
+  printf(
+      "usage: %s [options]\n\n"
+      "options:\n"
+      "  -h, --help\t\t\tPrint this help\n"
+      "  --seconds=SECONDS\t\tDuration of the run (default 10)\n"
+      "  --windows=N\t\t\tMost windows alive at once (default 64)\n"
+      "  --rate=N\t\t\tOperations per second, 0 for as fast as\n"
+      "\t\t\t\tpossible (default 0)\n"
+      "  --transient=PERCENT\t\tShare of new windows that are transient\n"
+      "\t\t\t\t(default 25)\n"
+      "  --override-redirect=PERCENT\tShare of new windows that are\n"
+      "\t\t\t\toverride-redirect (default 10)\n"
+      "  --size=WIDTHxHEIGHT\t\tSize of new windows (default 400x300)\n"
+      "  --seed=N\t\t\tSeed of the random operations (default 1)\n"
+      "  --stats-socket=PATH\t\tAlso report the histograms of sommelier\n",
+      name);
+}
+
+int main(int argc, char** argv) {
+  struct stress_context ctx = {
+      .max_windows = 64,
+      .transient_percent = 25,
+      .override_redirect_percent = 10,
+      .width = 400,
+      .height = 300,
+      .seed = 1,
+  };
+  const char* stats_socket = NULL;
+  double start_time, end_time, next_op_time, elapsed;
+  uint64_t total_ops = 0;
+  int seconds = 10;
+  int rate = 0;
+  struct pollfd pfd;
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value = strchr(arg, '=');
+
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      stress_usage(argv[0]);
+      return EXIT_SUCCESS;
+    } else if (strstr(arg, "--seconds") == arg && value) {
+      seconds = atoi(value + 1);
+    } else if (strstr(arg, "--windows") == arg && value) {
+      ctx.max_windows = atoi(value + 1);
+    } else if (strstr(arg, "--rate") == arg && value) {
+      rate = atoi(value + 1);
+    } else if (strstr(arg, "--transient") == arg && value) {
+      ctx.transient_percent = atoi(value + 1);
+    } else if (strstr(arg, "--override-redirect") == arg && value) {
+      ctx.override_redirect_percent = atoi(value + 1);
+    } else if (strstr(arg, "--size") == arg && value) {
+      if (sscanf(value + 1, "%dx%d", &ctx.width, &ctx.height) != 2) {
+        stress_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    } else if (strstr(arg, "--seed") == arg && value) {
+      ctx.seed = strtoul(value + 1, NULL, 10);
+    } else if (strstr(arg, "--stats-socket") == arg && value) {
+      stats_socket = value + 1;
+    } else {
+      fprintf(stderr, "Option `%s' is unknown.\n", arg);
+      return EXIT_FAILURE;
+    }
+  }
+  if (seconds < 1 || ctx.max_windows < 1 || rate < 0 || ctx.width < 2 ||
+      ctx.height < 2 || ctx.transient_percent < 0 ||
+      ctx.override_redirect_percent < 0 ||
+      ctx.transient_percent + ctx.override_redirect_percent > 100) {
+    stress_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  ctx.connection = xcb_connect(NULL, NULL);
+  if (xcb_connection_has_error(ctx.connection)) {
+    fprintf(stderr, "error: failed to connect to X server\n");
+    return EXIT_FAILURE;
+  }
+  ctx.screen = xcb_setup_roots_iterator(xcb_get_setup(ctx.connection)).data;
+  ctx.windows = malloc(sizeof(*ctx.windows) * ctx.max_windows);
+  assert(ctx.windows);
+
+  pfd.fd = xcb_get_file_descriptor(ctx.connection);
+  pfd.events = POLLIN;
+  start_time = stress_now();
+  end_time = start_time + seconds;
+  next_op_time = start_time;
+  for (;;) {
+    xcb_generic_event_t* event;
+    double now = stress_now();
+    int timeout;
+
+    if (now >= end_time)
+      break;
+
+    if (now >= next_op_time) {
+      stress_step(&ctx);
+      total_ops++;
+      next_op_time = rate ? next_op_time + 1.0 / rate : now;
+    }
+    xcb_flush(ctx.connection);
+
+    // As fast as possible still lets events in between operations.
+    timeout = (MIN(next_op_time, end_time) - stress_now()) * 1000;
+    if (poll(&pfd, 1, timeout > 0 ? timeout : 0) < 0)
+      continue;
+
+    while ((event = xcb_poll_for_event(ctx.connection))) {
+      stress_handle_event(&ctx, event);
+      free(event);
+    }
+    if (xcb_connection_has_error(ctx.connection)) {
+      fprintf(stderr, "error: lost connection to X server\n");
+      return EXIT_FAILURE;
+    }
+  }
+  elapsed = stress_now() - start_time;
+
+  while (ctx.num_windows)
+    stress_destroy_window(&ctx, &ctx.windows[0]);
+  xcb_flush(ctx.connection);
+
+  printf("%.0f operations/s:", total_ops / elapsed);
+  for (i = 0; i < STRESS_NUM_OPS; ++i) {
+    printf(" %llu %s%s", (unsigned long long)ctx.ops[i], stress_op_names[i],
+           i < STRESS_NUM_OPS - 1 ? "," : "\n");
+  }
+  printf("%-28s %8s %9s %9s %9s %9s\n", "latency", "samples", "p50 ms",
+         "p90 ms", "p99 ms", "max ms");
+  stress_print_samples("map to map notify", &ctx.map_latencies);
+  stress_print_samples("configure to notify", &ctx.configure_latencies);
+  if (stats_socket) {
+    // Let sommelier catch up with the last windows.
+    free(xcb_get_input_focus_reply(
+        ctx.connection, xcb_get_input_focus(ctx.connection), NULL));
+    stress_print_histogram(stats_socket, "map to first frame",
+                           "x11_map_to_first_frame_us");
+    stress_print_histogram(stats_socket, "configure to ack",
+                           "x11_configure_to_ack_us");
+  }
+
+  xcb_disconnect(ctx.connection);
+  return EXIT_SUCCESS;
+}
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-util.h>
@@ -48,6 +49,8 @@ struct sl_output_buffer {
   struct sl_mmap* mmap;
   struct pixman_region32 damage;
   struct sl_host_surface* surface;
+  // Flow of the last frame committed with this buffer.
+  uint64_t flow;
 };
 
 struct dma_buf_sync {
@@ -129,6 +132,8 @@ static uint32_t sl_drm_format_for_shm_format(int format) {
 }
 
 static void sl_output_buffer_destroy(struct sl_output_buffer* buffer) {
+  sl_metric_add(METRIC_OUTPUT_BUFFERS, -1);
+  sl_metric_add(METRIC_OUTPUT_BUFFER_BYTES, -(int64_t)buffer->mmap->size);
   wl_buffer_destroy(buffer->internal);
   sl_mmap_unref(buffer->mmap);
   pixman_region32_fini(&buffer->damage);
@@ -139,14 +144,38 @@ static void sl_output_buffer_destroy(struct sl_output_buffer* buffer) {
 static void sl_output_buffer_release(void* data, struct wl_buffer* buffer) {
   struct sl_output_buffer* output_buffer = wl_buffer_get_user_data(buffer);
   struct sl_host_surface* host_surface = output_buffer->surface;
+  uint64_t trace_start = sl_frame_trace_begin(host_surface->ctx, "release");
 
   wl_list_remove(&output_buffer->link);
   wl_list_insert(&host_surface->released_buffers, &output_buffer->link);
+
+  sl_frame_trace_end(host_surface->ctx, "release", trace_start,
+                     wl_resource_get_id(host_surface->resource),
+                     output_buffer->flow, FRAME_FLOW_STEP);
 }
 
 static const struct wl_buffer_listener sl_output_buffer_listener = {
     sl_output_buffer_release};
 
+// Traces a stage of the frame |host| is building. The frame gets its flow
+// when the first of its stages is traced.
+static uint64_t sl_host_surface_trace_begin(struct sl_host_surface* host,
+                                            const char* name) {
+  uint64_t start = sl_frame_trace_begin(host->ctx, name);
+
+  if (start && !host->frame_flow)
+    host->frame_flow = ++host->ctx->last_frame_flow;
+  return start;
+}
+
+static void sl_host_surface_trace_end(struct sl_host_surface* host,
+                                      const char* name,
+                                      uint64_t start,
+                                      int flow_phase) {
+  sl_frame_trace_end(host->ctx, name, start, wl_resource_get_id(host->resource),
+                     host->frame_flow, flow_phase);
+}
+
 static void sl_host_surface_destroy(struct wl_client* client,
                                     struct wl_resource* resource) {
   wl_resource_destroy(resource);
@@ -163,6 +192,9 @@ static void sl_host_surface_attach(struct wl_client* client,
   struct wl_buffer* buffer_proxy = NULL;
   struct sl_window* window;
   double scale = host->ctx->scale;
+  uint64_t trace_start = sl_host_surface_trace_begin(host, "attach");
+
+  sl_metric_add(METRIC_ATTACHES, 1);
 
   host->current_buffer = NULL;
   if (host->contents_shm_mmap) {
@@ -179,6 +211,8 @@ static void sl_host_surface_attach(struct wl_client* client,
   }
 
   if (host->contents_shm_mmap) {
+    uint64_t dequeue_start = sl_host_surface_trace_begin(host, "dequeue");
+
     while (!wl_list_empty(&host->released_buffers)) {
       host->current_buffer = wl_container_of(host->released_buffers.next,
                                              host->current_buffer, link);
@@ -192,6 +226,7 @@ static void sl_host_surface_attach(struct wl_client* client,
       sl_output_buffer_destroy(host->current_buffer);
       host->current_buffer = NULL;
     }
+    sl_host_surface_trace_end(host, "dequeue", dequeue_start, FRAME_FLOW_NONE);
 
     // Allocate new output buffer.
     if (!host->current_buffer) {
@@ -200,6 +235,7 @@ static void sl_host_surface_attach(struct wl_client* client,
       uint32_t shm_format = host_buffer->shm_format;
       size_t bpp = sl_shm_bpp_for_shm_format(shm_format);
       size_t num_planes = sl_shm_num_planes_for_shm_format(shm_format);
+      uint64_t alloc_start = sl_host_surface_trace_begin(host, "alloc");
 
       host->current_buffer = malloc(sizeof(struct sl_output_buffer));
       assert(host->current_buffer);
@@ -208,6 +244,7 @@ static void sl_host_surface_attach(struct wl_client* client,
       host->current_buffer->height = height;
       host->current_buffer->format = shm_format;
       host->current_buffer->surface = host;
+      host->current_buffer->flow = 0;
       pixman_region32_init_rect(&host->current_buffer->damage, 0, 0, MAX_SIZE,
                                 MAX_SIZE);
 
@@ -218,7 +255,7 @@ static void sl_host_surface_attach(struct wl_client* client,
           int stride0;
           int fd;
 
-          bo = gbm_bo_create(host->ctx->gbm, width, height,
+          bo = gbm_bo_create(sl_get_gbm_device(host->ctx), width, height,
                              sl_gbm_format_for_shm_format(shm_format),
                              GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
           stride0 = gbm_bo_get_stride(bo);
@@ -320,11 +357,16 @@ static void sl_host_surface_attach(struct wl_client* client,
 
       assert(host->current_buffer->internal);
       assert(host->current_buffer->mmap);
+      sl_metric_add(METRIC_OUTPUT_BUFFER_ALLOCATIONS, 1);
+      sl_metric_add(METRIC_OUTPUT_BUFFERS, 1);
+      sl_metric_add(METRIC_OUTPUT_BUFFER_BYTES,
+                    host->current_buffer->mmap->size);
 
       wl_buffer_set_user_data(host->current_buffer->internal,
                               host->current_buffer);
       wl_buffer_add_listener(host->current_buffer->internal,
                              &sl_output_buffer_listener, host->current_buffer);
+      sl_host_surface_trace_end(host, "alloc", alloc_start, FRAME_FLOW_NONE);
     }
   }
 
@@ -351,6 +393,8 @@ static void sl_host_surface_attach(struct wl_client* client,
       break;
     }
   }
+
+  sl_host_surface_trace_end(host, "attach", trace_start, FRAME_FLOW_NONE);
 }
 
 static void sl_host_surface_damage(struct wl_client* client,
@@ -363,6 +407,7 @@ static void sl_host_surface_damage(struct wl_client* client,
   double scale = host->ctx->scale;
   struct sl_output_buffer* buffer;
   int64_t x1, y1, x2, y2;
+  uint64_t trace_start = sl_host_surface_trace_begin(host, "damage");
 
   wl_list_for_each(buffer, &host->busy_buffers, link) {
     pixman_region32_union_rect(&buffer->damage, &buffer->damage, x, y, width,
@@ -386,15 +431,27 @@ static void sl_host_surface_damage(struct wl_client* client,
   y2 = ceil(MIN(y2 + 1, MAX_SIZE) / scale);
 
   wl_surface_damage(host->proxy, x1, y1, x2 - x1, y2 - y1);
+
+  sl_host_surface_trace_end(host, "damage", trace_start, FRAME_FLOW_NONE);
 }
 
 static void sl_frame_callback_done(void* data,
                                    struct wl_callback* callback,
                                    uint32_t time) {
   struct sl_host_callback* host = wl_callback_get_user_data(callback);
+  struct sl_context* ctx = host->ctx;
+  uint32_t surface_id = host->surface_id;
+  uint64_t flow = host->flow;
+  uint64_t trace_start = sl_frame_trace_begin(ctx, "frame done");
+  uint64_t send_start = sl_frame_trace_begin(ctx, "client done");
 
   wl_callback_send_done(host->resource, time);
+  sl_frame_trace_end(ctx, "client done", send_start, surface_id, flow,
+                     FRAME_FLOW_END);
   wl_resource_destroy(host->resource);
+
+  sl_frame_trace_end(ctx, "frame done", trace_start, surface_id, flow,
+                     FRAME_FLOW_STEP);
 }
 
 static const struct wl_callback_listener sl_frame_callback_listener = {
@@ -413,10 +470,14 @@ static void sl_host_surface_frame(struct wl_client* client,
                                   uint32_t callback) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
   struct sl_host_callback* host_callback;
+  uint64_t trace_start = sl_host_surface_trace_begin(host, "frame");
 
   host_callback = malloc(sizeof(*host_callback));
   assert(host_callback);
 
+  host_callback->ctx = host->ctx;
+  host_callback->surface_id = wl_resource_get_id(resource);
+  host_callback->flow = host->frame_flow;
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, callback);
   wl_resource_set_implementation(host_callback->resource, NULL, host_callback,
@@ -425,6 +486,8 @@ static void sl_host_surface_frame(struct wl_client* client,
   wl_callback_set_user_data(host_callback->proxy, host_callback);
   wl_callback_add_listener(host_callback->proxy, &sl_frame_callback_listener,
                            host_callback);
+
+  sl_host_surface_trace_end(host, "frame", trace_start, FRAME_FLOW_NONE);
 }
 
 static void sl_host_surface_set_opaque_region(
@@ -451,11 +514,23 @@ static void sl_host_surface_set_input_region(
                               host_region ? host_region->proxy : NULL);
 }
 
+static void sl_host_surface_commit_host(struct sl_host_surface* host) {
+  uint64_t trace_start = sl_host_surface_trace_begin(host, "host commit");
+
+  sl_latency_commit(host);
+  wl_surface_commit(host->proxy);
+  sl_host_surface_trace_end(host, "host commit", trace_start, FRAME_FLOW_NONE);
+}
+
 static void sl_host_surface_commit(struct wl_client* client,
                                    struct wl_resource* resource) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
   struct sl_viewport* viewport = NULL;
   struct sl_window* window;
+  uint64_t trace_start = sl_host_surface_trace_begin(host, "commit");
+
+  sl_metric_add(METRIC_COMMITS, 1);
+  host->commits++;
 
   if (!wl_list_empty(&host->contents_viewport))
     viewport = wl_container_of(host->contents_viewport.next, viewport, link);
@@ -475,6 +550,9 @@ static void sl_host_surface_commit(struct wl_client* client,
     double contents_offset_x = 0.0;
     double contents_offset_y = 0.0;
     pixman_box32_t* rect;
+    size_t copied = 0;
+    struct timespec start, end;
+    uint64_t copy_start;
     int n;
 
     // Determine scale and offset for damage based on current viewport.
@@ -503,6 +581,8 @@ static void sl_host_surface_commit(struct wl_client* client,
       }
     }
 
+    copy_start = sl_host_surface_trace_begin(host, "copy");
+    clock_gettime(CLOCK_MONOTONIC, &start);
     if (host->current_buffer->mmap->begin_write)
       host->current_buffer->mmap->begin_write(host->current_buffer->mmap->fd);
 
@@ -537,6 +617,7 @@ static void sl_host_surface_commit(struct wl_client* client,
             memcpy(dst, src, bytes);
             dst += dst_stride[i];
             src += src_stride[i];
+            copied += bytes;
           }
         }
       }
@@ -546,8 +627,17 @@ static void sl_host_surface_commit(struct wl_client* client,
 
     if (host->current_buffer->mmap->end_write)
       host->current_buffer->mmap->end_write(host->current_buffer->mmap->fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sl_host_surface_trace_end(host, "copy", copy_start, FRAME_FLOW_NONE);
+
+    sl_metric_add(METRIC_SHM_COPIES, 1);
+    sl_metric_add(METRIC_SHM_COPY_BYTES, copied);
+    sl_metric_observe(HISTOGRAM_SHM_COPY_TIME,
+                      (end.tv_sec - start.tv_sec) * 1000000 +
+                          (end.tv_nsec - start.tv_nsec) / 1000);
 
     pixman_region32_clear(&host->current_buffer->damage);
+    host->current_buffer->flow = host->frame_flow;
 
     wl_list_remove(&host->current_buffer->link);
     wl_list_insert(&host->busy_buffers, &host->current_buffer->link);
@@ -593,7 +683,9 @@ static void sl_host_surface_commit(struct wl_client* client,
   // No need to defer client commits if surface has a role. E.g. is a cursor
   // or shell surface.
   if (host->has_role) {
-    wl_surface_commit(host->proxy);
+    sl_host_surface_commit_host(host);
+    if (host->contents_width && host->contents_height)
+      sl_trace_startup(host->ctx, "first frame");
 
     // GTK determines the scale based on the output the surface has entered.
     // If the surface has not entered any output, then have it enter the
@@ -616,9 +708,9 @@ static void sl_host_surface_commit(struct wl_client* client,
     wl_list_for_each(window, &host->ctx->windows, link) {
       if (window->host_surface_id == wl_resource_get_id(resource)) {
         if (window->xdg_surface) {
-          wl_surface_commit(host->proxy);
+          sl_host_surface_commit_host(host);
           if (host->contents_width && host->contents_height)
-            window->realized = 1;
+            sl_window_realize(window);
         }
         break;
       }
@@ -631,6 +723,10 @@ static void sl_host_surface_commit(struct wl_client* client,
     sl_mmap_unref(host->contents_shm_mmap);
     host->contents_shm_mmap = NULL;
   }
+
+  // Frame callbacks and buffers carry the flow from here on.
+  sl_host_surface_trace_end(host, "commit", trace_start, FRAME_FLOW_START);
+  host->frame_flow = 0;
 }
 
 static void sl_host_surface_set_buffer_transform(struct wl_client* client,
@@ -703,7 +799,9 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
 
   if (host->viewport)
     wp_viewport_destroy(host->viewport);
+  sl_latency_destroy(host);
   wl_surface_destroy(host->proxy);
+  wl_list_remove(&host->link);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
@@ -804,6 +902,10 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
   host_surface->current_buffer = NULL;
   wl_list_init(&host_surface->released_buffers);
   wl_list_init(&host_surface->busy_buffers);
+  wl_list_insert(&host_surface->ctx->host_surfaces, &host_surface->link);
+  host_surface->commits = 0;
+  host_surface->frame_flow = 0;
+  host_surface->latency = NULL;
   host_surface->resource = wl_resource_create(
       client, &wl_surface_interface, wl_resource_get_version(resource), id);
   wl_resource_set_implementation(host_surface->resource,
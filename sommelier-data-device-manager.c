@@ -6,7 +6,6 @@
 
 #include <assert.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <linux/virtwl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,130 +37,6 @@ struct sl_host_data_offer {
   struct wl_data_offer* proxy;
 };
 
-struct sl_data_transfer {
-  int read_fd;
-  int write_fd;
-  size_t offset;
-  size_t bytes_left;
-  uint8_t data[4096];
-  struct wl_event_source* read_event_source;
-  struct wl_event_source* write_event_source;
-};
-
-static void sl_data_transfer_destroy(struct sl_data_transfer* transfer) {
-  assert(transfer->read_event_source);
-  wl_event_source_remove(transfer->read_event_source);
-  assert(transfer->write_event_source);
-  wl_event_source_remove(transfer->write_event_source);
-  close(transfer->read_fd);
-  close(transfer->write_fd);
-  free(transfer);
-}
-
-static int sl_handle_data_transfer_read(int fd, uint32_t mask, void* data) {
-  struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
-  if ((mask & WL_EVENT_READABLE) == 0) {
-    assert(mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR));
-
-    // Epoll (and therefore wl_event_loop) will notify listeners of errors and
-    // hangups even if all other events are disabled. Therefore, at this point,
-    // we don't know whether we didn't get a readable event because the fd has
-    // been exhausted, or because we aren't in the reading state and weren't
-    // listening for one. We can make the distinction be checking if there's any
-    // data left in the buffer. If there is, then we are just waiting for the
-    // writing to finish, otherwise end the transfer.
-
-    // In the case of an error, where there is not likely to be any more data to
-    // read, we still want to wait for any data we did get to be written out.
-    if (!transfer->bytes_left) {
-      sl_data_transfer_destroy(transfer);
-    }
-    return 0;
-  }
-
-  // At this point we must be in the reading state.
-  assert(!transfer->bytes_left);
-
-  transfer->bytes_left =
-      read(transfer->read_fd, transfer->data, sizeof(transfer->data));
-  if (transfer->bytes_left > 0) {
-    transfer->offset = 0;
-    // There may still be data to read from the event source, but we have no
-    // room in our buffer so move to the writing state.
-    wl_event_source_fd_update(transfer->read_event_source, 0);
-    wl_event_source_fd_update(transfer->write_event_source, WL_EVENT_WRITABLE);
-  } else {
-    // On a read error or EOF, end the transfer.
-    sl_data_transfer_destroy(transfer);
-  }
-
-  return 0;
-}
-
-static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
-  struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
-  int rv;
-
-  // If we receive a HANGUP or ERROR event on the write source then there is no
-  // point in continuing the transfer. We could still read more data, but we
-  // couldn't send it to the recipient, so just destroy the transfer now.
-  if ((mask & WL_EVENT_WRITABLE) == 0) {
-    assert(mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR));
-    sl_data_transfer_destroy(transfer);
-    return 0;
-  }
-
-  // At this point we must be in the writing state.
-  assert(transfer->bytes_left);
-
-  rv = write(transfer->write_fd, transfer->data + transfer->offset,
-             transfer->bytes_left);
-
-  if (rv < 0) {
-    // On a write error, end the transfer.
-    sl_data_transfer_destroy(transfer);
-  } else {
-    assert(rv <= transfer->bytes_left);
-    transfer->bytes_left -= rv;
-    transfer->offset += rv;
-  }
-
-  if (!transfer->bytes_left) {
-    // If all data has been written, move back to the reading state.
-    wl_event_source_fd_update(transfer->write_event_source, 0);
-    wl_event_source_fd_update(transfer->read_event_source, WL_EVENT_READABLE);
-  }
-
-  // If there is still data left, continue in the writing state.
-  return 0;
-}
-
-static void sl_data_transfer_create(struct wl_event_loop* event_loop,
-                                    int read_fd,
-                                    int write_fd) {
-  struct sl_data_transfer* transfer;
-  int flags;
-  int rv;
-
-  flags = fcntl(write_fd, F_GETFL, 0);
-  rv = fcntl(write_fd, F_SETFL, flags | O_NONBLOCK);
-  assert(!rv);
-  UNUSED(rv);
-
-  // Start out the transfer in the reading state.
-  transfer = malloc(sizeof(*transfer));
-  assert(transfer);
-  transfer->read_fd = read_fd;
-  transfer->write_fd = write_fd;
-  transfer->offset = 0;
-  transfer->bytes_left = 0;
-  transfer->read_event_source =
-      wl_event_loop_add_fd(event_loop, read_fd, WL_EVENT_READABLE,
-                           sl_handle_data_transfer_read, transfer);
-  transfer->write_event_source = wl_event_loop_add_fd(
-      event_loop, write_fd, 0, sl_handle_data_transfer_write, transfer);
-}
-
 static void sl_data_offer_accept(struct wl_client* client,
                                  struct wl_resource* resource,
                                  uint32_t serial,
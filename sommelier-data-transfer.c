@@ -0,0 +1,363 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Reading and writing run independently of each other. When both ends can be
+// spliced the data moves through a pipe and never leaves the kernel.
+// Otherwise it goes through a ring buffer that grows so a slow reader on the
+// other end doesn't stall the source more than necessary.
+static const size_t sl_data_transfer_initial_buffer_size = 64 * 1024;
+static const size_t sl_data_transfer_max_buffer_size = 4 * 1024 * 1024;
+
+struct sl_data_transfer {
+  struct wl_event_loop* event_loop;
+  // -1 once the source is exhausted.
+  int read_fd;
+  int write_fd;
+  // Intermediate pipe used for splicing, -1 when copying through |data|.
+  int pipe_fds[2];
+  size_t pipe_capacity;
+  size_t pipe_size;
+  uint8_t* data;
+  size_t capacity;
+  size_t offset;
+  size_t size;
+  // NULL while reading is paused, see sl_handle_data_transfer_read().
+  struct wl_event_source* read_event_source;
+  struct wl_event_source* write_event_source;
+};
+
+static int sl_handle_data_transfer_read(int fd, uint32_t mask, void* data);
+
+static void sl_data_transfer_destroy(struct sl_data_transfer* transfer) {
+  if (transfer->read_fd != -1) {
+    if (transfer->read_event_source)
+      wl_event_source_remove(transfer->read_event_source);
+    close(transfer->read_fd);
+  }
+  assert(transfer->write_event_source);
+  wl_event_source_remove(transfer->write_event_source);
+  close(transfer->write_fd);
+  if (transfer->pipe_fds[0] != -1) {
+    close(transfer->pipe_fds[0]);
+    close(transfer->pipe_fds[1]);
+  }
+  free(transfer->data);
+  free(transfer);
+}
+
+static int sl_data_transfer_grow(struct sl_data_transfer* transfer) {
+  size_t capacity;
+  size_t head_size;
+  uint8_t* data;
+
+  if (transfer->capacity >= sl_data_transfer_max_buffer_size)
+    return 0;
+
+  capacity = transfer->capacity ? transfer->capacity * 2
+                                : sl_data_transfer_initial_buffer_size;
+  data = malloc(capacity);
+  assert(data);
+
+  // Unwrap the ring so the pending data starts at the beginning.
+  if (transfer->size) {
+    head_size = MIN(transfer->size, transfer->capacity - transfer->offset);
+    memcpy(data, transfer->data + transfer->offset, head_size);
+    memcpy(data + head_size, transfer->data, transfer->size - head_size);
+  }
+
+  free(transfer->data);
+  transfer->data = data;
+  transfer->capacity = capacity;
+  transfer->offset = 0;
+  return 1;
+}
+
+static ssize_t sl_data_transfer_read(struct sl_data_transfer* transfer,
+                                     int fd,
+                                     size_t max_size) {
+  size_t tail;
+  ssize_t bytes;
+
+  if (transfer->size == transfer->capacity &&
+      !sl_data_transfer_grow(transfer)) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  tail = (transfer->offset + transfer->size) % transfer->capacity;
+  bytes = read(fd, transfer->data + tail,
+               MIN(max_size, MIN(transfer->capacity - transfer->size,
+                                 transfer->capacity - tail)));
+  if (bytes > 0)
+    transfer->size += bytes;
+  return bytes;
+}
+
+#ifdef __linux__
+// Moves whatever made it into the pipe to the copy buffer, as it still has to
+// be delivered, and closes the pipe. Returns -1 with errno set if that can't
+// be done yet, in which case the pipe is kept and this has to be retried.
+static int sl_data_transfer_stop_splice(struct sl_data_transfer* transfer) {
+  while (transfer->pipe_size) {
+    ssize_t bytes = sl_data_transfer_read(transfer, transfer->pipe_fds[0],
+                                          transfer->pipe_size);
+    if (bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (!bytes) {
+      errno = EPIPE;
+      return -1;
+    }
+    transfer->pipe_size -= bytes;
+  }
+
+  close(transfer->pipe_fds[0]);
+  close(transfer->pipe_fds[1]);
+  transfer->pipe_fds[0] = -1;
+  transfer->pipe_fds[1] = -1;
+  return 0;
+}
+#endif
+
+// Pulls more data from the source. Returns the number of bytes read, 0 on
+// EOF and -1 on error with errno set.
+static ssize_t sl_data_transfer_fill(struct sl_data_transfer* transfer) {
+#ifdef __linux__
+  if (transfer->pipe_fds[1] != -1) {
+    ssize_t bytes;
+
+    // A splice without room would return 0, which looks like EOF.
+    if (transfer->pipe_size == transfer->pipe_capacity) {
+      errno = EAGAIN;
+      return -1;
+    }
+
+    bytes = splice(transfer->read_fd, NULL, transfer->pipe_fds[1], NULL,
+                   transfer->pipe_capacity - transfer->pipe_size,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytes >= 0 || errno != EINVAL) {
+      if (bytes > 0)
+        transfer->pipe_size += bytes;
+      return bytes;
+    }
+
+    // The source can't be spliced, copy instead.
+    if (sl_data_transfer_stop_splice(transfer) < 0)
+      return -1;
+  }
+#endif
+
+  return sl_data_transfer_read(transfer, transfer->read_fd, SIZE_MAX);
+}
+
+// Writes as much pending data as the destination takes. Returns -1 if the
+// destination failed.
+static int sl_data_transfer_drain(struct sl_data_transfer* transfer) {
+#ifdef __linux__
+  while (transfer->pipe_size) {
+    ssize_t bytes = splice(transfer->pipe_fds[0], NULL, transfer->write_fd,
+                           NULL, transfer->pipe_size,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytes < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        return 0;
+      if (errno != EINVAL)
+        return -1;
+
+      // The destination can't be spliced, copy instead. Without room for
+      // all of the pipe, write out what was moved and try again later.
+      if (sl_data_transfer_stop_splice(transfer) < 0 && errno != EAGAIN)
+        return -1;
+      break;
+    }
+    transfer->pipe_size -= bytes;
+    sl_metric_add(METRIC_DATA_TRANSFER_BYTES, bytes);
+  }
+#endif
+
+  while (transfer->size) {
+    ssize_t bytes = write(
+        transfer->write_fd, transfer->data + transfer->offset,
+        MIN(transfer->size, transfer->capacity - transfer->offset));
+    if (bytes < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        return 0;
+      return -1;
+    }
+    transfer->offset = (transfer->offset + bytes) % transfer->capacity;
+    transfer->size -= bytes;
+    sl_metric_add(METRIC_DATA_TRANSFER_BYTES, bytes);
+  }
+
+  // Keep reads contiguous when the buffer runs empty.
+  transfer->offset = 0;
+  return 0;
+}
+
+static void sl_data_transfer_update(struct sl_data_transfer* transfer) {
+  if (transfer->read_fd != -1) {
+    int has_room =
+        transfer->pipe_fds[1] != -1
+            ? transfer->pipe_size < transfer->pipe_capacity
+            : transfer->size < transfer->capacity ||
+                  transfer->capacity < sl_data_transfer_max_buffer_size;
+
+    if (transfer->read_event_source) {
+      wl_event_source_fd_update(transfer->read_event_source,
+                                has_room ? WL_EVENT_READABLE : 0);
+    } else if (has_room) {
+      transfer->read_event_source = wl_event_loop_add_fd(
+          transfer->event_loop, transfer->read_fd, WL_EVENT_READABLE,
+          sl_handle_data_transfer_read, transfer);
+    }
+  }
+  wl_event_source_fd_update(
+      transfer->write_event_source,
+      transfer->pipe_size || transfer->size ? WL_EVENT_WRITABLE : 0);
+}
+
+// Called once the source is exhausted. The transfer ends as soon as all the
+// data read so far has been written.
+static void sl_data_transfer_finish_read(struct sl_data_transfer* transfer) {
+  wl_event_source_remove(transfer->read_event_source);
+  transfer->read_event_source = NULL;
+  close(transfer->read_fd);
+  transfer->read_fd = -1;
+
+  if (!transfer->pipe_size && !transfer->size) {
+    sl_data_transfer_destroy(transfer);
+    return;
+  }
+  sl_data_transfer_update(transfer);
+}
+
+static int sl_handle_data_transfer_read(int fd, uint32_t mask, void* data) {
+  struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
+  ssize_t bytes;
+
+  // In the case of an error, where there is not likely to be any more data
+  // to read, we still want to wait for any data we did get to be written out.
+  // A hangup is also reported while we aren't asking for readability, and
+  // the source might still hold data written before it hung up. That is read
+  // until EOF like when it is readable.
+  if ((mask & WL_EVENT_READABLE) == 0) {
+    assert(mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR));
+    if (mask & WL_EVENT_ERROR) {
+      sl_data_transfer_finish_read(transfer);
+      return 0;
+    }
+  }
+
+  bytes = sl_data_transfer_fill(transfer);
+  if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+    // Without room for more data, stop watching the source until there is.
+    // Otherwise the hangup would be reported over and over.
+    if ((mask & WL_EVENT_READABLE) == 0 && errno == EAGAIN) {
+      wl_event_source_remove(transfer->read_event_source);
+      transfer->read_event_source = NULL;
+    }
+    return 0;
+  }
+  if (bytes <= 0) {
+    // On a read error or EOF, finish the transfer.
+    sl_data_transfer_finish_read(transfer);
+    return 0;
+  }
+
+  // The destination is usually ready, so don't wait for the event loop to
+  // tell us.
+  if (sl_data_transfer_drain(transfer) < 0) {
+    sl_data_transfer_destroy(transfer);
+    return 0;
+  }
+
+  sl_data_transfer_update(transfer);
+  return 0;
+}
+
+static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
+  struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
+
+  // If we receive a HANGUP or ERROR event on the write source then there is no
+  // point in continuing the transfer. We could still read more data, but we
+  // couldn't send it to the recipient, so just destroy the transfer now.
+  if ((mask & WL_EVENT_WRITABLE) == 0) {
+    assert(mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR));
+    sl_data_transfer_destroy(transfer);
+    return 0;
+  }
+
+  if (sl_data_transfer_drain(transfer) < 0) {
+    sl_data_transfer_destroy(transfer);
+    return 0;
+  }
+
+  if (transfer->read_fd == -1 && !transfer->pipe_size && !transfer->size) {
+    sl_data_transfer_destroy(transfer);
+    return 0;
+  }
+
+  sl_data_transfer_update(transfer);
+  return 0;
+}
+
+void sl_data_transfer_create(struct wl_event_loop* event_loop,
+                             int read_fd,
+                             int write_fd) {
+  struct sl_data_transfer* transfer;
+  int flags;
+  int rv;
+
+  flags = fcntl(write_fd, F_GETFL, 0);
+  rv = fcntl(write_fd, F_SETFL, flags | O_NONBLOCK);
+  assert(!rv);
+  UNUSED(rv);
+
+  sl_metric_add(METRIC_DATA_TRANSFERS, 1);
+
+  transfer = malloc(sizeof(*transfer));
+  assert(transfer);
+  transfer->event_loop = event_loop;
+  transfer->read_fd = read_fd;
+  transfer->write_fd = write_fd;
+  transfer->pipe_fds[0] = -1;
+  transfer->pipe_fds[1] = -1;
+  transfer->pipe_capacity = 0;
+  transfer->pipe_size = 0;
+  transfer->data = NULL;
+  transfer->capacity = 0;
+  transfer->offset = 0;
+  transfer->size = 0;
+
+#ifdef __linux__
+  // Try splicing first. We only find out whether both ends support it when
+  // data starts moving.
+  if (!pipe2(transfer->pipe_fds, O_CLOEXEC | O_NONBLOCK)) {
+    int pipe_capacity = fcntl(transfer->pipe_fds[1], F_GETPIPE_SZ);
+
+    transfer->pipe_capacity = pipe_capacity > 0 ? pipe_capacity : 4096;
+  } else {
+    transfer->pipe_fds[0] = -1;
+    transfer->pipe_fds[1] = -1;
+  }
+#endif
+
+  transfer->read_event_source =
+      wl_event_loop_add_fd(event_loop, read_fd, WL_EVENT_READABLE,
+                           sl_handle_data_transfer_read, transfer);
+  transfer->write_event_source = wl_event_loop_add_fd(
+      event_loop, write_fd, 0, sl_handle_data_transfer_write, transfer);
+}
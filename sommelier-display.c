@@ -89,6 +89,9 @@ static void sl_display_get_registry(struct wl_client* client,
   host_registry = malloc(sizeof(*host_registry));
   assert(host_registry);
 
+  if (wl_list_empty(&ctx->registries))
+    sl_trace_startup(ctx, "first client registry");
+
   host_registry->ctx = ctx;
   host_registry->resource =
       wl_resource_create(client, &wl_registry_interface, 1, id);
@@ -120,7 +123,8 @@ static enum wl_iterator_result sl_set_implementation(
   return WL_ITERATOR_CONTINUE;
 }
 
-void sl_set_display_implementation(struct sl_context* ctx) {
+void sl_set_display_implementation(struct sl_context* ctx,
+                                   struct wl_client* client) {
   // Find display resource and set implementation.
-  wl_client_for_each_resource(ctx->client, sl_set_implementation, ctx);
+  wl_client_for_each_resource(client, sl_set_implementation, ctx);
 }
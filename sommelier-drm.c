@@ -5,7 +5,6 @@
 #include "sommelier.h"
 
 #include <assert.h>
-#include <gbm.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -59,7 +58,7 @@ static void sl_drm_create_planar_buffer(struct wl_client* client,
 
 static void sl_drm_sync(struct sl_context* ctx,
                         struct sl_sync_point* sync_point) {
-  int drm_fd = gbm_device_get_fd(ctx->gbm);
+  int drm_fd = ctx->drm_fd;
   struct drm_prime_handle prime_handle;
   int ret;
 
@@ -113,8 +112,8 @@ static void sl_drm_create_prime_buffer(struct wl_client* client,
   // if available.  Ideally mesa/gbm should have the correct stride. Remove
   // after crbug.com/892242 is resolved in mesa.
   int is_gpu_buffer = 0;
-  if (host->ctx->gbm) {
-    int drm_fd = gbm_device_get_fd(host->ctx->gbm);
+  if (host->ctx->drm_fd != -1) {
+    int drm_fd = host->ctx->drm_fd;
     struct drm_prime_handle prime_handle;
     int ret;
 
@@ -0,0 +1,256 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "presentation-time-client-protocol.h"
+
+// The latency probe measures how long it takes for a key or pointer button
+// press forwarded to a surface to show up in a commit to the host and, if
+// the host supports wp_presentation and isn't behind virtwl, on screen.
+// Releases aren't sampled. An input starts a sample if
+// none is pending on the surface, and the next commit of that surface to the
+// host ends it. Inputs that arrive while a sample is pending are answered by
+// the same commit and not sampled on their own.
+
+// Oldest samples are overwritten once a surface has this many.
+static const size_t sl_latency_max_samples = 4096;
+
+struct sl_latency_samples {
+  struct wl_array values;
+  size_t next;
+};
+
+struct sl_latency {
+  // Time of the oldest input not yet followed by a commit, 0 if none.
+  uint64_t input_time;
+  struct sl_latency_samples commit;
+  struct sl_latency_samples present;
+  uint64_t discarded;
+  struct wl_list feedbacks;
+};
+
+struct sl_latency_feedback {
+  struct wl_list link;
+  struct sl_latency* latency;
+  struct wp_presentation_feedback* proxy;
+  uint64_t input_time;
+};
+
+// Input times are taken from the presentation clock so they can be compared
+// with presentation timestamps.
+static uint64_t sl_latency_now(struct sl_context* ctx) {
+  struct timespec ts;
+
+  clock_gettime(ctx->presentation ? ctx->presentation->clock_id
+                                  : CLOCK_MONOTONIC,
+                &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sl_latency_add_sample(struct sl_latency_samples* samples,
+                                  uint64_t latency_ns) {
+  uint32_t* values = samples->values.data;
+  size_t count = samples->values.size / sizeof(*values);
+  uint32_t value = MIN(latency_ns / 1000, UINT32_MAX);
+
+  if (count < sl_latency_max_samples) {
+    uint32_t* p = wl_array_add(&samples->values, sizeof(*p));
+    assert(p);
+    *p = value;
+  } else {
+    values[samples->next] = value;
+    samples->next = (samples->next + 1) % sl_latency_max_samples;
+  }
+}
+
+static int sl_latency_compare(const void* a, const void* b) {
+  uint32_t value_a = *(const uint32_t*)a;
+  uint32_t value_b = *(const uint32_t*)b;
+
+  return value_a < value_b ? -1 : value_a > value_b;
+}
+
+static void sl_latency_print_samples(FILE* out,
+                                     const char* name,
+                                     struct sl_latency_samples* samples) {
+  size_t count = samples->values.size / sizeof(uint32_t);
+  uint32_t* values;
+
+  if (!count)
+    return;
+
+  values = malloc(samples->values.size);
+  assert(values);
+  memcpy(values, samples->values.data, samples->values.size);
+  qsort(values, count, sizeof(*values), sl_latency_compare);
+  fprintf(out,
+          " %s: %zu samples, p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, "
+          "max %.1f ms;",
+          name, count, values[count * 50 / 100] / 1e3,
+          values[count * 90 / 100] / 1e3, values[count * 99 / 100] / 1e3,
+          values[count - 1] / 1e3);
+  free(values);
+}
+
+static void sl_latency_print(struct sl_host_surface* host, FILE* out) {
+  struct sl_latency* latency = host->latency;
+  uint32_t id = wl_resource_get_id(host->resource);
+  const char* name = NULL;
+  struct sl_window* window;
+  pid_t pid;
+
+  if (!latency->commit.values.size)
+    return;
+
+  wl_list_for_each(window, &host->ctx->windows, link) {
+    if (window->host_surface_id == id) {
+      name = window->name;
+      break;
+    }
+  }
+
+  wl_client_get_credentials(wl_resource_get_client(host->resource), &pid,
+                            NULL, NULL);
+  fprintf(out, "latency[%d]: surface %d/%u", getpid(), pid, id);
+  if (name)
+    fprintf(out, " (%s)", name);
+  fprintf(out, ":");
+  sl_latency_print_samples(out, "input to commit", &latency->commit);
+  sl_latency_print_samples(out, "input to present", &latency->present);
+  if (latency->discarded)
+    fprintf(out, " %" PRIu64 " discarded;", latency->discarded);
+  fprintf(out, "\n");
+}
+
+static void sl_latency_feedback_destroy(struct sl_latency_feedback* feedback) {
+  wp_presentation_feedback_destroy(feedback->proxy);
+  wl_list_remove(&feedback->link);
+  free(feedback);
+}
+
+static void sl_latency_feedback_sync_output(
+    void* data,
+    struct wp_presentation_feedback* presentation_feedback,
+    struct wl_output* output) {}
+
+static void sl_latency_feedback_presented(
+    void* data,
+    struct wp_presentation_feedback* presentation_feedback,
+    uint32_t tv_sec_hi,
+    uint32_t tv_sec_lo,
+    uint32_t tv_nsec,
+    uint32_t refresh,
+    uint32_t seq_hi,
+    uint32_t seq_lo,
+    uint32_t flags) {
+  struct sl_latency_feedback* feedback = data;
+  uint64_t time =
+      (((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000ull + tv_nsec;
+
+  if (time > feedback->input_time) {
+    sl_latency_add_sample(&feedback->latency->present,
+                          time - feedback->input_time);
+  }
+  sl_latency_feedback_destroy(feedback);
+}
+
+static void sl_latency_feedback_discarded(
+    void* data,
+    struct wp_presentation_feedback* presentation_feedback) {
+  struct sl_latency_feedback* feedback = data;
+
+  feedback->latency->discarded++;
+  sl_latency_feedback_destroy(feedback);
+}
+
+static const struct wp_presentation_feedback_listener
+    sl_latency_feedback_listener = {sl_latency_feedback_sync_output,
+                                    sl_latency_feedback_presented,
+                                    sl_latency_feedback_discarded};
+
+void sl_latency_input(struct sl_context* ctx,
+                      struct wl_resource* surface_resource) {
+  struct sl_host_surface* host = wl_resource_get_user_data(surface_resource);
+
+  if (!ctx->latency_probe || !host)
+    return;
+
+  if (!host->latency) {
+    host->latency = malloc(sizeof(*host->latency));
+    assert(host->latency);
+    host->latency->input_time = 0;
+    wl_array_init(&host->latency->commit.values);
+    host->latency->commit.next = 0;
+    wl_array_init(&host->latency->present.values);
+    host->latency->present.next = 0;
+    host->latency->discarded = 0;
+    wl_list_init(&host->latency->feedbacks);
+  }
+
+  if (!host->latency->input_time)
+    host->latency->input_time = sl_latency_now(ctx);
+}
+
+void sl_latency_commit(struct sl_host_surface* host) {
+  struct sl_latency* latency = host->latency;
+  struct sl_latency_feedback* feedback;
+
+  if (!latency || !latency->input_time)
+    return;
+
+  sl_latency_add_sample(&latency->commit,
+                        sl_latency_now(host->ctx) - latency->input_time);
+
+  // Feedback applies to the commit that follows.
+  if (host->ctx->presentation) {
+    feedback = malloc(sizeof(*feedback));
+    assert(feedback);
+    feedback->latency = latency;
+    feedback->input_time = latency->input_time;
+    feedback->proxy =
+        wp_presentation_feedback(host->ctx->presentation->internal, host->proxy);
+    wp_presentation_feedback_add_listener(
+        feedback->proxy, &sl_latency_feedback_listener, feedback);
+    wl_list_insert(&latency->feedbacks, &feedback->link);
+  }
+
+  latency->input_time = 0;
+}
+
+void sl_latency_destroy(struct sl_host_surface* host) {
+  struct sl_latency* latency = host->latency;
+  struct sl_latency_feedback* feedback;
+  struct sl_latency_feedback* next;
+
+  if (!latency)
+    return;
+
+  sl_latency_print(host, stderr);
+  wl_list_for_each_safe(feedback, next, &latency->feedbacks, link) {
+    sl_latency_feedback_destroy(feedback);
+  }
+  wl_array_release(&latency->commit.values);
+  wl_array_release(&latency->present.values);
+  free(latency);
+  host->latency = NULL;
+}
+
+void sl_latency_report(struct sl_context* ctx, FILE* out) {
+  struct sl_host_surface* host;
+
+  wl_list_for_each(host, &ctx->host_surfaces, link) {
+    if (host->latency)
+      sl_latency_print(host, out);
+  }
+}
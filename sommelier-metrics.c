@@ -0,0 +1,476 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Metrics are relaxed atomics so they can be updated from any thread, like
+// the virtwl forwarder's, at the cost of an uncontended add. Counters that
+// only the main thread touches live in the context and are read when the
+// metrics are written.
+struct sl_metric_info {
+  const char* name;
+  const char* type;
+  const char* help;
+  const char* label_name;
+  const char* label_value;
+};
+
+static const struct sl_metric_info sl_metric_infos[METRIC_LAST + 1] = {
+    [METRIC_COMMITS] = {"commits_total", "counter", "Surface commits"},
+    [METRIC_ATTACHES] = {"attaches_total", "counter", "Surface attaches"},
+    [METRIC_SHM_COPIES] = {"shm_copies_total", "counter",
+                           "Commits that copied shm contents"},
+    [METRIC_SHM_COPY_BYTES] = {"shm_copy_bytes_total", "counter",
+                               "Bytes of shm contents copied"},
+    // A NULL label value is filled in with the shm driver.
+    [METRIC_OUTPUT_BUFFER_ALLOCATIONS] = {"output_buffer_allocations_total",
+                                          "counter",
+                                          "Output buffers allocated", "driver"},
+    [METRIC_OUTPUT_BUFFERS] = {"output_buffers", "gauge",
+                               "Output buffers in use", "driver"},
+    [METRIC_OUTPUT_BUFFER_BYTES] = {"output_buffer_bytes", "gauge",
+                                    "Size of the output buffers in use",
+                                    "driver"},
+    [METRIC_CLIPBOARD_BYTES_TO_X] = {"clipboard_bytes_total", "counter",
+                                     "Clipboard bytes passed between X11 and "
+                                     "Wayland",
+                                     "direction", "to_x"},
+    [METRIC_CLIPBOARD_BYTES_FROM_X] = {"clipboard_bytes_total", "counter",
+                                       "Clipboard bytes passed between X11 "
+                                       "and Wayland",
+                                       "direction", "from_x"},
+    [METRIC_DATA_TRANSFERS] = {"data_transfers_total", "counter",
+                               "Data transfers relayed"},
+    [METRIC_DATA_TRANSFER_BYTES] = {"data_transfer_bytes_total", "counter",
+                                    "Bytes relayed by data transfers"},
+    [METRIC_VIRTWL_HOST_TRANSACTIONS] = {"virtwl_transactions_total",
+                                         "counter", "Virtwl transactions",
+                                         "direction", "host"},
+    [METRIC_VIRTWL_CLIENT_TRANSACTIONS] = {"virtwl_transactions_total",
+                                           "counter", "Virtwl transactions",
+                                           "direction", "client"},
+    [METRIC_VIRTWL_HOST_MESSAGES] = {"virtwl_messages_total", "counter",
+                                     "Wayland messages in virtwl transactions",
+                                     "direction", "host"},
+    [METRIC_VIRTWL_CLIENT_MESSAGES] = {"virtwl_messages_total", "counter",
+                                       "Wayland messages in virtwl "
+                                       "transactions",
+                                       "direction", "client"},
+    [METRIC_VIRTWL_PARTIAL_WRITES] = {"virtwl_partial_writes_total", "counter",
+                                      "Host transactions that didn't fit into "
+                                      "the socket in one write"},
+    [METRIC_VIRTWL_HOST_RETRIES] = {"virtwl_host_retries_total", "counter",
+                                    "Client transactions the host asked us to "
+                                    "send again"},
+};
+
+struct sl_histogram_info {
+  const char* name;
+  const char* help;
+};
+
+static const struct sl_histogram_info sl_histogram_infos[HISTOGRAM_LAST + 1] =
+    {
+        [HISTOGRAM_SHM_COPY_TIME] = {"shm_copy_time_us",
+                                     "Time spent copying shm contents"},
+        [HISTOGRAM_X11_MAP_TO_FIRST_FRAME] = {"x11_map_to_first_frame_us",
+                                              "Time from X11 map request to "
+                                              "first frame"},
+        [HISTOGRAM_X11_CONFIGURE_TO_ACK] = {"x11_configure_to_ack_us",
+                                            "Time from applying a configure "
+                                            "to X11 to acking it"},
+        [HISTOGRAM_INPUT_DELAY] = {"input_delay_ms",
+                                   "Time from the host sending input events "
+                                   "to forwarding them, local hosts only"},
+        [HISTOGRAM_VIRTWL_HOST_LATENCY] = {"virtwl_host_latency_us",
+                                           "Time from receiving a virtwl "
+                                           "transaction to writing all of it "
+                                           "to the client"},
+        [HISTOGRAM_VIRTWL_CLIENT_LATENCY] = {"virtwl_client_latency_us",
+                                             "Time from reading client data "
+                                             "to the host accepting it"},
+};
+
+static const char* const sl_shm_driver_names[] = {"noop", "dmabuf", "virtwl",
+                                                  "virtwl-dmabuf"};
+
+static _Atomic uint64_t sl_metrics[METRIC_LAST + 1];
+// Bucket N counts values below 2^N, the last bucket everything above.
+static _Atomic uint64_t sl_histograms[HISTOGRAM_LAST + 1][16];
+static _Atomic uint64_t sl_histogram_sums[HISTOGRAM_LAST + 1];
+
+struct sl_metric_sample {
+  const char* name;
+  const char* type;
+  const char* help;
+  const char* label_name;
+  char label_value[32];
+  uint64_t value;
+};
+
+struct sl_metrics_client {
+  struct sl_context* ctx;
+  int fd;
+  struct wl_event_source* event_source;
+  char request[64];
+  size_t request_size;
+  char* response;
+  size_t response_size;
+  size_t response_offset;
+};
+
+void sl_metric_add(int metric, int64_t value) {
+  atomic_fetch_add_explicit(&sl_metrics[metric], value, memory_order_relaxed);
+}
+
+void sl_metric_observe(int histogram, uint64_t value) {
+  size_t bucket = 0;
+
+  while (bucket < ARRAY_SIZE(sl_histograms[histogram]) - 1 &&
+         value >= (1ull << bucket))
+    ++bucket;
+  atomic_fetch_add_explicit(&sl_histograms[histogram][bucket], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&sl_histogram_sums[histogram], value,
+                            memory_order_relaxed);
+}
+
+static void sl_metrics_add_sample(struct wl_array* samples,
+                                  const char* name,
+                                  const char* type,
+                                  const char* help,
+                                  const char* label_name,
+                                  const char* label_value,
+                                  uint64_t value) {
+  struct sl_metric_sample* sample = wl_array_add(samples, sizeof(*sample));
+
+  assert(sample);
+  sample->name = name;
+  sample->type = type;
+  sample->help = help;
+  sample->label_name = label_name;
+  snprintf(sample->label_value, sizeof(sample->label_value), "%s",
+           label_value ? label_value : "");
+  sample->value = value;
+}
+
+// Samples with the same name are added next to each other, as the formats
+// group them.
+static void sl_metrics_collect(struct sl_context* ctx,
+                               struct wl_array* samples) {
+  struct sl_host_surface* host_surface;
+  struct sl_window* window;
+  uint64_t windows = 0;
+  int i;
+
+  for (i = 0; i <= METRIC_LAST; ++i) {
+    const struct sl_metric_info* info = &sl_metric_infos[i];
+    const char* label_value = info->label_value;
+
+    if (info->label_name && !label_value)
+      label_value = sl_shm_driver_names[ctx->shm_driver];
+    sl_metrics_add_sample(
+        samples, info->name, info->type, info->help, info->label_name,
+        label_value,
+        atomic_load_explicit(&sl_metrics[i], memory_order_relaxed));
+  }
+
+  wl_list_for_each(host_surface, &ctx->host_surfaces, link) {
+    struct wl_client* client = wl_resource_get_client(host_surface->resource);
+    char label_value[32];
+    pid_t pid;
+
+    wl_client_get_credentials(client, &pid, NULL, NULL);
+    snprintf(label_value, sizeof(label_value), "%d/%u", pid,
+             wl_resource_get_id(host_surface->resource));
+    sl_metrics_add_sample(samples, "surface_commits_total", "counter",
+                          "Commits of each surface", "surface", label_value,
+                          host_surface->commits);
+  }
+
+  wl_list_for_each(window, &ctx->windows, link) {
+    ++windows;
+  }
+  sl_metrics_add_sample(samples, "x11_windows", "gauge", "Managed X11 windows",
+                        NULL, NULL, windows);
+  sl_metrics_add_sample(samples, "configures_total", "counter",
+                        "X11 configure requests not forwarded", "result",
+                        "merged", ctx->configures_merged);
+  sl_metrics_add_sample(samples, "configures_total", "counter",
+                        "X11 configure requests not forwarded", "result",
+                        "skipped", ctx->configures_skipped);
+  sl_metrics_add_sample(samples, "net_wm_state_writes_skipped_total",
+                        "counter", "Unchanged _NET_WM_STATE writes skipped",
+                        NULL, NULL, ctx->net_wm_state_writes_skipped);
+  sl_metrics_add_sample(samples, "selection_cache_bytes", "gauge",
+                        "Size of the cached selection payloads", NULL, NULL,
+                        ctx->selection_cache_size);
+  sl_metrics_add_sample(samples, "host_backlogs_total", "counter",
+                        "Flushes the host connection couldn't take", NULL,
+                        NULL, ctx->host_backlog_count);
+  sl_metrics_add_sample(samples, "host_backlog_bytes_total", "counter",
+                        "Bytes queued for the host at each backlog", NULL,
+                        NULL, ctx->host_backlog_bytes);
+  sl_metrics_add_sample(samples, "host_backlog_max_bytes", "gauge",
+                        "Largest backlog of bytes queued for the host", NULL,
+                        NULL, ctx->host_backlog_max_bytes);
+  sl_metrics_add_sample(samples, "host_queue_bytes", "gauge",
+                        "Bytes queued in the socket to the host", NULL, NULL,
+                        sl_host_bytes_queued(ctx));
+  sl_metrics_add_sample(samples, "keymaps_total", "counter",
+                        "Keymaps received from the host", "result", "compiled",
+                        ctx->keymaps_compiled);
+  sl_metrics_add_sample(samples, "keymaps_total", "counter",
+                        "Keymaps received from the host", "result", "cached",
+                        ctx->keymap_cache_hits);
+  sl_metrics_add_sample(samples, "motion_events_total", "counter",
+                        "Motion events from the host and to clients",
+                        "direction", "received", ctx->motion_events_received);
+  sl_metrics_add_sample(samples, "motion_events_total", "counter",
+                        "Motion events from the host and to clients",
+                        "direction", "sent", ctx->motion_events_sent);
+}
+
+static void sl_metrics_write_json_histogram(FILE* out,
+                                            const char* name,
+                                            const uint64_t* counts,
+                                            size_t num_counts) {
+  size_t i;
+
+  fprintf(out, "\"%s\": [", name);
+  for (i = 0; i < num_counts; ++i)
+    fprintf(out, "%s%" PRIu64, i ? ", " : "", counts[i]);
+  fprintf(out, "]");
+}
+
+static void sl_metrics_write_prometheus_histogram(FILE* out,
+                                                  const char* name,
+                                                  const char* help,
+                                                  const uint64_t* counts,
+                                                  size_t num_counts,
+                                                  uint64_t sum) {
+  uint64_t total = 0;
+  size_t i;
+
+  fprintf(out, "# HELP sommelier_%s %s\n", name, help);
+  fprintf(out, "# TYPE sommelier_%s histogram\n", name);
+  for (i = 0; i < num_counts; ++i) {
+    total += counts[i];
+    // Values are integers, so everything below 2^i is at most 2^i - 1.
+    if (i < num_counts - 1) {
+      fprintf(out, "sommelier_%s_bucket{le=\"%llu\"} %" PRIu64 "\n", name,
+              (1ull << i) - 1, total);
+    } else {
+      fprintf(out, "sommelier_%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name,
+              total);
+    }
+  }
+  fprintf(out, "sommelier_%s_sum %" PRIu64 "\n", name, sum);
+  fprintf(out, "sommelier_%s_count %" PRIu64 "\n", name, total);
+}
+
+// Writes all metrics to |out|. The JSON format has one member per metric,
+// an object keyed by label value for labeled ones. Histograms are arrays of
+// counts where bucket N counts values below 2^N and the last one the rest.
+void sl_metrics_write(struct sl_context* ctx, FILE* out, int format) {
+  struct wl_array samples;
+  struct sl_metric_sample* sample;
+  size_t num_samples;
+  uint64_t counts[HISTOGRAM_LAST + 1][ARRAY_SIZE(sl_histograms[0])];
+  size_t i, j;
+
+  wl_array_init(&samples);
+  sl_metrics_collect(ctx, &samples);
+  sample = samples.data;
+  num_samples = samples.size / sizeof(*sample);
+  for (i = 0; i <= HISTOGRAM_LAST; ++i) {
+    for (j = 0; j < ARRAY_SIZE(counts[i]); ++j) {
+      counts[i][j] =
+          atomic_load_explicit(&sl_histograms[i][j], memory_order_relaxed);
+    }
+  }
+
+  if (format == METRICS_FORMAT_PROMETHEUS) {
+    for (i = 0; i < num_samples; ++i) {
+      if (!i || strcmp(sample[i - 1].name, sample[i].name)) {
+        fprintf(out, "# HELP sommelier_%s %s\n", sample[i].name,
+                sample[i].help);
+        fprintf(out, "# TYPE sommelier_%s %s\n", sample[i].name,
+                sample[i].type);
+      }
+      if (sample[i].label_name) {
+        fprintf(out, "sommelier_%s{%s=\"%s\"} %" PRIu64 "\n", sample[i].name,
+                sample[i].label_name, sample[i].label_value, sample[i].value);
+      } else {
+        fprintf(out, "sommelier_%s %" PRIu64 "\n", sample[i].name,
+                sample[i].value);
+      }
+    }
+    for (i = 0; i <= HISTOGRAM_LAST; ++i) {
+      sl_metrics_write_prometheus_histogram(
+          out, sl_histogram_infos[i].name, sl_histogram_infos[i].help,
+          counts[i], ARRAY_SIZE(counts[i]),
+          atomic_load_explicit(&sl_histogram_sums[i], memory_order_relaxed));
+    }
+  } else {
+    fprintf(out, "{\"pid\": %d, \"metrics\": {", getpid());
+    for (i = 0; i < num_samples; ++i) {
+      int first = !i || strcmp(sample[i - 1].name, sample[i].name);
+      int last = i == num_samples - 1 ||
+                 strcmp(sample[i + 1].name, sample[i].name);
+
+      if (first) {
+        fprintf(out, "%s\"%s\": %s", i ? ", " : "", sample[i].name,
+                sample[i].label_name ? "{" : "");
+      } else {
+        fprintf(out, ", ");
+      }
+      if (sample[i].label_name)
+        fprintf(out, "\"%s\": ", sample[i].label_value);
+      fprintf(out, "%" PRIu64 "%s", sample[i].value,
+              last && sample[i].label_name ? "}" : "");
+    }
+    fprintf(out, "}, \"histograms\": {");
+    for (i = 0; i <= HISTOGRAM_LAST; ++i) {
+      if (i)
+        fprintf(out, ", ");
+      sl_metrics_write_json_histogram(out, sl_histogram_infos[i].name,
+                                      counts[i], ARRAY_SIZE(counts[i]));
+    }
+    fprintf(out, "}}\n");
+  }
+
+  wl_array_release(&samples);
+}
+
+static void sl_metrics_client_destroy(struct sl_metrics_client* client) {
+  wl_event_source_remove(client->event_source);
+  close(client->fd);
+  free(client->response);
+  free(client);
+}
+
+// A client sends a line with the format it wants, "prometheus" or "json",
+// and gets the metrics back before the connection is closed.
+static int sl_handle_metrics_client(int fd, uint32_t mask, void* data) {
+  struct sl_metrics_client* client = data;
+  ssize_t bytes;
+
+  if (mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR)) {
+    sl_metrics_client_destroy(client);
+    return 0;
+  }
+
+  if (!client->response) {
+    FILE* out;
+    int format = METRICS_FORMAT_JSON;
+
+    bytes = read(fd, client->request + client->request_size,
+                 sizeof(client->request) - client->request_size - 1);
+    if (bytes < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        return 0;
+      sl_metrics_client_destroy(client);
+      return 0;
+    }
+    client->request_size += bytes;
+    client->request[client->request_size] = '\0';
+    if (bytes && !strchr(client->request, '\n') &&
+        client->request_size < sizeof(client->request) - 1)
+      return 0;
+
+    if (strncmp(client->request, "prometheus", 10) == 0)
+      format = METRICS_FORMAT_PROMETHEUS;
+    out = open_memstream(&client->response, &client->response_size);
+    assert(out);
+    sl_metrics_write(client->ctx, out, format);
+    fclose(out);
+    wl_event_source_fd_update(client->event_source, WL_EVENT_WRITABLE);
+  }
+
+  while (client->response_offset < client->response_size) {
+    bytes = send(fd, client->response + client->response_offset,
+                 client->response_size - client->response_offset,
+                 MSG_NOSIGNAL);
+    if (bytes < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        return 0;
+      break;
+    }
+    client->response_offset += bytes;
+  }
+
+  sl_metrics_client_destroy(client);
+  return 0;
+}
+
+static int sl_handle_metrics_connection(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = data;
+  struct sl_metrics_client* client;
+  int client_fd;
+
+  client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (client_fd < 0)
+    return 0;
+
+  client = malloc(sizeof(*client));
+  assert(client);
+  client->ctx = ctx;
+  client->fd = client_fd;
+  client->request_size = 0;
+  client->response = NULL;
+  client->response_size = 0;
+  client->response_offset = 0;
+  client->event_source = wl_event_loop_add_fd(
+      wl_display_get_event_loop(ctx->host_display), client_fd,
+      WL_EVENT_READABLE, sl_handle_metrics_client, client);
+  return 0;
+}
+
+// Serves the metrics on a Unix socket at |path|. A stale socket left behind
+// at |path| is replaced. Returns -1 on failure.
+int sl_metrics_listen(struct sl_context* ctx,
+                      struct wl_event_loop* event_loop,
+                      const char* path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "error: metrics socket path too long: %s\n", path);
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    fprintf(stderr, "error: could not create metrics socket: %m\n");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 4) < 0) {
+    fprintf(stderr, "error: could not listen on %s: %m\n", path);
+    close(fd);
+    return -1;
+  }
+
+  wl_event_loop_add_fd(event_loop, fd, WL_EVENT_READABLE,
+                       sl_handle_metrics_connection, ctx);
+  return 0;
+}
@@ -0,0 +1,396 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <ffi.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wayland-client.h>
+
+// The protocol profiler sees three of the four directions. Requests from
+// clients and events sent to them go through the protocol logger, and the
+// request handlers and host event listeners are timed by installing a
+// dispatcher in place of the implementation. Sommelier is linked with
+// --wrap for wl_proxy_add_listener and wl_resource_set_implementation so
+// that happens without touching every call site. When the profiler is off
+// the wrappers only add a branch when an object is created.
+//
+// Requests sent to the host are marshalled by libwayland-client without any
+// hook, so they are not profiled.
+
+enum {
+  PROFILE_REQUEST,
+  PROFILE_EVENT,
+  PROFILE_HOST_EVENT,
+};
+
+static const char* sl_profile_directions[] = {"request", "event",
+                                              "host event"};
+
+// Same as WL_CLOSURE_MAX_ARGS.
+#define SL_PROFILE_MAX_ARGS 20
+
+struct sl_profile_entry {
+  const struct wl_message* message;
+  const char* interface;
+  int direction;
+  uint64_t count;
+  uint64_t time_ns;
+  uint64_t bytes;
+  // Call interface of the handler, prepared on first dispatch.
+  int has_cif;
+  ffi_cif cif;
+  ffi_type* types[2 + SL_PROFILE_MAX_ARGS];
+};
+
+static struct sl_profile_entry** sl_profile_entries;
+static size_t sl_profile_capacity;
+static size_t sl_profile_size;
+
+int __real_wl_proxy_add_listener(struct wl_proxy* proxy,
+                                 void (**implementation)(void),
+                                 void* data);
+
+void __real_wl_resource_set_implementation(struct wl_resource* resource,
+                                           const void* implementation,
+                                           void* data,
+                                           wl_resource_destroy_func_t destroy);
+
+static uint64_t sl_profile_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t sl_profile_hash(const struct wl_message* message,
+                              int direction) {
+  uintptr_t key = (uintptr_t)message ^ direction;
+
+  return (key ^ (key >> 7) ^ (key >> 17)) & (sl_profile_capacity - 1);
+}
+
+static void sl_profile_grow(void) {
+  struct sl_profile_entry** entries = sl_profile_entries;
+  size_t capacity = sl_profile_capacity;
+  size_t i;
+
+  sl_profile_capacity = capacity * 2;
+  sl_profile_entries =
+      calloc(sl_profile_capacity, sizeof(*sl_profile_entries));
+  assert(sl_profile_entries);
+  for (i = 0; i < capacity; ++i) {
+    size_t j;
+
+    if (!entries[i])
+      continue;
+    j = sl_profile_hash(entries[i]->message, entries[i]->direction);
+    while (sl_profile_entries[j])
+      j = (j + 1) & (sl_profile_capacity - 1);
+    sl_profile_entries[j] = entries[i];
+  }
+  free(entries);
+}
+
+// Entries are allocated one at a time as the call interfaces point into
+// them and must not move.
+static struct sl_profile_entry* sl_profile_entry(
+    const char* interface,
+    const struct wl_message* message,
+    int direction) {
+  struct sl_profile_entry* entry;
+  size_t i = sl_profile_hash(message, direction);
+
+  for (; sl_profile_entries[i]; i = (i + 1) & (sl_profile_capacity - 1)) {
+    entry = sl_profile_entries[i];
+    if (entry->message == message && entry->direction == direction)
+      return entry;
+  }
+
+  entry = calloc(1, sizeof(*entry));
+  assert(entry);
+  entry->message = message;
+  entry->interface = interface;
+  entry->direction = direction;
+  sl_profile_entries[i] = entry;
+
+  // Keep the table at most half full.
+  if (++sl_profile_size * 2 > sl_profile_capacity)
+    sl_profile_grow();
+
+  return entry;
+}
+
+// Size of the arguments on the wire. File descriptors travel out of band.
+static uint64_t sl_profile_argument_bytes(const struct wl_message* message,
+                                          const union wl_argument* args) {
+  const char* signature = message->signature;
+  uint64_t bytes = 0;
+  int i = 0;
+
+  for (; *signature; ++signature) {
+    switch (*signature) {
+      case 'i':
+      case 'u':
+      case 'f':
+      case 'o':
+      case 'n':
+        bytes += 4;
+        ++i;
+        break;
+      case 's':
+        bytes += 4;
+        if (args[i].s)
+          bytes += (strlen(args[i].s) + 1 + 3) & ~3;
+        ++i;
+        break;
+      case 'a':
+        bytes += 4;
+        if (args[i].a)
+          bytes += (args[i].a->size + 3) & ~3;
+        ++i;
+        break;
+      case 'h':
+        ++i;
+        break;
+    }
+  }
+
+  return bytes;
+}
+
+static void sl_profile_prepare(struct sl_profile_entry* entry, int server) {
+  const char* signature = entry->message->signature;
+  int n = 2;
+  ffi_status status;
+
+  entry->types[0] = &ffi_type_pointer;
+  entry->types[1] = &ffi_type_pointer;
+  for (; *signature; ++signature) {
+    switch (*signature) {
+      case 'i':
+      case 'f':
+      case 'h':
+        entry->types[n++] = &ffi_type_sint32;
+        break;
+      case 'u':
+        entry->types[n++] = &ffi_type_uint32;
+        break;
+      case 'n':
+        // New objects are created before a client listener is called.
+        entry->types[n++] = server ? &ffi_type_uint32 : &ffi_type_pointer;
+        break;
+      case 's':
+      case 'o':
+      case 'a':
+        entry->types[n++] = &ffi_type_pointer;
+        break;
+    }
+  }
+  assert(n <= ARRAY_SIZE(entry->types));
+
+  status = ffi_prep_cif(&entry->cif, FFI_DEFAULT_ABI, n, &ffi_type_void,
+                        entry->types);
+  assert(status == FFI_OK);
+  UNUSED(status);
+  entry->has_cif = 1;
+}
+
+static void sl_profile_invoke(struct sl_profile_entry* entry,
+                              void (*func)(void),
+                              void* data,
+                              void* target,
+                              union wl_argument* args,
+                              int server) {
+  const char* signature = entry->message->signature;
+  void* values[2 + SL_PROFILE_MAX_ARGS];
+  uint64_t start;
+  int n = 2;
+  int i = 0;
+
+  if (!entry->has_cif)
+    sl_profile_prepare(entry, server);
+
+  values[0] = &data;
+  values[1] = &target;
+  for (; *signature; ++signature) {
+    switch (*signature) {
+      case 'i':
+        values[n++] = &args[i++].i;
+        break;
+      case 'u':
+        values[n++] = &args[i++].u;
+        break;
+      case 'f':
+        values[n++] = &args[i++].f;
+        break;
+      case 'h':
+        values[n++] = &args[i++].h;
+        break;
+      case 'n':
+        values[n++] = server ? (void*)&args[i].n : (void*)&args[i].o;
+        ++i;
+        break;
+      case 's':
+        values[n++] = &args[i++].s;
+        break;
+      case 'o':
+        values[n++] = &args[i++].o;
+        break;
+      case 'a':
+        values[n++] = &args[i++].a;
+        break;
+    }
+  }
+
+  // Handlers can dispatch other messages, e.g. through a roundtrip, so the
+  // time includes theirs.
+  start = sl_profile_now();
+  ffi_call(&entry->cif, func, NULL, values);
+  entry->time_ns += sl_profile_now() - start;
+}
+
+static int sl_profile_dispatch_request(const void* implementation,
+                                       void* target,
+                                       uint32_t opcode,
+                                       const struct wl_message* message,
+                                       union wl_argument* args) {
+  struct wl_resource* resource = (struct wl_resource*)target;
+  void (*const* funcs)(void) = implementation;
+  struct sl_profile_entry* entry;
+
+  if (!funcs[opcode])
+    return 0;
+
+  // Counted by the protocol logger.
+  entry = sl_profile_entry(wl_resource_get_class(resource), message,
+                           PROFILE_REQUEST);
+  sl_profile_invoke(entry, funcs[opcode], wl_resource_get_client(resource),
+                    resource, args, 1);
+  return 0;
+}
+
+static int sl_profile_dispatch_host_event(const void* implementation,
+                                          void* target,
+                                          uint32_t opcode,
+                                          const struct wl_message* message,
+                                          union wl_argument* args) {
+  struct wl_proxy* proxy = (struct wl_proxy*)target;
+  void (*const* funcs)(void) = implementation;
+  struct sl_profile_entry* entry;
+
+  entry =
+      sl_profile_entry(wl_proxy_get_class(proxy), message, PROFILE_HOST_EVENT);
+  entry->count++;
+  entry->bytes += sl_profile_argument_bytes(message, args);
+  if (funcs[opcode]) {
+    sl_profile_invoke(entry, funcs[opcode], wl_proxy_get_user_data(proxy),
+                      proxy, args, 0);
+  }
+  return 0;
+}
+
+static void sl_profile_log(void* data,
+                           enum wl_protocol_logger_type type,
+                           const struct wl_protocol_logger_message* message) {
+  struct sl_profile_entry* entry = sl_profile_entry(
+      wl_resource_get_class(message->resource), message->message,
+      type == WL_PROTOCOL_LOGGER_REQUEST ? PROFILE_REQUEST : PROFILE_EVENT);
+
+  entry->count++;
+  entry->bytes +=
+      sl_profile_argument_bytes(message->message, message->arguments);
+}
+
+int __wrap_wl_proxy_add_listener(struct wl_proxy* proxy,
+                                 void (**implementation)(void),
+                                 void* data) {
+  if (!sl_profile_entries)
+    return __real_wl_proxy_add_listener(proxy, implementation, data);
+
+  return wl_proxy_add_dispatcher(proxy, sl_profile_dispatch_host_event,
+                                 implementation, data);
+}
+
+void __wrap_wl_resource_set_implementation(struct wl_resource* resource,
+                                           const void* implementation,
+                                           void* data,
+                                           wl_resource_destroy_func_t destroy) {
+  if (!sl_profile_entries || !implementation) {
+    __real_wl_resource_set_implementation(resource, implementation, data,
+                                          destroy);
+    return;
+  }
+
+  wl_resource_set_dispatcher(resource, sl_profile_dispatch_request,
+                             implementation, data, destroy);
+}
+
+static int sl_profile_compare(const void* a, const void* b) {
+  const struct sl_profile_entry* entry_a = *(struct sl_profile_entry**)a;
+  const struct sl_profile_entry* entry_b = *(struct sl_profile_entry**)b;
+
+  if (entry_a->time_ns != entry_b->time_ns)
+    return entry_a->time_ns < entry_b->time_ns ? 1 : -1;
+  if (entry_a->count != entry_b->count)
+    return entry_a->count < entry_b->count ? 1 : -1;
+  return 0;
+}
+
+static void sl_profile_print_at_exit(void) {
+  sl_profile_print(stderr);
+}
+
+void sl_profile_enable(struct wl_display* display) {
+  if (sl_profile_entries)
+    return;
+
+  sl_profile_capacity = 256;
+  sl_profile_entries =
+      calloc(sl_profile_capacity, sizeof(*sl_profile_entries));
+  assert(sl_profile_entries);
+
+  wl_display_add_protocol_logger(display, sl_profile_log, NULL);
+  atexit(sl_profile_print_at_exit);
+}
+
+void sl_profile_print(FILE* out) {
+  struct sl_profile_entry** entries;
+  size_t num_entries = 0;
+  size_t i;
+
+  if (!sl_profile_entries)
+    return;
+
+  entries = malloc(sl_profile_capacity * sizeof(*entries));
+  assert(entries);
+  for (i = 0; i < sl_profile_capacity; ++i) {
+    if (sl_profile_entries[i])
+      entries[num_entries++] = sl_profile_entries[i];
+  }
+  qsort(entries, num_entries, sizeof(*entries), sl_profile_compare);
+
+  fprintf(out, "%-10s %-48s %10s %12s %10s %12s\n", "direction", "message",
+          "count", "total ms", "avg us", "arg bytes");
+  for (i = 0; i < num_entries; ++i) {
+    struct sl_profile_entry* entry = entries[i];
+    char name[256];
+
+    snprintf(name, sizeof(name), "%s.%s", entry->interface,
+             entry->message->name);
+    fprintf(out, "%-10s %-48s %10" PRIu64 " %12.3f %10.1f %12" PRIu64 "\n",
+            sl_profile_directions[entry->direction], name, entry->count,
+            entry->time_ns / 1e6,
+            entry->count ? entry->time_ns / 1e3 / entry->count : 0.0,
+            entry->bytes);
+  }
+  fflush(out);
+  free(entries);
+}
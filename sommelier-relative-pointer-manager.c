@@ -25,8 +25,30 @@ struct sl_host_relative_pointer {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct zwp_relative_pointer_v1* proxy;
+  // Sum of the motion held back, sent with the time of the latest event.
+  struct sl_pending_motion pending_motion;
+  uint64_t utime;
+  wl_fixed_t dx;
+  wl_fixed_t dy;
+  wl_fixed_t dx_unaccel;
+  wl_fixed_t dy_unaccel;
 };
 
+static void sl_relative_pointer_flush_motion(
+    struct sl_pending_motion* motion) {
+  struct sl_host_relative_pointer* host;
+
+  host = wl_container_of(motion, host, pending_motion);
+  zwp_relative_pointer_v1_send_relative_motion(
+      host->resource, host->utime >> 32, host->utime & 0xffffffff, host->dx,
+      host->dy, host->dx_unaccel, host->dy_unaccel);
+  host->ctx->motion_events_sent++;
+  host->dx = 0;
+  host->dy = 0;
+  host->dx_unaccel = 0;
+  host->dy_unaccel = 0;
+}
+
 static void sl_relative_pointer_relative_motion(
     void* data,
     struct zwp_relative_pointer_v1* relative_pointer,
@@ -38,15 +60,31 @@ static void sl_relative_pointer_relative_motion(
     wl_fixed_t dy_unaccel) {
   struct sl_host_relative_pointer* host =
       zwp_relative_pointer_v1_get_user_data(relative_pointer);
+  uint64_t utime = ((uint64_t)utime_hi << 32) | utime_lo;
+
+  sl_record_input_delay(host->ctx, utime / 1000);
+  host->ctx->motion_events_received++;
+
+  if (host->ctx->coalesce_motion) {
+    host->utime = utime;
+    host->dx += dx;
+    host->dy += dy;
+    host->dx_unaccel += dx_unaccel;
+    host->dy_unaccel += dy_unaccel;
+    sl_defer_motion(host->ctx, &host->pending_motion, 1);
+    return;
+  }
 
   zwp_relative_pointer_v1_send_relative_motion(
       host->resource, utime_hi, utime_lo, dx, dy, dx_unaccel, dy_unaccel);
+  host->ctx->motion_events_sent++;
 }
 
 static void sl_destroy_host_relative_pointer(struct wl_resource* resource) {
   struct sl_host_relative_pointer* host = wl_resource_get_user_data(resource);
 
   zwp_relative_pointer_v1_destroy(host->proxy);
+  wl_list_remove(&host->pending_motion.link);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
@@ -96,6 +134,14 @@ static void sl_relative_pointer_manager_get_relative_pointer(
   assert(relative_pointer_host);
   relative_pointer_host->resource = relative_pointer_resource;
   relative_pointer_host->ctx = host->ctx;
+  wl_list_init(&relative_pointer_host->pending_motion.link);
+  relative_pointer_host->pending_motion.flush =
+      sl_relative_pointer_flush_motion;
+  relative_pointer_host->utime = 0;
+  relative_pointer_host->dx = 0;
+  relative_pointer_host->dy = 0;
+  relative_pointer_host->dx_unaccel = 0;
+  relative_pointer_host->dy_unaccel = 0;
   relative_pointer_host->proxy =
       zwp_relative_pointer_manager_v1_get_relative_pointer(
           host->ctx->relative_pointer_manager->internal, host_pointer->proxy);
@@ -27,15 +27,42 @@ struct sl_host_keyboard {
   xkb_mod_mask_t alt_mask;
   xkb_mod_mask_t shift_mask;
   uint32_t modifiers;
+  // Indexed by keycode, bit N is set if the key can trigger an accelerator
+  // with modifiers N. Other presses can't be reserved, whatever the state.
+  uint8_t* accelerator_keys;
+  xkb_keycode_t max_accelerator_key;
   struct wl_array pressed_keys;
 };
 
+// Hosts send the same keymap to every wl_keyboard and switch back and forth
+// between a few layouts, so each keymap is only compiled once.
+struct sl_keymap {
+  struct wl_list link;
+  uint64_t hash;
+  char* text;
+  size_t length;
+  struct xkb_keymap* keymap;
+};
+
+static const int sl_max_cached_keymaps = 8;
+
+struct sl_touch_motion {
+  int32_t id;
+  uint32_t time;
+  wl_fixed_t x;
+  wl_fixed_t y;
+};
+
 struct sl_host_touch {
   struct sl_seat* seat;
   struct wl_resource* resource;
   struct wl_touch* proxy;
   struct wl_resource* focus_resource;
   struct wl_listener focus_resource_listener;
+  struct sl_pending_motion pending_motion;
+  // Latest position of each moved touch point, struct sl_touch_motion.
+  struct wl_array motions;
+  int has_frame;
 };
 
 static void sl_host_pointer_set_cursor(struct wl_client* client,
@@ -125,6 +152,7 @@ static void sl_pointer_enter(void* data,
   if (!host_surface)
     return;
 
+  sl_flush_motion(host->seat->ctx);
   sl_pointer_set_focus(host, serial, host_surface, x, y);
 
   if (host->focus_resource)
@@ -138,18 +166,56 @@ static void sl_pointer_leave(void* data,
                              struct wl_surface* surface) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_flush_motion(host->seat->ctx);
   sl_pointer_set_focus(host, serial, NULL, 0, 0);
 }
 
+static void sl_pointer_send_motion(struct sl_host_pointer* host,
+                                   uint32_t time,
+                                   wl_fixed_t x,
+                                   wl_fixed_t y) {
+  double scale = host->seat->ctx->scale;
+
+  wl_pointer_send_motion(host->resource, time, x * scale, y * scale);
+  host->seat->ctx->motion_events_sent++;
+}
+
+static void sl_pointer_flush_motion(struct sl_pending_motion* motion) {
+  struct sl_host_pointer* host;
+
+  host = wl_container_of(motion, host, pending_motion);
+  if (host->has_motion) {
+    sl_pointer_send_motion(host, host->motion_time, host->motion_x,
+                           host->motion_y);
+    host->has_motion = 0;
+  }
+  if (host->has_frame) {
+    wl_pointer_send_frame(host->resource);
+    host->has_frame = 0;
+  }
+}
+
 static void sl_pointer_motion(void* data,
                               struct wl_pointer* pointer,
                               uint32_t time,
                               wl_fixed_t x,
                               wl_fixed_t y) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
-  double scale = host->seat->ctx->scale;
+  struct sl_context* ctx = host->seat->ctx;
 
-  wl_pointer_send_motion(host->resource, time, x * scale, y * scale);
+  sl_record_input_delay(ctx, time);
+  ctx->motion_events_received++;
+
+  if (ctx->coalesce_motion) {
+    host->has_motion = 1;
+    host->motion_time = time;
+    host->motion_x = x;
+    host->motion_y = y;
+    sl_defer_motion(ctx, &host->pending_motion, 0);
+    return;
+  }
+
+  sl_pointer_send_motion(host, time, x, y);
 }
 
 static void sl_pointer_button(void* data,
@@ -160,10 +226,15 @@ static void sl_pointer_button(void* data,
                               uint32_t state) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_record_input_delay(host->seat->ctx, time);
+  sl_flush_motion(host->seat->ctx);
   wl_pointer_send_button(host->resource, serial, time, button, state);
 
-  if (host->focus_resource)
+  if (host->focus_resource) {
+    if (state == WL_POINTER_BUTTON_STATE_PRESSED)
+      sl_latency_input(host->seat->ctx, host->focus_resource);
     sl_set_last_event_serial(host->focus_resource, serial);
+  }
   host->seat->last_serial = serial;
 }
 
@@ -175,11 +246,22 @@ static void sl_pointer_axis(void* data,
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
   double scale = host->seat->ctx->scale;
 
+  sl_flush_motion(host->seat->ctx);
   wl_pointer_send_axis(host->resource, time, axis, value * scale);
 }
 
 static void sl_pointer_frame(void* data, struct wl_pointer* pointer) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
+  struct sl_context* ctx = host->seat->ctx;
+
+  // A frame with nothing but motion is held back with its motion, so it
+  // can be merged with the frames that follow. That includes relative
+  // motion, which is deferred without any pointer motion.
+  if (host->has_motion || !wl_list_empty(&ctx->pending_motion)) {
+    host->has_frame = 1;
+    sl_defer_motion(ctx, &host->pending_motion, 0);
+    return;
+  }
 
   wl_pointer_send_frame(host->resource);
 }
@@ -189,6 +271,7 @@ void sl_pointer_axis_source(void* data,
                             uint32_t axis_source) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_flush_motion(host->seat->ctx);
   wl_pointer_send_axis_source(host->resource, axis_source);
 }
 
@@ -198,6 +281,7 @@ static void sl_pointer_axis_stop(void* data,
                                  uint32_t axis) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_flush_motion(host->seat->ctx);
   wl_pointer_send_axis_stop(host->resource, time, axis);
 }
 
@@ -207,6 +291,7 @@ static void sl_pointer_axis_discrete(void* data,
                                      int32_t discrete) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_flush_motion(host->seat->ctx);
   wl_pointer_send_axis_discrete(host->resource, axis, discrete);
 }
 
@@ -223,6 +308,126 @@ static void sl_host_keyboard_release(struct wl_client* client,
 static const struct wl_keyboard_interface sl_keyboard_implementation = {
     sl_host_keyboard_release};
 
+static uint64_t sl_keymap_hash(const char* text, size_t length) {
+  uint64_t hash = 14695981039346656037ull;  // FNV-1a
+  size_t i;
+
+  for (i = 0; i < length; ++i) {
+    hash ^= (uint8_t)text[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static void sl_keymap_destroy(struct sl_keymap* keymap) {
+  wl_list_remove(&keymap->link);
+  xkb_keymap_unref(keymap->keymap);
+  free(keymap->text);
+  free(keymap);
+}
+
+// Returns a reference to the compiled keymap for |text|, compiling it only
+// if it is not in the cache already.
+static struct xkb_keymap* sl_keymap_get(struct sl_context* ctx,
+                                        const char* text,
+                                        size_t length) {
+  uint64_t hash = sl_keymap_hash(text, length);
+  struct sl_keymap* keymap;
+  int count = 0;
+
+  wl_list_for_each(keymap, &ctx->keymaps, link) {
+    if (keymap->hash == hash && keymap->length == length &&
+        memcmp(keymap->text, text, length) == 0) {
+      wl_list_remove(&keymap->link);
+      wl_list_insert(&ctx->keymaps, &keymap->link);
+      ctx->keymap_cache_hits++;
+      return xkb_keymap_ref(keymap->keymap);
+    }
+    ++count;
+  }
+
+  if (count >= sl_max_cached_keymaps) {
+    keymap = wl_container_of(ctx->keymaps.prev, keymap, link);
+    sl_keymap_destroy(keymap);
+  }
+
+  keymap = malloc(sizeof(*keymap));
+  assert(keymap);
+  keymap->hash = hash;
+  keymap->text = malloc(length);
+  assert(keymap->text);
+  memcpy(keymap->text, text, length);
+  keymap->length = length;
+  keymap->keymap = xkb_keymap_new_from_buffer(
+      sl_get_xkb_context(ctx), text, length, XKB_KEYMAP_FORMAT_TEXT_V1, 0);
+  assert(keymap->keymap);
+  wl_list_insert(&ctx->keymaps, &keymap->link);
+  ctx->keymaps_compiled++;
+
+  return xkb_keymap_ref(keymap->keymap);
+}
+
+// Returns the modifiers, as bit N for modifiers N, of the accelerators that
+// the key can trigger in some layout and level.
+static uint8_t sl_keyboard_key_accelerators(struct sl_host_keyboard* host,
+                                            xkb_keycode_t code) {
+  xkb_layout_index_t num_layouts =
+      xkb_keymap_num_layouts_for_key(host->keymap, code);
+  xkb_layout_index_t layout;
+  uint8_t modifiers = 0;
+
+  for (layout = 0; layout < num_layouts; ++layout) {
+    xkb_level_index_t num_levels =
+        xkb_keymap_num_levels_for_key(host->keymap, code, layout);
+    xkb_level_index_t level;
+
+    for (level = 0; level < num_levels; ++level) {
+      const xkb_keysym_t* symbols;
+      struct sl_accelerator* accelerator;
+
+      // Only single symbol keys are matched against accelerators.
+      if (xkb_keymap_key_get_syms_by_level(host->keymap, code, layout, level,
+                                           &symbols) != 1)
+        continue;
+
+      wl_list_for_each(accelerator, &host->seat->ctx->accelerators, link) {
+        if (symbols[0] == accelerator->symbol)
+          modifiers |= 1 << accelerator->modifiers;
+      }
+    }
+  }
+  return modifiers;
+}
+
+// Works out which key and modifier combinations can trigger an accelerator,
+// so presses that can't be reserved are forwarded without looking at the
+// state or the accelerator list.
+static void sl_keyboard_update_accelerators(struct sl_host_keyboard* host) {
+  xkb_keycode_t code;
+
+  free(host->accelerator_keys);
+  host->accelerator_keys = NULL;
+  host->max_accelerator_key = 0;
+
+  if (wl_list_empty(&host->seat->ctx->accelerators))
+    return;
+
+  host->max_accelerator_key = xkb_keymap_max_keycode(host->keymap);
+  host->accelerator_keys = calloc(host->max_accelerator_key + 1, 1);
+  assert(host->accelerator_keys);
+  for (code = xkb_keymap_min_keycode(host->keymap);
+       code <= host->max_accelerator_key; ++code) {
+    host->accelerator_keys[code] = sl_keyboard_key_accelerators(host, code);
+  }
+}
+
+static int sl_keyboard_may_be_accelerator(struct sl_host_keyboard* host,
+                                          xkb_keycode_t code) {
+  if (!host->accelerator_keys || code > host->max_accelerator_key)
+    return 0;
+  return host->accelerator_keys[code] & (1 << host->modifiers);
+}
+
 static void sl_keyboard_keymap(void* data,
                                struct wl_keyboard* keyboard,
                                uint32_t format,
@@ -240,9 +445,8 @@ static void sl_keyboard_keymap(void* data,
     if (host->keymap)
       xkb_keymap_unref(host->keymap);
 
-    host->keymap = xkb_keymap_new_from_string(
-        host->seat->ctx->xkb_context, data, XKB_KEYMAP_FORMAT_TEXT_V1, 0);
-    assert(host->keymap);
+    // The keymap is a string, but the host might not count the terminator.
+    host->keymap = sl_keymap_get(host->seat->ctx, data, strnlen(data, size));
 
     munmap(data, size);
 
@@ -254,6 +458,8 @@ static void sl_keyboard_keymap(void* data,
     host->control_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Control");
     host->alt_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Mod1");
     host->shift_mask = 1 << xkb_keymap_mod_get_index(host->keymap, "Shift");
+
+    sl_keyboard_update_accelerators(host);
   }
 
   close(fd);
@@ -352,12 +558,16 @@ static void sl_keyboard_key(void* data,
   struct sl_host_keyboard* host = wl_keyboard_get_user_data(keyboard);
   int handled = 1;
 
+  sl_record_input_delay(host->seat->ctx, time);
+  sl_flush_motion(host->seat->ctx);
+
   if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
-    if (host->state) {
+    uint32_t code = key + 8;
+
+    if (host->state && sl_keyboard_may_be_accelerator(host, code)) {
       const xkb_keysym_t* symbols;
       uint32_t num_symbols;
       xkb_keysym_t symbol = XKB_KEY_NoSymbol;
-      uint32_t code = key + 8;
       struct sl_accelerator* accelerator;
 
       num_symbols = xkb_state_key_get_syms(host->state, code, &symbols);
@@ -388,8 +598,11 @@ static void sl_keyboard_key(void* data,
       wl_keyboard_send_key(host->resource, serial, time, key, state);
   }
 
-  if (host->focus_resource)
+  if (host->focus_resource) {
+    if (handled && state == WL_KEYBOARD_KEY_STATE_PRESSED)
+      sl_latency_input(host->seat->ctx, host->focus_resource);
     sl_set_last_event_serial(host->focus_resource, serial);
+  }
   host->seat->last_serial = serial;
 
   if (host->extended_keyboard_proxy) {
@@ -410,6 +623,7 @@ static void sl_keyboard_modifiers(void* data,
   struct sl_host_keyboard* host = wl_keyboard_get_user_data(keyboard);
   xkb_mod_mask_t mask;
 
+  sl_flush_motion(host->seat->ctx);
   wl_keyboard_send_modifiers(host->resource, serial, mods_depressed,
                              mods_latched, mods_locked, group);
 
@@ -470,6 +684,9 @@ static void sl_host_touch_down(void* data,
   if (!host_surface)
     return;
 
+  sl_record_input_delay(host->seat->ctx, time);
+  sl_flush_motion(host->seat->ctx);
+
   if (host_surface->resource != host->focus_resource) {
     wl_list_remove(&host->focus_resource_listener.link);
     wl_list_init(&host->focus_resource_listener.link);
@@ -500,6 +717,8 @@ static void sl_host_touch_up(void* data,
                              int32_t id) {
   struct sl_host_touch* host = wl_touch_get_user_data(touch);
 
+  sl_flush_motion(host->seat->ctx);
+
   wl_list_remove(&host->focus_resource_listener.link);
   wl_list_init(&host->focus_resource_listener.link);
   host->focus_resource = NULL;
@@ -511,6 +730,33 @@ static void sl_host_touch_up(void* data,
   host->seat->last_serial = serial;
 }
 
+static void sl_host_touch_send_motion(struct sl_host_touch* host,
+                                      uint32_t time,
+                                      int32_t id,
+                                      wl_fixed_t x,
+                                      wl_fixed_t y) {
+  double scale = host->seat->ctx->scale;
+
+  wl_touch_send_motion(host->resource, time, id, x * scale, y * scale);
+  host->seat->ctx->motion_events_sent++;
+}
+
+static void sl_host_touch_flush_motion(struct sl_pending_motion* motion) {
+  struct sl_host_touch* host;
+  struct sl_touch_motion* touch_motion;
+
+  host = wl_container_of(motion, host, pending_motion);
+  wl_array_for_each(touch_motion, &host->motions) {
+    sl_host_touch_send_motion(host, touch_motion->time, touch_motion->id,
+                              touch_motion->x, touch_motion->y);
+  }
+  host->motions.size = 0;
+  if (host->has_frame) {
+    wl_touch_send_frame(host->resource);
+    host->has_frame = 0;
+  }
+}
+
 static void sl_host_touch_motion(void* data,
                                  struct wl_touch* touch,
                                  uint32_t time,
@@ -518,20 +764,55 @@ static void sl_host_touch_motion(void* data,
                                  wl_fixed_t x,
                                  wl_fixed_t y) {
   struct sl_host_touch* host = wl_touch_get_user_data(touch);
-  double scale = host->seat->ctx->scale;
+  struct sl_context* ctx = host->seat->ctx;
+  struct sl_touch_motion* touch_motion;
 
-  wl_touch_send_motion(host->resource, time, id, x * scale, y * scale);
+  sl_record_input_delay(ctx, time);
+  ctx->motion_events_received++;
+
+  if (!ctx->coalesce_motion) {
+    sl_host_touch_send_motion(host, time, id, x, y);
+    return;
+  }
+
+  // Only the latest position of each touch point is kept.
+  wl_array_for_each(touch_motion, &host->motions) {
+    if (touch_motion->id == id)
+      break;
+  }
+  if ((char*)touch_motion >= (char*)host->motions.data + host->motions.size) {
+    touch_motion = wl_array_add(&host->motions, sizeof(*touch_motion));
+    assert(touch_motion);
+    touch_motion->id = id;
+  }
+  touch_motion->time = time;
+  touch_motion->x = x;
+  touch_motion->y = y;
+  sl_defer_motion(ctx, &host->pending_motion, 0);
 }
 
 static void sl_host_touch_frame(void* data, struct wl_touch* touch) {
   struct sl_host_touch* host = wl_touch_get_user_data(touch);
 
+  // A frame with nothing but motion is held back with its motion.
+  if (host->motions.size) {
+    host->has_frame = 1;
+    return;
+  }
+
   wl_touch_send_frame(host->resource);
 }
 
 static void sl_host_touch_cancel(void* data, struct wl_touch* touch) {
   struct sl_host_touch* host = wl_touch_get_user_data(touch);
 
+  // Motion of cancelled touch points is of no use to the client.
+  wl_list_remove(&host->pending_motion.link);
+  wl_list_init(&host->pending_motion.link);
+  host->motions.size = 0;
+  host->has_frame = 0;
+
+  sl_flush_motion(host->seat->ctx);
   wl_touch_send_cancel(host->resource);
 }
 
@@ -548,6 +829,7 @@ static void sl_destroy_host_pointer(struct wl_resource* resource) {
     wl_pointer_destroy(host->proxy);
   }
   wl_list_remove(&host->focus_resource_listener.link);
+  wl_list_remove(&host->pending_motion.link);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
@@ -584,6 +866,13 @@ static void sl_host_seat_get_host_pointer(struct wl_client* client,
       sl_pointer_focus_resource_destroyed;
   host_pointer->focus_resource = NULL;
   host_pointer->focus_serial = 0;
+  wl_list_init(&host_pointer->pending_motion.link);
+  host_pointer->pending_motion.flush = sl_pointer_flush_motion;
+  host_pointer->has_motion = 0;
+  host_pointer->motion_time = 0;
+  host_pointer->motion_x = 0;
+  host_pointer->motion_y = 0;
+  host_pointer->has_frame = 0;
 }
 
 static void sl_destroy_host_keyboard(struct wl_resource* resource) {
@@ -597,6 +886,7 @@ static void sl_destroy_host_keyboard(struct wl_resource* resource) {
     xkb_keymap_unref(host->keymap);
   if (host->state)
     xkb_state_unref(host->state);
+  free(host->accelerator_keys);
 
   if (wl_keyboard_get_version(host->proxy) >=
       WL_KEYBOARD_RELEASE_SINCE_VERSION) {
@@ -650,6 +940,8 @@ static void sl_host_seat_get_host_keyboard(struct wl_client* client,
   host_keyboard->alt_mask = 0;
   host_keyboard->shift_mask = 0;
   host_keyboard->modifiers = 0;
+  host_keyboard->accelerator_keys = NULL;
+  host_keyboard->max_accelerator_key = 0;
   wl_array_init(&host_keyboard->pressed_keys);
 
   if (host->seat->ctx->keyboard_extension) {
@@ -670,6 +962,8 @@ static void sl_destroy_host_touch(struct wl_resource* resource) {
   } else {
     wl_touch_destroy(host->proxy);
   }
+  wl_list_remove(&host->pending_motion.link);
+  wl_array_release(&host->motions);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
@@ -705,6 +999,10 @@ static void sl_host_seat_get_host_touch(struct wl_client* client,
   host_touch->focus_resource_listener.notify =
       sl_touch_focus_resource_destroyed;
   host_touch->focus_resource = NULL;
+  wl_list_init(&host_touch->pending_motion.link);
+  host_touch->pending_motion.flush = sl_host_touch_flush_motion;
+  wl_array_init(&host_touch->motions);
+  host_touch->has_frame = 0;
 }
 
 static void sl_host_seat_release(struct wl_client* client,
@@ -280,8 +280,8 @@ static void sl_text_input_manager_create_text_input(
 
   text_input_host->resource = text_input_resource;
   text_input_host->ctx = host->ctx;
-  text_input_host->proxy = zwp_text_input_manager_v1_create_text_input(
-      host->ctx->text_input_manager->internal);
+  text_input_host->proxy =
+      zwp_text_input_manager_v1_create_text_input(host->proxy);
   wl_resource_set_implementation(text_input_resource,
                                  &sl_text_input_implementation, text_input_host,
                                  sl_destroy_host_text_input);
@@ -0,0 +1,123 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Frame traces are written in the Chrome JSON array format, one event per
+// line. The closing bracket is optional in that format, so a trace stays
+// readable when sommelier is killed, and peers that share a file append to
+// it with single writes.
+static const char* sl_frame_trace_markers[] = {
+    "/sys/kernel/tracing/trace_marker",
+    "/sys/kernel/debug/tracing/trace_marker",
+};
+
+static const char sl_frame_flow_phases[] = {
+    [FRAME_FLOW_START] = 's',
+    [FRAME_FLOW_STEP] = 't',
+    [FRAME_FLOW_END] = 'f',
+};
+
+static uint64_t sl_frame_trace_now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+int sl_frame_trace_open(struct sl_context* ctx, const char* path, int marker) {
+  struct stat st;
+  size_t i;
+
+  if (path) {
+    ctx->frame_trace_fd =
+        open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+             S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (ctx->frame_trace_fd == -1) {
+      fprintf(stderr, "error: could not open %s (%s)\n", path,
+              strerror(errno));
+      return -1;
+    }
+    if (!fstat(ctx->frame_trace_fd, &st) && !st.st_size)
+      dprintf(ctx->frame_trace_fd, "[\n");
+  }
+
+  if (marker) {
+    for (i = 0; i < ARRAY_SIZE(sl_frame_trace_markers); ++i) {
+      ctx->trace_marker_fd =
+          open(sl_frame_trace_markers[i], O_WRONLY | O_CLOEXEC);
+      if (ctx->trace_marker_fd != -1)
+        break;
+    }
+    if (ctx->trace_marker_fd == -1)
+      fprintf(stderr, "warning: could not open trace_marker (%s)\n",
+              strerror(errno));
+  }
+
+  return 0;
+}
+
+uint64_t sl_frame_trace_begin(struct sl_context* ctx, const char* name) {
+  if (ctx->frame_trace_fd == -1 && ctx->trace_marker_fd == -1)
+    return 0;
+
+  if (ctx->trace_marker_fd != -1)
+    dprintf(ctx->trace_marker_fd, "B|%d|%s", getpid(), name);
+
+  return sl_frame_trace_now_us();
+}
+
+void sl_frame_trace_end(struct sl_context* ctx,
+                        const char* name,
+                        uint64_t start,
+                        uint32_t surface_id,
+                        uint64_t flow,
+                        int flow_phase) {
+  char event[512];
+  int pid = getpid();
+  int length;
+
+  if (!start)
+    return;
+
+  if (ctx->trace_marker_fd != -1)
+    dprintf(ctx->trace_marker_fd, "E|%d", pid);
+
+  if (ctx->frame_trace_fd == -1)
+    return;
+
+  length = snprintf(event, sizeof(event),
+                    "{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\","
+                    "\"ts\":%" PRIu64 ",\"dur\":%" PRIu64
+                    ",\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"surface\":%u,\"frame\":%" PRIu64 "}},\n",
+                    name, start, sl_frame_trace_now_us() - start, pid, pid,
+                    surface_id, flow);
+
+  // Flow events bind to the span that encloses their timestamp, which is
+  // this one. Flow ids count up in each process, so they are scoped to the
+  // process to keep peers sharing the file from joining each other's flows.
+  if (flow && flow_phase != FRAME_FLOW_NONE) {
+    length += snprintf(event + length, sizeof(event) - length,
+                       "{\"name\":\"frame\",\"cat\":\"frame\",\"ph\":\"%c\","
+                       "\"id2\":{\"local\":\"0x%" PRIx64 "\"},\"ts\":%" PRIu64
+                       ",\"pid\":%d,\"tid\":%d,\"bp\":\"e\"},\n",
+                       sl_frame_flow_phases[flow_phase], flow, start, pid, pid);
+  }
+
+  // A single write keeps events from peers sharing the file intact.
+  if (write(ctx->frame_trace_fd, event, length) != length) {
+    close(ctx->frame_trace_fd);
+    ctx->frame_trace_fd = -1;
+  }
+}
@@ -0,0 +1,398 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/virtwl.h>
+
+// Size of a virtwl transaction including the ioctl header.
+#define SL_VIRTWL_TXN_SIZE 4096
+
+// Poll timeout used while the host refuses a transaction. The virtwl driver
+// doesn't report POLLOUT on a context, so there is nothing to wait for.
+static const int sl_virtwl_retry_timeout_ms = 1;
+
+// Tracks Wayland message boundaries in a byte stream so that we can report
+// how many messages each transaction carried.
+struct sl_virtwl_message_counter {
+  uint8_t header[8];
+  size_t header_size;
+  size_t remaining;
+};
+
+struct sl_virtwl_forwarder {
+  int ctx_fd;
+  int socket_fd;
+  pthread_t thread;
+
+  // Transaction received from the host that has not been fully written to
+  // the socket yet.
+  union {
+    struct virtwl_ioctl_txn txn;
+    uint8_t buffer[SL_VIRTWL_TXN_SIZE];
+  } recv;
+  int recv_pending;
+  size_t recv_offset;
+  int recv_fd_count;
+  uint64_t recv_time;
+  struct sl_virtwl_message_counter recv_counter;
+
+  // Transaction collected from the socket that the host has not accepted
+  // yet.
+  union {
+    struct virtwl_ioctl_txn txn;
+    uint8_t buffer[SL_VIRTWL_TXN_SIZE];
+  } send;
+  int send_pending;
+  int send_fd_count;
+  uint64_t send_messages;
+  uint64_t send_time;
+  struct sl_virtwl_message_counter send_counter;
+};
+
+static const size_t sl_virtwl_max_data_size =
+    SL_VIRTWL_TXN_SIZE - sizeof(struct virtwl_ioctl_txn);
+
+// Returns the number of messages that start within |data|.
+static uint64_t sl_virtwl_count_messages(
+    struct sl_virtwl_message_counter* counter, const uint8_t* data,
+    size_t size) {
+  uint64_t count = 0;
+
+  while (size) {
+    size_t n;
+
+    if (counter->remaining) {
+      n = MIN(counter->remaining, size);
+      counter->remaining -= n;
+    } else {
+      uint32_t opcode_size;
+
+      n = MIN(sizeof(counter->header) - counter->header_size, size);
+      memcpy(counter->header + counter->header_size, data, n);
+      counter->header_size += n;
+      if (counter->header_size == sizeof(counter->header)) {
+        memcpy(&opcode_size, counter->header + 4, sizeof(opcode_size));
+        // A bogus size would throw off every later count, so never let a
+        // message be shorter than its header.
+        counter->remaining =
+            MAX(opcode_size >> 16, sizeof(counter->header)) -
+            sizeof(counter->header);
+        counter->header_size = 0;
+        ++count;
+      }
+    }
+    data += n;
+    size -= n;
+  }
+
+  return count;
+}
+
+// Writes as much of the pending host transaction to the socket as it will
+// take. Returns 0 when the transaction is complete, 1 if the socket is full
+// and -1 on error.
+static int sl_virtwl_flush_recv(struct sl_virtwl_forwarder* forwarder) {
+  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+  struct msghdr msg = {0};
+  struct iovec buffer_iov;
+  ssize_t bytes;
+
+  buffer_iov.iov_base = forwarder->recv.txn.data + forwarder->recv_offset;
+  buffer_iov.iov_len = forwarder->recv.txn.len - forwarder->recv_offset;
+
+  msg.msg_iov = &buffer_iov;
+  msg.msg_iovlen = 1;
+
+  // FDs go out with the first chunk that makes it into the socket.
+  if (!forwarder->recv_offset && forwarder->recv_fd_count) {
+    struct cmsghdr* cmsg;
+
+    msg.msg_control = fd_buffer;
+    msg.msg_controllen = sizeof(fd_buffer);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(forwarder->recv_fd_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), forwarder->recv.txn.fds,
+           forwarder->recv_fd_count * sizeof(int));
+    msg.msg_controllen = cmsg->cmsg_len;
+  }
+
+  bytes = sendmsg(forwarder->socket_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (bytes < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return 1;
+    fprintf(stderr, "error: virtwl socket write failed: %s\n",
+            strerror(errno));
+    return -1;
+  }
+
+  forwarder->recv_offset += bytes;
+  if (forwarder->recv_offset < forwarder->recv.txn.len) {
+    sl_metric_add(METRIC_VIRTWL_PARTIAL_WRITES, 1);
+    return 1;
+  }
+
+  while (forwarder->recv_fd_count--)
+    close(forwarder->recv.txn.fds[forwarder->recv_fd_count]);
+  forwarder->recv_fd_count = 0;
+  forwarder->recv_pending = 0;
+
+  sl_metric_observe(HISTOGRAM_VIRTWL_HOST_LATENCY,
+                    (sl_monotonic_time_ns() - forwarder->recv_time) / 1000);
+
+  return 0;
+}
+
+// Moves host transactions to the socket until the host has nothing more to
+// give or the socket is full. Returns -1 on error.
+static int sl_virtwl_forward_host(struct sl_virtwl_forwarder* forwarder) {
+  for (;;) {
+    uint64_t messages;
+    int rv;
+
+    if (forwarder->recv_pending) {
+      rv = sl_virtwl_flush_recv(forwarder);
+      if (rv)
+        return rv < 0 ? -1 : 0;
+    }
+
+    forwarder->recv.txn.len = sl_virtwl_max_data_size;
+    rv = ioctl(forwarder->ctx_fd, VIRTWL_IOCTL_RECV, &forwarder->recv.txn);
+    if (rv) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return 0;
+      return -1;
+    }
+
+    forwarder->recv_time = sl_monotonic_time_ns();
+    forwarder->recv_offset = 0;
+    forwarder->recv_pending = 1;
+
+    // Count how many FDs the kernel gave us.
+    for (forwarder->recv_fd_count = 0;
+         forwarder->recv_fd_count < VIRTWL_SEND_MAX_ALLOCS;
+         forwarder->recv_fd_count++) {
+      if (forwarder->recv.txn.fds[forwarder->recv_fd_count] < 0)
+        break;
+    }
+
+    messages = sl_virtwl_count_messages(
+        &forwarder->recv_counter, forwarder->recv.txn.data,
+        forwarder->recv.txn.len);
+
+    sl_metric_add(METRIC_VIRTWL_HOST_TRANSACTIONS, 1);
+    sl_metric_add(METRIC_VIRTWL_HOST_MESSAGES, messages);
+  }
+}
+
+// Passes the collected client data to the host. Returns 0 when the
+// transaction was accepted, 1 if the host asked us to retry and -1 on error.
+static int sl_virtwl_flush_send(struct sl_virtwl_forwarder* forwarder) {
+  int rv;
+  int i;
+
+  for (i = forwarder->send_fd_count; i < VIRTWL_SEND_MAX_ALLOCS; ++i)
+    forwarder->send.txn.fds[i] = -1;
+
+  rv = ioctl(forwarder->ctx_fd, VIRTWL_IOCTL_SEND, &forwarder->send.txn);
+  if (rv) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      sl_metric_add(METRIC_VIRTWL_HOST_RETRIES, 1);
+      return 1;
+    }
+    fprintf(stderr, "error: virtwl send failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  while (forwarder->send_fd_count--)
+    close(forwarder->send.txn.fds[forwarder->send_fd_count]);
+  forwarder->send_fd_count = 0;
+  forwarder->send_pending = 0;
+
+  sl_metric_add(METRIC_VIRTWL_CLIENT_TRANSACTIONS, 1);
+  sl_metric_add(METRIC_VIRTWL_CLIENT_MESSAGES, forwarder->send_messages);
+  sl_metric_observe(HISTOGRAM_VIRTWL_CLIENT_LATENCY,
+                    (sl_monotonic_time_ns() - forwarder->send_time) / 1000);
+
+  return 0;
+}
+
+// Collects everything the client has written, packing as many reads as fit
+// into each transaction. Returns -1 on error or when the client went away.
+static int sl_virtwl_forward_client(struct sl_virtwl_forwarder* forwarder) {
+  for (;;) {
+    int rv;
+
+    if (forwarder->send_pending) {
+      rv = sl_virtwl_flush_send(forwarder);
+      if (rv)
+        return rv < 0 ? -1 : 0;
+    }
+
+    forwarder->send.txn.len = 0;
+    forwarder->send_messages = 0;
+
+    // Stop packing once FDs have been received as the transaction can't
+    // carry more than VIRTWL_SEND_MAX_ALLOCS of them.
+    while (forwarder->send.txn.len < sl_virtwl_max_data_size &&
+           !forwarder->send_fd_count) {
+      char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+      struct iovec buffer_iov;
+      struct msghdr msg = {0};
+      struct cmsghdr* cmsg;
+      ssize_t bytes;
+
+      buffer_iov.iov_base = forwarder->send.txn.data + forwarder->send.txn.len;
+      buffer_iov.iov_len = sl_virtwl_max_data_size - forwarder->send.txn.len;
+
+      msg.msg_iov = &buffer_iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = fd_buffer;
+      msg.msg_controllen = sizeof(fd_buffer);
+
+      bytes = recvmsg(forwarder->socket_fd, &msg, MSG_DONTWAIT);
+      if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+          break;
+        return -1;
+      }
+      if (!bytes && !msg.msg_controllen) {
+        if (forwarder->send.txn.len)
+          break;
+        return -1;
+      }
+
+      if (!forwarder->send.txn.len)
+        forwarder->send_time = sl_monotonic_time_ns();
+
+      // If there were any FDs recv'd by recvmsg, there will be some data in
+      // the msg_control buffer. To get the FDs out we iterate all cmsghdr's
+      // within and unpack the FDs if the cmsghdr type is SCM_RIGHTS.
+      for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
+           cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        size_t cmsg_fd_count;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+          continue;
+
+        cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        // send_fd_count will never exceed VIRTWL_SEND_MAX_ALLOCS because the
+        // control message buffer only allocates enough space for that many
+        // FDs.
+        memcpy(&forwarder->send.txn.fds[forwarder->send_fd_count],
+               CMSG_DATA(cmsg), cmsg_fd_count * sizeof(int));
+        forwarder->send_fd_count += cmsg_fd_count;
+      }
+
+      forwarder->send_messages += sl_virtwl_count_messages(
+          &forwarder->send_counter,
+          forwarder->send.txn.data + forwarder->send.txn.len, bytes);
+      forwarder->send.txn.len += bytes;
+    }
+
+    if (!forwarder->send.txn.len && !forwarder->send_fd_count)
+      return 0;
+
+    forwarder->send_pending = 1;
+  }
+}
+
+static void* sl_virtwl_forwarder_thread(void* data) {
+  struct sl_virtwl_forwarder* forwarder = (struct sl_virtwl_forwarder*)data;
+
+  for (;;) {
+    struct pollfd fds[2];
+    int rv;
+
+    // Don't accept more from either side while the other one is full. That
+    // leaves the back-pressure to the kernel buffers of the producer.
+    fds[0].fd = forwarder->ctx_fd;
+    fds[0].events = forwarder->recv_pending ? 0 : POLLIN;
+    fds[1].fd = forwarder->socket_fd;
+    fds[1].events = (forwarder->send_pending ? 0 : POLLIN) |
+                    (forwarder->recv_pending ? POLLOUT : 0);
+
+    rv = poll(fds, ARRAY_SIZE(fds),
+              forwarder->send_pending ? sl_virtwl_retry_timeout_ms : -1);
+    if (rv < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    // Hangups are reported even for a side we aren't reading from, so
+    // waiting for it to drain would spin. Either side going away ends the
+    // connection anyway.
+    if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL))
+      break;
+    if (fds[1].revents & (POLLHUP | POLLERR | POLLNVAL))
+      break;
+
+    if (sl_virtwl_forward_host(forwarder) < 0)
+      break;
+    if (sl_virtwl_forward_client(forwarder) < 0)
+      break;
+  }
+
+  // Closing our end of the socket makes the Wayland connection of the main
+  // thread hang up, which is how the rest of sommelier learns that the host
+  // connection is gone.
+  close(forwarder->socket_fd);
+  forwarder->socket_fd = -1;
+
+  return NULL;
+}
+
+struct sl_virtwl_forwarder* sl_virtwl_forwarder_create(int ctx_fd,
+                                                       int socket_fd) {
+  struct sl_virtwl_forwarder* forwarder;
+  sigset_t all_signals, old_signals;
+  int flags;
+  int rv;
+
+  forwarder = malloc(sizeof(*forwarder));
+  assert(forwarder);
+  memset(forwarder, 0, sizeof(*forwarder));
+  forwarder->ctx_fd = ctx_fd;
+  forwarder->socket_fd = socket_fd;
+
+  flags = fcntl(ctx_fd, F_GETFL, 0);
+  if (flags == -1 || fcntl(ctx_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    fprintf(stderr, "error: failed to make virtwl context non-blocking: %s\n",
+            strerror(errno));
+    free(forwarder);
+    return NULL;
+  }
+
+  // Signals are handled by the event loop of the main thread.
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+  rv = pthread_create(&forwarder->thread, NULL, sl_virtwl_forwarder_thread,
+                      forwarder);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  if (rv) {
+    fprintf(stderr, "error: failed to start virtwl forwarding thread: %s\n",
+            strerror(rv));
+    free(forwarder);
+    return NULL;
+  }
+
+  return forwarder;
+}
@@ -8,9 +8,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <gbm.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <linux/virtwl.h>
 #include <math.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +23,7 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <xcb/composite.h>
@@ -37,6 +40,7 @@
 #include "keyboard-extension-unstable-v1-client-protocol.h"
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "pointer-constraints-unstable-v1-client-protocol.h"
+#include "presentation-time-client-protocol.h"
 #include "relative-pointer-unstable-v1-client-protocol.h"
 #include "text-input-unstable-v1-client-protocol.h"
 #include "viewporter-client-protocol.h"
@@ -73,6 +77,36 @@ struct sl_data_source {
   struct wl_data_source* internal;
 };
 
+struct sl_selection_cache_entry {
+  struct sl_context* ctx;
+  struct wl_list link;
+  xcb_atom_t target;
+  struct wl_array data;
+  int complete;
+  // Set while the entry is prefetched rather than filled by a transfer.
+  int fd;
+  struct wl_event_source* event_source;
+};
+
+// Transfer of Wayland selection data to an X client that asked for it with
+// a SelectionRequest.
+struct sl_selection_transfer {
+  struct sl_context* ctx;
+  struct wl_list link;
+  xcb_selection_request_event_t request;
+  xcb_atom_t data_type;
+  struct wl_array data;
+  int incremental;
+  int ack_pending;
+  int receive_fd;
+  struct wl_event_source* event_source;
+  // Entry that receives a copy of the data, if any.
+  struct sl_selection_cache_entry* cache_entry;
+  // Payload served from the cache instead of |receive_fd|.
+  struct wl_array cached;
+  size_t cached_offset;
+};
+
 enum {
   PROPERTY_WM_NAME,
   PROPERTY_WM_CLASS,
@@ -283,6 +317,17 @@ static void sl_internal_xdg_shell_ping(void* data,
   zxdg_shell_v6_pong(xdg_shell, serial);
 }
 
+static void sl_presentation_clock_id(void* data,
+                                     struct wp_presentation* presentation,
+                                     uint32_t clk_id) {
+  struct sl_presentation* host = data;
+
+  host->clock_id = clk_id;
+}
+
+static const struct wp_presentation_listener sl_presentation_listener = {
+    sl_presentation_clock_id};
+
 static const struct zxdg_shell_v6_listener sl_internal_xdg_shell_listener = {
     sl_internal_xdg_shell_ping};
 
@@ -323,57 +368,96 @@ static void sl_adjust_window_position_for_screen_size(
   window->y = ctx->screen->height_in_pixels / 2 - window->height / 2;
 }
 
-static void sl_configure_window(struct sl_window* window) {
-  assert(!window->pending_config.serial);
+static int sl_window_net_wm_state_changed(struct sl_window* window,
+                                          struct sl_config* config) {
+  if (window->net_wm_states_length < 0)
+    return 1;
 
-  if (window->next_config.mask) {
-    int values[5];
-    int x = window->x;
-    int y = window->y;
-    int i = 0;
+  if ((uint32_t)window->net_wm_states_length != config->states_length)
+    return 1;
 
-    xcb_configure_window(window->ctx->connection, window->frame_id,
-                         window->next_config.mask, window->next_config.values);
-
-    if (window->next_config.mask & XCB_CONFIG_WINDOW_X)
-      x = window->next_config.values[i++];
-    if (window->next_config.mask & XCB_CONFIG_WINDOW_Y)
-      y = window->next_config.values[i++];
-    if (window->next_config.mask & XCB_CONFIG_WINDOW_WIDTH)
-      window->width = window->next_config.values[i++];
-    if (window->next_config.mask & XCB_CONFIG_WINDOW_HEIGHT)
-      window->height = window->next_config.values[i++];
-    if (window->next_config.mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
-      window->border_width = window->next_config.values[i++];
-
-    // Set x/y to origin in case window gravity is not northwest as expected.
-    assert(window->managed);
-    values[0] = 0;
-    values[1] = 0;
-    values[2] = window->width;
-    values[3] = window->height;
-    values[4] = window->border_width;
-    xcb_configure_window(
-        window->ctx->connection, window->id,
-        XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
-            XCB_CONFIG_WINDOW_HEIGHT | XCB_CONFIG_WINDOW_BORDER_WIDTH,
-        values);
+  return memcmp(window->net_wm_states, config->states,
+                sizeof(uint32_t) * config->states_length) != 0;
+}
 
-    if (x != window->x || y != window->y) {
-      window->x = x;
-      window->y = y;
-      sl_send_configure_notify(window);
-    }
+static void sl_configure_window_geometry(struct sl_window* window) {
+  int values[5];
+  int x = window->x;
+  int y = window->y;
+  int width = window->width;
+  int height = window->height;
+  int border_width = window->border_width;
+  int i = 0;
+
+  if (window->next_config.mask & XCB_CONFIG_WINDOW_X)
+    x = window->next_config.values[i++];
+  if (window->next_config.mask & XCB_CONFIG_WINDOW_Y)
+    y = window->next_config.values[i++];
+  if (window->next_config.mask & XCB_CONFIG_WINDOW_WIDTH)
+    width = window->next_config.values[i++];
+  if (window->next_config.mask & XCB_CONFIG_WINDOW_HEIGHT)
+    height = window->next_config.values[i++];
+  if (window->next_config.mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
+    border_width = window->next_config.values[i++];
+
+  // Nothing to tell the client if the geometry is unchanged. This is common
+  // when only the states change or when a resize ends where it started.
+  if (x == window->x && y == window->y && width == window->width &&
+      height == window->height && border_width == window->border_width) {
+    window->ctx->configures_skipped++;
+    return;
+  }
+
+  xcb_configure_window(window->ctx->connection, window->frame_id,
+                       window->next_config.mask, window->next_config.values);
+
+  window->width = width;
+  window->height = height;
+  window->border_width = border_width;
+
+  // Set x/y to origin in case window gravity is not northwest as expected.
+  assert(window->managed);
+  values[0] = 0;
+  values[1] = 0;
+  values[2] = window->width;
+  values[3] = window->height;
+  values[4] = window->border_width;
+  xcb_configure_window(
+      window->ctx->connection, window->id,
+      XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
+          XCB_CONFIG_WINDOW_HEIGHT | XCB_CONFIG_WINDOW_BORDER_WIDTH,
+      values);
+
+  if (x != window->x || y != window->y) {
+    window->x = x;
+    window->y = y;
+    sl_send_configure_notify(window);
   }
+}
+
+static void sl_configure_window(struct sl_window* window) {
+  assert(!window->pending_config.serial);
+
+  if (window->next_config.mask)
+    sl_configure_window_geometry(window);
 
   if (window->managed) {
-    xcb_change_property(window->ctx->connection, XCB_PROP_MODE_REPLACE,
-                        window->id, window->ctx->atoms[ATOM_NET_WM_STATE].value,
-                        XCB_ATOM_ATOM, 32, window->next_config.states_length,
-                        window->next_config.states);
+    if (sl_window_net_wm_state_changed(window, &window->next_config)) {
+      xcb_change_property(window->ctx->connection, XCB_PROP_MODE_REPLACE,
+                          window->id,
+                          window->ctx->atoms[ATOM_NET_WM_STATE].value,
+                          XCB_ATOM_ATOM, 32, window->next_config.states_length,
+                          window->next_config.states);
+      window->net_wm_states_length = window->next_config.states_length;
+      memcpy(window->net_wm_states, window->next_config.states,
+             sizeof(uint32_t) * window->next_config.states_length);
+    } else {
+      window->ctx->net_wm_state_writes_skipped++;
+    }
   }
 
   window->pending_config = window->next_config;
+  window->configure_time = sl_monotonic_time_ns();
   window->next_config.serial = 0;
   window->next_config.mask = 0;
   window->next_config.states_length = 0;
@@ -430,6 +514,15 @@ void sl_roundtrip(struct sl_context* ctx) {
                                  xcb_get_input_focus(ctx->connection), NULL));
 }
 
+static void sl_window_observe_configure_ack(struct sl_window* window) {
+  if (!window->configure_time)
+    return;
+
+  sl_metric_observe(HISTOGRAM_X11_CONFIGURE_TO_ACK,
+                    (sl_monotonic_time_ns() - window->configure_time) / 1000);
+  window->configure_time = 0;
+}
+
 int sl_process_pending_configure_acks(struct sl_window* window,
                                       struct sl_host_surface* host_surface) {
   if (!window->pending_config.serial)
@@ -451,6 +544,7 @@ int sl_process_pending_configure_acks(struct sl_window* window,
                                   window->pending_config.serial);
   }
   window->pending_config.serial = 0;
+  sl_window_observe_configure_ack(window);
 
   if (window->next_config.serial)
     sl_configure_window(window);
@@ -462,6 +556,12 @@ static void sl_internal_xdg_surface_configure(
     void* data, struct zxdg_surface_v6* xdg_surface, uint32_t serial) {
   struct sl_window* window = zxdg_surface_v6_get_user_data(xdg_surface);
 
+  // While the client has yet to catch up with the last configure we applied,
+  // only the most recent configure from the host is kept. Superseded serials
+  // never need to be acked as acking the latest one implies them.
+  if (window->next_config.serial)
+    window->ctx->configures_merged++;
+
   window->next_config.serial = serial;
   if (!window->pending_config.serial) {
     struct wl_resource* host_resource;
@@ -625,6 +725,18 @@ void sl_update_application_id(struct sl_context* ctx,
   }
 }
 
+// Called when the host surface of |window| has contents. That happens at
+// commit time, or when the window is updated after a buffer was committed.
+void sl_window_realize(struct sl_window* window) {
+  window->realized = 1;
+  sl_trace_startup(window->ctx, "first frame");
+  if (window->map_time) {
+    sl_metric_observe(HISTOGRAM_X11_MAP_TO_FIRST_FRAME,
+                      (sl_monotonic_time_ns() - window->map_time) / 1000);
+    window->map_time = 0;
+  }
+}
+
 void sl_window_update(struct sl_window* window) {
   struct wl_resource* host_resource = NULL;
   struct sl_host_surface* host_surface;
@@ -821,7 +933,7 @@ void sl_window_update(struct sl_window* window) {
 
   wl_surface_commit(host_surface->proxy);
   if (host_surface->contents_width && host_surface->contents_height)
-    window->realized = 1;
+    sl_window_realize(window);
 }
 
 static void sl_host_buffer_destroy(struct wl_client* client,
@@ -886,15 +998,328 @@ struct sl_host_buffer* sl_create_host_buffer(struct wl_client* client,
   return host_buffer;
 }
 
+struct sl_atom_name {
+  xcb_atom_t atom;
+  char* name;
+};
+
+struct sl_atom_request {
+  xcb_intern_atom_cookie_t cookie;
+  char* name;
+  // Position of the atom in the offer's atoms.
+  size_t index;
+};
+
+// Atoms are never freed by the X server, so once resolved an atom and its
+// name can be cached for the lifetime of the connection. This keeps the
+// clipboard code free of round trips for the MIME types that are exchanged
+// on every copy and paste.
+static const char* sl_atom_cache_insert(struct sl_context* ctx,
+                                        xcb_atom_t atom,
+                                        const char* name,
+                                        size_t name_len) {
+  struct sl_atom_name* entry;
+
+  entry = wl_array_add(&ctx->atom_names, sizeof(*entry));
+  assert(entry);
+  entry->atom = atom;
+  entry->name = strndup(name, name_len);
+  assert(entry->name);
+
+  return entry->name;
+}
+
+static const char* sl_atom_cache_lookup_name(struct sl_context* ctx,
+                                             xcb_atom_t atom) {
+  struct sl_atom_name* entry;
+
+  wl_array_for_each(entry, &ctx->atom_names) {
+    if (entry->atom == atom)
+      return entry->name;
+  }
+
+  return NULL;
+}
+
+static xcb_atom_t sl_atom_cache_lookup_atom(struct sl_context* ctx,
+                                            const char* name) {
+  struct sl_atom_name* entry;
+
+  wl_array_for_each(entry, &ctx->atom_names) {
+    if (!strcmp(entry->name, name))
+      return entry->atom;
+  }
+
+  return XCB_ATOM_NONE;
+}
+
+static const char* sl_get_atom_name(struct sl_context* ctx, xcb_atom_t atom) {
+  const char* name = sl_atom_cache_lookup_name(ctx, atom);
+  xcb_get_atom_name_reply_t* reply;
+
+  if (name)
+    return name;
+
+  reply = xcb_get_atom_name_reply(ctx->connection,
+                                  xcb_get_atom_name(ctx->connection, atom),
+                                  NULL);
+  if (!reply)
+    return NULL;
+
+  name = sl_atom_cache_insert(ctx, atom, xcb_get_atom_name_name(reply),
+                              xcb_get_atom_name_name_length(reply));
+  free(reply);
+
+  return name;
+}
+
+static xcb_atom_t sl_intern_atom(struct sl_context* ctx, const char* name) {
+  xcb_atom_t atom = sl_atom_cache_lookup_atom(ctx, name);
+  xcb_intern_atom_reply_t* reply;
+
+  if (atom != XCB_ATOM_NONE)
+    return atom;
+
+  reply = xcb_intern_atom_reply(
+      ctx->connection,
+      xcb_intern_atom(ctx->connection, 0, strlen(name), name), NULL);
+  if (!reply)
+    return XCB_ATOM_NONE;
+
+  atom = reply->atom;
+  free(reply);
+  sl_atom_cache_insert(ctx, atom, name, strlen(name));
+
+  return atom;
+}
+
 static void sl_internal_data_offer_destroy(struct sl_data_offer* host) {
+  struct sl_atom_request* request;
+
   wl_data_offer_destroy(host->internal);
   wl_array_release(&host->atoms);
+  wl_array_for_each(request, &host->cookies) {
+    free(request->name);
+  }
   wl_array_release(&host->cookies);
   free(host);
 }
 
+// Payloads of the current selection offer are cached so that repeated
+// requests for the same target don't have to go back to the host.
+static const size_t sl_selection_cache_max_size = 16 * 1024 * 1024;
+
+// Text targets larger than this are not worth fetching before anyone asks.
+static const size_t sl_selection_prefetch_max_size = 64 * 1024;
+
+// Time a new offer has to stay the selection before it is prefetched, so
+// selections that are replaced right away aren't read.
+static const int sl_selection_prefetch_delay_ms = 500;
+
+static void sl_selection_cache_entry_destroy(
+    struct sl_selection_cache_entry* entry) {
+  struct sl_context* ctx = entry->ctx;
+  struct sl_selection_transfer* transfer;
+
+  wl_list_for_each(transfer, &ctx->selection_transfers, link) {
+    if (transfer->cache_entry == entry)
+      transfer->cache_entry = NULL;
+  }
+
+  if (entry->event_source)
+    wl_event_source_remove(entry->event_source);
+  if (entry->fd >= 0)
+    close(entry->fd);
+  ctx->selection_cache_size -= entry->data.size;
+  wl_array_release(&entry->data);
+  wl_list_remove(&entry->link);
+  free(entry);
+}
+
+static struct sl_selection_cache_entry* sl_selection_cache_create(
+    struct sl_context* ctx, xcb_atom_t target) {
+  struct sl_selection_cache_entry* entry;
+
+  entry = malloc(sizeof(*entry));
+  assert(entry);
+  entry->ctx = ctx;
+  entry->target = target;
+  wl_array_init(&entry->data);
+  entry->complete = 0;
+  entry->fd = -1;
+  entry->event_source = NULL;
+  wl_list_insert(&ctx->selection_cache, &entry->link);
+
+  return entry;
+}
+
+static struct sl_selection_cache_entry* sl_selection_cache_lookup(
+    struct sl_context* ctx, xcb_atom_t target) {
+  struct sl_selection_cache_entry* entry;
+
+  wl_list_for_each(entry, &ctx->selection_cache, link) {
+    if (entry->target == target)
+      return entry;
+  }
+
+  return NULL;
+}
+
+// Returns 0 if the entry would exceed the cache size and was dropped.
+static int sl_selection_cache_append(struct sl_selection_cache_entry* entry,
+                                     const void* data,
+                                     size_t size) {
+  struct sl_context* ctx = entry->ctx;
+  void* p;
+
+  if (ctx->selection_cache_size + size > sl_selection_cache_max_size) {
+    sl_selection_cache_entry_destroy(entry);
+    return 0;
+  }
+
+  p = wl_array_add(&entry->data, size);
+  assert(p);
+  memcpy(p, data, size);
+  ctx->selection_cache_size += size;
+  return 1;
+}
+
+static void sl_selection_cache_clear(struct sl_context* ctx) {
+  struct sl_selection_cache_entry* entry;
+  struct sl_selection_cache_entry* next;
+
+  wl_list_for_each_safe(entry, next, &ctx->selection_cache, link)
+      sl_selection_cache_entry_destroy(entry);
+}
+
+// Asks the host for the data of |name| in the current offer. Returns the fd
+// to read it from or -1 on failure.
+static int sl_receive_data_offer(struct sl_context* ctx,
+                                 struct sl_data_offer* data_offer,
+                                 const char* name) {
+  int rv, fd_to_receive, fd_to_wayland;
+
+  switch (ctx->data_driver) {
+    case DATA_DRIVER_VIRTWL: {
+      struct virtwl_ioctl_new new_pipe = {
+          .type = VIRTWL_IOCTL_NEW_PIPE_READ,
+          .fd = -1,
+          .flags = 0,
+          .size = 0,
+      };
+
+      rv = ioctl(ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &new_pipe);
+      if (rv) {
+        fprintf(stderr, "error: failed to create virtwl pipe: %s\n",
+                strerror(errno));
+        return -1;
+      }
+
+      fd_to_receive = new_pipe.fd;
+      fd_to_wayland = new_pipe.fd;
+
+    } break;
+    case DATA_DRIVER_NOOP: {
+      int p[2];
+
+      rv = pipe2(p, O_CLOEXEC | O_NONBLOCK);
+      assert(!rv);
+
+      fd_to_receive = p[0];
+      fd_to_wayland = p[1];
+
+    } break;
+  }
+
+  wl_data_offer_receive(data_offer->internal, name, fd_to_wayland);
+
+  // Close the wayland end of the pipe, now that it's been sent. The VIRTWL
+  // driver uses the same fd for both ends of the pipe, so don't close the fd
+  // if both ends are the same.
+  if (fd_to_receive != fd_to_wayland)
+    close(fd_to_wayland);
+
+  return fd_to_receive;
+}
+
+static int sl_handle_selection_prefetch_readable(int fd,
+                                                 uint32_t mask,
+                                                 void* data) {
+  struct sl_selection_cache_entry* entry = data;
+  uint8_t buffer[4096];
+  int bytes;
+
+  bytes = read(fd, buffer, sizeof(buffer));
+  if (bytes < 0 ||
+      entry->data.size + bytes > sl_selection_prefetch_max_size) {
+    sl_selection_cache_entry_destroy(entry);
+    return 1;
+  }
+
+  if (bytes) {
+    sl_selection_cache_append(entry, buffer, bytes);
+    return 1;
+  }
+
+  entry->complete = 1;
+  wl_event_source_remove(entry->event_source);
+  entry->event_source = NULL;
+  close(entry->fd);
+  entry->fd = -1;
+  return 1;
+}
+
+static void sl_selection_prefetch(struct sl_context* ctx,
+                                  struct sl_data_offer* data_offer) {
+  static const char* targets[] = {"UTF8_STRING", "text/plain;charset=utf-8"};
+  unsigned i;
+
+  ctx->selection_prefetch_pending = 0;
+  if (ctx->selection_prefetch_timer)
+    wl_event_source_timer_update(ctx->selection_prefetch_timer, 0);
+
+  for (i = 0; i < ARRAY_SIZE(targets); ++i) {
+    struct sl_selection_cache_entry* entry;
+    xcb_atom_t target = sl_atom_cache_lookup_atom(ctx, targets[i]);
+    xcb_atom_t* atom;
+    int offered = 0;
+    int fd;
+
+    wl_array_for_each(atom, &data_offer->atoms) {
+      if (*atom == target)
+        offered = 1;
+    }
+    if (target == XCB_ATOM_NONE || !offered ||
+        sl_selection_cache_lookup(ctx, target))
+      continue;
+
+    fd = sl_receive_data_offer(ctx, data_offer, targets[i]);
+    if (fd < 0)
+      continue;
+
+    entry = sl_selection_cache_create(ctx, target);
+    entry->fd = fd;
+    entry->event_source = wl_event_loop_add_fd(
+        wl_display_get_event_loop(ctx->host_display), fd, WL_EVENT_READABLE,
+        sl_handle_selection_prefetch_readable, entry);
+  }
+}
+
+static int sl_handle_selection_prefetch_timer(void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  if (ctx->selection_prefetch_pending && ctx->selection_data_offer)
+    sl_selection_prefetch(ctx, ctx->selection_data_offer);
+  return 0;
+}
+
 static void sl_set_selection(struct sl_context* ctx,
                              struct sl_data_offer* data_offer) {
+  sl_selection_cache_clear(ctx);
+  ctx->selection_prefetch_pending = 0;
+  if (ctx->selection_prefetch_timer)
+    wl_event_source_timer_update(ctx->selection_prefetch_timer, 0);
+
   if (ctx->selection_data_offer) {
     sl_internal_data_offer_destroy(ctx->selection_data_offer);
     ctx->selection_data_offer = NULL;
@@ -909,23 +1334,57 @@ static void sl_set_selection(struct sl_context* ctx,
       return;
     }
 
-    int atoms = data_offer->cookies.size / sizeof(xcb_intern_atom_cookie_t);
-    wl_array_add(&data_offer->atoms, sizeof(xcb_atom_t) * (atoms + 2));
-    ((xcb_atom_t*)data_offer->atoms.data)[0] = ctx->atoms[ATOM_TARGETS].value;
-    ((xcb_atom_t*)data_offer->atoms.data)[1] = ctx->atoms[ATOM_TIMESTAMP].value;
-    for (int i = 0; i < atoms; i++) {
-      xcb_intern_atom_cookie_t cookie =
-          ((xcb_intern_atom_cookie_t*)data_offer->cookies.data)[i];
+    // Cached mime types were added to |atoms| as they were offered, only the
+    // ones that needed to be interned are left to resolve. They fill the
+    // slots kept for them, as X clients take the order of TARGETS as the
+    // order of preference.
+    struct sl_atom_request* request;
+    xcb_atom_t* atom;
+    size_t count = 0;
+    wl_array_for_each(request, &data_offer->cookies) {
       xcb_intern_atom_reply_t* reply =
-          xcb_intern_atom_reply(ctx->connection, cookie, NULL);
+          xcb_intern_atom_reply(ctx->connection, request->cookie, NULL);
       if (reply) {
-        ((xcb_atom_t*)data_offer->atoms.data)[i + 2] = reply->atom;
+        ((xcb_atom_t*)data_offer->atoms.data)[request->index] = reply->atom;
+        if (!sl_atom_cache_lookup_name(ctx, reply->atom))
+          sl_atom_cache_insert(ctx, reply->atom, request->name,
+                               strlen(request->name));
         free(reply);
       }
+      free(request->name);
+    }
+    wl_array_release(&data_offer->cookies);
+    wl_array_init(&data_offer->cookies);
+
+    // Drop the slots of types that failed to intern.
+    wl_array_for_each(atom, &data_offer->atoms) {
+      if (*atom != XCB_ATOM_NONE)
+        ((xcb_atom_t*)data_offer->atoms.data)[count++] = *atom;
     }
+    data_offer->atoms.size = count * sizeof(xcb_atom_t);
+
+    size_t size = data_offer->atoms.size;
+    wl_array_add(&data_offer->atoms, sizeof(xcb_atom_t) * 2);
+    xcb_atom_t* atoms = data_offer->atoms.data;
+    memmove(atoms + 2, atoms, size);
+    atoms[0] = ctx->atoms[ATOM_TARGETS].value;
+    atoms[1] = ctx->atoms[ATOM_TIMESTAMP].value;
 
     xcb_set_selection_owner(ctx->connection, ctx->selection_window,
                             ctx->atoms[ATOM_CLIPBOARD].value, XCB_CURRENT_TIME);
+
+    // Our own data source offered back by the host is only read from the
+    // X11 client that owns it, there is nothing to prefetch.
+    if (!ctx->selection_data_source) {
+      if (!ctx->selection_prefetch_timer) {
+        ctx->selection_prefetch_timer = wl_event_loop_add_timer(
+            wl_display_get_event_loop(ctx->host_display),
+            sl_handle_selection_prefetch_timer, ctx);
+      }
+      ctx->selection_prefetch_pending = 1;
+      wl_event_source_timer_update(ctx->selection_prefetch_timer,
+                                   sl_selection_prefetch_delay_ms);
+    }
   }
 
   ctx->selection_data_offer = data_offer;
@@ -935,9 +1394,18 @@ static void sl_internal_data_offer_offer(void* data,
                                          struct wl_data_offer* data_offer,
                                          const char* type) {
   struct sl_data_offer* host = data;
-  xcb_intern_atom_cookie_t* cookie =
-      wl_array_add(&host->cookies, sizeof(xcb_intern_atom_cookie_t));
-  *cookie = xcb_intern_atom(host->ctx->connection, 0, strlen(type), type);
+  xcb_atom_t* value = wl_array_add(&host->atoms, sizeof(*value));
+
+  *value = sl_atom_cache_lookup_atom(host->ctx, type);
+  if (*value == XCB_ATOM_NONE) {
+    struct sl_atom_request* request =
+        wl_array_add(&host->cookies, sizeof(*request));
+    request->cookie =
+        xcb_intern_atom(host->ctx->connection, 0, strlen(type), type);
+    request->name = strdup(type);
+    assert(request->name);
+    request->index = host->atoms.size / sizeof(*value) - 1;
+  }
 }
 
 static void sl_internal_data_offer_source_actions(
@@ -1239,14 +1707,29 @@ static void sl_registry_handler(void* data,
         wl_registry_bind(registry, id, &zcr_keyboard_extension_v1_interface, 1);
     assert(!ctx->keyboard_extension);
     ctx->keyboard_extension = keyboard_extension;
+  } else if (strcmp(interface, "wp_presentation") == 0) {
+    // Presentation timestamps of a host behind virtwl are from the host's
+    // clock, which can't be compared with our input times.
+    if (ctx->latency_probe && ctx->virtwl_ctx_fd == -1) {
+      struct sl_presentation* presentation =
+          malloc(sizeof(struct sl_presentation));
+      assert(presentation);
+      presentation->ctx = ctx;
+      presentation->id = id;
+      presentation->clock_id = CLOCK_MONOTONIC;
+      presentation->internal =
+          wl_registry_bind(registry, id, &wp_presentation_interface, 1);
+      wp_presentation_add_listener(presentation->internal,
+                                   &sl_presentation_listener, presentation);
+      assert(!ctx->presentation);
+      ctx->presentation = presentation;
+    }
   } else if (strcmp(interface, "zwp_text_input_manager_v1") == 0) {
     struct sl_text_input_manager* text_input_manager =
         malloc(sizeof(struct sl_text_input_manager));
     assert(text_input_manager);
     text_input_manager->ctx = ctx;
     text_input_manager->id = id;
-    text_input_manager->internal =
-        wl_registry_bind(registry, id, &zwp_text_input_manager_v1_interface, 1);
     text_input_manager->host_global = sl_text_input_manager_global_create(ctx);
     assert(!ctx->text_input_manager);
     ctx->text_input_manager = text_input_manager;
@@ -1334,6 +1817,12 @@ static void sl_registry_remover(void* data,
     ctx->keyboard_extension = NULL;
     return;
   }
+  if (ctx->presentation && ctx->presentation->id == id) {
+    wp_presentation_destroy(ctx->presentation->internal);
+    free(ctx->presentation);
+    ctx->presentation = NULL;
+    return;
+  }
   if (ctx->text_input_manager && ctx->text_input_manager->id == id) {
     sl_global_destroy(ctx->text_input_manager->host_global);
     free(ctx->text_input_manager);
@@ -1382,12 +1871,26 @@ static int sl_handle_event(int fd, uint32_t mask, void* data) {
   int count = 0;
 
   if ((mask & WL_EVENT_HANGUP) || (mask & WL_EVENT_ERROR)) {
-    wl_client_flush(ctx->client);
+    wl_display_flush_clients(ctx->host_display);
     exit(EXIT_SUCCESS);
   }
 
-  if (mask & WL_EVENT_READABLE)
-    count = wl_display_dispatch(ctx->display);
+  if (mask & WL_EVENT_READABLE) {
+    // The event loop has already established that the connection is readable,
+    // so read directly instead of using wl_display_dispatch, which flushes and
+    // polls the connection again before reading. The main loop flushes
+    // before going back to sleep.
+    while (wl_display_prepare_read(ctx->display) != 0) {
+      int rv = wl_display_dispatch_pending(ctx->display);
+      if (rv < 0)
+        return rv;
+      count += rv;
+    }
+    if (wl_display_read_events(ctx->display) < 0)
+      return -1;
+    count += wl_display_dispatch_pending(ctx->display);
+    sl_flush_motion(ctx);
+  }
   if (mask & WL_EVENT_WRITABLE)
     wl_display_flush(ctx->display);
 
@@ -1399,6 +1902,107 @@ static int sl_handle_event(int fd, uint32_t mask, void* data) {
   return count;
 }
 
+// Holds back |motion| until the input that has been read is dispatched.
+// Relative motion is forwarded first as it belongs to the pointer frames
+// that are held back with it.
+void sl_defer_motion(struct sl_context* ctx,
+                     struct sl_pending_motion* motion,
+                     int relative) {
+  if (!wl_list_empty(&motion->link))
+    return;
+
+  if (relative)
+    wl_list_insert(&ctx->pending_motion, &motion->link);
+  else
+    wl_list_insert(ctx->pending_motion.prev, &motion->link);
+}
+
+// Forwards the motion that has been held back. This happens once all input
+// that was read is dispatched, and before any other input event so motion is
+// never merged across buttons, axis events, touch points or keys.
+void sl_flush_motion(struct sl_context* ctx) {
+  struct sl_pending_motion *motion, *next;
+
+  wl_list_for_each_safe(motion, next, &ctx->pending_motion, link) {
+    wl_list_remove(&motion->link);
+    wl_list_init(&motion->link);
+    motion->flush(motion);
+  }
+}
+
+// Records how long an input event took from the host to the client. This
+// includes the time the event waited in the socket while sommelier was busy,
+// like copying a large buffer. Input timestamps are in ms of the host's
+// monotonic clock, which is only ours when the host isn't behind virtwl.
+void sl_record_input_delay(struct sl_context* ctx, uint32_t time) {
+  uint32_t delay;
+
+  if (ctx->virtwl_ctx_fd != -1)
+    return;
+
+  delay = (uint32_t)(sl_monotonic_time_ns() / 1000000) - time;
+
+  // Ignore timestamps that don't seem to be from the same clock.
+  if (delay > 60000)
+    return;
+
+  sl_metric_observe(HISTOGRAM_INPUT_DELAY, delay);
+}
+
+int sl_host_bytes_queued(struct sl_context* ctx) {
+  int bytes = 0;
+
+#ifdef __linux__
+  ioctl(wl_display_get_fd(ctx->display), TIOCOUTQ, &bytes);
+#elif defined(__FreeBSD__)
+  ioctl(wl_display_get_fd(ctx->display), FIONWRITE, &bytes);
+#endif
+
+  return bytes;
+}
+
+// Flush requests to the host compositor. When the host can't keep up with
+// the requests we produce, the socket buffer fills up and the flush fails with
+// EAGAIN. Requests that don't fit stay in the connection buffer, which
+// becomes a fatal error once it overflows. Instead of dispatching more client
+// and X11 work, which is what produces host requests, only handle host events
+// until the backlog has been written.
+static int sl_flush_host(struct sl_context* ctx) {
+  int fd = wl_display_get_fd(ctx->display);
+  int bytes;
+
+  if (wl_display_flush(ctx->display) >= 0)
+    return 0;
+  if (errno != EAGAIN)
+    return -1;
+
+  bytes = sl_host_bytes_queued(ctx);
+  ctx->host_backlog_count++;
+  ctx->host_backlog_bytes += bytes;
+  ctx->host_backlog_max_bytes =
+      MAX(ctx->host_backlog_max_bytes, (uint64_t)bytes);
+
+  for (;;) {
+    struct pollfd pollfd = {.fd = fd, .events = POLLIN | POLLOUT};
+
+    if (poll(&pollfd, 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    if (pollfd.revents & (POLLHUP | POLLERR))
+      sl_handle_event(fd, WL_EVENT_HANGUP, ctx);
+    if (pollfd.revents & POLLIN)
+      sl_handle_event(fd, WL_EVENT_READABLE, ctx);
+
+    if (wl_display_flush(ctx->display) >= 0)
+      return 0;
+    if (errno != EAGAIN)
+      return -1;
+  }
+}
+
 static void sl_create_window(struct sl_context* ctx,
                              xcb_window_t id,
                              int x,
@@ -1447,6 +2051,9 @@ static void sl_create_window(struct sl_context* ctx,
   window->pending_config.serial = 0;
   window->pending_config.mask = 0;
   window->pending_config.states_length = 0;
+  window->net_wm_states_length = -1;
+  window->map_time = 0;
+  window->configure_time = 0;
   wl_list_insert(&ctx->unpaired_windows, &window->link);
   values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_FOCUS_CHANGE;
   xcb_change_window_attributes(ctx->connection, window->id, XCB_CW_EVENT_MASK,
@@ -1592,6 +2199,81 @@ static void sl_decode_wm_class(struct sl_window* window,
   }
 }
 
+struct sl_property_request {
+  struct wl_list link;
+  unsigned int sequence;
+  xcb_window_t window;
+  xcb_atom_t property;
+  // NULL once the reply is stale, it is then only read and dropped.
+  void (*handler)(struct sl_window* window, xcb_get_property_reply_t* reply);
+};
+
+// Drops the replies in flight for |property| of |window|, or all of its
+// properties if |property| is XCB_ATOM_NONE. Needed when the property is
+// read again or deleted, as the older reply would otherwise land last.
+static void sl_drop_property_requests(struct sl_context* ctx,
+                                      xcb_window_t window,
+                                      xcb_atom_t property) {
+  struct sl_property_request* request;
+
+  wl_list_for_each(request, &ctx->property_requests, link) {
+    if (request->window == window &&
+        (property == XCB_ATOM_NONE || request->property == property))
+      request->handler = NULL;
+  }
+}
+
+// Property reads triggered by PropertyNotify events are not needed to handle
+// any later event, so instead of blocking the event loop on a round trip to
+// the X server, the reply is handled when it arrives. Replies arrive in
+// request order, which keeps updates to the same property in order.
+static void sl_get_window_property(
+    struct sl_context* ctx,
+    struct sl_window* window,
+    xcb_atom_t property,
+    uint32_t long_length,
+    void (*handler)(struct sl_window* window,
+                    xcb_get_property_reply_t* reply)) {
+  struct sl_property_request* request;
+
+  sl_drop_property_requests(ctx, window->id, property);
+
+  request = malloc(sizeof(*request));
+  assert(request);
+  request->window = window->id;
+  request->property = property;
+  request->sequence = xcb_get_property(ctx->connection, 0, window->id,
+                                       property, XCB_ATOM_ANY, 0, long_length)
+                          .sequence;
+  request->handler = handler;
+  wl_list_insert(ctx->property_requests.prev, &request->link);
+}
+
+static void sl_process_property_requests(struct sl_context* ctx) {
+  struct sl_property_request* request;
+  struct sl_property_request* next;
+
+  wl_list_for_each_safe(request, next, &ctx->property_requests, link) {
+    xcb_get_property_reply_t* reply = NULL;
+    xcb_generic_error_t* error = NULL;
+    struct sl_window* window;
+
+    if (!xcb_poll_for_reply(ctx->connection, request->sequence,
+                            (void**)&reply, &error))
+      break;
+    free(error);
+
+    // The window might have been destroyed while the request was in flight.
+    window = sl_lookup_window(ctx, request->window);
+    if (window && request->handler)
+      request->handler(window, reply);
+
+    free(reply);
+    wl_list_remove(&request->link);
+    free(request);
+  }
+}
+
 static void sl_handle_map_request(struct sl_context* ctx,
                                   xcb_map_request_event_t* event) {
   struct sl_window* window = sl_lookup_window(ctx, event->window);
@@ -1624,10 +2306,15 @@ static void sl_handle_map_request(struct sl_context* ctx,
   assert(!sl_is_our_window(ctx, event->window));
 
   window->managed = 1;
+  window->map_time = sl_monotonic_time_ns();
+  // The client may have set _NET_WM_STATE itself while unmanaged.
+  window->net_wm_states_length = -1;
   if (window->frame_id == XCB_WINDOW_NONE)
     geometry_cookie = xcb_get_geometry(ctx->connection, window->id);
 
   for (i = 0; i < ARRAY_SIZE(properties); ++i) {
+    // These reads supersede any in flight from earlier property changes.
+    sl_drop_property_requests(ctx, window->id, properties[i].atom);
     property_cookies[i] =
         xcb_get_property(ctx->connection, 0, window->id, properties[i].atom,
                          XCB_ATOM_ANY, 0, 2048);
@@ -1916,6 +2603,7 @@ static void sl_handle_configure_request(struct sl_context* ctx,
       window->pending_config.serial = 0;
       window->pending_config.mask = 0;
       window->pending_config.states_length = 0;
+      sl_window_observe_configure_ack(window);
     }
     if (window->next_config.serial) {
       zxdg_surface_v6_ack_configure(window->xdg_surface,
@@ -2167,428 +2855,629 @@ static void sl_handle_focus_in(struct sl_context* ctx,
 static void sl_handle_focus_out(struct sl_context* ctx,
                                 xcb_focus_out_event_t* event) {}
 
-int sl_begin_data_source_send(struct sl_context* ctx,
-                              int fd,
-                              xcb_intern_atom_cookie_t cookie,
-                              struct sl_data_source* data_source) {
-  xcb_intern_atom_reply_t* reply =
-      xcb_intern_atom_reply(ctx->connection, cookie, NULL);
-
-  if (!reply) {
-    close(fd);
-    return 0;
+// Transfer of X selection data to a Wayland client that asked our data
+// source for it.
+struct sl_data_source_transfer {
+  struct sl_context* ctx;
+  struct wl_list link;
+  int fd;
+  xcb_atom_t target;
+  // Property of the selection window that the owner converts into.
+  xcb_atom_t property;
+  int notified;
+  int incremental;
+  // Large properties are read in windows of |selection_chunk_size| bytes.
+  // The next window is requested before the current one is written.
+  uint32_t long_offset;
+  xcb_get_property_cookie_t cookie;
+  int fetch_pending;
+  xcb_get_property_reply_t* reply;
+  int offset;
+  struct wl_event_source* event_source;
+};
+
+// Each transfer from the X selection owner needs its own property on the
+// selection window. Properties are reused once their transfer is done.
+static xcb_atom_t sl_acquire_selection_property(struct sl_context* ctx) {
+  xcb_atom_t property;
+  char* name;
+
+  if (ctx->selection_properties.size) {
+    ctx->selection_properties.size -= sizeof(xcb_atom_t);
+    memcpy(&property,
+           (char*)ctx->selection_properties.data +
+               ctx->selection_properties.size,
+           sizeof(property));
+    return property;
   }
 
+  name = sl_xasprintf("_WL_SELECTION_%d", ctx->selection_property_count++);
+  property = sl_intern_atom(ctx, name);
+  free(name);
+  return property;
+}
+
+static void sl_release_selection_property(struct sl_context* ctx,
+                                          xcb_atom_t property) {
+  xcb_atom_t* p = wl_array_add(&ctx->selection_properties, sizeof(*p));
+
+  assert(p);
+  *p = property;
+}
+
+static void sl_data_source_transfer_destroy(
+    struct sl_data_source_transfer* transfer) {
+  if (transfer->event_source)
+    wl_event_source_remove(transfer->event_source);
+  if (transfer->fetch_pending)
+    xcb_discard_reply(transfer->ctx->connection, transfer->cookie.sequence);
+  free(transfer->reply);
+  if (transfer->fd >= 0)
+    close(transfer->fd);
+  sl_release_selection_property(transfer->ctx, transfer->property);
+  wl_list_remove(&transfer->link);
+  free(transfer);
+}
+
+static void sl_data_source_transfer_create(struct sl_context* ctx,
+                                           int fd,
+                                           xcb_atom_t target) {
+  struct sl_data_source_transfer* transfer;
   int flags, rv;
 
-  xcb_convert_selection(ctx->connection, ctx->selection_window,
-                        ctx->atoms[ATOM_CLIPBOARD].value, reply->atom,
-                        ctx->atoms[ATOM_WL_SELECTION].value, XCB_CURRENT_TIME);
+  if (target == XCB_ATOM_NONE) {
+    close(fd);
+    return;
+  }
 
   flags = fcntl(fd, F_GETFL, 0);
   rv = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
   assert(!rv);
   UNUSED(rv);
 
-  ctx->selection_data_source_send_fd = fd;
-  free(reply);
-  return 1;
-}
-
-void sl_process_data_source_send_pending_list(struct sl_context* ctx) {
-  while (!wl_list_empty(&ctx->selection_data_source_send_pending)) {
-    struct wl_list* next = ctx->selection_data_source_send_pending.next;
-    struct sl_data_source_send_request* request;
-    request = wl_container_of(next, request, link);
-    wl_list_remove(next);
+  transfer = malloc(sizeof(*transfer));
+  assert(transfer);
+  transfer->ctx = ctx;
+  transfer->fd = fd;
+  transfer->target = target;
+  transfer->property = sl_acquire_selection_property(ctx);
+  transfer->notified = 0;
+  transfer->incremental = 0;
+  transfer->long_offset = 0;
+  transfer->fetch_pending = 0;
+  transfer->reply = NULL;
+  transfer->offset = 0;
+  transfer->event_source = NULL;
+  wl_list_insert(ctx->data_source_transfers.prev, &transfer->link);
 
-    int rv = sl_begin_data_source_send(ctx, request->fd, request->cookie,
-                                       request->data_source);
-    free(request);
-    if (rv)
-      break;
-  }
+  xcb_convert_selection(ctx->connection, ctx->selection_window,
+                        ctx->atoms[ATOM_CLIPBOARD].value, target,
+                        transfer->property, XCB_CURRENT_TIME);
 }
 
-static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
-  struct sl_context* ctx = data;
+// Writes what is left of the current chunk. Returns non-zero if the fd
+// couldn't take all of it.
+static int sl_data_source_transfer_write(
+    struct sl_data_source_transfer* transfer) {
   uint8_t* value;
   int bytes, bytes_left;
 
-  value = xcb_get_property_value(ctx->selection_property_reply);
-  bytes_left = xcb_get_property_value_length(ctx->selection_property_reply) -
-               ctx->selection_property_offset;
-
-  bytes = write(fd, value + ctx->selection_property_offset, bytes_left);
-  if (bytes == -1) {
-    fprintf(stderr, "write error to target fd: %m\n");
-    close(fd);
-    fd = -1;
-  } else if (bytes == bytes_left) {
-    if (ctx->selection_incremental_transfer) {
-      xcb_delete_property(ctx->connection, ctx->selection_window,
-                          ctx->atoms[ATOM_WL_SELECTION].value);
+  // After a write error the remaining chunks are still consumed so the
+  // owner finishes and the property is clean when it gets reused.
+  if (transfer->fd >= 0) {
+    value = xcb_get_property_value(transfer->reply);
+    bytes_left =
+        xcb_get_property_value_length(transfer->reply) - transfer->offset;
+
+    bytes = write(transfer->fd, value + transfer->offset, bytes_left);
+    if (bytes == -1) {
+      fprintf(stderr, "write error to target fd: %m\n");
+      close(transfer->fd);
+      transfer->fd = -1;
     } else {
-      close(fd);
-      fd = -1;
+      sl_metric_add(METRIC_CLIPBOARD_BYTES_FROM_X, bytes);
+      if (bytes < bytes_left) {
+        transfer->offset += bytes;
+        return 1;
+      }
     }
-  } else {
-    ctx->selection_property_offset += bytes;
-    return 1;
   }
 
-  free(ctx->selection_property_reply);
-  ctx->selection_property_reply = NULL;
-  if (ctx->selection_send_event_source) {
-    wl_event_source_remove(ctx->selection_send_event_source);
-    ctx->selection_send_event_source = NULL;
+  free(transfer->reply);
+  transfer->reply = NULL;
+  return 0;
+}
+
+static void sl_data_source_transfer_fetch(
+    struct sl_data_source_transfer* transfer) {
+  struct sl_context* ctx = transfer->ctx;
+
+  transfer->cookie = xcb_get_property(
+      ctx->connection, 0, ctx->selection_window, transfer->property,
+      XCB_GET_PROPERTY_TYPE_ANY, transfer->long_offset,
+      ctx->selection_chunk_size / 4);
+  transfer->fetch_pending = 1;
+}
+
+static void sl_data_source_transfer_receive(
+    struct sl_data_source_transfer* transfer);
+
+static void sl_data_source_transfer_window_done(
+    struct sl_data_source_transfer* transfer) {
+  struct sl_context* ctx = transfer->ctx;
+
+  if (transfer->fetch_pending &&
+      (transfer->fd >= 0 || transfer->incremental)) {
+    sl_data_source_transfer_receive(transfer);
+    return;
   }
-  if (fd < 0) {
-    ctx->selection_data_source_send_fd = -1;
-    sl_process_data_source_send_pending_list(ctx);
+
+  // Deleting the property tells the owner we are done with it. For
+  // incremental transfers that asks for the next chunk.
+  xcb_delete_property(ctx->connection, ctx->selection_window,
+                      transfer->property);
+  if (transfer->incremental) {
+    transfer->long_offset = 0;
+  } else {
+    sl_data_source_transfer_destroy(transfer);
   }
+}
+
+static int sl_handle_data_source_transfer_writable(int fd,
+                                                   uint32_t mask,
+                                                   void* data) {
+  struct sl_data_source_transfer* transfer = data;
+
+  if (sl_data_source_transfer_write(transfer))
+    return 1;
+
+  wl_event_source_remove(transfer->event_source);
+  transfer->event_source = NULL;
+  sl_data_source_transfer_window_done(transfer);
   return 1;
 }
 
-static void sl_write_selection_property(struct sl_context* ctx,
-                                        xcb_get_property_reply_t* reply) {
-  ctx->selection_property_offset = 0;
-  ctx->selection_property_reply = reply;
-  sl_handle_selection_fd_writable(ctx->selection_data_source_send_fd,
-                                  WL_EVENT_WRITABLE, ctx);
+static void sl_write_data_source_transfer(
+    struct sl_data_source_transfer* transfer,
+    xcb_get_property_reply_t* reply) {
+  transfer->offset = 0;
+  transfer->reply = reply;
+  if (!sl_data_source_transfer_write(transfer)) {
+    sl_data_source_transfer_window_done(transfer);
+    return;
+  }
+
+  assert(!transfer->event_source);
+  transfer->event_source = wl_event_loop_add_fd(
+      wl_display_get_event_loop(transfer->ctx->host_display), transfer->fd,
+      WL_EVENT_WRITABLE, sl_handle_data_source_transfer_writable, transfer);
+}
+
+static void sl_data_source_transfer_receive(
+    struct sl_data_source_transfer* transfer) {
+  struct sl_context* ctx = transfer->ctx;
+  int first_window = !transfer->long_offset;
+  xcb_get_property_reply_t* reply;
 
-  if (!ctx->selection_property_reply)
+  reply = xcb_get_property_reply(ctx->connection, transfer->cookie, NULL);
+  transfer->fetch_pending = 0;
+  if (!reply) {
+    sl_data_source_transfer_destroy(transfer);
     return;
+  }
 
-  assert(!ctx->selection_send_event_source);
-  ctx->selection_send_event_source = wl_event_loop_add_fd(
-      wl_display_get_event_loop(ctx->host_display),
-      ctx->selection_data_source_send_fd, WL_EVENT_WRITABLE,
-      sl_handle_selection_fd_writable, ctx);
+  if (first_window && !transfer->incremental &&
+      reply->type == ctx->atoms[ATOM_INCR].value) {
+    // Deleting the INCR property starts the transfer.
+    transfer->incremental = 1;
+    free(reply);
+    xcb_delete_property(ctx->connection, ctx->selection_window,
+                        transfer->property);
+    return;
+  }
+
+  // A zero-length chunk ends an incremental transfer.
+  if (first_window && transfer->incremental &&
+      !xcb_get_property_value_length(reply)) {
+    free(reply);
+    xcb_delete_property(ctx->connection, ctx->selection_window,
+                        transfer->property);
+    sl_data_source_transfer_destroy(transfer);
+    return;
+  }
+
+  transfer->long_offset += xcb_get_property_value_length(reply) / 4;
+  if (reply->bytes_after)
+    sl_data_source_transfer_fetch(transfer);
+  sl_write_data_source_transfer(transfer, reply);
 }
 
 static void sl_send_selection_notify(struct sl_context* ctx,
+                                     xcb_selection_request_event_t* request,
                                      xcb_atom_t property) {
   xcb_selection_notify_event_t event = {
       .response_type = XCB_SELECTION_NOTIFY,
       .sequence = 0,
-      .time = ctx->selection_request.time,
-      .requestor = ctx->selection_request.requestor,
-      .selection = ctx->selection_request.selection,
-      .target = ctx->selection_request.target,
+      .time = request->time,
+      .requestor = request->requestor,
+      .selection = request->selection,
+      .target = request->target,
       .property = property,
       .pad0 = 0};
 
-  xcb_send_event(ctx->connection, 0, ctx->selection_request.requestor,
+  xcb_send_event(ctx->connection, 0, request->requestor,
                  XCB_EVENT_MASK_NO_EVENT, (char*)&event);
 }
 
-static void sl_send_selection_data(struct sl_context* ctx) {
-  assert(!ctx->selection_data_ack_pending);
-  xcb_change_property(
-      ctx->connection, XCB_PROP_MODE_REPLACE, ctx->selection_request.requestor,
-      ctx->selection_request.property, ctx->selection_data_type,
-      /*format=*/8, ctx->selection_data.size, ctx->selection_data.data);
-  ctx->selection_data_ack_pending = 1;
-  ctx->selection_data.size = 0;
+static void sl_selection_transfer_destroy(
+    struct sl_selection_transfer* transfer) {
+  if (transfer->event_source)
+    wl_event_source_remove(transfer->event_source);
+  if (transfer->receive_fd >= 0)
+    close(transfer->receive_fd);
+  // Partial payloads are of no use to anyone else.
+  if (transfer->cache_entry && !transfer->cache_entry->complete)
+    sl_selection_cache_entry_destroy(transfer->cache_entry);
+  wl_array_release(&transfer->data);
+  wl_array_release(&transfer->cached);
+  wl_list_remove(&transfer->link);
+  free(transfer);
 }
 
-static const uint32_t sl_incr_chunk_size = 64 * 1024;
+static void sl_send_selection_data(struct sl_selection_transfer* transfer) {
+  assert(!transfer->ack_pending);
+  xcb_change_property(transfer->ctx->connection, XCB_PROP_MODE_REPLACE,
+                      transfer->request.requestor, transfer->request.property,
+                      transfer->data_type,
+                      /*format=*/8, transfer->data.size, transfer->data.data);
+  sl_metric_add(METRIC_CLIPBOARD_BYTES_TO_X, transfer->data.size);
+  transfer->ack_pending = 1;
+  transfer->data.size = 0;
+}
 
 static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
-  struct sl_context* ctx = data;
+  struct sl_selection_transfer* transfer = data;
+  struct sl_context* ctx = transfer->ctx;
   int bytes, offset, bytes_left;
   void* p;
 
-  offset = ctx->selection_data.size;
-  if (ctx->selection_data.size < sl_incr_chunk_size)
-    p = wl_array_add(&ctx->selection_data, sl_incr_chunk_size);
+  offset = transfer->data.size;
+  if (transfer->data.size < ctx->selection_chunk_size)
+    p = wl_array_add(&transfer->data, ctx->selection_chunk_size);
   else
-    p = (char*)ctx->selection_data.data + ctx->selection_data.size;
-  bytes_left = ctx->selection_data.alloc - offset;
+    p = (char*)transfer->data.data + transfer->data.size;
+  bytes_left = transfer->data.alloc - offset;
 
   bytes = read(fd, p, bytes_left);
   if (bytes == -1) {
     fprintf(stderr, "read error from data source: %m\n");
-    sl_send_selection_notify(ctx, XCB_ATOM_NONE);
-    ctx->selection_data_offer_receive_fd = -1;
-    close(fd);
-  } else {
-    ctx->selection_data.size = offset + bytes;
-    if (ctx->selection_data.size >= sl_incr_chunk_size) {
-      if (!ctx->selection_incremental_transfer) {
-        ctx->selection_incremental_transfer = 1;
-        xcb_change_property(
-            ctx->connection, XCB_PROP_MODE_REPLACE,
-            ctx->selection_request.requestor, ctx->selection_request.property,
-            ctx->atoms[ATOM_INCR].value, 32, 1, &sl_incr_chunk_size);
-        ctx->selection_data_ack_pending = 1;
-        sl_send_selection_notify(ctx, ctx->selection_request.property);
-      } else if (!ctx->selection_data_ack_pending) {
-        sl_send_selection_data(ctx);
-      }
-    } else if (bytes == 0) {
-      if (!ctx->selection_data_ack_pending)
-        sl_send_selection_data(ctx);
-      if (!ctx->selection_incremental_transfer) {
-        sl_send_selection_notify(ctx, ctx->selection_request.property);
-        ctx->selection_request.requestor = XCB_NONE;
-        wl_array_release(&ctx->selection_data);
-      }
-      xcb_flush(ctx->connection);
-      ctx->selection_data_offer_receive_fd = -1;
-      close(fd);
-    } else {
-      ctx->selection_data.size = offset + bytes;
+    sl_send_selection_notify(ctx, &transfer->request, XCB_ATOM_NONE);
+    sl_selection_transfer_destroy(transfer);
+    return 1;
+  }
+
+  transfer->data.size = offset + bytes;
+  if (bytes && transfer->cache_entry)
+    sl_selection_cache_append(transfer->cache_entry, p, bytes);
+
+  if (transfer->data.size >= ctx->selection_chunk_size) {
+    if (!transfer->incremental) {
+      transfer->incremental = 1;
+      xcb_change_property(
+          ctx->connection, XCB_PROP_MODE_REPLACE, transfer->request.requestor,
+          transfer->request.property, ctx->atoms[ATOM_INCR].value, 32, 1,
+          &ctx->selection_chunk_size);
+      transfer->ack_pending = 1;
+      sl_send_selection_notify(ctx, &transfer->request,
+                               transfer->request.property);
+    } else if (!transfer->ack_pending) {
+      sl_send_selection_data(transfer);
+    }
+  } else if (bytes == 0) {
+    if (transfer->cache_entry)
+      transfer->cache_entry->complete = 1;
+    if (!transfer->ack_pending)
+      sl_send_selection_data(transfer);
+    xcb_flush(ctx->connection);
+    if (!transfer->incremental) {
+      sl_send_selection_notify(ctx, &transfer->request,
+                               transfer->request.property);
+      sl_selection_transfer_destroy(transfer);
       return 1;
     }
+    close(transfer->receive_fd);
+    transfer->receive_fd = -1;
+  } else {
+    return 1;
   }
 
-  wl_event_source_remove(ctx->selection_event_source);
-  ctx->selection_event_source = NULL;
+  // Wait for the requestor to take the data before reading more.
+  wl_event_source_remove(transfer->event_source);
+  transfer->event_source = NULL;
   return 1;
 }
 
-static void sl_handle_property_notify(struct sl_context* ctx,
-                                      xcb_property_notify_event_t* event) {
-  if (event->atom == XCB_ATOM_WM_NAME) {
-    struct sl_window* window = sl_lookup_window(ctx, event->window);
-    if (!window)
+static void sl_handle_data_source_transfer_property(struct sl_context* ctx,
+                                                    xcb_atom_t property) {
+  struct sl_data_source_transfer* transfer;
+
+  wl_list_for_each(transfer, &ctx->data_source_transfers, link) {
+    if (transfer->property != property)
+      continue;
+
+    // A new value is only expected once we have asked for the next chunk.
+    if (!transfer->incremental || transfer->reply || transfer->fetch_pending)
       return;
 
-    if (window->name) {
-      free(window->name);
-      window->name = NULL;
+    sl_data_source_transfer_fetch(transfer);
+    sl_data_source_transfer_receive(transfer);
+    return;
+  }
+}
+
+static void sl_handle_selection_transfer_property_delete(
+    struct sl_context* ctx, xcb_property_notify_event_t* event) {
+  struct sl_selection_transfer* transfer;
+
+  wl_list_for_each(transfer, &ctx->selection_transfers, link) {
+    int data_size;
+
+    if (transfer->request.requestor != event->window ||
+        transfer->request.property != event->atom || !transfer->incremental)
+      continue;
+
+    // Cached payloads are handed out one chunk per acknowledgement.
+    if (transfer->cached_offset < transfer->cached.size) {
+      size_t size = MIN(ctx->selection_chunk_size,
+                        transfer->cached.size - transfer->cached_offset);
+      void* p = wl_array_add(&transfer->data, size);
+
+      assert(p);
+      memcpy(p, (uint8_t*)transfer->cached.data + transfer->cached_offset,
+             size);
+      transfer->cached_offset += size;
     }
 
-    if (event->state != XCB_PROPERTY_DELETE) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_NAME,
-                           XCB_ATOM_ANY, 0, 2048),
-          NULL);
-      if (reply) {
-        window->name = strndup(xcb_get_property_value(reply),
-                               xcb_get_property_value_length(reply));
-        free(reply);
+    data_size = transfer->data.size;
+    transfer->ack_pending = 0;
+
+    // Handle the case when there's more data to be received.
+    if (transfer->receive_fd >= 0) {
+      // Avoid sending empty data until transfer is complete.
+      if (data_size)
+        sl_send_selection_data(transfer);
+
+      if (!transfer->event_source) {
+        transfer->event_source = wl_event_loop_add_fd(
+            wl_display_get_event_loop(ctx->host_display), transfer->receive_fd,
+            WL_EVENT_READABLE, sl_handle_selection_fd_readable, transfer);
       }
+      return;
     }
 
-    if (!window->xdg_toplevel)
+    sl_send_selection_data(transfer);
+
+    // Release data if transfer is complete.
+    if (!data_size)
+      sl_selection_transfer_destroy(transfer);
+    return;
+  }
+}
+
+static void sl_window_set_title(struct sl_window* window) {
+  if (!window->xdg_toplevel)
+    return;
+
+  if (window->name) {
+    zxdg_toplevel_v6_set_title(window->xdg_toplevel, window->name);
+  } else {
+    zxdg_toplevel_v6_set_title(window->xdg_toplevel, "");
+  }
+}
+
+static void sl_window_set_size_limits(struct sl_window* window) {
+  struct sl_context* ctx = window->ctx;
+
+  if (!window->xdg_toplevel)
+    return;
+
+  if (window->size_flags & P_MIN_SIZE) {
+    zxdg_toplevel_v6_set_min_size(window->xdg_toplevel,
+                                  window->min_width / ctx->scale,
+                                  window->min_height / ctx->scale);
+  } else {
+    zxdg_toplevel_v6_set_min_size(window->xdg_toplevel, 0, 0);
+  }
+
+  if (window->size_flags & P_MAX_SIZE) {
+    zxdg_toplevel_v6_set_max_size(window->xdg_toplevel,
+                                  window->max_width / ctx->scale,
+                                  window->max_height / ctx->scale);
+  } else {
+    zxdg_toplevel_v6_set_max_size(window->xdg_toplevel, 0, 0);
+  }
+}
+
+static void sl_window_set_frame(struct sl_window* window) {
+  if (!window->aura_surface)
+    return;
+
+  zaura_surface_set_frame(window->aura_surface,
+                          window->decorated
+                              ? ZAURA_SURFACE_FRAME_TYPE_NORMAL
+                              : window->depth == 32
+                                    ? ZAURA_SURFACE_FRAME_TYPE_NONE
+                                    : ZAURA_SURFACE_FRAME_TYPE_SHADOW);
+}
+
+static void sl_window_set_frame_colors(struct sl_window* window) {
+  struct sl_context* ctx = window->ctx;
+  uint32_t frame_color;
+
+  if (!window->aura_surface)
+    return;
+
+  frame_color = window->dark_frame ? ctx->dark_frame_color : ctx->frame_color;
+  zaura_surface_set_frame_colors(window->aura_surface, frame_color,
+                                 frame_color);
+}
+
+static void sl_handle_wm_name_reply(struct sl_window* window,
+                                    xcb_get_property_reply_t* reply) {
+  free(window->name);
+  window->name = NULL;
+
+  if (reply && reply->type != XCB_ATOM_NONE) {
+    window->name = strndup(xcb_get_property_value(reply),
+                           xcb_get_property_value_length(reply));
+  }
+
+  sl_window_set_title(window);
+}
+
+static void sl_handle_wm_class_reply(struct sl_window* window,
+                                     xcb_get_property_reply_t* reply) {
+  if (reply)
+    sl_decode_wm_class(window, reply);
+  sl_update_application_id(window->ctx, window);
+}
+
+static void sl_handle_wm_normal_hints_reply(struct sl_window* window,
+                                            xcb_get_property_reply_t* reply) {
+  struct sl_wm_size_hints size_hints = {0};
+
+  if (reply && xcb_get_property_value_length(reply) >= sizeof(size_hints))
+    memcpy(&size_hints, xcb_get_property_value(reply), sizeof(size_hints));
+
+  window->size_flags &= ~(P_MIN_SIZE | P_MAX_SIZE);
+  window->size_flags |= size_hints.flags & (P_MIN_SIZE | P_MAX_SIZE);
+  if (window->size_flags & P_MIN_SIZE) {
+    window->min_width = size_hints.min_width;
+    window->min_height = size_hints.min_height;
+  }
+  if (window->size_flags & P_MAX_SIZE) {
+    window->max_width = size_hints.max_width;
+    window->max_height = size_hints.max_height;
+  }
+
+  sl_window_set_size_limits(window);
+}
+
+static void sl_handle_wm_hints_reply(struct sl_window* window,
+                                     xcb_get_property_reply_t* reply) {
+  struct sl_wm_hints wm_hints = {0};
+
+  if (!reply || xcb_get_property_value_length(reply) < sizeof(wm_hints))
+    return;
+  memcpy(&wm_hints, xcb_get_property_value(reply), sizeof(wm_hints));
+
+  if (wm_hints.flags & WM_HINTS_FLAG_URGENCY) {
+    sl_request_attention(window->ctx, window, /*is_strong_request=*/false);
+  }
+}
+
+static void sl_handle_motif_wm_hints_reply(struct sl_window* window,
+                                           xcb_get_property_reply_t* reply) {
+  struct sl_mwm_hints mwm_hints = {0};
+
+  // Managed windows are decorated by default.
+  window->decorated = window->managed;
+
+  if (reply && xcb_get_property_value_length(reply) >= sizeof(mwm_hints))
+    memcpy(&mwm_hints, xcb_get_property_value(reply), sizeof(mwm_hints));
+
+  if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
+    if (mwm_hints.decorations & MWM_DECOR_ALL)
+      window->decorated = ~mwm_hints.decorations & MWM_DECOR_TITLE;
+    else
+      window->decorated = mwm_hints.decorations & MWM_DECOR_TITLE;
+  }
+
+  sl_window_set_frame(window);
+}
+
+static void sl_handle_gtk_theme_variant_reply(
+    struct sl_window* window, xcb_get_property_reply_t* reply) {
+  window->dark_frame = 0;
+
+  if (reply && xcb_get_property_value_length(reply) >= 4)
+    window->dark_frame = !strcmp(xcb_get_property_value(reply), "dark");
+
+  sl_window_set_frame_colors(window);
+}
+
+static void sl_handle_property_notify(struct sl_context* ctx,
+                                      xcb_property_notify_event_t* event) {
+  if (event->atom == XCB_ATOM_WM_NAME) {
+    struct sl_window* window = sl_lookup_window(ctx, event->window);
+    if (!window)
       return;
 
-    if (window->name) {
-      zxdg_toplevel_v6_set_title(window->xdg_toplevel, window->name);
+    if (event->state != XCB_PROPERTY_DELETE) {
+      sl_get_window_property(ctx, window, XCB_ATOM_WM_NAME, 2048,
+                             sl_handle_wm_name_reply);
     } else {
-      zxdg_toplevel_v6_set_title(window->xdg_toplevel, "");
+      sl_drop_property_requests(ctx, window->id, event->atom);
+      sl_handle_wm_name_reply(window, NULL);
     }
   } else if (event->atom == XCB_ATOM_WM_CLASS) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
     if (!window || event->state == XCB_PROPERTY_DELETE)
       return;
 
-    xcb_get_property_cookie_t cookie =
-        xcb_get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_CLASS,
-                         XCB_ATOM_ANY, 0, 2048);
-    xcb_get_property_reply_t* reply =
-        xcb_get_property_reply(ctx->connection, cookie, NULL);
-    if (reply) {
-      sl_decode_wm_class(window, reply);
-      free(reply);
-    }
-    sl_update_application_id(ctx, window);
+    sl_get_window_property(ctx, window, XCB_ATOM_WM_CLASS, 2048,
+                           sl_handle_wm_class_reply);
   } else if (event->atom == XCB_ATOM_WM_NORMAL_HINTS) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
     if (!window)
       return;
 
-    window->size_flags &= ~(P_MIN_SIZE | P_MAX_SIZE);
-
     if (event->state != XCB_PROPERTY_DELETE) {
-      struct sl_wm_size_hints size_hints = {0};
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id,
-                           XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_ANY, 0,
-                           sizeof(size_hints)),
-          NULL);
-      if (reply) {
-        memcpy(&size_hints, xcb_get_property_value(reply), sizeof(size_hints));
-        free(reply);
-      }
-
-      window->size_flags |= size_hints.flags & (P_MIN_SIZE | P_MAX_SIZE);
-      if (window->size_flags & P_MIN_SIZE) {
-        window->min_width = size_hints.min_width;
-        window->min_height = size_hints.min_height;
-      }
-      if (window->size_flags & P_MAX_SIZE) {
-        window->max_width = size_hints.max_width;
-        window->max_height = size_hints.max_height;
-      }
-    }
-
-    if (!window->xdg_toplevel)
-      return;
-
-    if (window->size_flags & P_MIN_SIZE) {
-      zxdg_toplevel_v6_set_min_size(window->xdg_toplevel,
-                                    window->min_width / ctx->scale,
-                                    window->min_height / ctx->scale);
-    } else {
-      zxdg_toplevel_v6_set_min_size(window->xdg_toplevel, 0, 0);
-    }
-
-    if (window->size_flags & P_MAX_SIZE) {
-      zxdg_toplevel_v6_set_max_size(window->xdg_toplevel,
-                                    window->max_width / ctx->scale,
-                                    window->max_height / ctx->scale);
+      sl_get_window_property(ctx, window, XCB_ATOM_WM_NORMAL_HINTS,
+                             sizeof(struct sl_wm_size_hints),
+                             sl_handle_wm_normal_hints_reply);
     } else {
-      zxdg_toplevel_v6_set_max_size(window->xdg_toplevel, 0, 0);
+      sl_drop_property_requests(ctx, window->id, event->atom);
+      sl_handle_wm_normal_hints_reply(window, NULL);
     }
   } else if (event->atom == XCB_ATOM_WM_HINTS) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
-    if (!window)
+    if (!window || event->state == XCB_PROPERTY_DELETE)
       return;
 
-    if (event->state == XCB_PROPERTY_DELETE)
-      return;
-    struct sl_wm_hints wm_hints = {0};
-    xcb_get_property_reply_t* reply = xcb_get_property_reply(
-        ctx->connection,
-        xcb_get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_HINTS,
-                         XCB_ATOM_ANY, 0, sizeof(wm_hints)),
-        NULL);
-
-    if (!reply)
-      return;
-    memcpy(&wm_hints, xcb_get_property_value(reply), sizeof(wm_hints));
-    free(reply);
-
-    if (wm_hints.flags & WM_HINTS_FLAG_URGENCY) {
-      sl_request_attention(ctx, window, /*is_strong_request=*/false);
-    }
+    sl_get_window_property(ctx, window, XCB_ATOM_WM_HINTS,
+                           sizeof(struct sl_wm_hints), sl_handle_wm_hints_reply);
   } else if (event->atom == ctx->atoms[ATOM_MOTIF_WM_HINTS].value) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
     if (!window)
       return;
 
-    // Managed windows are decorated by default.
-    window->decorated = window->managed;
-
     if (event->state != XCB_PROPERTY_DELETE) {
-      struct sl_mwm_hints mwm_hints = {0};
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id,
-                           ctx->atoms[ATOM_MOTIF_WM_HINTS].value, XCB_ATOM_ANY,
-                           0, sizeof(mwm_hints)),
-          NULL);
-      if (reply) {
-        if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
-          if (mwm_hints.decorations & MWM_DECOR_ALL)
-            window->decorated = ~mwm_hints.decorations & MWM_DECOR_TITLE;
-          else
-            window->decorated = mwm_hints.decorations & MWM_DECOR_TITLE;
-        }
-      }
+      sl_get_window_property(ctx, window, ctx->atoms[ATOM_MOTIF_WM_HINTS].value,
+                             sizeof(struct sl_mwm_hints),
+                             sl_handle_motif_wm_hints_reply);
+    } else {
+      sl_drop_property_requests(ctx, window->id, event->atom);
+      sl_handle_motif_wm_hints_reply(window, NULL);
     }
-
-    if (!window->aura_surface)
-      return;
-
-    zaura_surface_set_frame(window->aura_surface,
-                            window->decorated
-                                ? ZAURA_SURFACE_FRAME_TYPE_NORMAL
-                                : window->depth == 32
-                                      ? ZAURA_SURFACE_FRAME_TYPE_NONE
-                                      : ZAURA_SURFACE_FRAME_TYPE_SHADOW);
   } else if (event->atom == ctx->atoms[ATOM_GTK_THEME_VARIANT].value) {
-    struct sl_window* window;
-    uint32_t frame_color;
-
-    window = sl_lookup_window(ctx, event->window);
+    struct sl_window* window = sl_lookup_window(ctx, event->window);
     if (!window)
       return;
 
-    window->dark_frame = 0;
-
     if (event->state != XCB_PROPERTY_DELETE) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, window->id,
-                           ctx->atoms[ATOM_GTK_THEME_VARIANT].value,
-                           XCB_ATOM_ANY, 0, 2048),
-          NULL);
-      if (reply) {
-        if (xcb_get_property_value_length(reply) >= 4)
-          window->dark_frame = !strcmp(xcb_get_property_value(reply), "dark");
-        free(reply);
-      }
-    }
-
-    if (!window->aura_surface)
-      return;
-
-    frame_color = window->dark_frame ? ctx->dark_frame_color : ctx->frame_color;
-    zaura_surface_set_frame_colors(window->aura_surface, frame_color,
-                                   frame_color);
-  } else if (event->atom == ctx->atoms[ATOM_WL_SELECTION].value) {
-    if (event->window == ctx->selection_window &&
-        event->state == XCB_PROPERTY_NEW_VALUE &&
-        ctx->selection_incremental_transfer) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, ctx->selection_window,
-                           ctx->atoms[ATOM_WL_SELECTION].value,
-                           XCB_GET_PROPERTY_TYPE_ANY, 0, 0x1fffffff),
-          NULL);
-
-      if (!reply)
-        return;
-
-      if (xcb_get_property_value_length(reply) > 0) {
-        sl_write_selection_property(ctx, reply);
-      } else {
-        assert(!ctx->selection_send_event_source);
-        close(ctx->selection_data_source_send_fd);
-        ctx->selection_data_source_send_fd = -1;
-        free(reply);
-
-        sl_process_data_source_send_pending_list(ctx);
-      }
-    }
-  } else if (event->atom == ctx->selection_request.property) {
-    if (event->window == ctx->selection_request.requestor &&
-        event->state == XCB_PROPERTY_DELETE &&
-        ctx->selection_incremental_transfer) {
-      int data_size = ctx->selection_data.size;
-
-      ctx->selection_data_ack_pending = 0;
-
-      // Handle the case when there's more data to be received.
-      if (ctx->selection_data_offer_receive_fd >= 0) {
-        // Avoid sending empty data until transfer is complete.
-        if (data_size)
-          sl_send_selection_data(ctx);
-
-        if (!ctx->selection_event_source) {
-          ctx->selection_event_source = wl_event_loop_add_fd(
-              wl_display_get_event_loop(ctx->host_display),
-              ctx->selection_data_offer_receive_fd, WL_EVENT_READABLE,
-              sl_handle_selection_fd_readable, ctx);
-        }
-        return;
-      }
-
-      sl_send_selection_data(ctx);
-
-      // Release data if transfer is complete.
-      if (!data_size) {
-        ctx->selection_request.requestor = XCB_NONE;
-        wl_array_release(&ctx->selection_data);
-      }
+      sl_get_window_property(ctx, window,
+                             ctx->atoms[ATOM_GTK_THEME_VARIANT].value, 2048,
+                             sl_handle_gtk_theme_variant_reply);
+    } else {
+      sl_drop_property_requests(ctx, window->id, event->atom);
+      sl_handle_gtk_theme_variant_reply(window, NULL);
     }
+  } else if (event->window == ctx->selection_window) {
+    if (event->state == XCB_PROPERTY_NEW_VALUE)
+      sl_handle_data_source_transfer_property(ctx, event->atom);
+  } else if (event->state == XCB_PROPERTY_DELETE) {
+    sl_handle_selection_transfer_property_delete(ctx, event);
   }
 }
 
@@ -2603,20 +3492,11 @@ static void sl_internal_data_source_send(void* data,
   struct sl_data_source* host = data;
   struct sl_context* ctx = host->ctx;
 
-  xcb_intern_atom_cookie_t cookie =
-      xcb_intern_atom(ctx->connection, false, strlen(mime_type), mime_type);
-
-  if (ctx->selection_data_source_send_fd < 0) {
-    sl_begin_data_source_send(ctx, fd, cookie, host);
-  } else {
-    struct sl_data_source_send_request* request =
-        malloc(sizeof(struct sl_data_source_send_request));
+  // The mime types offered by our data source come from the atom cache, so
+  // this is expected to resolve without a round trip to the X server.
+  xcb_atom_t atom = sl_intern_atom(ctx, mime_type);
 
-    request->fd = fd;
-    request->cookie = cookie;
-    request->data_source = host;
-    wl_list_insert(&ctx->selection_data_source_send_pending, &request->link);
-  }
+  sl_data_source_transfer_create(ctx, fd, atom);
 }
 
 static void sl_internal_data_source_cancelled(
@@ -2633,18 +3513,6 @@ static const struct wl_data_source_listener sl_internal_data_source_listener = {
     sl_internal_data_source_target, sl_internal_data_source_send,
     sl_internal_data_source_cancelled};
 
-char* sl_copy_atom_name(xcb_get_atom_name_reply_t* reply) {
-  // The string produced by xcb_get_atom_name_name isn't null terminated, so we
-  // have to copy |name_len| bytes into a new buffer and add the null character
-  // ourselves.
-  char* name_start = xcb_get_atom_name_name(reply);
-  int name_len = xcb_get_atom_name_name_length(reply);
-  char* name = malloc(name_len + 1);
-  memcpy(name, name_start, name_len);
-  name[name_len] = '\0';
-  return name;
-}
-
 static void sl_get_selection_targets(struct sl_context* ctx) {
   struct sl_data_source* data_source = NULL;
   xcb_get_property_reply_t* reply;
@@ -2678,25 +3546,39 @@ static void sl_get_selection_targets(struct sl_context* ctx) {
     value = xcb_get_property_value(reply);
 
     // We need to convert all of the offered target types from X11 atoms to
-    // strings (i.e. getting the names of the atoms). Each conversion requires a
-    // round trip to the X server, but none of the requests depend on each
-    // other. Therefore, we can speed things up by sending out all the requests
-    // as a batch with xcb_get_atom_name, and then read all the replies as a
-    // batch with xcb_get_atom_name_reply.
+    // strings (i.e. getting the names of the atoms). Most of them are usually
+    // in the atom cache already. Each remaining conversion requires a round
+    // trip to the X server, but none of the requests depend on each other.
+    // Therefore, we can speed things up by sending out the requests for all
+    // cache misses as a batch with xcb_get_atom_name, and then read all the
+    // replies as a batch with xcb_get_atom_name_reply.
     xcb_get_atom_name_cookie_t* atom_name_cookies =
         malloc(sizeof(xcb_get_atom_name_cookie_t) * reply->value_len);
+    assert(atom_name_cookies);
     for (i = 0; i < reply->value_len; i++) {
-      atom_name_cookies[i] = xcb_get_atom_name(ctx->connection, value[i]);
+      if (sl_atom_cache_lookup_name(ctx, value[i]))
+        atom_name_cookies[i].sequence = 0;
+      else
+        atom_name_cookies[i] = xcb_get_atom_name(ctx->connection, value[i]);
     }
     for (i = 0; i < reply->value_len; i++) {
-      xcb_get_atom_name_reply_t* atom_name_reply =
-          xcb_get_atom_name_reply(ctx->connection, atom_name_cookies[i], NULL);
-      if (atom_name_reply) {
-        char* name = sl_copy_atom_name(atom_name_reply);
-        wl_data_source_offer(data_source->internal, name);
-        free(atom_name_reply);
-        free(name);
+      const char* name;
+
+      if (atom_name_cookies[i].sequence) {
+        xcb_get_atom_name_reply_t* atom_name_reply = xcb_get_atom_name_reply(
+            ctx->connection, atom_name_cookies[i], NULL);
+        if (atom_name_reply) {
+          if (!sl_atom_cache_lookup_name(ctx, value[i]))
+            sl_atom_cache_insert(
+                ctx, value[i], xcb_get_atom_name_name(atom_name_reply),
+                xcb_get_atom_name_name_length(atom_name_reply));
+          free(atom_name_reply);
+        }
       }
+
+      name = sl_atom_cache_lookup_name(ctx, value[i]);
+      if (name)
+        wl_data_source_offer(data_source->internal, name);
     }
     free(atom_name_cookies);
 
@@ -2706,178 +3588,199 @@ static void sl_get_selection_targets(struct sl_context* ctx) {
                                    ctx->default_seat->seat->last_serial);
     }
 
-    if (ctx->selection_data_source) {
-      wl_data_source_destroy(ctx->selection_data_source->internal);
-      free(ctx->selection_data_source);
-    }
-    ctx->selection_data_source = data_source;
-  }
-
-  free(reply);
-}
-
-static void sl_get_selection_data(struct sl_context* ctx) {
-  xcb_get_property_reply_t* reply = xcb_get_property_reply(
-      ctx->connection,
-      xcb_get_property(ctx->connection, 1, ctx->selection_window,
-                       ctx->atoms[ATOM_WL_SELECTION].value,
-                       XCB_GET_PROPERTY_TYPE_ANY, 0, 0x1fffffff),
-      NULL);
-  if (!reply)
-    return;
-
-  if (reply->type == ctx->atoms[ATOM_INCR].value) {
-    ctx->selection_incremental_transfer = 1;
-    free(reply);
-  } else {
-    ctx->selection_incremental_transfer = 0;
-    sl_write_selection_property(ctx, reply);
+    if (ctx->selection_data_source) {
+      wl_data_source_destroy(ctx->selection_data_source->internal);
+      free(ctx->selection_data_source);
+    }
+    ctx->selection_data_source = data_source;
   }
+
+  free(reply);
 }
 
 static void sl_handle_selection_notify(struct sl_context* ctx,
                                        xcb_selection_notify_event_t* event) {
-  if (event->property == XCB_ATOM_NONE)
-    return;
+  struct sl_data_source_transfer* transfer;
 
-  if (event->target == ctx->atoms[ATOM_TARGETS].value)
+  if (event->property == ctx->atoms[ATOM_WL_SELECTION].value) {
     sl_get_selection_targets(ctx);
-  else
-    sl_get_selection_data(ctx);
+    return;
+  }
+
+  // A refused conversion doesn't name our property, so fall back to matching
+  // the oldest transfer of that target.
+  wl_list_for_each(transfer, &ctx->data_source_transfers, link) {
+    if (transfer->notified)
+      continue;
+
+    if (event->property == XCB_ATOM_NONE) {
+      if (transfer->target == event->target) {
+        sl_data_source_transfer_destroy(transfer);
+        return;
+      }
+    } else if (transfer->property == event->property) {
+      transfer->notified = 1;
+      sl_data_source_transfer_fetch(transfer);
+      sl_data_source_transfer_receive(transfer);
+      return;
+    }
+  }
 }
 
-static void sl_send_targets(struct sl_context* ctx) {
+static void sl_send_targets(struct sl_context* ctx,
+                            xcb_selection_request_event_t* request) {
   xcb_change_property(
-      ctx->connection, XCB_PROP_MODE_REPLACE, ctx->selection_request.requestor,
-      ctx->selection_request.property, XCB_ATOM_ATOM, 32,
+      ctx->connection, XCB_PROP_MODE_REPLACE, request->requestor,
+      request->property, XCB_ATOM_ATOM, 32,
       ctx->selection_data_offer->atoms.size / sizeof(xcb_atom_t),
       ctx->selection_data_offer->atoms.data);
 
-  sl_send_selection_notify(ctx, ctx->selection_request.property);
+  sl_send_selection_notify(ctx, request, request->property);
 }
 
-static void sl_send_timestamp(struct sl_context* ctx) {
+static void sl_send_timestamp(struct sl_context* ctx,
+                              xcb_selection_request_event_t* request) {
   xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE,
-                      ctx->selection_request.requestor,
-                      ctx->selection_request.property, XCB_ATOM_INTEGER, 32, 1,
-                      &ctx->selection_timestamp);
+                      request->requestor, request->property, XCB_ATOM_INTEGER,
+                      32, 1, &ctx->selection_timestamp);
 
-  sl_send_selection_notify(ctx, ctx->selection_request.property);
+  sl_send_selection_notify(ctx, request, request->property);
 }
 
-static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
-  int rv, fd_to_receive, fd_to_wayland;
+static struct sl_selection_transfer* sl_selection_transfer_create(
+    struct sl_context* ctx,
+    xcb_selection_request_event_t* request,
+    xcb_atom_t data_type) {
+  struct sl_selection_transfer* transfer;
+
+  transfer = malloc(sizeof(*transfer));
+  assert(transfer);
+  transfer->ctx = ctx;
+  transfer->request = *request;
+  transfer->data_type = data_type;
+  wl_array_init(&transfer->data);
+  transfer->incremental = 0;
+  transfer->ack_pending = 0;
+  transfer->receive_fd = -1;
+  transfer->event_source = NULL;
+  transfer->cache_entry = NULL;
+  wl_array_init(&transfer->cached);
+  transfer->cached_offset = 0;
+  wl_list_insert(&ctx->selection_transfers, &transfer->link);
+
+  return transfer;
+}
 
-  if (!ctx->selection_data_offer) {
-    sl_send_selection_notify(ctx, XCB_ATOM_NONE);
-    return;
-  }
+static void sl_send_cached_data(struct sl_context* ctx,
+                                xcb_selection_request_event_t* request,
+                                struct sl_selection_cache_entry* entry) {
+  struct sl_selection_transfer* transfer;
+  void* p;
 
-  if (ctx->selection_event_source) {
-    fprintf(stderr, "error: selection transfer already pending\n");
-    sl_send_selection_notify(ctx, XCB_ATOM_NONE);
+  if (entry->data.size < ctx->selection_chunk_size) {
+    xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE,
+                        request->requestor, request->property, entry->target,
+                        /*format=*/8, entry->data.size, entry->data.data);
+    sl_metric_add(METRIC_CLIPBOARD_BYTES_TO_X, entry->data.size);
+    sl_send_selection_notify(ctx, request, request->property);
     return;
   }
 
-  ctx->selection_data_type = data_type;
-
-  // We will need the name of this atom later to tell the wayland server what
-  // type of data to send us, so start the request now.
-  xcb_get_atom_name_cookie_t atom_name_cookie =
-      xcb_get_atom_name(ctx->connection, data_type);
-
-  wl_array_init(&ctx->selection_data);
-  ctx->selection_data_ack_pending = 0;
-
-  switch (ctx->data_driver) {
-    case DATA_DRIVER_VIRTWL: {
-      struct virtwl_ioctl_new new_pipe = {
-          .type = VIRTWL_IOCTL_NEW_PIPE_READ,
-          .fd = -1,
-          .flags = 0,
-          .size = 0,
-      };
-
-      rv = ioctl(ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &new_pipe);
-      if (rv) {
-        fprintf(stderr, "error: failed to create virtwl pipe: %s\n",
-                strerror(errno));
-        sl_send_selection_notify(ctx, XCB_ATOM_NONE);
-        return;
-      }
+  // The transfer keeps its own copy as the cache entry goes away when the
+  // selection changes.
+  transfer = sl_selection_transfer_create(ctx, request, entry->target);
+  p = wl_array_add(&transfer->cached, entry->data.size);
+  assert(p);
+  memcpy(p, entry->data.data, entry->data.size);
 
-      fd_to_receive = new_pipe.fd;
-      fd_to_wayland = new_pipe.fd;
+  transfer->incremental = 1;
+  transfer->ack_pending = 1;
+  xcb_change_property(ctx->connection, XCB_PROP_MODE_REPLACE,
+                      request->requestor, request->property,
+                      ctx->atoms[ATOM_INCR].value, 32, 1,
+                      &ctx->selection_chunk_size);
+  sl_send_selection_notify(ctx, request, request->property);
+}
 
-    } break;
-    case DATA_DRIVER_NOOP: {
-      int p[2];
+static void sl_send_data(struct sl_context* ctx,
+                         xcb_selection_request_event_t* request,
+                         xcb_atom_t data_type) {
+  struct sl_selection_cache_entry* entry;
+  struct sl_selection_transfer* transfer;
+  int fd;
 
-      rv = pipe2(p, O_CLOEXEC | O_NONBLOCK);
-      assert(!rv);
+  if (!ctx->selection_data_offer) {
+    sl_send_selection_notify(ctx, request, XCB_ATOM_NONE);
+    return;
+  }
 
-      fd_to_receive = p[0];
-      fd_to_wayland = p[1];
+  entry = sl_selection_cache_lookup(ctx, data_type);
+  if (entry && entry->complete) {
+    sl_send_cached_data(ctx, request, entry);
+    return;
+  }
 
-    } break;
+  // We need the name of this atom to tell the wayland server what type of data
+  // to send us. If getting the atom name fails, notify the requestor that
+  // there won't be any data.
+  const char* name = sl_get_atom_name(ctx, data_type);
+  if (!name) {
+    sl_send_selection_notify(ctx, request, XCB_ATOM_NONE);
+    return;
   }
 
-  xcb_get_atom_name_reply_t* atom_name_reply =
-      xcb_get_atom_name_reply(ctx->connection, atom_name_cookie, NULL);
-  if (atom_name_reply) {
-    // If we got the atom name, then send the request to wayland and add our end
-    // of the pipe to the wayland event loop.
-    ctx->selection_data_offer_receive_fd = fd_to_receive;
-    char* name = sl_copy_atom_name(atom_name_reply);
-    wl_data_offer_receive(ctx->selection_data_offer->internal, name,
-                          fd_to_wayland);
-    free(atom_name_reply);
-    free(name);
-
-    ctx->selection_event_source = wl_event_loop_add_fd(
-        wl_display_get_event_loop(ctx->host_display),
-        ctx->selection_data_offer_receive_fd, WL_EVENT_READABLE,
-        sl_handle_selection_fd_readable, ctx);
-  } else {
-    // If getting the atom name failed, notify the requestor that there won't be
-    // any data, and close our end of the pipe.
-    close(fd_to_receive);
-    sl_send_selection_notify(ctx, XCB_ATOM_NONE);
+  fd = sl_receive_data_offer(ctx, ctx->selection_data_offer, name);
+  if (fd < 0) {
+    sl_send_selection_notify(ctx, request, XCB_ATOM_NONE);
+    return;
   }
 
-  // Close the wayland end of the pipe, now that it's either been sent or not
-  // going to be sent. The VIRTWL driver uses the same fd for both ends of the
-  // pipe, so don't close the fd if both ends are the same.
-  if (fd_to_receive != fd_to_wayland)
-    close(fd_to_wayland);
+  transfer = sl_selection_transfer_create(ctx, request, data_type);
+  transfer->receive_fd = fd;
+  // Keep a copy for later requests unless someone is already filling the
+  // cache for this target.
+  if (!entry)
+    transfer->cache_entry = sl_selection_cache_create(ctx, data_type);
+  transfer->event_source = wl_event_loop_add_fd(
+      wl_display_get_event_loop(ctx->host_display), transfer->receive_fd,
+      WL_EVENT_READABLE, sl_handle_selection_fd_readable, transfer);
+
+  // The first paste fetches the other text targets without waiting for the
+  // prefetch delay.
+  if (ctx->selection_prefetch_pending)
+    sl_selection_prefetch(ctx, ctx->selection_data_offer);
 }
 
 static void sl_handle_selection_request(struct sl_context* ctx,
                                         xcb_selection_request_event_t* event) {
-  ctx->selection_request = *event;
-  ctx->selection_incremental_transfer = 0;
-
   if (event->selection == ctx->atoms[ATOM_CLIPBOARD_MANAGER].value) {
-    sl_send_selection_notify(ctx, ctx->selection_request.property);
+    sl_send_selection_notify(ctx, event, event->property);
+    return;
+  }
+
+  // Our own window asks when the host offers our X11 data source back to
+  // us. Converting would read that source again, which asks us again.
+  if (event->requestor == ctx->selection_window) {
+    sl_send_selection_notify(ctx, event, XCB_ATOM_NONE);
     return;
   }
 
   if (event->target == ctx->atoms[ATOM_TARGETS].value) {
-    sl_send_targets(ctx);
+    sl_send_targets(ctx, event);
   } else if (event->target == ctx->atoms[ATOM_TIMESTAMP].value) {
-    sl_send_timestamp(ctx);
+    sl_send_timestamp(ctx, event);
   } else {
     int success = 0;
     xcb_atom_t* atom;
     wl_array_for_each(atom, &ctx->selection_data_offer->atoms) {
       if (event->target == *atom) {
         success = 1;
-        sl_send_data(ctx, *atom);
+        sl_send_data(ctx, event, *atom);
         break;
       }
     }
     if (!success) {
-      sl_send_selection_notify(ctx, XCB_ATOM_NONE);
+      sl_send_selection_notify(ctx, event, XCB_ATOM_NONE);
     }
   }
 }
@@ -2907,7 +3810,6 @@ static void sl_handle_xfixes_selection_notify(
     return;
   }
 
-  ctx->selection_incremental_transfer = 0;
   xcb_convert_selection(ctx->connection, ctx->selection_window,
                         ctx->atoms[ATOM_CLIPBOARD].value,
                         ctx->atoms[ATOM_TARGETS].value,
@@ -2979,6 +3881,11 @@ static int sl_handle_x_connection_event(int fd, uint32_t mask, void* data) {
     ++count;
   }
 
+  sl_process_property_requests(ctx);
+
+  if (count)
+    ctx->xwayland_idle = 0;
+
   if ((mask & ~WL_EVENT_WRITABLE) == 0)
     xcb_flush(ctx->connection);
 
@@ -3004,6 +3911,42 @@ static void sl_set_supported(struct sl_context* ctx) {
                       supported_atoms);
 }
 
+static const char* const sl_atom_names[ATOM_LAST + 1] = {
+    [ATOM_WM_S0] = "WM_S0",
+    [ATOM_WM_PROTOCOLS] = "WM_PROTOCOLS",
+    [ATOM_WM_STATE] = "WM_STATE",
+    [ATOM_WM_CHANGE_STATE] = "WM_CHANGE_STATE",
+    [ATOM_WM_DELETE_WINDOW] = "WM_DELETE_WINDOW",
+    [ATOM_WM_TAKE_FOCUS] = "WM_TAKE_FOCUS",
+    [ATOM_WM_CLIENT_LEADER] = "WM_CLIENT_LEADER",
+    [ATOM_WL_SURFACE_ID] = "WL_SURFACE_ID",
+    [ATOM_UTF8_STRING] = "UTF8_STRING",
+    [ATOM_MOTIF_WM_HINTS] = "_MOTIF_WM_HINTS",
+    [ATOM_NET_ACTIVE_WINDOW] = "_NET_ACTIVE_WINDOW",
+    [ATOM_NET_FRAME_EXTENTS] = "_NET_FRAME_EXTENTS",
+    [ATOM_NET_STARTUP_ID] = "_NET_STARTUP_ID",
+    [ATOM_NET_SUPPORTED] = "_NET_SUPPORTED",
+    [ATOM_NET_SUPPORTING_WM_CHECK] = "_NET_SUPPORTING_WM_CHECK",
+    [ATOM_NET_WM_NAME] = "_NET_WM_NAME",
+    [ATOM_NET_WM_MOVERESIZE] = "_NET_WM_MOVERESIZE",
+    [ATOM_NET_WM_STATE] = "_NET_WM_STATE",
+    [ATOM_NET_WM_STATE_FULLSCREEN] = "_NET_WM_STATE_FULLSCREEN",
+    [ATOM_NET_WM_STATE_MAXIMIZED_VERT] = "_NET_WM_STATE_MAXIMIZED_VERT",
+    [ATOM_NET_WM_STATE_MAXIMIZED_HORZ] = "_NET_WM_STATE_MAXIMIZED_HORZ",
+    [ATOM_CLIPBOARD] = "CLIPBOARD",
+    [ATOM_CLIPBOARD_MANAGER] = "CLIPBOARD_MANAGER",
+    [ATOM_TARGETS] = "TARGETS",
+    [ATOM_TIMESTAMP] = "TIMESTAMP",
+    [ATOM_TEXT] = "TEXT",
+    [ATOM_INCR] = "INCR",
+    [ATOM_WL_SELECTION] = "_WL_SELECTION",
+    [ATOM_GTK_THEME_VARIANT] = "_GTK_THEME_VARIANT",
+};
+
+// Upper bound for selection chunks. This bounds the memory used by each
+// transfer no matter how large the payload is.
+static const uint32_t sl_max_selection_chunk_size = 1024 * 1024;
+
 static void sl_connect(struct sl_context* ctx) {
   const char wm_name[] = "Sommelier";
   const xcb_setup_t* setup;
@@ -3022,9 +3965,10 @@ static void sl_connect(struct sl_context* ctx) {
 
   xcb_prefetch_extension_data(ctx->connection, &xcb_xfixes_id);
   xcb_prefetch_extension_data(ctx->connection, &xcb_composite_id);
+  xcb_prefetch_maximum_request_length(ctx->connection);
 
   for (i = 0; i < ARRAY_SIZE(ctx->atoms); ++i) {
-    const char* name = ctx->atoms[i].name;
+    const char* name = sl_atom_names[i];
     ctx->atoms[i].cookie =
         xcb_intern_atom(ctx->connection, 0, strlen(name), name);
   }
@@ -3085,8 +4029,18 @@ static void sl_connect(struct sl_context* ctx) {
     assert(!error);
     ctx->atoms[i].value = atom_reply->atom;
     free(atom_reply);
+    sl_atom_cache_insert(ctx, ctx->atoms[i].value, sl_atom_names[i],
+                         strlen(sl_atom_names[i]));
   }
 
+  // Selection data moves in chunks that fit into a single ChangeProperty
+  // request, including the extra length field of BIG-REQUESTS.
+  ctx->selection_chunk_size =
+      MIN(xcb_get_maximum_request_length(ctx->connection) * 4 -
+              sizeof(xcb_change_property_request_t) - sizeof(uint32_t),
+          sl_max_selection_chunk_size) &
+      ~3u;
+
   depth_iterator = xcb_screen_allowed_depths_iterator(ctx->screen);
   while (depth_iterator.rem > 0) {
     int depth = depth_iterator.data->depth;
@@ -3145,6 +4099,74 @@ static void sl_connect(struct sl_context* ctx) {
   xcb_flush(ctx->connection);
 }
 
+// Drops all state that belongs to the X server so that sl_connect can be
+// used with a new one.
+static void sl_disconnect(struct sl_context* ctx) {
+  struct sl_selection_transfer* selection_transfer;
+  struct sl_selection_transfer* next_selection_transfer;
+  struct sl_data_source_transfer* data_source_transfer;
+  struct sl_data_source_transfer* next_data_source_transfer;
+  struct sl_property_request* request;
+  struct sl_property_request* next_request;
+  struct sl_window* window;
+  struct sl_window* next_window;
+  struct sl_atom_name* entry;
+
+  wl_list_for_each_safe(selection_transfer, next_selection_transfer,
+                        &ctx->selection_transfers, link) {
+    sl_selection_transfer_destroy(selection_transfer);
+  }
+  wl_list_for_each_safe(data_source_transfer, next_data_source_transfer,
+                        &ctx->data_source_transfers, link) {
+    sl_data_source_transfer_destroy(data_source_transfer);
+  }
+  wl_list_for_each_safe(request, next_request, &ctx->property_requests, link) {
+    wl_list_remove(&request->link);
+    free(request);
+  }
+  wl_list_for_each_safe(window, next_window, &ctx->windows, link) {
+    sl_destroy_window(window);
+  }
+  wl_list_for_each_safe(window, next_window, &ctx->unpaired_windows, link) {
+    sl_destroy_window(window);
+  }
+
+  sl_set_selection(ctx, NULL);
+  if (ctx->selection_data_source) {
+    wl_data_source_destroy(ctx->selection_data_source->internal);
+    free(ctx->selection_data_source);
+    ctx->selection_data_source = NULL;
+  }
+  if (ctx->selection_data_device) {
+    wl_data_device_destroy(ctx->selection_data_device);
+    ctx->selection_data_device = NULL;
+  }
+  ctx->selection_owner = XCB_WINDOW_NONE;
+  ctx->selection_window = XCB_WINDOW_NONE;
+  ctx->host_focus_window = NULL;
+  ctx->needs_set_input_focus = 0;
+
+  wl_event_source_remove(ctx->connection_event_source);
+  ctx->connection_event_source = NULL;
+  xcb_disconnect(ctx->connection);
+  ctx->connection = NULL;
+  ctx->xfixes_extension = NULL;
+  ctx->screen = NULL;
+  ctx->window = XCB_WINDOW_NONE;
+
+  // Atoms and everything derived from them are specific to the server.
+  wl_array_for_each(entry, &ctx->atom_names) {
+    free(entry->name);
+  }
+  wl_array_release(&ctx->atom_names);
+  wl_array_init(&ctx->atom_names);
+  wl_array_release(&ctx->selection_properties);
+  wl_array_init(&ctx->selection_properties);
+  ctx->selection_property_count = 0;
+  memset(ctx->visual_ids, 0, sizeof(ctx->visual_ids));
+  memset(ctx->colormaps, 0, sizeof(ctx->colormaps));
+}
+
 static void sl_sd_notify(const char* state) {
   const char* socket_name;
   struct msghdr msghdr;
@@ -3179,6 +4201,15 @@ static void sl_sd_notify(const char* state) {
   UNUSED(rv);
 }
 
+static int sl_handle_sigusr1(int signal_number, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  sl_metrics_write(ctx, stderr, METRICS_FORMAT_JSON);
+  sl_profile_print(stderr);
+  sl_latency_report(ctx, stderr);
+  return 1;
+}
+
 static int sl_handle_sigchld(int signal_number, void* data) {
   struct sl_context* ctx = (struct sl_context*)data;
   int status;
@@ -3193,6 +4224,8 @@ static int sl_handle_sigchld(int signal_number, void* data) {
       if (ctx->exit_with_child) {
         if (ctx->xwayland_pid >= 0)
           kill(ctx->xwayland_pid, SIGTERM);
+        else if (ctx->x_listen_fds[0] != -1)
+          exit(EXIT_SUCCESS);
       } else {
         // Notify systemd that we are ready to accept connections now that
         // child process has finished running and all environment is ready.
@@ -3212,6 +4245,19 @@ static int sl_handle_sigchld(int signal_number, void* data) {
   return 1;
 }
 
+// libwayland blocks the signals it watches through the event loop, and both
+// the blocked mask and ignored dispositions survive exec.
+static void sl_reset_signals_for_exec(void) {
+  sigset_t signals;
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGCHLD);
+  sigprocmask(SIG_UNBLOCK, &signals, NULL);
+  signal(SIGUSR1, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+}
+
 static void sl_execvp(const char* file,
                       char* const argv[],
                       int wayland_socked_fd) {
@@ -3223,6 +4269,7 @@ static void sl_execvp(const char* file,
 
   setenv("SOMMELIER_VERSION", SOMMELIER_VERSION, 1);
 
+  sl_reset_signals_for_exec();
   execvp(file, argv);
   perror(file);
 }
@@ -3265,14 +4312,34 @@ static void sl_calculate_scale_for_xwayland(struct sl_context* ctx) {
       sl_output_send_host_output_state(output);
 }
 
+static void sl_spawn_child(struct sl_context* ctx) {
+  pid_t pid;
+
+  putenv(sl_xasprintf("XCURSOR_SIZE=%d",
+                      (int)(XCURSOR_SIZE_BASE * ctx->scale + 0.5)));
+
+  pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    sl_execvp(ctx->runprog[0], ctx->runprog, -1);
+    _exit(EXIT_FAILURE);
+  }
+
+  ctx->child_pid = pid;
+}
+
 static int sl_handle_display_ready_event(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = (struct sl_context*)data;
   char display_name[9];
   int bytes_read = 0;
-  pid_t pid;
 
-  if (!(mask & WL_EVENT_READABLE))
+  // Xwayland went away before it was ready.
+  if (!(mask & WL_EVENT_READABLE)) {
+    wl_event_source_remove(ctx->display_ready_event_source);
+    ctx->display_ready_event_source = NULL;
+    close(fd);
     return 0;
+  }
 
   display_name[0] = ':';
   do {
@@ -3293,198 +4360,662 @@ static int sl_handle_display_ready_event(int fd, uint32_t mask, void* data) {
   setenv("DISPLAY", display_name, 1);
 
   sl_connect(ctx);
+  sl_trace_startup(ctx, "xwayland connected");
 
   wl_event_source_remove(ctx->display_ready_event_source);
   ctx->display_ready_event_source = NULL;
   close(fd);
 
-  // Calculate scale now that the default scale factor is known. This also
-  // happens to workaround an issue in Xwayland where an output update is
-  // needed for DPI to be set correctly.
-  sl_calculate_scale_for_xwayland(ctx);
-  wl_display_flush_clients(ctx->host_display);
+  // Calculate scale now that the default scale factor is known. This also
+  // happens to workaround an issue in Xwayland where an output update is
+  // needed for DPI to be set correctly.
+  sl_calculate_scale_for_xwayland(ctx);
+  wl_display_flush_clients(ctx->host_display);
+
+  // A lazily started Xwayland gets its clients from the sockets we listen
+  // on, and the child has been running since then.
+  if (ctx->x_listen_fds[0] == -1)
+    sl_spawn_child(ctx);
+
+  return 1;
+}
+
+static void sl_sigchld_handler(int signal) {
+  while (waitpid(-1, NULL, WNOHANG) > 0)
+    continue;
+}
+
+// The forking master has no metrics of its own to report. Catching SIGUSR1
+// keeps it alive, and unlike SIG_IGN the handler is not inherited across exec.
+static void sl_sigusr1_handler(int signal) {}
+
+static void sl_client_destroy_notify(struct wl_listener* listener, void* data) {
+  exit(0);
+}
+
+static void sl_client_created_notify(struct wl_listener* listener, void* data) {
+  struct sl_context* ctx =
+      wl_container_of(listener, ctx, client_created_listener);
+
+  sl_set_display_implementation(ctx, (struct wl_client*)data);
+}
+
+// Runs |runprog| with WAYLAND_DISPLAY pointing at |socket_name| and waits
+// for it to exit.
+static void sl_run_and_wait(char** runprog, const char* socket_name) {
+  pid_t pid;
+
+  pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    setenv("WAYLAND_DISPLAY", socket_name, 1);
+    sl_execvp(runprog[0], runprog, -1);
+    _exit(EXIT_FAILURE);
+  }
+  while (waitpid(-1, NULL, WNOHANG) != pid)
+    continue;
+}
+
+// Break |str| into a sequence of zero or more nonempty arguments. No more
+// than |argc| arguments will be added to |argv|. Returns the total number of
+// argments found in |str|.
+static int sl_parse_cmd_prefix(char* str, int argc, char** argv) {
+  char* s = str;
+  int n = 0;
+  int delim = 0;
+
+  do {
+    // Look for ending delimiter if |delim| is set.
+    if (delim) {
+      if (*s == delim) {
+        delim = 0;
+        *s = '\0';
+      }
+      ++s;
+    } else {
+      // Skip forward to first non-space character.
+      while (*s == ' ' && *s != '\0')
+        ++s;
+
+      // Check for quote delimiter.
+      if (*s == '"') {
+        delim = '"';
+        ++s;
+      } else {
+        delim = ' ';
+      }
+
+      // Add string to arguments if there's room.
+      if (n < argc)
+        argv[n] = s;
+
+      ++n;
+    }
+  } while (*s != '\0');
+
+  return n;
+}
+
+// Starts Xwayland with |wayland_fd| as its Wayland connection.
+static void sl_spawn_xwayland(struct sl_context* ctx, int wayland_fd) {
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+  int ds[2], wm[2];
+  pid_t pid;
+  int rv;
+
+  // Xwayland display ready socket.
+  rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ds);
+  assert(!rv);
+
+  ctx->display_ready_event_source =
+      wl_event_loop_add_fd(event_loop, ds[0], WL_EVENT_READABLE,
+                           sl_handle_display_ready_event, ctx);
+
+  // X connection to Xwayland.
+  rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, wm);
+  assert(!rv);
+
+  ctx->wm_fd = wm[0];
+
+  pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    char* display_fd_str;
+    char* wm_fd_str;
+    char* xwayland_cmd_prefix_str;
+    char* args[64];
+    int i = 0, j;
+    int fd;
+
+    if (ctx->xwayland_cmd_prefix) {
+      xwayland_cmd_prefix_str = sl_xasprintf("%s", ctx->xwayland_cmd_prefix);
+
+      i = sl_parse_cmd_prefix(xwayland_cmd_prefix_str, 32, args);
+      if (i > 32) {
+        fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
+        i = 0;
+      }
+    }
+
+    args[i++] = sl_xasprintf("%s", ctx->xwayland_path ?: XWAYLAND_PATH);
+
+    fd = dup(ds[1]);
+    display_fd_str = sl_xasprintf("%d", fd);
+    fd = dup(wm[1]);
+    wm_fd_str = sl_xasprintf("%d", fd);
+
+    if (ctx->xdisplay > 0 || ctx->x_listen_fds[0] != -1) {
+      args[i++] = sl_xasprintf(":%d", ctx->xdisplay);
+    }
+    // Clients are already waiting on the sockets we listen on.
+    for (j = 0; j < ARRAY_SIZE(ctx->x_listen_fds); ++j) {
+      if (ctx->x_listen_fds[j] != -1) {
+        fd = dup(ctx->x_listen_fds[j]);
+        args[i++] = "-listen";
+        args[i++] = sl_xasprintf("%d", fd);
+      }
+    }
+    args[i++] = "-nolisten";
+    args[i++] = "tcp";
+    args[i++] = "-rootless";
+    // Use software rendering unless we have a DRM device and glamor is
+    // enabled.
+    if (!ctx->drm_device || !ctx->glamor)
+      args[i++] = "-shm";
+    args[i++] = "-displayfd";
+    args[i++] = display_fd_str;
+    args[i++] = "-wm";
+    args[i++] = wm_fd_str;
+    if (ctx->xauth_path) {
+      args[i++] = "-auth";
+      args[i++] = sl_xasprintf("%s", ctx->xauth_path);
+    }
+    if (ctx->xfont_path) {
+      args[i++] = "-fp";
+      args[i++] = sl_xasprintf("%s", ctx->xfont_path);
+    }
+    args[i++] = NULL;
+
+    // If a path is explicitly specified via command line or environment
+    // use that instead of the compiled in default.  In either case, only
+    // set the environment variable if the value specified is non-empty.
+    if (ctx->xwayland_gl_driver_path) {
+      if (*ctx->xwayland_gl_driver_path) {
+        setenv("LIBGL_DRIVERS_PATH", ctx->xwayland_gl_driver_path, 1);
+      }
+    } else if (XWAYLAND_GL_DRIVER_PATH && *XWAYLAND_GL_DRIVER_PATH) {
+      setenv("LIBGL_DRIVERS_PATH", XWAYLAND_GL_DRIVER_PATH, 1);
+    }
+
+    sl_execvp(args[0], args, wayland_fd);
+    _exit(EXIT_FAILURE);
+  }
+  close(ds[1]);
+  close(wm[1]);
+  ctx->xwayland_pid = pid;
+}
+
+// Lazily started Xwayland listens on sockets created by us, so X clients can
+// connect before it runs. The lock file and sockets follow the conventions of
+// the X server. Stale ones are taken over, like the X server does.
+static int sl_lock_xdisplay(int display) {
+  char path[64];
+  char pid[12];
+  ssize_t bytes;
+  int fd;
+
+  snprintf(path, sizeof(path), "/tmp/.X%d-lock", display);
+  fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+  if (fd < 0 && errno == EEXIST) {
+    char* end;
+    long other;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return 0;
+    bytes = read(fd, pid, sizeof(pid) - 1);
+    close(fd);
+    if (bytes != sizeof(pid) - 1)
+      return 0;
+    pid[bytes] = '\0';
+
+    other = strtol(pid, &end, 10);
+    if (end != pid + 10 || kill(other, 0) == 0 || errno != ESRCH)
+      return 0;
+    if (unlink(path))
+      return 0;
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+  }
+  if (fd < 0)
+    return 0;
+
+  snprintf(pid, sizeof(pid), "%10d\n", getpid());
+  bytes = write(fd, pid, sizeof(pid) - 1);
+  close(fd);
+  if (bytes != sizeof(pid) - 1) {
+    unlink(path);
+    return 0;
+  }
+
+  return 1;
+}
+
+static int sl_bind_xdisplay_socket(struct sockaddr_un* addr,
+                                   socklen_t length) {
+  int fd;
+
+  fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  if (bind(fd, (struct sockaddr*)addr, length) < 0 || listen(fd, 128) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Takes over X display |display|. Returns 0 if it is in use.
+static int sl_listen_on_xdisplay(struct sl_context* ctx, int display) {
+  struct sockaddr_un addr;
+  int n = 0;
+  int fd;
+
+  if (!sl_lock_xdisplay(display))
+    return 0;
+
+  addr.sun_family = AF_LOCAL;
+#ifdef __linux__
+  // Abstract socket, which is what X clients try first.
+  addr.sun_path[0] = '\0';
+  snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "/tmp/.X11-unix/X%d",
+           display);
+  fd = sl_bind_xdisplay_socket(
+      &addr,
+      offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr.sun_path + 1));
+  if (fd >= 0)
+    ctx->x_listen_fds[n++] = fd;
+#endif
+
+  mkdir("/tmp/.X11-unix", 01777);
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/.X11-unix/X%d",
+           display);
+  unlink(addr.sun_path);
+  fd = sl_bind_xdisplay_socket(
+      &addr, offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path));
+  if (fd >= 0)
+    ctx->x_listen_fds[n++] = fd;
 
-  putenv(sl_xasprintf("XCURSOR_SIZE=%d",
-                      (int)(XCURSOR_SIZE_BASE * ctx->scale + 0.5)));
+  if (!n) {
+    char* lock_path = sl_xasprintf("/tmp/.X%d-lock", display);
 
-  pid = fork();
-  assert(pid >= 0);
-  if (pid == 0) {
-    sl_execvp(ctx->runprog[0], ctx->runprog, -1);
-    _exit(EXIT_FAILURE);
+    unlink(lock_path);
+    free(lock_path);
+    return 0;
   }
 
-  ctx->child_pid = pid;
+  ctx->xdisplay = display;
+  return 1;
+}
 
+static void sl_start_xwayland(struct sl_context* ctx);
+
+static int sl_handle_x_listen_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  sl_start_xwayland(ctx);
   return 1;
 }
 
-static void sl_sigchld_handler(int signal) {
-  while (waitpid(-1, NULL, WNOHANG) > 0)
-    continue;
+static void sl_watch_xdisplay(struct sl_context* ctx) {
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(ctx->x_listen_fds); ++i) {
+    if (ctx->x_listen_fds[i] != -1)
+      ctx->x_listen_event_sources[i] =
+          wl_event_loop_add_fd(event_loop, ctx->x_listen_fds[i],
+                               WL_EVENT_READABLE, sl_handle_x_listen_event, ctx);
+  }
 }
 
-static void sl_client_destroy_notify(struct wl_listener* listener, void* data) {
-  exit(0);
+static void sl_xwayland_destroy_notify(struct wl_listener* listener,
+                                       void* data) {
+  struct sl_context* ctx =
+      wl_container_of(listener, ctx, xwayland_destroy_listener);
+
+  if (!ctx->xwayland_stopping)
+    exit(0);
+
+  // Xwayland was stopped for being idle. Forget everything about it and
+  // start a new one when the next X client connects.
+  ctx->xwayland_stopping = 0;
+  ctx->client = NULL;
+  if (ctx->connection) {
+    sl_disconnect(ctx);
+  } else if (ctx->wm_fd >= 0) {
+    close(ctx->wm_fd);
+  }
+  ctx->wm_fd = -1;
+
+  sl_watch_xdisplay(ctx);
 }
 
-static int sl_handle_virtwl_ctx_event(int fd, uint32_t mask, void* data) {
+// Xwayland is stopped once it has had no windows and sent us no events for a
+// full timeout period.
+static int sl_handle_xwayland_idle_timer(void* data) {
   struct sl_context* ctx = (struct sl_context*)data;
-  uint8_t ioctl_buffer[4096];
-  struct virtwl_ioctl_txn* ioctl_recv = (struct virtwl_ioctl_txn*)ioctl_buffer;
-  void* recv_data = ioctl_buffer + sizeof(struct virtwl_ioctl_txn);
-  size_t max_recv_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
-  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
-  struct msghdr msg = {0};
-  struct iovec buffer_iov;
-  ssize_t bytes;
-  int fd_count;
-  int rv;
 
-  ioctl_recv->len = max_recv_size;
-  rv = ioctl(fd, VIRTWL_IOCTL_RECV, ioctl_recv);
-  if (rv) {
-    close(ctx->virtwl_socket_fd);
-    ctx->virtwl_socket_fd = -1;
+  if (ctx->xwayland_idle && wl_list_empty(&ctx->windows) &&
+      wl_list_empty(&ctx->unpaired_windows) && ctx->xwayland_pid >= 0) {
+    ctx->xwayland_stopping = 1;
+    kill(ctx->xwayland_pid, SIGTERM);
     return 0;
   }
 
-  buffer_iov.iov_base = recv_data;
-  buffer_iov.iov_len = ioctl_recv->len;
+  ctx->xwayland_idle = 1;
+  wl_event_source_timer_update(ctx->xwayland_idle_timer,
+                               ctx->xwayland_idle_timeout * 1000);
+  return 0;
+}
 
-  msg.msg_iov = &buffer_iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = fd_buffer;
+static void sl_start_xwayland(struct sl_context* ctx) {
+  int sv[2];
+  int rv;
+  int i;
 
-  // Count how many FDs the kernel gave us.
-  for (fd_count = 0; fd_count < VIRTWL_SEND_MAX_ALLOCS; fd_count++) {
-    if (ioctl_recv->fds[fd_count] < 0)
-      break;
+  for (i = 0; i < ARRAY_SIZE(ctx->x_listen_event_sources); ++i) {
+    if (ctx->x_listen_event_sources[i]) {
+      wl_event_source_remove(ctx->x_listen_event_sources[i]);
+      ctx->x_listen_event_sources[i] = NULL;
+    }
   }
-  if (fd_count) {
-    struct cmsghdr* cmsg;
 
-    // Need to set msg_controllen so CMSG_FIRSTHDR will return the first
-    // cmsghdr. We copy every fd we just received from the ioctl into this
-    // cmsghdr.
-    msg.msg_controllen = sizeof(fd_buffer);
-    cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
-    memcpy(CMSG_DATA(cmsg), ioctl_recv->fds, fd_count * sizeof(int));
-    msg.msg_controllen = cmsg->cmsg_len;
+  rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+  assert(!rv);
+  UNUSED(rv);
+
+  ctx->client = wl_client_create(ctx->host_display, sv[0]);
+  sl_set_display_implementation(ctx, ctx->client);
+  ctx->xwayland_destroy_listener.notify = sl_xwayland_destroy_notify;
+  wl_client_add_destroy_listener(ctx->client, &ctx->xwayland_destroy_listener);
+
+  sl_spawn_xwayland(ctx, sv[1]);
+  close(sv[1]);
+
+  if (ctx->xwayland_idle_timeout) {
+    if (!ctx->xwayland_idle_timer)
+      ctx->xwayland_idle_timer = wl_event_loop_add_timer(
+          wl_display_get_event_loop(ctx->host_display),
+          sl_handle_xwayland_idle_timer, ctx);
+    ctx->xwayland_idle = 0;
+    wl_event_source_timer_update(ctx->xwayland_idle_timer,
+                                 ctx->xwayland_idle_timeout * 1000);
   }
+}
 
-  bytes = sendmsg(ctx->virtwl_socket_fd, &msg, MSG_NOSIGNAL);
-  assert(bytes == ioctl_recv->len);
-  UNUSED(bytes);
+// Sent by the master along with the client fd when a warm peer takes over a
+// connection.
+struct sl_peer_handoff {
+  pid_t peer_pid;
+  // CLOCK_MONOTONIC time at which the client was accepted, in nanoseconds.
+  uint64_t accept_time;
+};
 
-  while (fd_count--)
-    close(ioctl_recv->fds[fd_count]);
+// Peer sommelier started ahead of time by the master. It connects to the host
+// and then waits on |fd| for a client.
+struct sl_warm_peer {
+  pid_t pid;
+  int fd;
+  int ready;
+};
 
-  return 1;
+uint64_t sl_monotonic_time_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
-  struct sl_context* ctx = (struct sl_context*)data;
-  uint8_t ioctl_buffer[4096];
-  struct virtwl_ioctl_txn* ioctl_send = (struct virtwl_ioctl_txn*)ioctl_buffer;
-  void* send_data = ioctl_buffer + sizeof(struct virtwl_ioctl_txn);
-  size_t max_send_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
-  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
-  struct iovec buffer_iov;
-  struct msghdr msg = {0};
-  struct cmsghdr* cmsg;
-  ssize_t bytes;
-  int fd_count = 0;
-  int rv;
-  int i;
+void sl_trace_startup(struct sl_context* ctx, const char* phase) {
+  if (ctx->startup_trace_fd == -1)
+    return;
+
+  dprintf(ctx->startup_trace_fd, "startup[%d]: %9.3f ms %s\n", getpid(),
+          (sl_monotonic_time_ns() - ctx->startup_time) / 1e6, phase);
 
-  buffer_iov.iov_base = send_data;
-  buffer_iov.iov_len = max_send_size;
+  // Nothing after the first frame is startup.
+  if (strcmp(phase, "first frame") == 0) {
+    if (ctx->startup_trace_fd != STDERR_FILENO)
+      close(ctx->startup_trace_fd);
+    ctx->startup_trace_fd = -1;
+  }
+}
+
+// The xkb context is only needed to compile keymaps, so short-lived peers
+// that never see a keyboard don't pay for loading xkb-data.
+struct xkb_context* sl_get_xkb_context(struct sl_context* ctx) {
+  if (!ctx->xkb_context) {
+    // The success of this depends on xkb-data being installed.
+    ctx->xkb_context = xkb_context_new(0);
+    if (!ctx->xkb_context) {
+      fprintf(stderr, "error: xkb_context_new failed. xkb-data missing?\n");
+      exit(EXIT_FAILURE);
+    }
+    sl_trace_startup(ctx, "xkb context created");
+  }
+  return ctx->xkb_context;
+}
+
+// Creating the gbm device loads the driver backend, which is only needed once
+// the dmabuf shm driver allocates its first buffer.
+struct gbm_device* sl_get_gbm_device(struct sl_context* ctx) {
+  if (!ctx->gbm && ctx->drm_fd != -1) {
+    ctx->gbm = gbm_create_device(ctx->drm_fd);
+    if (!ctx->gbm) {
+      fprintf(stderr, "error: couldn't get display device\n");
+      exit(EXIT_FAILURE);
+    }
+    sl_trace_startup(ctx, "gbm device created");
+  }
+  return ctx->gbm;
+}
 
-  msg.msg_iov = &buffer_iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = fd_buffer;
-  msg.msg_controllen = sizeof(fd_buffer);
+// Runs a peer sommelier with |peer_args| followed by the flags forwarded from
+// the master's command line. Only returns if exec fails.
+static void sl_execvp_peer(const char* peer_cmd_prefix,
+                           int argc,
+                           char** argv,
+                           char* const* peer_args) {
+  char* peer_cmd_prefix_str;
+  char* args[64];
+  int i = 0, j;
+
+  if (!peer_cmd_prefix)
+    peer_cmd_prefix = PEER_CMD_PREFIX;
+
+  if (peer_cmd_prefix) {
+    peer_cmd_prefix_str = sl_xasprintf("%s", peer_cmd_prefix);
+
+    i = sl_parse_cmd_prefix(peer_cmd_prefix_str, 32, args);
+    if (i > 32) {
+      fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
+      i = 0;
+    }
+  }
 
-  bytes = recvmsg(ctx->virtwl_socket_fd, &msg, 0);
-  assert(bytes > 0);
+  args[i++] = argv[0];
+  for (j = 0; peer_args[j]; ++j)
+    args[i++] = peer_args[j];
+
+  // forward some flags.
+  for (j = 1; j < argc; ++j) {
+    char* arg = argv[j];
+    if (strstr(arg, "--display") == arg || strstr(arg, "--scale") == arg ||
+        strstr(arg, "--accelerators") == arg ||
+        strstr(arg, "--virtwl-device") == arg ||
+        strstr(arg, "--drm-device") == arg ||
+        strstr(arg, "--shm-driver") == arg ||
+        strstr(arg, "--data-driver") == arg ||
+        strstr(arg, "--trace-startup") == arg ||
+        strstr(arg, "--coalesce-motion") == arg ||
+        strstr(arg, "--profile-protocol") == arg ||
+        strstr(arg, "--trace-frames") == arg ||
+        strstr(arg, "--trace-marker") == arg ||
+        strstr(arg, "--latency-probe") == arg) {
+      args[i++] = arg;
+    }
+  }
 
-  // If there were any FDs recv'd by recvmsg, there will be some data in the
-  // msg_control buffer. To get the FDs out we iterate all cmsghdr's within and
-  // unpack the FDs if the cmsghdr type is SCM_RIGHTS.
-  for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
-       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-    size_t cmsg_fd_count;
+  args[i++] = NULL;
 
-    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
-      continue;
+  sl_reset_signals_for_exec();
+  execvp(args[0], args);
+}
 
-    cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+static void sl_spawn_warm_peer(struct sl_warm_peer* peer,
+                               const char* peer_cmd_prefix,
+                               int argc,
+                               char** argv,
+                               int sock_fd,
+                               int lock_fd) {
+  pid_t pid;
+  int sv[2];
+  int rv;
 
-    // fd_count will never exceed VIRTWL_SEND_MAX_ALLOCS because the
-    // control message buffer only allocates enough space for that many FDs.
-    memcpy(&ioctl_send->fds[fd_count], CMSG_DATA(cmsg),
-           cmsg_fd_count * sizeof(int));
-    fd_count += cmsg_fd_count;
+  rv = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+  if (rv) {
+    fprintf(stderr, "error: failed to create peer socket: %m\n");
+    return;
   }
 
-  for (i = fd_count; i < VIRTWL_SEND_MAX_ALLOCS; ++i)
-    ioctl_send->fds[i] = -1;
+  pid = fork();
+  assert(pid != -1);
+  if (pid == 0) {
+    char* peer_args[] = {sl_xasprintf("--warm-peer-fd=%d", sv[1]), NULL};
 
-  // The FDs and data were extracted from the recvmsg call into the ioctl_send
-  // structure which we now pass along to the kernel.
-  ioctl_send->len = bytes;
-  rv = ioctl(ctx->virtwl_ctx_fd, VIRTWL_IOCTL_SEND, ioctl_send);
-  assert(!rv);
-  UNUSED(rv);
+    close(sock_fd);
+    close(lock_fd);
+    close(sv[0]);
+    fcntl(sv[1], F_SETFD, 0);
 
-  while (fd_count--)
-    close(ioctl_send->fds[fd_count]);
+    sl_execvp_peer(peer_cmd_prefix, argc, argv, peer_args);
+    _exit(EXIT_FAILURE);
+  }
+  close(sv[1]);
 
-  return 1;
+  peer->pid = pid;
+  peer->fd = sv[0];
+  peer->ready = 0;
 }
 
-// Break |str| into a sequence of zero or more nonempty arguments. No more
-// than |argc| arguments will be added to |argv|. Returns the total number of
-// argments found in |str|.
-static int sl_parse_cmd_prefix(char* str, int argc, char** argv) {
-  char* s = str;
-  int n = 0;
-  int delim = 0;
+// Passes |client_fd| to |peer| and empties the pool slot. Returns 0 if the
+// peer received the client.
+static int sl_handoff_to_warm_peer(struct sl_warm_peer* peer,
+                                   int client_fd,
+                                   pid_t peer_pid,
+                                   uint64_t accept_time) {
+  struct sl_peer_handoff handoff;
+  struct msghdr msghdr;
+  struct iovec iovec;
+  struct cmsghdr* cmsg;
+  char control[CMSG_SPACE(sizeof(int))];
+  ssize_t rv;
 
-  do {
-    // Look for ending delimiter if |delim| is set.
-    if (delim) {
-      if (*s == delim) {
-        delim = 0;
-        *s = '\0';
-      }
-      ++s;
-    } else {
-      // Skip forward to first non-space character.
-      while (*s == ' ' && *s != '\0')
-        ++s;
+  handoff.peer_pid = peer_pid;
+  handoff.accept_time = accept_time;
 
-      // Check for quote delimiter.
-      if (*s == '"') {
-        delim = '"';
-        ++s;
-      } else {
-        delim = ' ';
-      }
+  memset(&iovec, 0, sizeof(iovec));
+  iovec.iov_base = &handoff;
+  iovec.iov_len = sizeof(handoff);
 
-      // Add string to arguments if there's room.
-      if (n < argc)
-        argv[n] = s;
+  memset(&msghdr, 0, sizeof(msghdr));
+  memset(control, 0, sizeof(control));
+  msghdr.msg_iov = &iovec;
+  msghdr.msg_iovlen = 1;
+  msghdr.msg_control = control;
+  msghdr.msg_controllen = sizeof(control);
 
-      ++n;
+  cmsg = CMSG_FIRSTHDR(&msghdr);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &client_fd, sizeof(int));
+
+  rv = sendmsg(peer->fd, &msghdr, MSG_NOSIGNAL);
+
+  // The peer is on its own from here on. If it failed to receive the client
+  // it exits as soon as it notices that the socket is gone.
+  close(peer->fd);
+  peer->fd = -1;
+  peer->pid = -1;
+  peer->ready = 0;
+
+  return rv == sizeof(handoff) ? 0 : -1;
+}
+
+// Waits for the master to hand over a client while keeping up with host
+// events. Returns the client fd, or -1 if the master or the host went away.
+static int sl_wait_for_handoff(struct sl_context* ctx,
+                               int fd,
+                               struct sl_peer_handoff* handoff) {
+  struct pollfd fds[] = {
+      {.fd = fd, .events = POLLIN},
+      {.fd = wl_display_get_fd(ctx->display), .events = POLLIN},
+  };
+
+  do {
+    wl_display_flush(ctx->display);
+    if (poll(fds, ARRAY_SIZE(fds), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
     }
-  } while (*s != '\0');
 
-  return n;
+    if (fds[1].revents) {
+      if (wl_display_dispatch(ctx->display) < 0)
+        return -1;
+    }
+
+    if (fds[0].revents) {
+      struct msghdr msghdr;
+      struct iovec iovec;
+      struct cmsghdr* cmsg;
+      char control[CMSG_SPACE(sizeof(int))];
+      int client_fd = -1;
+      ssize_t rv;
+
+      memset(&iovec, 0, sizeof(iovec));
+      iovec.iov_base = handoff;
+      iovec.iov_len = sizeof(*handoff);
+
+      memset(&msghdr, 0, sizeof(msghdr));
+      msghdr.msg_iov = &iovec;
+      msghdr.msg_iovlen = 1;
+      msghdr.msg_control = control;
+      msghdr.msg_controllen = sizeof(control);
+
+      rv = recvmsg(fd, &msghdr, MSG_CMSG_CLOEXEC);
+      if (rv < 0 && errno == EINTR)
+        continue;
+
+      cmsg = CMSG_FIRSTHDR(&msghdr);
+      if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+          cmsg->cmsg_type == SCM_RIGHTS &&
+          cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        memcpy(&client_fd, CMSG_DATA(cmsg), sizeof(int));
+
+      if (rv != sizeof(*handoff)) {
+        if (client_fd >= 0)
+          close(client_fd);
+        return -1;
+      }
+      return client_fd;
+    }
+  } while (1);
 }
 
 static void sl_print_usage() {
@@ -3494,6 +5025,7 @@ static void sl_print_usage() {
       "  -h, --help\t\t\tPrint this help\n"
       "  -X\t\t\t\tEnable X11 forwarding\n"
       "  --master\t\t\tRun as master and spawn child processes\n"
+      "  --single-process\t\tServe all clients of master in one process\n"
       "  --socket=SOCKET\t\tName of socket to listen on\n"
       "  --display=DISPLAY\t\tWayland display to connect to\n"
       "  --shm-driver=DRIVER\t\tSHM driver to use (noop, dmabuf, virtwl)\n"
@@ -3501,12 +5033,22 @@ static void sl_print_usage() {
       "  --scale=SCALE\t\t\tScale factor for contents\n"
       "  --dpi=[DPI[,DPI...]]\t\tDPI buckets\n"
       "  --peer-cmd-prefix=PREFIX\tPeer process command line prefix\n"
+      "  --peer-pool-size=SIZE\t\tNumber of peers to start ahead of time\n"
       "  --accelerators=ACCELERATORS\tList of keyboard accelerators\n"
       "  --application-id=ID\t\tForced application ID for X11 clients\n"
       "  --x-display=DISPLAY\t\tX11 display to listen on\n"
       "  --xwayland-path=PATH\t\tPath to Xwayland executable\n"
       "  --xwayland-gl-driver-path=PATH\tPath to GL drivers for Xwayland\n"
       "  --xwayland-cmd-prefix=PREFIX\tXwayland command line prefix\n"
+      "  --xwayland-lazy\t\tStart Xwayland when the first X client connects\n"
+      "  --xwayland-idle-timeout=SECONDS\tStop lazy Xwayland when idle\n"
+      "  --trace-startup[=FILE]\tTrace startup phases to stderr or FILE\n"
+      "  --coalesce-motion\t\tMerge motion events read together\n"
+      "  --stats-socket=PATH\t\tServe metrics on a unix socket\n"
+      "  --profile-protocol\t\tProfile protocol messages per opcode\n"
+      "  --trace-frames=FILE\t\tTrace frame stages to a Chrome JSON trace\n"
+      "  --trace-marker\t\tTrace frame stages to ftrace trace_marker\n"
+      "  --latency-probe\t\tMeasure input to commit and present latency\n"
       "  --no-exit-with-child\t\tKeep process alive after child exists\n"
       "  --no-clipboard-manager\tDisable X11 clipboard manager\n"
       "  --frame-color=COLOR\t\tWindow frame color for X11 clients\n"
@@ -3540,6 +5082,7 @@ int main(int argc, char** argv) {
       .viewporter = NULL,
       .linux_dmabuf = NULL,
       .keyboard_extension = NULL,
+      .presentation = NULL,
       .text_input_manager = NULL,
       .display_event_source = NULL,
       .display_ready_event_source = NULL,
@@ -3550,15 +5093,36 @@ int main(int argc, char** argv) {
       .virtwl_fd = -1,
       .virtwl_ctx_fd = -1,
       .virtwl_socket_fd = -1,
-      .virtwl_ctx_event_source = NULL,
-      .virtwl_socket_event_source = NULL,
+      .virtwl_forwarder = NULL,
       .drm_device = NULL,
+      .drm_fd = -1,
       .gbm = NULL,
       .xwayland = 0,
       .xwayland_pid = -1,
+      .xwayland_path = NULL,
+      .xwayland_gl_driver_path = NULL,
+      .xwayland_cmd_prefix = NULL,
+      .xauth_path = NULL,
+      .xfont_path = NULL,
+      .glamor = 0,
+      .xdisplay = -1,
+      .x_listen_fds = {-1, -1},
+      .x_listen_event_sources = {NULL, NULL},
+      .xwayland_idle_timeout = 0,
+      .xwayland_idle_timer = NULL,
+      .selection_prefetch_timer = NULL,
+      .selection_prefetch_pending = 0,
+      .xwayland_idle = 0,
+      .xwayland_stopping = 0,
       .child_pid = -1,
       .peer_pid = -1,
       .xkb_context = NULL,
+      .startup_trace_fd = -1,
+      .startup_time = 0,
+      .frame_trace_fd = -1,
+      .trace_marker_fd = -1,
+      .last_frame_flow = 0,
+      .latency_probe = 0,
       .next_global_id = 1,
       .connection = NULL,
       .connection_event_source = NULL,
@@ -3578,53 +5142,24 @@ int main(int argc, char** argv) {
       .default_seat = NULL,
       .selection_window = XCB_WINDOW_NONE,
       .selection_owner = XCB_WINDOW_NONE,
-      .selection_incremental_transfer = 0,
-      .selection_request = {.requestor = XCB_NONE, .property = XCB_ATOM_NONE},
       .selection_timestamp = XCB_CURRENT_TIME,
       .selection_data_device = NULL,
       .selection_data_offer = NULL,
       .selection_data_source = NULL,
-      .selection_data_source_send_fd = -1,
-      .selection_send_event_source = NULL,
-      .selection_property_reply = NULL,
-      .selection_property_offset = 0,
-      .selection_event_source = NULL,
-      .selection_data_offer_receive_fd = -1,
-      .selection_data_ack_pending = 0,
-      .atoms =
-          {
-              [ATOM_WM_S0] = {"WM_S0"},
-              [ATOM_WM_PROTOCOLS] = {"WM_PROTOCOLS"},
-              [ATOM_WM_STATE] = {"WM_STATE"},
-              [ATOM_WM_CHANGE_STATE] = {"WM_CHANGE_STATE"},
-              [ATOM_WM_DELETE_WINDOW] = {"WM_DELETE_WINDOW"},
-              [ATOM_WM_TAKE_FOCUS] = {"WM_TAKE_FOCUS"},
-              [ATOM_WM_CLIENT_LEADER] = {"WM_CLIENT_LEADER"},
-              [ATOM_WL_SURFACE_ID] = {"WL_SURFACE_ID"},
-              [ATOM_UTF8_STRING] = {"UTF8_STRING"},
-              [ATOM_MOTIF_WM_HINTS] = {"_MOTIF_WM_HINTS"},
-              [ATOM_NET_ACTIVE_WINDOW] = {"_NET_ACTIVE_WINDOW"},
-              [ATOM_NET_FRAME_EXTENTS] = {"_NET_FRAME_EXTENTS"},
-              [ATOM_NET_STARTUP_ID] = {"_NET_STARTUP_ID"},
-              [ATOM_NET_SUPPORTED] = {"_NET_SUPPORTED"},
-              [ATOM_NET_SUPPORTING_WM_CHECK] = {"_NET_SUPPORTING_WM_CHECK"},
-              [ATOM_NET_WM_NAME] = {"_NET_WM_NAME"},
-              [ATOM_NET_WM_MOVERESIZE] = {"_NET_WM_MOVERESIZE"},
-              [ATOM_NET_WM_STATE] = {"_NET_WM_STATE"},
-              [ATOM_NET_WM_STATE_FULLSCREEN] = {"_NET_WM_STATE_FULLSCREEN"},
-              [ATOM_NET_WM_STATE_MAXIMIZED_VERT] =
-                  {"_NET_WM_STATE_MAXIMIZED_VERT"},
-              [ATOM_NET_WM_STATE_MAXIMIZED_HORZ] =
-                  {"_NET_WM_STATE_MAXIMIZED_HORZ"},
-              [ATOM_CLIPBOARD] = {"CLIPBOARD"},
-              [ATOM_CLIPBOARD_MANAGER] = {"CLIPBOARD_MANAGER"},
-              [ATOM_TARGETS] = {"TARGETS"},
-              [ATOM_TIMESTAMP] = {"TIMESTAMP"},
-              [ATOM_TEXT] = {"TEXT"},
-              [ATOM_INCR] = {"INCR"},
-              [ATOM_WL_SELECTION] = {"_WL_SELECTION"},
-              [ATOM_GTK_THEME_VARIANT] = {"_GTK_THEME_VARIANT"},
-          },
+      .selection_property_count = 0,
+      .selection_chunk_size = 0,
+      .selection_cache_size = 0,
+      .configures_merged = 0,
+      .configures_skipped = 0,
+      .net_wm_state_writes_skipped = 0,
+      .keymaps_compiled = 0,
+      .keymap_cache_hits = 0,
+      .host_backlog_count = 0,
+      .host_backlog_bytes = 0,
+      .host_backlog_max_bytes = 0,
+      .coalesce_motion = 0,
+      .motion_events_received = 0,
+      .motion_events_sent = 0,
       .visual_ids = {0},
       .colormaps = {0}};
   const char* display = getenv("SOMMELIER_DISPLAY");
@@ -3639,6 +5174,7 @@ int main(int argc, char** argv) {
   const char* shm_driver = getenv("SOMMELIER_SHM_DRIVER");
   const char* data_driver = getenv("SOMMELIER_DATA_DRIVER");
   const char* peer_cmd_prefix = getenv("SOMMELIER_PEER_CMD_PREFIX");
+  const char* peer_pool = getenv("SOMMELIER_PEER_POOL_SIZE");
   const char* xwayland_cmd_prefix = getenv("SOMMELIER_XWAYLAND_CMD_PREFIX");
   const char* accelerators = getenv("SOMMELIER_ACCELERATORS");
   const char* xwayland_path = getenv("SOMMELIER_XWAYLAND_PATH");
@@ -3646,6 +5182,16 @@ int main(int argc, char** argv) {
       getenv("SOMMELIER_XWAYLAND_GL_DRIVER_PATH");
   const char* xauth_path = getenv("SOMMELIER_XAUTH_PATH");
   const char* xfont_path = getenv("SOMMELIER_XFONT_PATH");
+  const char* xwayland_lazy = getenv("SOMMELIER_XWAYLAND_LAZY");
+  const char* xwayland_idle_timeout =
+      getenv("SOMMELIER_XWAYLAND_IDLE_TIMEOUT");
+  const char* trace_startup = getenv("SOMMELIER_TRACE_STARTUP");
+  const char* coalesce_motion = getenv("SOMMELIER_COALESCE_MOTION");
+  const char* stats_socket = getenv("SOMMELIER_STATS_SOCKET");
+  const char* profile_protocol = getenv("SOMMELIER_PROFILE_PROTOCOL");
+  const char* trace_frames = getenv("SOMMELIER_TRACE_FRAMES");
+  const char* trace_marker = getenv("SOMMELIER_TRACE_MARKER");
+  const char* latency_probe = getenv("SOMMELIER_LATENCY_PROBE");
   const char* socket_name = "wayland-0";
   const char* runtime_dir;
   struct wl_event_loop* event_loop;
@@ -3656,10 +5202,16 @@ int main(int argc, char** argv) {
   int virtwl_display_fd = -1;
   int xdisplay = -1;
   int master = 0;
+  int single_process = 0;
+  int peer_pool_size = 0;
+  int warm_peer_fd = -1;
+  uint64_t accept_time = 0;
   int client_fd = -1;
   int rv;
   int i;
 
+  ctx.startup_time = sl_monotonic_time_ns();
+
   for (i = 1; i < argc; ++i) {
     const char* arg = argv[i];
     if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0 ||
@@ -3673,6 +5225,8 @@ int main(int argc, char** argv) {
     }
     if (strstr(arg, "--master") == arg) {
       master = 1;
+    } else if (strstr(arg, "--single-process") == arg) {
+      single_process = 1;
     } else if (strstr(arg, "--socket") == arg) {
       socket_name = sl_arg_value(arg);
     } else if (strstr(arg, "--display") == arg) {
@@ -3685,6 +5239,12 @@ int main(int argc, char** argv) {
       ctx.peer_pid = atoi(sl_arg_value(arg));
     } else if (strstr(arg, "--peer-cmd-prefix") == arg) {
       peer_cmd_prefix = sl_arg_value(arg);
+    } else if (strstr(arg, "--peer-pool-size") == arg) {
+      peer_pool = sl_arg_value(arg);
+    } else if (strstr(arg, "--warm-peer-fd") == arg) {
+      warm_peer_fd = atoi(sl_arg_value(arg));
+    } else if (strstr(arg, "--accept-time") == arg) {
+      accept_time = strtoull(sl_arg_value(arg), NULL, 10);
     } else if (strstr(arg, "--xwayland-cmd-prefix") == arg) {
       xwayland_cmd_prefix = sl_arg_value(arg);
     } else if (strstr(arg, "--client-fd") == arg) {
@@ -3707,6 +5267,10 @@ int main(int argc, char** argv) {
       xwayland_path = sl_arg_value(arg);
     } else if (strstr(arg, "--xwayland-gl-driver-path") == arg) {
       xwayland_gl_driver_path = sl_arg_value(arg);
+    } else if (strstr(arg, "--xwayland-lazy") == arg) {
+      xwayland_lazy = "1";
+    } else if (strstr(arg, "--xwayland-idle-timeout") == arg) {
+      xwayland_idle_timeout = sl_arg_value(arg);
     } else if (strstr(arg, "--no-exit-with-child") == arg) {
       ctx.exit_with_child = 0;
     } else if (strstr(arg, "--sd-notify") == arg) {
@@ -3727,6 +5291,21 @@ int main(int argc, char** argv) {
       xauth_path = sl_arg_value(arg);
     } else if (strstr(arg, "--x-font-path") == arg) {
       xfont_path = sl_arg_value(arg);
+    } else if (strstr(arg, "--coalesce-motion") == arg) {
+      coalesce_motion = "1";
+    } else if (strstr(arg, "--stats-socket") == arg) {
+      stats_socket = sl_arg_value(arg);
+    } else if (strstr(arg, "--profile-protocol") == arg) {
+      profile_protocol = "1";
+    } else if (strstr(arg, "--trace-frames") == arg) {
+      trace_frames = sl_arg_value(arg);
+    } else if (strstr(arg, "--trace-marker") == arg) {
+      trace_marker = "1";
+    } else if (strstr(arg, "--latency-probe") == arg) {
+      latency_probe = "1";
+    } else if (strstr(arg, "--trace-startup") == arg) {
+      const char* value = strchr(arg, '=');
+      trace_startup = value ? value + 1 : "-";
     } else if (arg[0] == '-') {
       if (strcmp(arg, "--") == 0) {
         ctx.runprog = &argv[i + 1];
@@ -3741,17 +5320,49 @@ int main(int argc, char** argv) {
     }
   }
 
+  if (trace_startup) {
+    if (strcmp(trace_startup, "-") == 0) {
+      ctx.startup_trace_fd = STDERR_FILENO;
+    } else {
+      ctx.startup_trace_fd =
+          open(trace_startup, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+      if (ctx.startup_trace_fd == -1) {
+        fprintf(stderr, "error: could not open %s (%s)\n", trace_startup,
+                strerror(errno));
+        return EXIT_FAILURE;
+      }
+    }
+    sl_trace_startup(&ctx, "arguments parsed");
+  }
+
+  if (sl_frame_trace_open(&ctx, trace_frames,
+                          trace_marker && strcmp(trace_marker, "0"))) {
+    return EXIT_FAILURE;
+  }
+
   runtime_dir = getenv("XDG_RUNTIME_DIR");
   if (!runtime_dir) {
     fprintf(stderr, "error: XDG_RUNTIME_DIR not set in the environment\n");
     return EXIT_FAILURE;
   }
 
-  if (master) {
+  if (peer_pool)
+    peer_pool_size = MAX(atoi(peer_pool), 0);
+
+  if (coalesce_motion)
+    ctx.coalesce_motion = !!strcmp(coalesce_motion, "0");
+
+  if (latency_probe)
+    ctx.latency_probe = !!strcmp(latency_probe, "0");
+
+  if (master && !single_process) {
     char* lock_addr;
     struct sockaddr_un addr;
     struct sigaction sa;
     struct stat sock_stat;
+    struct sl_warm_peer* peers;
+    struct pollfd* fds;
     int lock_fd;
     int sock_fd;
 
@@ -3795,17 +5406,8 @@ int main(int argc, char** argv) {
     // Spawn optional child process before we notify systemd that we're ready
     // to accept connections. WAYLAND_DISPLAY will be set but any attempt to
     // connect to this socket at this time will fail.
-    if (ctx.runprog && ctx.runprog[0]) {
-      pid = fork();
-      assert(pid != -1);
-      if (pid == 0) {
-        setenv("WAYLAND_DISPLAY", socket_name, 1);
-        sl_execvp(ctx.runprog[0], ctx.runprog, -1);
-        _exit(EXIT_FAILURE);
-      }
-      while (waitpid(-1, NULL, WNOHANG) != pid)
-        continue;
-    }
+    if (ctx.runprog && ctx.runprog[0])
+      sl_run_and_wait(ctx.runprog, socket_name);
 
     if (ctx.sd_notify)
       sl_sd_notify(ctx.sd_notify);
@@ -3816,6 +5418,21 @@ int main(int argc, char** argv) {
     rv = sigaction(SIGCHLD, &sa, NULL);
     assert(rv >= 0);
 
+    sa.sa_handler = sl_sigusr1_handler;
+    rv = sigaction(SIGUSR1, &sa, NULL);
+    assert(rv >= 0);
+
+    peers = calloc(peer_pool_size, sizeof(*peers));
+    assert(!peer_pool_size || peers);
+    fds = calloc(peer_pool_size + 1, sizeof(*fds));
+    assert(fds);
+    for (i = 0; i < peer_pool_size; ++i) {
+      peers[i].pid = -1;
+      peers[i].fd = -1;
+      sl_spawn_warm_peer(&peers[i], peer_cmd_prefix, argc, argv, sock_fd,
+                         lock_fd);
+    }
+
     do {
 #ifdef __linux__
       struct ucred ucred;
@@ -3823,84 +5440,113 @@ int main(int argc, char** argv) {
       struct xucred ucred;
 #endif
       socklen_t length = sizeof(addr);
+      pid_t client_pid;
+      int pending = 0;
+      int handed_off = 0;
+
+      // Wait for a client while keeping track of which warm peers are done
+      // connecting to the host.
+      fds[0].fd = sock_fd;
+      fds[0].events = POLLIN;
+      for (i = 0; i < peer_pool_size; ++i) {
+        fds[i + 1].fd = peers[i].fd;
+        fds[i + 1].events = POLLIN;
+      }
+      rv = poll(fds, peer_pool_size + 1, -1);
+      for (i = 0; rv > 0 && i < peer_pool_size; ++i) {
+        char ready;
+
+        if (!fds[i + 1].revents)
+          continue;
+
+        // A warm peer writes a single byte once it is ready. Anything else
+        // means it went away and the slot is refilled on the next accept.
+        if (read(peers[i].fd, &ready, 1) == 1) {
+          peers[i].ready = 1;
+        } else {
+          close(peers[i].fd);
+          peers[i].fd = -1;
+          peers[i].pid = -1;
+          peers[i].ready = 0;
+        }
+      }
+      if (rv > 0)
+        pending = fds[0].revents;
+      else if (rv < 0 && errno != EINTR)
+        fprintf(stderr, "error: failed to poll: %m\n");
+      if (!pending)
+        continue;
 
       client_fd = accept(sock_fd, (struct sockaddr*)&addr, &length);
       if (client_fd < 0) {
         fprintf(stderr, "error: failed to accept: %m\n");
         continue;
       }
+      accept_time = sl_monotonic_time_ns();
 
       length = sizeof(ucred);
 #ifdef __linux__
       ucred.pid = -1;
       rv = getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &ucred, &length);
+      client_pid = ucred.pid;
 #elif defined(__FreeBSD__)
       ucred.cr_pid = -1;
       rv = getsockopt(client_fd, 0, LOCAL_PEERCRED, &ucred, &length);
+      client_pid = ucred.cr_pid;
 #endif
 
-      pid = fork();
-      assert(pid != -1);
-      if (pid == 0) {
-        char* client_fd_str;
-        char* peer_pid_str;
-        char* peer_cmd_prefix_str;
-        char* args[64];
-        int i = 0, j;
-
-        close(sock_fd);
-        close(lock_fd);
-
-        if (!peer_cmd_prefix)
-          peer_cmd_prefix = PEER_CMD_PREFIX;
-
-        if (peer_cmd_prefix) {
-          peer_cmd_prefix_str = sl_xasprintf("%s", peer_cmd_prefix);
-
-          i = sl_parse_cmd_prefix(peer_cmd_prefix_str, 32, args);
-          if (i > 32) {
-            fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
-            i = 0;
-          }
-        }
+      // Prefer a peer that is ready. One that is still connecting to the
+      // host picks up the client as soon as it is done, which is still
+      // quicker than starting from scratch.
+      for (i = 0; !handed_off && i < peer_pool_size; ++i) {
+        if (peers[i].fd != -1 && peers[i].ready)
+          handed_off = !sl_handoff_to_warm_peer(&peers[i], client_fd,
+                                                client_pid, accept_time);
+      }
+      for (i = 0; !handed_off && i < peer_pool_size; ++i) {
+        if (peers[i].fd != -1)
+          handed_off = !sl_handoff_to_warm_peer(&peers[i], client_fd,
+                                                client_pid, accept_time);
+      }
 
-        args[i++] = argv[0];
-#ifdef __linux__
-        peer_pid_str = sl_xasprintf("--peer-pid=%d", ucred.pid);
-#elif defined(__FreeBSD__)
-        peer_pid_str = sl_xasprintf("--peer-pid=%d", ucred.cr_pid);
-#endif
-        args[i++] = peer_pid_str;
-        client_fd_str = sl_xasprintf("--client-fd=%d", client_fd);
-        args[i++] = client_fd_str;
-
-        // forward some flags.
-        for (j = 1; j < argc; ++j) {
-          char* arg = argv[j];
-          if (strstr(arg, "--display") == arg ||
-              strstr(arg, "--scale") == arg ||
-              strstr(arg, "--accelerators") == arg ||
-              strstr(arg, "--virtwl-device") == arg ||
-              strstr(arg, "--drm-device") == arg ||
-              strstr(arg, "--shm-driver") == arg ||
-              strstr(arg, "--data-driver") == arg) {
-            args[i++] = arg;
-          }
+      if (!handed_off) {
+        pid = fork();
+        assert(pid != -1);
+        if (pid == 0) {
+          char* peer_args[4];
+          int j = 0;
+
+          close(sock_fd);
+          close(lock_fd);
+
+          peer_args[j++] = sl_xasprintf("--peer-pid=%d", client_pid);
+          peer_args[j++] = sl_xasprintf("--client-fd=%d", client_fd);
+          // Only report startup latency when there is a pool to compare
+          // against.
+          if (peer_pool_size)
+            peer_args[j++] = sl_xasprintf("--accept-time=%" PRIu64,
+                                          accept_time);
+          peer_args[j++] = NULL;
+
+          sl_execvp_peer(peer_cmd_prefix, argc, argv, peer_args);
+          _exit(EXIT_FAILURE);
         }
-
-        args[i++] = NULL;
-
-        execvp(args[0], args);
-        _exit(EXIT_FAILURE);
       }
       close(client_fd);
+
+      // Replace the peers that were used or went away.
+      for (i = 0; i < peer_pool_size; ++i) {
+        if (peers[i].fd == -1)
+          sl_spawn_warm_peer(&peers[i], peer_cmd_prefix, argc, argv, sock_fd,
+                             lock_fd);
+      }
     } while (1);
 
     // Control should never reach here.
     assert(false);
   }
 
-  if (client_fd == -1) {
+  if (client_fd == -1 && warm_peer_fd == -1 && !master) {
     if (!ctx.runprog || !ctx.runprog[0]) {
       sl_print_usage();
       return EXIT_FAILURE;
@@ -3908,11 +5554,40 @@ int main(int argc, char** argv) {
   }
 
   if (ctx.xwayland) {
-    assert(client_fd == -1);
+    assert(client_fd == -1 && warm_peer_fd == -1);
 
     ctx.clipboard_manager = 1;
     if (clipboard_manager)
       ctx.clipboard_manager = !!strcmp(clipboard_manager, "0");
+
+    ctx.xwayland_path = xwayland_path;
+    ctx.xwayland_gl_driver_path = xwayland_gl_driver_path;
+    ctx.xwayland_cmd_prefix = xwayland_cmd_prefix;
+    ctx.xauth_path = xauth_path;
+    ctx.xfont_path = xfont_path;
+    ctx.glamor = glamor && strcmp(glamor, "0");
+    ctx.xdisplay = xdisplay;
+
+    if (xwayland_lazy && strcmp(xwayland_lazy, "0")) {
+      int display_number = xdisplay;
+
+      // Pick the first free display unless one was specified.
+      if (display_number < 0) {
+        for (display_number = 0; display_number < 32; ++display_number) {
+          if (sl_listen_on_xdisplay(&ctx, display_number))
+            break;
+        }
+      } else if (!sl_listen_on_xdisplay(&ctx, display_number)) {
+        display_number = 32;
+      }
+      if (display_number >= 32) {
+        fprintf(stderr, "error: no X display available\n");
+        return EXIT_FAILURE;
+      }
+
+      if (xwayland_idle_timeout)
+        ctx.xwayland_idle_timeout = MAX(atoi(xwayland_idle_timeout), 0);
+    }
   }
 
   if (scale) {
@@ -3945,8 +5620,39 @@ int main(int argc, char** argv) {
   ctx.host_display = wl_display_create();
   assert(ctx.host_display);
 
+  // Before any objects are created so all of them are profiled.
+  if (profile_protocol && strcmp(profile_protocol, "0"))
+    sl_profile_enable(ctx.host_display);
+
   event_loop = wl_display_get_event_loop(ctx.host_display);
 
+  wl_event_loop_add_signal(event_loop, SIGUSR1, sl_handle_sigusr1, &ctx);
+  if (stats_socket && sl_metrics_listen(&ctx, event_loop, stats_socket))
+    return EXIT_FAILURE;
+
+  if (master) {
+    // All clients share the host connection, globals, outputs, seats and
+    // keymaps. Everything else already hangs off their resources, so the
+    // display implementation is all a new client needs.
+    ctx.client_created_listener.notify = sl_client_created_notify;
+    wl_display_add_client_created_listener(ctx.host_display,
+                                           &ctx.client_created_listener);
+
+    // Run the optional child process while connecting to the socket still
+    // fails, like the forking master does.
+    if (ctx.runprog && ctx.runprog[0])
+      sl_run_and_wait(ctx.runprog, socket_name);
+    ctx.runprog = NULL;
+
+    if (wl_display_add_socket(ctx.host_display, socket_name)) {
+      fprintf(stderr, "error: failed to add socket %s: %m\n", socket_name);
+      return EXIT_FAILURE;
+    }
+
+    if (ctx.sd_notify)
+      sl_sd_notify(ctx.sd_notify);
+  }
+
   if (!virtwl_device)
     virtwl_device = VIRTWL_DEVICE;
 
@@ -3966,9 +5672,8 @@ int main(int argc, char** argv) {
     }
 
     // We use a virtwl context unless display was explicitly specified.
-    // WARNING: It's critical that we never call wl_display_roundtrip
-    // as we're not spawning a new thread to handle forwarding. Calling
-    // wl_display_roundtrip will cause a deadlock.
+    // Traffic is forwarded on a separate thread so blocking calls such as
+    // wl_display_roundtrip are safe on the main thread.
     if (!display) {
       int vws[2];
 
@@ -3988,31 +5693,25 @@ int main(int argc, char** argv) {
 
       ctx.virtwl_ctx_fd = new_ctx.fd;
 
-      ctx.virtwl_socket_event_source = wl_event_loop_add_fd(
-          event_loop, ctx.virtwl_socket_fd, WL_EVENT_READABLE,
-          sl_handle_virtwl_socket_event, &ctx);
-      ctx.virtwl_ctx_event_source =
-          wl_event_loop_add_fd(event_loop, ctx.virtwl_ctx_fd, WL_EVENT_READABLE,
-                               sl_handle_virtwl_ctx_event, &ctx);
+      ctx.virtwl_forwarder =
+          sl_virtwl_forwarder_create(ctx.virtwl_ctx_fd, ctx.virtwl_socket_fd);
+      if (!ctx.virtwl_forwarder)
+        return EXIT_FAILURE;
     }
   }
 
   if (drm_device) {
-    int drm_fd = open(drm_device, O_RDWR | O_CLOEXEC);
-    if (drm_fd == -1) {
+    ctx.drm_fd = open(drm_device, O_RDWR | O_CLOEXEC);
+    if (ctx.drm_fd == -1) {
       fprintf(stderr, "error: could not open %s (%s)\n", drm_device,
               strerror(errno));
       return EXIT_FAILURE;
     }
 
-    ctx.gbm = gbm_create_device(drm_fd);
-    if (!ctx.gbm) {
-      fprintf(stderr, "error: couldn't get display device\n");
-      return EXIT_FAILURE;
-    }
-
+    // The gbm device is created when the first buffer is allocated.
     ctx.drm_device = drm_device;
   }
+  sl_trace_startup(&ctx, "devices opened");
 
   if (!shm_driver)
     shm_driver = ctx.xwayland ? XWAYLAND_SHM_DRIVER : SHM_DRIVER;
@@ -4077,6 +5776,8 @@ int main(int argc, char** argv) {
   }
 
   wl_array_init(&ctx.dpi);
+  wl_array_init(&ctx.atom_names);
+  wl_array_init(&ctx.selection_properties);
   if (dpi) {
     char* str = strdup(dpi);
     char* token = strtok(str, ",");
@@ -4091,7 +5792,7 @@ int main(int argc, char** argv) {
     free(str);
   }
 
-  if (ctx.runprog || ctx.xwayland) {
+  if ((ctx.runprog || ctx.xwayland) && ctx.x_listen_fds[0] == -1) {
     // Wayland connection from client.
     rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
     assert(!rv);
@@ -4099,13 +5800,6 @@ int main(int argc, char** argv) {
     client_fd = sv[0];
   }
 
-  // The success of this depends on xkb-data being installed.
-  ctx.xkb_context = xkb_context_new(0);
-  if (!ctx.xkb_context) {
-    fprintf(stderr, "error: xkb_context_new failed. xkb-data missing?\n");
-    return EXIT_FAILURE;
-  }
-
   if (virtwl_display_fd != -1) {
     ctx.display = wl_display_connect_to_fd(virtwl_display_fd);
   } else {
@@ -4121,8 +5815,12 @@ int main(int argc, char** argv) {
     fprintf(stderr, "error: failed to connect to %s\n", display);
     return EXIT_FAILURE;
   }
+  sl_trace_startup(&ctx, "host connected");
 
   wl_list_init(&ctx.accelerators);
+  wl_list_init(&ctx.keymaps);
+  wl_list_init(&ctx.pending_motion);
+  wl_list_init(&ctx.host_surfaces);
   wl_list_init(&ctx.registries);
   wl_list_init(&ctx.globals);
   wl_list_init(&ctx.outputs);
@@ -4130,7 +5828,10 @@ int main(int argc, char** argv) {
   wl_list_init(&ctx.windows);
   wl_list_init(&ctx.unpaired_windows);
   wl_list_init(&ctx.host_outputs);
-  wl_list_init(&ctx.selection_data_source_send_pending);
+  wl_list_init(&ctx.selection_transfers);
+  wl_list_init(&ctx.data_source_transfers);
+  wl_list_init(&ctx.selection_cache);
+  wl_list_init(&ctx.property_requests);
 
   // Parse the list of accelerators that should be reserved by the
   // compositor. Format is "|MODIFIERS|KEYSYM", where MODIFIERS is a
@@ -4178,6 +5879,7 @@ int main(int argc, char** argv) {
       }
     }
   }
+  sl_trace_startup(&ctx, "accelerators parsed");
 
   ctx.display_event_source =
       wl_event_loop_add_fd(event_loop, wl_display_get_fd(ctx.display),
@@ -4186,11 +5888,37 @@ int main(int argc, char** argv) {
   wl_registry_add_listener(wl_display_get_registry(ctx.display),
                            &sl_registry_listener, &ctx);
 
-  ctx.client = wl_client_create(ctx.host_display, client_fd);
+  if (warm_peer_fd != -1) {
+    struct sl_peer_handoff handoff;
+
+    // Get through the host handshake before telling the master that we are
+    // ready. The first roundtrip announces the globals and the second one
+    // the initial state of the ones we bound.
+    wl_display_roundtrip(ctx.display);
+    wl_display_roundtrip(ctx.display);
+    sl_trace_startup(&ctx, "host globals bound");
 
-  // Replace the core display implementation. This is needed in order to
-  // implement sync handler properly.
-  sl_set_display_implementation(&ctx);
+    rv = write(warm_peer_fd, "", 1);
+    UNUSED(rv);
+
+    client_fd = sl_wait_for_handoff(&ctx, warm_peer_fd, &handoff);
+    close(warm_peer_fd);
+    if (client_fd == -1)
+      return EXIT_SUCCESS;
+
+    ctx.peer_pid = handoff.peer_pid;
+    accept_time = handoff.accept_time;
+    sl_trace_startup(&ctx, "client handed off");
+  }
+
+  if (client_fd != -1) {
+    ctx.client = wl_client_create(ctx.host_display, client_fd);
+
+    // Replace the core display implementation. This is needed in order to
+    // implement sync handler properly.
+    sl_set_display_implementation(&ctx, ctx.client);
+    sl_trace_startup(&ctx, "client created");
+  }
 
   if (ctx.runprog || ctx.xwayland) {
     ctx.sigchld_event_source =
@@ -4205,90 +5933,21 @@ int main(int argc, char** argv) {
     // it's not set.
     setenv("WAYLAND_DISPLAY", ".", 1);
 
-    if (ctx.xwayland) {
-      int ds[2], wm[2];
-
-      // Xwayland display ready socket.
-      rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ds);
-      assert(!rv);
-
-      ctx.display_ready_event_source =
-          wl_event_loop_add_fd(event_loop, ds[0], WL_EVENT_READABLE,
-                               sl_handle_display_ready_event, &ctx);
-
-      // X connection to Xwayland.
-      rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, wm);
-      assert(!rv);
-
-      ctx.wm_fd = wm[0];
-
-      pid = fork();
-      assert(pid != -1);
-      if (pid == 0) {
-        char* display_fd_str;
-        char* wm_fd_str;
-        char* xwayland_cmd_prefix_str;
-        char* args[64];
-        int i = 0;
-        int fd;
-
-        if (xwayland_cmd_prefix) {
-          xwayland_cmd_prefix_str = sl_xasprintf("%s", xwayland_cmd_prefix);
-
-          i = sl_parse_cmd_prefix(xwayland_cmd_prefix_str, 32, args);
-          if (i > 32) {
-            fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
-            i = 0;
-          }
-        }
-
-        args[i++] = sl_xasprintf("%s", xwayland_path ?: XWAYLAND_PATH);
-
-        fd = dup(ds[1]);
-        display_fd_str = sl_xasprintf("%d", fd);
-        fd = dup(wm[1]);
-        wm_fd_str = sl_xasprintf("%d", fd);
-
-        if (xdisplay > 0) {
-          args[i++] = sl_xasprintf(":%d", xdisplay);
-        }
-        args[i++] = "-nolisten";
-        args[i++] = "tcp";
-        args[i++] = "-rootless";
-        // Use software rendering unless we have a DRM device and glamor is
-        // enabled.
-        if (!ctx.drm_device || !glamor || !strcmp(glamor, "0"))
-          args[i++] = "-shm";
-        args[i++] = "-displayfd";
-        args[i++] = display_fd_str;
-        args[i++] = "-wm";
-        args[i++] = wm_fd_str;
-        if (xauth_path) {
-          args[i++] = "-auth";
-          args[i++] = sl_xasprintf("%s", xauth_path);
-        }
-        if (xfont_path) {
-          args[i++] = "-fp";
-          args[i++] = sl_xasprintf("%s", xfont_path);
-        }
-        args[i++] = NULL;
-
-        // If a path is explicitly specified via command line or environment
-        // use that instead of the compiled in default.  In either case, only
-        // set the environment variable if the value specified is non-empty.
-        if (xwayland_gl_driver_path) {
-          if (*xwayland_gl_driver_path) {
-            setenv("LIBGL_DRIVERS_PATH", xwayland_gl_driver_path, 1);
-          }
-        } else if (XWAYLAND_GL_DRIVER_PATH && *XWAYLAND_GL_DRIVER_PATH) {
-          setenv("LIBGL_DRIVERS_PATH", XWAYLAND_GL_DRIVER_PATH, 1);
-        }
-
-        sl_execvp(args[0], args, sv[1]);
-        _exit(EXIT_FAILURE);
-      }
-      close(wm[1]);
-      ctx.xwayland_pid = pid;
+    if (ctx.x_listen_fds[0] != -1) {
+      char* display_name = sl_xasprintf(":%d", ctx.xdisplay);
+
+      setenv("DISPLAY", display_name, 1);
+      free(display_name);
+      sl_watch_xdisplay(&ctx);
+
+      // Get the scale from the host outputs, as sl_spawn_child uses it for
+      // the cursor size.
+      wl_display_roundtrip(ctx.display);
+      wl_display_roundtrip(ctx.display);
+      sl_calculate_scale_for_xwayland(&ctx);
+      sl_spawn_child(&ctx);
+    } else if (ctx.xwayland) {
+      sl_spawn_xwayland(&ctx, sv[1]);
     } else {
       pid = fork();
       assert(pid != -1);
@@ -4298,21 +5957,39 @@ int main(int argc, char** argv) {
       }
       ctx.child_pid = pid;
     }
-    close(sv[1]);
+    if (ctx.x_listen_fds[0] == -1)
+      close(sv[1]);
+    sl_trace_startup(&ctx, "child spawned");
   }
 
-  wl_client_add_destroy_listener(ctx.client, &client_destroy_listener);
+  if (ctx.client)
+    wl_client_add_destroy_listener(ctx.client, &client_destroy_listener);
 
   do {
+    // Motion might have been held back by host events dispatched during a
+    // roundtrip.
+    sl_flush_motion(&ctx);
     wl_display_flush_clients(ctx.host_display);
+    // The registry is where the client gets its first events.
+    if (accept_time && !wl_list_empty(&ctx.registries)) {
+      if (ctx.startup_trace_fd != -1) {
+        dprintf(ctx.startup_trace_fd,
+                "startup[%d]: first event %.3f ms after accept (%s)\n",
+                getpid(), (sl_monotonic_time_ns() - accept_time) / 1e6,
+                warm_peer_fd != -1 ? "warm peer" : "new peer");
+      }
+      accept_time = 0;
+    }
     if (ctx.connection) {
+      // Replies might have been read while waiting for an unrelated reply.
+      sl_process_property_requests(&ctx);
       if (ctx.needs_set_input_focus) {
         sl_set_input_focus(&ctx, ctx.host_focus_window);
         ctx.needs_set_input_focus = 0;
       }
       xcb_flush(ctx.connection);
     }
-    if (wl_display_flush(ctx.display) < 0)
+    if (sl_flush_host(&ctx) < 0)
       return EXIT_FAILURE;
   } while (wl_event_loop_dispatch(event_loop, -1) != -1);
 
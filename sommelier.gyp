@@ -47,6 +47,7 @@
         'protocol/gtk-shell.xml',
         'protocol/keyboard-extension-unstable-v1.xml',
         'protocol/linux-dmabuf-unstable-v1.xml',
+        'protocol/presentation-time.xml',
         'protocol/text-input-unstable-v1.xml',
         'protocol/viewporter.xml',
         'protocol/xdg-shell-unstable-v6.xml',
@@ -60,6 +61,7 @@
         'exported_deps': [
           'gbm',
           'libdrm',
+          'libffi',
           'pixman-1',
           'wayland-client',
           'wayland-server',
@@ -73,6 +75,12 @@
       'link_settings': {
         'libraries': [
           '-lm',
+          '-lpthread',
+        ],
+        # The protocol profiler swaps in its dispatchers from these.
+        'ldflags': [
+          '-Wl,--wrap=wl_proxy_add_listener',
+          '-Wl,--wrap=wl_resource_set_implementation',
         ],
       },
       'dependencies': [
@@ -81,16 +89,22 @@
       'sources': [
         'sommelier-compositor.c',
         'sommelier-data-device-manager.c',
+        'sommelier-data-transfer.c',
         'sommelier-display.c',
         'sommelier-drm.c',
         'sommelier-gtk-shell.c',
+        'sommelier-latency.c',
+        'sommelier-metrics.c',
         'sommelier-output.c',
+        'sommelier-profile.c',
         'sommelier-seat.c',
         'sommelier-shell.c',
         'sommelier-shm.c',
         'sommelier-subcompositor.c',
         'sommelier-text-input.c',
+        'sommelier-tracing.c',
         'sommelier-viewporter.c',
+        'sommelier-virtwl.c',
         'sommelier-xdg-shell.c',
         'sommelier.c',
       ],
@@ -126,23 +140,5 @@
         'demos/wayland_demo.cc',
       ],
     },
-    {
-      'target_name': 'x11_demo',
-      'type': 'executable',
-      'variables': {
-        'deps': [
-          'libbrillo-<(libbase_ver)',
-          'libchrome-<(libbase_ver)',
-        ],
-      },
-      'link_settings': {
-        'libraries': [
-          '-lX11',
-        ],
-      },
-      'sources': [
-        'demos/x11_demo.cc',
-      ],
-    },
   ],
 }
@@ -5,6 +5,7 @@
 #ifndef VM_TOOLS_SOMMELIER_SOMMELIER_H_
 #define VM_TOOLS_SOMMELIER_SOMMELIER_H_
 
+#include <stdio.h>
 #include <sys/types.h>
 #include <wayland-server.h>
 #include <wayland-util.h>
@@ -37,10 +38,13 @@ struct sl_aura_shell;
 struct sl_viewporter;
 struct sl_linux_dmabuf;
 struct sl_keyboard_extension;
+struct sl_presentation;
+struct sl_latency;
 struct sl_text_input_manager;
 struct sl_relative_pointer_manager;
 struct sl_pointer_constraints;
 struct sl_window;
+struct sl_virtwl_forwarder;
 struct zaura_shell;
 struct zcr_keyboard_extension_v1;
 
@@ -89,11 +93,58 @@ enum {
   DATA_DRIVER_VIRTWL,
 };
 
+// Process wide metrics, see sommelier-metrics.c.
+enum {
+  METRIC_COMMITS,
+  METRIC_ATTACHES,
+  METRIC_SHM_COPIES,
+  METRIC_SHM_COPY_BYTES,
+  METRIC_OUTPUT_BUFFER_ALLOCATIONS,
+  METRIC_OUTPUT_BUFFERS,
+  METRIC_OUTPUT_BUFFER_BYTES,
+  METRIC_CLIPBOARD_BYTES_TO_X,
+  METRIC_CLIPBOARD_BYTES_FROM_X,
+  METRIC_DATA_TRANSFERS,
+  METRIC_DATA_TRANSFER_BYTES,
+  METRIC_VIRTWL_HOST_TRANSACTIONS,
+  METRIC_VIRTWL_CLIENT_TRANSACTIONS,
+  METRIC_VIRTWL_HOST_MESSAGES,
+  METRIC_VIRTWL_CLIENT_MESSAGES,
+  METRIC_VIRTWL_PARTIAL_WRITES,
+  METRIC_VIRTWL_HOST_RETRIES,
+  METRIC_LAST = METRIC_VIRTWL_HOST_RETRIES,
+};
+
+enum {
+  HISTOGRAM_SHM_COPY_TIME,
+  HISTOGRAM_X11_MAP_TO_FIRST_FRAME,
+  HISTOGRAM_X11_CONFIGURE_TO_ACK,
+  HISTOGRAM_INPUT_DELAY,
+  HISTOGRAM_VIRTWL_HOST_LATENCY,
+  HISTOGRAM_VIRTWL_CLIENT_LATENCY,
+  HISTOGRAM_LAST = HISTOGRAM_VIRTWL_CLIENT_LATENCY,
+};
+
+enum {
+  METRICS_FORMAT_JSON,
+  METRICS_FORMAT_PROMETHEUS,
+};
+
+enum {
+  FRAME_FLOW_NONE,
+  FRAME_FLOW_START,
+  FRAME_FLOW_STEP,
+  FRAME_FLOW_END,
+};
+
 struct sl_context {
   char** runprog;
   struct wl_display* display;
   struct wl_display* host_display;
+  // Client we were started for, NULL when only serving clients that connect
+  // to our socket.
   struct wl_client* client;
+  struct wl_listener client_created_listener;
   struct sl_compositor* compositor;
   struct sl_subcompositor* subcompositor;
   struct sl_shm* shm;
@@ -104,6 +155,8 @@ struct sl_context {
   struct sl_viewporter* viewporter;
   struct sl_linux_dmabuf* linux_dmabuf;
   struct sl_keyboard_extension* keyboard_extension;
+  // Only bound for the latency probe.
+  struct sl_presentation* presentation;
   struct sl_text_input_manager* text_input_manager;
   struct sl_relative_pointer_manager* relative_pointer_manager;
   struct sl_pointer_constraints* pointer_constraints;
@@ -119,19 +172,49 @@ struct sl_context {
   int virtwl_fd;
   int virtwl_ctx_fd;
   int virtwl_socket_fd;
-  struct wl_event_source* virtwl_ctx_event_source;
-  struct wl_event_source* virtwl_socket_event_source;
+  struct sl_virtwl_forwarder* virtwl_forwarder;
   const char* drm_device;
+  int drm_fd;
+  // Created on first use, see sl_get_gbm_device().
   struct gbm_device* gbm;
   int xwayland;
   pid_t xwayland_pid;
+  // Xwayland command line, kept to start it again later.
+  const char* xwayland_path;
+  const char* xwayland_gl_driver_path;
+  const char* xwayland_cmd_prefix;
+  const char* xauth_path;
+  const char* xfont_path;
+  int glamor;
+  int xdisplay;
+  // X display sockets when Xwayland is started on demand, -1 otherwise.
+  int x_listen_fds[2];
+  struct wl_event_source* x_listen_event_sources[2];
+  struct wl_listener xwayland_destroy_listener;
+  // Seconds without X activity before Xwayland is stopped, 0 for never.
+  int xwayland_idle_timeout;
+  struct wl_event_source* xwayland_idle_timer;
+  int xwayland_idle;
+  int xwayland_stopping;
   pid_t child_pid;
   pid_t peer_pid;
+  // Created on first use, see sl_get_xkb_context().
   struct xkb_context* xkb_context;
+  // Compiled keymaps, most recently used first. Contains struct sl_keymap.
+  struct wl_list keymaps;
+  // Startup phases are traced to this fd until the first frame, -1 if off.
+  int startup_trace_fd;
+  uint64_t startup_time;
+  // Frame stages are traced to these fds, -1 if off.
+  int frame_trace_fd;
+  int trace_marker_fd;
+  uint64_t last_frame_flow;
+  int latency_probe;
   struct wl_list accelerators;
   struct wl_list registries;
   struct wl_list globals;
   struct wl_list host_outputs;
+  struct wl_list host_surfaces;
   int next_global_id;
   xcb_connection_t* connection;
   struct wl_event_source* connection_event_source;
@@ -152,24 +235,43 @@ struct sl_context {
   struct sl_host_seat* default_seat;
   xcb_window_t selection_window;
   xcb_window_t selection_owner;
-  int selection_incremental_transfer;
-  xcb_selection_request_event_t selection_request;
   xcb_timestamp_t selection_timestamp;
   struct wl_data_device* selection_data_device;
   struct sl_data_offer* selection_data_offer;
   struct sl_data_source* selection_data_source;
-  int selection_data_source_send_fd;
-  struct wl_list selection_data_source_send_pending;
-  struct wl_event_source* selection_send_event_source;
-  xcb_get_property_reply_t* selection_property_reply;
-  int selection_property_offset;
-  struct wl_event_source* selection_event_source;
-  xcb_atom_t selection_data_type;
-  struct wl_array selection_data;
-  int selection_data_offer_receive_fd;
-  int selection_data_ack_pending;
+  // X clients reading our selection, contains struct sl_selection_transfer.
+  struct wl_list selection_transfers;
+  // Wayland clients reading the X selection, contains
+  // struct sl_data_source_transfer.
+  struct wl_list data_source_transfers;
+  // Selection window properties free for reuse by transfers.
+  struct wl_array selection_properties;
+  int selection_property_count;
+  // Size of the property windows and INCR chunks of selection transfers.
+  uint32_t selection_chunk_size;
+  // Payloads of the current offer, contains struct sl_selection_cache_entry.
+  struct wl_list selection_cache;
+  size_t selection_cache_size;
+  // Prefetch of the current offer waiting for the first paste or idle.
+  struct wl_event_source* selection_prefetch_timer;
+  int selection_prefetch_pending;
+  struct wl_list property_requests;
+  struct wl_array atom_names;  // Contains struct sl_atom_name
+  uint64_t configures_merged;
+  uint64_t configures_skipped;
+  uint64_t net_wm_state_writes_skipped;
+  uint64_t keymaps_compiled;
+  uint64_t keymap_cache_hits;
+  uint64_t host_backlog_count;
+  uint64_t host_backlog_bytes;
+  uint64_t host_backlog_max_bytes;
+  // Merge motion events read together instead of forwarding each of them.
+  int coalesce_motion;
+  // Contains struct sl_pending_motion.
+  struct wl_list pending_motion;
+  uint64_t motion_events_received;
+  uint64_t motion_events_sent;
   union {
-    const char* name;
     xcb_intern_atom_cookie_t cookie;
     xcb_atom_t value;
   } atoms[ATOM_LAST + 1];
@@ -201,6 +303,13 @@ struct sl_seat {
   struct wl_list link;
 };
 
+// Motion held back so it can be merged with the motion that follows it.
+// |flush| forwards what has been merged.
+struct sl_pending_motion {
+  struct wl_list link;
+  void (*flush)(struct sl_pending_motion* motion);
+};
+
 struct sl_host_pointer {
   struct sl_seat* seat;
   struct wl_resource* resource;
@@ -208,6 +317,12 @@ struct sl_host_pointer {
   struct wl_resource* focus_resource;
   struct wl_listener focus_resource_listener;
   uint32_t focus_serial;
+  struct sl_pending_motion pending_motion;
+  int has_motion;
+  uint32_t motion_time;
+  wl_fixed_t motion_x;
+  wl_fixed_t motion_y;
+  int has_frame;
 };
 
 struct sl_relative_pointer_manager {
@@ -228,8 +343,12 @@ struct sl_viewport {
 };
 
 struct sl_host_callback {
+  struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_callback* proxy;
+  // Surface and frame flow of a frame callback, for tracing.
+  uint32_t surface_id;
+  uint64_t flow;
 };
 
 struct sl_host_surface {
@@ -248,6 +367,12 @@ struct sl_host_surface {
   struct sl_output_buffer* current_buffer;
   struct wl_list released_buffers;
   struct wl_list busy_buffers;
+  struct wl_list link;
+  uint64_t commits;
+  // Flow of the frame being built, 0 until its first request is traced.
+  uint64_t frame_flow;
+  // Created on the first input when the latency probe is on.
+  struct sl_latency* latency;
 };
 
 struct sl_host_region {
@@ -266,13 +391,6 @@ struct sl_host_buffer {
   struct sl_sync_point* sync_point;
 };
 
-struct sl_data_source_send_request {
-  int fd;
-  xcb_intern_atom_cookie_t cookie;
-  struct sl_data_source* data_source;
-  struct wl_list link;
-};
-
 struct sl_subcompositor {
   struct sl_context* ctx;
   uint32_t id;
@@ -337,6 +455,13 @@ struct sl_keyboard_extension {
   struct zcr_keyboard_extension_v1* internal;
 };
 
+struct sl_presentation {
+  struct sl_context* ctx;
+  uint32_t id;
+  clockid_t clock_id;
+  struct wp_presentation* internal;
+};
+
 struct sl_data_device_manager {
   struct sl_context* ctx;
   uint32_t id;
@@ -349,14 +474,13 @@ struct sl_data_offer {
   struct sl_context* ctx;
   struct wl_data_offer* internal;
   struct wl_array atoms;    // Contains xcb_atom_t
-  struct wl_array cookies;  // Contains xcb_intern_atom_cookie_t
+  struct wl_array cookies;  // Contains struct sl_atom_request
 };
 
 struct sl_text_input_manager {
   struct sl_context* ctx;
   uint32_t id;
   struct sl_global* host_global;
-  struct zwp_text_input_manager_v1* internal;
 };
 
 struct sl_pointer_constraints {
@@ -476,6 +600,12 @@ struct sl_window {
   int max_height;
   struct sl_config next_config;
   struct sl_config pending_config;
+  int net_wm_states_length;  // -1 if the property content is unknown
+  uint32_t net_wm_states[3];
+  // Monotonic times of the map request not yet followed by a frame and of
+  // the configure the client has yet to catch up with, 0 if none.
+  uint64_t map_time;
+  uint64_t configure_time;
   struct zxdg_surface_v6* xdg_surface;
   struct zxdg_toplevel_v6* xdg_toplevel;
   struct zxdg_popup_v6* xdg_popup;
@@ -532,7 +662,15 @@ struct sl_global* sl_text_input_manager_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_pointer_constraints_global_create(struct sl_context* ctx);
 
-void sl_set_display_implementation(struct sl_context* ctx);
+void sl_set_display_implementation(struct sl_context* ctx,
+                                   struct wl_client* client);
+
+void sl_data_transfer_create(struct wl_event_loop* event_loop,
+                             int read_fd,
+                             int write_fd);
+
+struct sl_virtwl_forwarder* sl_virtwl_forwarder_create(int ctx_fd,
+                                                       int socket_fd);
 
 struct sl_mmap* sl_mmap_create(int fd,
                                size_t size,
@@ -557,9 +695,63 @@ void sl_restack_windows(struct sl_context* ctx, uint32_t focus_resource_id);
 
 void sl_roundtrip(struct sl_context* ctx);
 
+int sl_host_bytes_queued(struct sl_context* ctx);
+
+void sl_metric_add(int metric, int64_t value);
+
+void sl_metric_observe(int histogram, uint64_t value);
+
+void sl_metrics_write(struct sl_context* ctx, FILE* out, int format);
+
+int sl_metrics_listen(struct sl_context* ctx,
+                      struct wl_event_loop* event_loop,
+                      const char* path);
+
+void sl_profile_enable(struct wl_display* display);
+
+void sl_latency_input(struct sl_context* ctx,
+                      struct wl_resource* surface_resource);
+
+void sl_latency_commit(struct sl_host_surface* host);
+
+void sl_latency_destroy(struct sl_host_surface* host);
+
+void sl_latency_report(struct sl_context* ctx, FILE* out);
+
+int sl_frame_trace_open(struct sl_context* ctx, const char* path, int marker);
+
+uint64_t sl_frame_trace_begin(struct sl_context* ctx, const char* name);
+
+void sl_frame_trace_end(struct sl_context* ctx,
+                        const char* name,
+                        uint64_t start,
+                        uint32_t surface_id,
+                        uint64_t flow,
+                        int flow_phase);
+
+void sl_profile_print(FILE* out);
+
+void sl_defer_motion(struct sl_context* ctx,
+                     struct sl_pending_motion* motion,
+                     int relative);
+
+void sl_flush_motion(struct sl_context* ctx);
+
+void sl_record_input_delay(struct sl_context* ctx, uint32_t time);
+
+uint64_t sl_monotonic_time_ns(void);
+
+void sl_trace_startup(struct sl_context* ctx, const char* phase);
+
+struct xkb_context* sl_get_xkb_context(struct sl_context* ctx);
+
+struct gbm_device* sl_get_gbm_device(struct sl_context* ctx);
+
 int sl_process_pending_configure_acks(struct sl_window* window,
                                       struct sl_host_surface* host_surface);
 
 void sl_window_update(struct sl_window* window);
 
+void sl_window_realize(struct sl_window* window);
+
 #endif  // VM_TOOLS_SOMMELIER_SOMMELIER_H_